@@ -62,6 +62,12 @@ struct drm_amdgpu_info_hw_ip;
  */
 #define AMDGPU_QUERY_FENCE_TIMEOUT_IS_ABSOLUTE     (1 << 0)
 
+/**
+ * Used in amdgpu_cs_submit(), allowing back-to-back requests to the same
+ * ring with the same resources to be sent to the kernel as one submission.
+ */
+#define AMDGPU_CS_SUBMIT_MERGE			(1 << 0)
+
 /*--------------------------------------------------------------------------*/
 /* ----------------------------- Enums ------------------------------------ */
 /*--------------------------------------------------------------------------*/
@@ -224,6 +230,32 @@ struct amdgpu_bo_import_result {
 	uint64_t alloc_size;
 };
 
+/**
+ * Structure describing the state of the buffer cache of a device
+ *
+ * \sa amdgpu_bo_cache_enable(), amdgpu_bo_cache_query_stats()
+ *
+*/
+struct amdgpu_bo_cache_stats {
+	/** Total size of the buffers currently cached, in bytes */
+	uint64_t size;
+
+	/** Number of buffers currently cached */
+	uint32_t count;
+
+	/** Allocations served from the cache */
+	uint64_t hits;
+
+	/** Allocations that found nothing to reuse */
+	uint64_t misses;
+
+	/** Misses where the buffers to reuse were all still busy */
+	uint64_t busy;
+
+	/** Buffers released without being reused */
+	uint64_t evictions;
+};
+
 /**
  *
  * Structure to describe GDS partitioning information.
@@ -290,8 +322,15 @@ struct amdgpu_cs_ib_info {
 /**
  * Structure describing fence information
  *
+ * The sequence number of the submission is written there once it
+ * completes. If the buffer can be CPU mapped, fences of the ring are then
+ * checked with a CPU read before asking the kernel, so the location must
+ * not be written by any other ring or context. It is cleared when a ring
+ * is first submitted with it, so whatever it held before is ignored.
+ *
  * \sa amdgpu_cs_request, amdgpu_cs_query_fence,
- *     amdgpu_cs_submit(), amdgpu_cs_query_fence_status()
+ *     amdgpu_cs_submit(), amdgpu_cs_query_fence_status(),
+ *     amdgpu_cs_wait_fences()
 */
 struct amdgpu_cs_fence_info {
 	/** buffer object for the fence */
@@ -723,6 +762,72 @@ int amdgpu_bo_wait_for_idle(amdgpu_bo_handle buf_handle,
 			    uint64_t timeout_ns,
 			    bool *buffer_busy);
 
+/**
+ * Keep freed buffers around for reuse by later allocations
+ *
+ * Buffers freed with amdgpu_bo_free() go to a cache instead of being
+ * destroyed, and amdgpu_bo_alloc() takes an idle one of the same size
+ * class, heap and flags from it before asking the kernel for a new one.
+ * Sizes are rounded up to the next of four classes per power of two.
+ *
+ * Buffers that have been exported or given metadata are never cached,
+ * and neither are buffers larger than 64MB or than \c max_bytes.
+ *
+ * \param   dev	     - \c [in] Device handle.
+ *				See #amdgpu_device_initialize()
+ * \param   max_bytes  - \c [in] Total size the cache may hold. Once it is
+ *				full, the least recently freed buffers are
+ *				released first.
+ * \param   max_age_ms - \c [in] Buffers not reused within this many
+ *				milliseconds are released by the next
+ *				allocation or free on the device
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \note The cache is shared by every user of the device. Buffers must be
+ *	 unmapped from the GPU virtual address space before they are freed,
+ *	 since a cached buffer keeps its kernel object and its mappings.
+ *
+ * \note There is no timer: a device that stops allocating and freeing
+ *	 keeps its cached buffers until amdgpu_bo_cache_disable() or the
+ *	 next call to amdgpu_bo_cache_enable().
+ *
+ * \sa amdgpu_bo_cache_disable(), amdgpu_bo_cache_query_stats()
+ *
+*/
+int amdgpu_bo_cache_enable(amdgpu_device_handle dev,
+			   uint64_t max_bytes,
+			   uint32_t max_age_ms);
+
+/**
+ * Release every cached buffer and stop caching freed buffers
+ *
+ * \param   dev - \c [in] Device handle. See #amdgpu_device_initialize()
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \sa amdgpu_bo_cache_enable()
+ *
+*/
+int amdgpu_bo_cache_disable(amdgpu_device_handle dev);
+
+/**
+ * Report the state of the buffer cache
+ *
+ * \param   dev   - \c [in] Device handle. See #amdgpu_device_initialize()
+ * \param   stats - \c [out] Counters since the device was initialized
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \sa amdgpu_bo_cache_enable()
+ *
+*/
+int amdgpu_bo_cache_query_stats(amdgpu_device_handle dev,
+				struct amdgpu_bo_cache_stats *stats);
+
 /**
  * Creates a BO list handle for command submission.
  *
@@ -868,6 +973,17 @@ int amdgpu_cs_query_reset_state(amdgpu_context_handle context,
  *	 This will allow kernel driver to correctly implement "paging".
  *	 Failure to do so will have unpredictable results.
  *
+ * \note With #AMDGPU_CS_SUBMIT_MERGE in \c flags, consecutive requests to
+ *	 the same ip:ip_instance:ring with the same resource list, of which
+ *	 at most one has a user fence, are submitted together, up to
+ *	 #AMDGPU_CS_MAX_IBS_PER_SUBMIT IBs in total. They all get
+ *	 the sequence number of the combined submission, and the
+ *	 dependencies of each apply to all of them.
+ *
+ * \note Dependencies on the same ring of the same context, and on fences
+ *	 already seen signalled, or signalled according to a user fence,
+ *	 are not passed to the kernel.
+ *
  * \sa amdgpu_command_buffer_alloc(), amdgpu_command_buffer_free(),
  *     amdgpu_cs_query_fence_status()
  *
@@ -902,6 +1018,40 @@ int amdgpu_cs_query_fence_status(struct amdgpu_cs_fence *fence,
 				 uint64_t flags,
 				 uint32_t *expired);
 
+/**
+ *  Wait for several Command Buffer Submissions
+ *
+ * \param   fences     - \c [in] Array of fences to wait for
+ * \param   fence_count - \c [in] Number of fences
+ * \param   wait_all   - \c [in] Wait for all fences, or for any of them
+ * \param   timeout_ns - \c [in] Timeout value to wait, relative
+ * \param   status     - \c [out] If the wait was satisfied or not.\n
+ *				0  – if it timed out\n
+ *				!0 - otherwise
+ * \param   first      - \c [out] Index of a signalled fence when waiting
+ *				for any of them, may be NULL
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \note Fences are first checked against the ones already seen signalled
+ *	 and against the user fences of their rings, which takes no system
+ *	 call. With a timeout of 0, a fence whose own submission writes a
+ *	 user fence that doesn't show it signalled yet isn't asked about.
+ *
+ * \note The kernel waits for one fence at a time, so waiting for any of
+ *	 several fences with a timeout polls them. Fences shown busy by a
+ *	 user fence are asked about too once the polling has backed off.
+ *
+ * \sa amdgpu_cs_submit(), amdgpu_cs_query_fence_status()
+*/
+int amdgpu_cs_wait_fences(struct amdgpu_cs_fence *fences,
+			  uint32_t fence_count,
+			  bool wait_all,
+			  uint64_t timeout_ns,
+			  uint32_t *status,
+			  uint32_t *first);
+
 /*
  * Query / Info API
  *
@@ -54,6 +54,12 @@ static void amdgpu_close_kms_handle(amdgpu_device_handle dev,
 }
 
 drm_private void amdgpu_bo_free_internal(amdgpu_bo_handle bo)
+{
+	if (!amdgpu_bo_cache_put(bo))
+		amdgpu_bo_destroy(bo);
+}
+
+drm_private void amdgpu_bo_destroy(amdgpu_bo_handle bo)
 {
 	/* Remove the buffer from the hash tables. */
 	pthread_mutex_lock(&bo->dev->bo_table_mutex);
@@ -81,6 +87,7 @@ int amdgpu_bo_alloc(amdgpu_device_handle dev,
 		    amdgpu_bo_handle *buf_handle)
 {
 	struct amdgpu_bo *bo;
+	struct amdgpu_bo_cache_bucket *bucket;
 	union drm_amdgpu_gem_create args;
 	unsigned heap = alloc_buffer->preferred_heap;
 	int r = 0;
@@ -89,6 +96,13 @@ int amdgpu_bo_alloc(amdgpu_device_handle dev,
 	if (!(heap & (AMDGPU_GEM_DOMAIN_GTT | AMDGPU_GEM_DOMAIN_VRAM)))
 		return -EINVAL;
 
+	/* See if a freed buffer can be recycled. */
+	bo = amdgpu_bo_cache_get(dev, alloc_buffer, &bucket);
+	if (bo) {
+		*buf_handle = bo;
+		return 0;
+	}
+
 	bo = calloc(1, sizeof(struct amdgpu_bo));
 	if (!bo)
 		return -ENOMEM;
@@ -96,9 +110,16 @@ int amdgpu_bo_alloc(amdgpu_device_handle dev,
 	atomic_set(&bo->refcount, 1);
 	bo->dev = dev;
 	bo->alloc_size = alloc_buffer->alloc_size;
+	bo->phys_alignment = alloc_buffer->phys_alignment;
+
+	/* Cached buffers are created at the size of their class. */
+	if (bucket) {
+		bo->alloc_size = bucket->size;
+		bo->cache_bucket = bucket;
+	}
 
 	memset(&args, 0, sizeof(args));
-	args.in.bo_size = alloc_buffer->alloc_size;
+	args.in.bo_size = bo->alloc_size;
 	args.in.alignment = alloc_buffer->phys_alignment;
 
 	/* Set the placement. */
@@ -126,6 +147,9 @@ int amdgpu_bo_set_metadata(amdgpu_bo_handle bo,
 {
 	struct drm_amdgpu_gem_metadata args = {};
 
+	/* A reused buffer would come back with stale metadata. */
+	bo->cache_bucket = NULL;
+
 	args.handle = bo->handle;
 	args.op = AMDGPU_GEM_METADATA_OP_SET_METADATA;
 	args.data.flags = info->flags;
@@ -257,6 +281,9 @@ int amdgpu_bo_export(amdgpu_bo_handle bo,
 {
 	int r;
 
+	/* Others may hold on to the buffer after we free it. */
+	bo->cache_bucket = NULL;
+
 	switch (type) {
 	case amdgpu_bo_handle_type_gem_flink_name:
 		r = amdgpu_bo_export_flink(bo);
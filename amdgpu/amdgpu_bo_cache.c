@@ -0,0 +1,329 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/**
+ * \file amdgpu_bo_cache.c
+ *
+ *  Reuse of freed buffers, so that short-lived buffers don't cost a
+ *  GEM_CREATE and a GEM_CLOSE each.
+ *
+ *  Cached buffers sit both in the bucket of their size class, heap and
+ *  flags, and in a device-wide LRU that the byte budget and the age limit
+ *  trim from the oldest end.  The age limit is enforced whenever buffers
+ *  are allocated or freed, rather than from a timer thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "xf86drm.h"
+#include "amdgpu_drm.h"
+#include "amdgpu_internal.h"
+
+#define AMDGPU_BO_CACHE_PAGE_SIZE 4096
+
+static uint64_t amdgpu_bo_cache_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Up to 4 pages, one class per page.  Above that, four classes per power
+ * of two: pages in (2^b, 2^(b+1)] are rounded up to a multiple of 2^(b-2).
+ */
+static unsigned amdgpu_bo_cache_bucket_index(uint64_t size)
+{
+	unsigned pages = (size + AMDGPU_BO_CACHE_PAGE_SIZE - 1) /
+			 AMDGPU_BO_CACHE_PAGE_SIZE;
+	unsigned b;
+
+	if (pages <= 4)
+		return pages - 1;
+
+	b = 31 - __builtin_clz(pages - 1);
+	return (b - 2) * 4 + ((pages - 1) >> (b - 2));
+}
+
+static uint64_t amdgpu_bo_cache_bucket_size(unsigned index)
+{
+	unsigned b;
+
+	if (index < 4)
+		return (index + 1) * AMDGPU_BO_CACHE_PAGE_SIZE;
+
+	b = (index - 4) / 4 + 2;
+	return (uint64_t)((index - 4) % 4 + 5) * AMDGPU_BO_CACHE_PAGE_SIZE <<
+	       (b - 2);
+}
+
+/* Finds the buckets for @heap and @flags, creating them on first use. */
+static struct amdgpu_bo_cache_heap *
+amdgpu_bo_cache_find_heap(struct amdgpu_bo_cache *cache, uint32_t heap,
+			  uint64_t flags)
+{
+	struct amdgpu_bo_cache_heap *h;
+	unsigned i;
+
+	LIST_FOR_EACH_ENTRY(h, &cache->heaps, link) {
+		if (h->heap == heap && h->flags == flags)
+			return h;
+	}
+
+	h = calloc(1, sizeof(struct amdgpu_bo_cache_heap));
+	if (!h)
+		return NULL;
+
+	h->heap = heap;
+	h->flags = flags;
+	for (i = 0; i < AMDGPU_BO_CACHE_NUM_BUCKETS; i++) {
+		list_inithead(&h->buckets[i].list);
+		h->buckets[i].size = amdgpu_bo_cache_bucket_size(i);
+	}
+	list_add(&h->link, &cache->heaps);
+
+	return h;
+}
+
+static void amdgpu_bo_cache_remove(struct amdgpu_bo_cache *cache,
+				   amdgpu_bo_handle bo)
+{
+	list_del(&bo->cache_link);
+	list_del(&bo->cache_lru);
+	cache->stats.size -= bo->alloc_size;
+	cache->stats.count--;
+}
+
+static void amdgpu_bo_cache_evict(struct amdgpu_bo_cache *cache,
+				  amdgpu_bo_handle bo)
+{
+	amdgpu_bo_cache_remove(cache, bo);
+	cache->stats.evictions++;
+	amdgpu_bo_destroy(bo);
+}
+
+/* Releases the least recently freed buffers until the rest fit in @size. */
+static void amdgpu_bo_cache_shrink(struct amdgpu_bo_cache *cache,
+				   uint64_t size)
+{
+	while (cache->stats.size > size)
+		amdgpu_bo_cache_evict(cache, LIST_ENTRY(struct amdgpu_bo,
+							cache->lru.next,
+							cache_lru));
+}
+
+/* Releases the buffers freed more than max_age milliseconds before @now. */
+static void amdgpu_bo_cache_expire(struct amdgpu_bo_cache *cache,
+				   uint64_t now)
+{
+	while (!LIST_IS_EMPTY(&cache->lru)) {
+		struct amdgpu_bo *bo = LIST_ENTRY(struct amdgpu_bo,
+						  cache->lru.next, cache_lru);
+
+		if (now - bo->free_time <= cache->max_age)
+			break;
+
+		amdgpu_bo_cache_evict(cache, bo);
+	}
+}
+
+drm_private void amdgpu_bo_cache_init(struct amdgpu_bo_cache *cache)
+{
+	pthread_mutex_init(&cache->mutex, NULL);
+	list_inithead(&cache->heaps);
+	list_inithead(&cache->lru);
+}
+
+drm_private void amdgpu_bo_cache_deinit(struct amdgpu_bo_cache *cache)
+{
+	struct amdgpu_bo_cache_heap *h, *tmp;
+
+	amdgpu_bo_cache_shrink(cache, 0);
+	LIST_FOR_EACH_ENTRY_SAFE(h, tmp, &cache->heaps, link)
+		free(h);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+/**
+ * Takes an idle buffer matching @request from the cache.
+ *
+ * On a miss, returns NULL and sets @bucket to the size class the new
+ * buffer should be created with and returned to, or to NULL if it
+ * shouldn't be cached.
+ */
+drm_private amdgpu_bo_handle
+amdgpu_bo_cache_get(amdgpu_device_handle dev,
+		    struct amdgpu_bo_alloc_request *request,
+		    struct amdgpu_bo_cache_bucket **bucket)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+	struct amdgpu_bo_cache_heap *heap;
+	struct amdgpu_bo *bo, *tmp;
+	uint64_t now;
+	bool busy;
+
+	*bucket = NULL;
+	if (request->alloc_size == 0 ||
+	    request->alloc_size > AMDGPU_BO_CACHE_MAX_SIZE)
+		return NULL;
+
+	now = amdgpu_bo_cache_time();
+
+	pthread_mutex_lock(&cache->mutex);
+
+	heap = NULL;
+	if (cache->max_size)
+		heap = amdgpu_bo_cache_find_heap(cache, request->preferred_heap,
+						 request->flags);
+	if (!heap) {
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+
+	/* There is no timer, so expire here as well as on free, for
+	 * applications that allocate more than they free for a while.
+	 */
+	amdgpu_bo_cache_expire(cache, now);
+
+	*bucket = &heap->buckets[amdgpu_bo_cache_bucket_index(request->alloc_size)];
+
+	/* The oldest buffers are the most likely to be idle already, so
+	 * stop at the first busy one.
+	 */
+	LIST_FOR_EACH_ENTRY_SAFE(bo, tmp, &(*bucket)->list, cache_link) {
+		if (bo->phys_alignment < request->phys_alignment)
+			continue;
+
+		if (amdgpu_bo_wait_for_idle(bo, 0, &busy)) {
+			amdgpu_bo_cache_evict(cache, bo);
+			continue;
+		}
+
+		if (busy) {
+			cache->stats.busy++;
+			break;
+		}
+
+		amdgpu_bo_cache_remove(cache, bo);
+		cache->stats.hits++;
+		pthread_mutex_unlock(&cache->mutex);
+
+		atomic_set(&bo->refcount, 1);
+		return bo;
+	}
+
+	cache->stats.misses++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/**
+ * Puts a buffer whose last reference was dropped into the cache.
+ *
+ * \return true if the buffer was cached, false if it must be destroyed
+ */
+drm_private bool amdgpu_bo_cache_put(amdgpu_bo_handle bo)
+{
+	struct amdgpu_bo_cache *cache = &bo->dev->bo_cache;
+	uint64_t now;
+
+	if (!bo->cache_bucket)
+		return false;
+
+	/* Release CPU access, as destroying the buffer would. */
+	if (bo->cpu_map_count > 0) {
+		bo->cpu_map_count = 1;
+		amdgpu_bo_cpu_unmap(bo);
+	}
+
+	now = amdgpu_bo_cache_time();
+
+	pthread_mutex_lock(&cache->mutex);
+
+	if (bo->alloc_size > cache->max_size) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	bo->free_time = now;
+	list_addtail(&bo->cache_link, &bo->cache_bucket->list);
+	list_addtail(&bo->cache_lru, &cache->lru);
+	cache->stats.size += bo->alloc_size;
+	cache->stats.count++;
+
+	amdgpu_bo_cache_shrink(cache, cache->max_size);
+	amdgpu_bo_cache_expire(cache, now);
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return true;
+}
+
+int amdgpu_bo_cache_enable(amdgpu_device_handle dev,
+			   uint64_t max_bytes,
+			   uint32_t max_age_ms)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+
+	if (max_bytes == 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_size = max_bytes;
+	cache->max_age = max_age_ms;
+	amdgpu_bo_cache_shrink(cache, max_bytes);
+	amdgpu_bo_cache_expire(cache, amdgpu_bo_cache_time());
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+int amdgpu_bo_cache_disable(amdgpu_device_handle dev)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_size = 0;
+	amdgpu_bo_cache_shrink(cache, 0);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
+
+int amdgpu_bo_cache_query_stats(amdgpu_device_handle dev,
+				struct amdgpu_bo_cache_stats *stats)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
@@ -31,14 +31,13 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
 #include <sys/ioctl.h>
-#ifdef HAVE_ALLOCA_H
-# include <alloca.h>
-#endif
 
 #include "xf86drm.h"
 #include "amdgpu_drm.h"
 #include "amdgpu_internal.h"
+#include "util_math.h"
 
 /**
  * Create command submission context
@@ -65,6 +64,8 @@ int amdgpu_cs_ctx_create(amdgpu_device_handle dev,
 		return -ENOMEM;
 
 	gpu_context->dev = dev;
+	pthread_mutex_init(&gpu_context->cs_mutex, NULL);
+	pthread_mutex_init(&gpu_context->fence_mutex, NULL);
 
 	/* Create the context */
 	memset(&args, 0, sizeof(args));
@@ -79,10 +80,20 @@ int amdgpu_cs_ctx_create(amdgpu_device_handle dev,
 	return 0;
 
 error:
+	pthread_mutex_destroy(&gpu_context->fence_mutex);
+	pthread_mutex_destroy(&gpu_context->cs_mutex);
 	free(gpu_context);
 	return r;
 }
 
+static void amdgpu_cs_user_fence_release(amdgpu_bo_handle bo)
+{
+	if (bo) {
+		amdgpu_bo_cpu_unmap(bo);
+		amdgpu_bo_reference(&bo, NULL);
+	}
+}
+
 /**
  * Release command submission context
  *
@@ -94,6 +105,7 @@ error:
 int amdgpu_cs_ctx_free(amdgpu_context_handle context)
 {
 	union drm_amdgpu_ctx args;
+	unsigned i, j, k;
 	int r;
 
 	if (NULL == context)
@@ -106,6 +118,17 @@ int amdgpu_cs_ctx_free(amdgpu_context_handle context)
 	r = drmCommandWriteRead(context->dev->fd, DRM_AMDGPU_CTX,
 				&args, sizeof(args));
 
+	free(context->builder.chunk_array);
+	free(context->builder.chunks);
+	free(context->builder.chunk_data);
+	free(context->builder.dependencies);
+	for (i = 0; i < AMDGPU_HW_IP_NUM; i++)
+		for (j = 0; j < AMDGPU_HW_IP_INSTANCE_MAX_COUNT; j++)
+			for (k = 0; k < AMDGPU_CS_MAX_RINGS; k++)
+				amdgpu_cs_user_fence_release(
+					context->user_fence[i][j][k].bo);
+	pthread_mutex_destroy(&context->fence_mutex);
+	pthread_mutex_destroy(&context->cs_mutex);
 	free(context);
 
 	return r;
@@ -132,124 +155,401 @@ int amdgpu_cs_query_reset_state(amdgpu_context_handle context,
 	return r;
 }
 
-/**
- * Submit command to kernel DRM
- * \param   dev - \c [in]  Device handle
- * \param   context - \c [in]  GPU Context
- * \param   ibs_request - \c [in]  Pointer to submission requests
- * \param   fence - \c [out] return fence for this submission
- *
- * \return  0 on success otherwise POSIX Error code
- * \sa amdgpu_cs_submit()
-*/
-static int amdgpu_cs_submit_one(amdgpu_context_handle context,
-				struct amdgpu_cs_request *ibs_request)
+enum amdgpu_cs_fence_state {
+	AMDGPU_CS_FENCE_UNKNOWN,
+	AMDGPU_CS_FENCE_SIGNALLED,
+	AMDGPU_CS_FENCE_BUSY,
+};
+
+/*
+ * What can be told about @fence without asking the kernel: from the fences
+ * seen signalled so far, then from the ring's user fence.  The latter also
+ * tells that the fence is still busy if it will write the user fence
+ * itself.
+ */
+static enum amdgpu_cs_fence_state
+amdgpu_cs_fence_check(struct amdgpu_cs_fence *fence)
 {
-	union drm_amdgpu_cs cs;
-	uint64_t *chunk_array;
-	struct drm_amdgpu_cs_chunk *chunks;
-	struct drm_amdgpu_cs_chunk_data *chunk_data;
-	struct drm_amdgpu_cs_chunk_dep *dependencies = NULL;
-	uint32_t i, size;
-	bool user_fence;
-	int r = 0;
+	amdgpu_context_handle context = fence->context;
+	enum amdgpu_cs_fence_state state = AMDGPU_CS_FENCE_UNKNOWN;
+	struct amdgpu_cs_user_fence *user_fence;
+	uint64_t *signalled, value;
+
+	if (fence->ip_type >= AMDGPU_HW_IP_NUM ||
+	    fence->ip_instance >= AMDGPU_HW_IP_INSTANCE_MAX_COUNT ||
+	    fence->ring >= AMDGPU_CS_MAX_RINGS)
+		return state;
+
+	pthread_mutex_lock(&context->fence_mutex);
+	signalled = &context->signalled[fence->ip_type][fence->ip_instance]
+				       [fence->ring];
+	user_fence = &context->user_fence[fence->ip_type][fence->ip_instance]
+					 [fence->ring];
+
+	if (fence->fence > *signalled && user_fence->cpu) {
+		/* Anything past the last submission is stale data. */
+		value = *user_fence->cpu;
+		if (value > *signalled && value <= user_fence->last)
+			*signalled = value;
+	}
+
+	if (fence->fence <= *signalled)
+		state = AMDGPU_CS_FENCE_SIGNALLED;
+	else if (fence->fence >= user_fence->first &&
+		 fence->fence <= user_fence->last)
+		state = AMDGPU_CS_FENCE_BUSY;
+	pthread_mutex_unlock(&context->fence_mutex);
+
+	return state;
+}
+
+/* Records that @fence, and so every earlier fence on its ring, signalled. */
+static void amdgpu_cs_fence_mark_signalled(struct amdgpu_cs_fence *fence)
+{
+	amdgpu_context_handle context = fence->context;
+	uint64_t *signalled;
+
+	if (fence->ip_type >= AMDGPU_HW_IP_NUM ||
+	    fence->ip_instance >= AMDGPU_HW_IP_INSTANCE_MAX_COUNT ||
+	    fence->ring >= AMDGPU_CS_MAX_RINGS)
+		return;
+
+	pthread_mutex_lock(&context->fence_mutex);
+	signalled = &context->signalled[fence->ip_type][fence->ip_instance]
+				       [fence->ring];
+	if (fence->fence > *signalled)
+		*signalled = fence->fence;
+	pthread_mutex_unlock(&context->fence_mutex);
+}
+
+/*
+ * Maps the user fence of @request before it is submitted.  Returns the
+ * buffer for amdgpu_cs_user_fence_track(), referenced if the ring doesn't
+ * hold it yet, and sets @cpu to the slot (or NULL).  A slot the ring didn't
+ * write its fences to so far is cleared first: it may still hold fences of
+ * another context, or of the buffer's previous owner.  Called with
+ * cs_mutex held.
+ */
+static amdgpu_bo_handle
+amdgpu_cs_user_fence_prepare(amdgpu_context_handle context,
+			     struct amdgpu_cs_request *request,
+			     struct amdgpu_cs_fence_info *fence_info,
+			     volatile uint64_t **cpu)
+{
+	struct amdgpu_cs_user_fence *user_fence;
+	amdgpu_bo_handle bo;
+	void *ptr;
+
+	*cpu = NULL;
+	if (!fence_info ||
+	    request->ip_instance >= AMDGPU_HW_IP_INSTANCE_MAX_COUNT)
+		return NULL;
+
+	user_fence = &context->user_fence[request->ip_type]
+					 [request->ip_instance][request->ring];
+
+	bo = fence_info->handle;
+	if (user_fence->bo == bo)
+		ptr = bo->cpu_ptr;
+	else if (amdgpu_bo_cpu_map(bo, &ptr) == 0)
+		atomic_inc(&bo->refcount);
+	else
+		return NULL;
+
+	if ((fence_info->offset + 1) * sizeof(uint64_t) <= bo->alloc_size)
+		*cpu = (uint64_t *)ptr + fence_info->offset;
+
+	/* Not read before the ring tracks it, and not written before the
+	 * submission either. */
+	if (*cpu && *cpu != user_fence->cpu)
+		**cpu = 0;
+
+	return bo;
+}
+
+/*
+ * Remembers where the ring of @request writes its user fence, so that its
+ * fences can be checked with a CPU read.  @seq is the fence of the
+ * submission, or 0 if it failed.  @bo and @cpu are what
+ * amdgpu_cs_user_fence_prepare() returned, @fence_info may be NULL.
+ * Called with cs_mutex held.
+ */
+static void amdgpu_cs_user_fence_track(amdgpu_context_handle context,
+				       struct amdgpu_cs_request *request,
+				       struct amdgpu_cs_fence_info *fence_info,
+				       amdgpu_bo_handle bo,
+				       volatile uint64_t *cpu,
+				       uint64_t seq)
+{
+	struct amdgpu_cs_user_fence *user_fence;
+	amdgpu_bo_handle old = NULL;
 
+	if (!fence_info ||
+	    request->ip_instance >= AMDGPU_HW_IP_INSTANCE_MAX_COUNT)
+		return;
+
+	user_fence = &context->user_fence[request->ip_type]
+					 [request->ip_instance][request->ring];
+
+	if (!seq) {
+		if (bo != user_fence->bo)
+			amdgpu_cs_user_fence_release(bo);
+		return;
+	}
+
+	pthread_mutex_lock(&context->fence_mutex);
+	if (user_fence->bo != bo)
+		old = user_fence->bo;
+	user_fence->bo = bo;
+
+	/* A submission without this user fence in between breaks the run. */
+	if (!cpu) {
+		user_fence->first = 0;
+		seq = 0;
+	} else if (cpu != user_fence->cpu || seq != user_fence->last + 1) {
+		user_fence->first = seq;
+	}
+	user_fence->cpu = cpu;
+	user_fence->last = seq;
+	pthread_mutex_unlock(&context->fence_mutex);
+
+	amdgpu_cs_user_fence_release(old);
+}
+
+/* Makes room for @num_chunks chunks and @num_dependencies dependencies. */
+static int amdgpu_cs_builder_reserve(struct amdgpu_cs_builder *builder,
+				     unsigned num_chunks,
+				     unsigned num_dependencies)
+{
+	if (num_chunks > builder->max_chunks) {
+		unsigned max = MAX2(num_chunks, builder->max_chunks * 2);
+		void *ptr;
+
+		ptr = realloc(builder->chunk_array, sizeof(uint64_t) * max);
+		if (!ptr)
+			return -ENOMEM;
+		builder->chunk_array = ptr;
+
+		ptr = realloc(builder->chunks,
+			      sizeof(struct drm_amdgpu_cs_chunk) * max);
+		if (!ptr)
+			return -ENOMEM;
+		builder->chunks = ptr;
+
+		ptr = realloc(builder->chunk_data,
+			      sizeof(struct drm_amdgpu_cs_chunk_data) * max);
+		if (!ptr)
+			return -ENOMEM;
+		builder->chunk_data = ptr;
+
+		builder->max_chunks = max;
+	}
+
+	if (num_dependencies > builder->max_dependencies) {
+		unsigned max = MAX2(num_dependencies,
+				    builder->max_dependencies * 2);
+		void *ptr;
+
+		ptr = realloc(builder->dependencies,
+			      sizeof(struct drm_amdgpu_cs_chunk_dep) * max);
+		if (!ptr)
+			return -ENOMEM;
+		builder->dependencies = ptr;
+		builder->max_dependencies = max;
+	}
+
+	return 0;
+}
+
+static int amdgpu_cs_validate_request(struct amdgpu_cs_request *ibs_request)
+{
 	if (ibs_request->ip_type >= AMDGPU_HW_IP_NUM)
 		return -EINVAL;
 	if (ibs_request->ring >= AMDGPU_CS_MAX_RINGS)
 		return -EINVAL;
 	if (ibs_request->number_of_ibs > AMDGPU_CS_MAX_IBS_PER_SUBMIT)
 		return -EINVAL;
-	user_fence = (ibs_request->fence_info.handle != NULL);
+	return 0;
+}
 
-	size = ibs_request->number_of_ibs + (user_fence ? 2 : 1);
+/*
+ * Whether @next may be sent to the kernel along with the group of @first.
+ * A merged submission stays within the limit callers have for one
+ * request, so it never carries more IBs than a caller could send.
+ */
+static bool amdgpu_cs_can_merge(struct amdgpu_cs_request *first,
+				struct amdgpu_cs_request *next,
+				uint32_t num_ibs, bool user_fence)
+{
+	return next->ip_type == first->ip_type &&
+	       next->ip_instance == first->ip_instance &&
+	       next->ring == first->ring &&
+	       next->resources == first->resources &&
+	       num_ibs + next->number_of_ibs <= AMDGPU_CS_MAX_IBS_PER_SUBMIT &&
+	       !(user_fence && next->fence_info.handle);
+}
 
-	chunk_array = alloca(sizeof(uint64_t) * size);
-	chunks = alloca(sizeof(struct drm_amdgpu_cs_chunk) * size);
+/**
+ * Submit command to kernel DRM
+ * \param   context - \c [in]  GPU Context
+ * \param   ibs_request - \c [in]  Requests to the same ring to submit as one
+ * \param   number_of_requests - \c [in]  Number of requests
+ *
+ * \return  0 on success otherwise POSIX Error code
+ * \sa amdgpu_cs_submit()
+*/
+static int amdgpu_cs_submit_group(amdgpu_context_handle context,
+				  struct amdgpu_cs_request *ibs_request,
+				  uint32_t number_of_requests)
+{
+	struct amdgpu_cs_builder *builder = &context->builder;
+	struct amdgpu_cs_fence_info *fence_info = NULL;
+	struct drm_amdgpu_cs_chunk_data *chunk_data;
+	volatile uint64_t *fence_cpu;
+	amdgpu_bo_handle fence_bo;
+	struct drm_amdgpu_cs_chunk *chunks;
+	uint32_t num_ibs = 0, num_dependencies = 0, num_chunks = 0;
+	uint32_t i, j, k;
+	union drm_amdgpu_cs cs;
+	int r;
+
+	for (i = 0; i < number_of_requests; i++) {
+		num_ibs += ibs_request[i].number_of_ibs;
+		num_dependencies += ibs_request[i].number_of_dependencies;
+		if (ibs_request[i].fence_info.handle)
+			fence_info = &ibs_request[i].fence_info;
+	}
 
-	size = ibs_request->number_of_ibs + (user_fence ? 1 : 0);
+	r = amdgpu_cs_builder_reserve(builder, num_ibs + 2, num_dependencies);
+	if (r)
+		return r;
 
-	chunk_data = alloca(sizeof(struct drm_amdgpu_cs_chunk_data) * size);
+	chunks = builder->chunks;
+	chunk_data = builder->chunk_data;
 
 	memset(&cs, 0, sizeof(cs));
-	cs.in.chunks = (uint64_t)(uintptr_t)chunk_array;
+	cs.in.chunks = (uint64_t)(uintptr_t)builder->chunk_array;
 	cs.in.ctx_id = context->id;
 	if (ibs_request->resources)
 		cs.in.bo_list_handle = ibs_request->resources->handle;
-	cs.in.num_chunks = ibs_request->number_of_ibs;
+
 	/* IB chunks */
-	for (i = 0; i < ibs_request->number_of_ibs; i++) {
-		struct amdgpu_cs_ib_info *ib;
-		chunk_array[i] = (uint64_t)(uintptr_t)&chunks[i];
-		chunks[i].chunk_id = AMDGPU_CHUNK_ID_IB;
-		chunks[i].length_dw = sizeof(struct drm_amdgpu_cs_chunk_ib) / 4;
-		chunks[i].chunk_data = (uint64_t)(uintptr_t)&chunk_data[i];
-
-		ib = &ibs_request->ibs[i];
-
-		chunk_data[i].ib_data._pad = 0;
-		chunk_data[i].ib_data.va_start = ib->ib_mc_address;
-		chunk_data[i].ib_data.ib_bytes = ib->size * 4;
-		chunk_data[i].ib_data.ip_type = ibs_request->ip_type;
-		chunk_data[i].ib_data.ip_instance = ibs_request->ip_instance;
-		chunk_data[i].ib_data.ring = ibs_request->ring;
-		chunk_data[i].ib_data.flags = ib->flags;
+	for (i = 0; i < number_of_requests; i++) {
+		struct amdgpu_cs_request *request = &ibs_request[i];
+
+		for (j = 0; j < request->number_of_ibs; j++) {
+			struct amdgpu_cs_ib_info *ib = &request->ibs[j];
+
+			k = num_chunks++;
+			builder->chunk_array[k] = (uint64_t)(uintptr_t)&chunks[k];
+			chunks[k].chunk_id = AMDGPU_CHUNK_ID_IB;
+			chunks[k].length_dw =
+				sizeof(struct drm_amdgpu_cs_chunk_ib) / 4;
+			chunks[k].chunk_data =
+				(uint64_t)(uintptr_t)&chunk_data[k];
+
+			chunk_data[k].ib_data._pad = 0;
+			chunk_data[k].ib_data.va_start = ib->ib_mc_address;
+			chunk_data[k].ib_data.ib_bytes = ib->size * 4;
+			chunk_data[k].ib_data.ip_type = request->ip_type;
+			chunk_data[k].ib_data.ip_instance = request->ip_instance;
+			chunk_data[k].ib_data.ring = request->ring;
+			chunk_data[k].ib_data.flags = ib->flags;
+		}
 	}
 
-	if (user_fence) {
-		i = cs.in.num_chunks++;
+	if (fence_info) {
+		k = num_chunks++;
 
 		/* fence chunk */
-		chunk_array[i] = (uint64_t)(uintptr_t)&chunks[i];
-		chunks[i].chunk_id = AMDGPU_CHUNK_ID_FENCE;
-		chunks[i].length_dw = sizeof(struct drm_amdgpu_cs_chunk_fence) / 4;
-		chunks[i].chunk_data = (uint64_t)(uintptr_t)&chunk_data[i];
+		builder->chunk_array[k] = (uint64_t)(uintptr_t)&chunks[k];
+		chunks[k].chunk_id = AMDGPU_CHUNK_ID_FENCE;
+		chunks[k].length_dw = sizeof(struct drm_amdgpu_cs_chunk_fence) / 4;
+		chunks[k].chunk_data = (uint64_t)(uintptr_t)&chunk_data[k];
 
 		/* fence bo handle */
-		chunk_data[i].fence_data.handle = ibs_request->fence_info.handle->handle;
+		chunk_data[k].fence_data.handle = fence_info->handle->handle;
 		/* offset */
-		chunk_data[i].fence_data.offset = 
-			ibs_request->fence_info.offset * sizeof(uint64_t);
+		chunk_data[k].fence_data.offset =
+			fence_info->offset * sizeof(uint64_t);
 	}
 
-	if (ibs_request->number_of_dependencies) {
-		dependencies = malloc(sizeof(struct drm_amdgpu_cs_chunk_dep) *
-			ibs_request->number_of_dependencies);
-		if (!dependencies) {
-			r = -ENOMEM;
-			goto error_unlock;
-		}
-
-		for (i = 0; i < ibs_request->number_of_dependencies; ++i) {
-			struct amdgpu_cs_fence *info = &ibs_request->dependencies[i];
-			struct drm_amdgpu_cs_chunk_dep *dep = &dependencies[i];
-			dep->ip_type = info->ip_type;
-			dep->ip_instance = info->ip_instance;
-			dep->ring = info->ring;
-			dep->ctx_id = info->context->id;
-			dep->handle = info->fence;
+	/* Only the latest fence of each other ring is worth waiting for:
+	 * our own ring executes in order, and signalled fences are done.
+	 */
+	num_dependencies = 0;
+	for (i = 0; i < number_of_requests; i++) {
+		struct amdgpu_cs_request *request = &ibs_request[i];
+
+		for (j = 0; j < request->number_of_dependencies; j++) {
+			struct amdgpu_cs_fence *info = &request->dependencies[j];
+			struct drm_amdgpu_cs_chunk_dep *dep;
+
+			if (info->context == context &&
+			    info->ip_type == ibs_request->ip_type &&
+			    info->ip_instance == ibs_request->ip_instance &&
+			    info->ring == ibs_request->ring)
+				continue;
+
+			if (amdgpu_cs_fence_check(info) ==
+			    AMDGPU_CS_FENCE_SIGNALLED)
+				continue;
+
+			for (k = 0; k < num_dependencies; k++) {
+				dep = &builder->dependencies[k];
+				if (dep->ctx_id == info->context->id &&
+				    dep->ip_type == info->ip_type &&
+				    dep->ip_instance == info->ip_instance &&
+				    dep->ring == info->ring)
+					break;
+			}
+
+			dep = &builder->dependencies[k];
+			if (k == num_dependencies) {
+				num_dependencies++;
+				dep->ip_type = info->ip_type;
+				dep->ip_instance = info->ip_instance;
+				dep->ring = info->ring;
+				dep->ctx_id = info->context->id;
+				dep->handle = info->fence;
+			} else if (info->fence > dep->handle) {
+				dep->handle = info->fence;
+			}
 		}
+	}
 
-		i = cs.in.num_chunks++;
+	if (num_dependencies) {
+		k = num_chunks++;
 
 		/* dependencies chunk */
-		chunk_array[i] = (uint64_t)(uintptr_t)&chunks[i];
-		chunks[i].chunk_id = AMDGPU_CHUNK_ID_DEPENDENCIES;
-		chunks[i].length_dw = sizeof(struct drm_amdgpu_cs_chunk_dep) / 4
-			* ibs_request->number_of_dependencies;
-		chunks[i].chunk_data = (uint64_t)(uintptr_t)dependencies;
+		builder->chunk_array[k] = (uint64_t)(uintptr_t)&chunks[k];
+		chunks[k].chunk_id = AMDGPU_CHUNK_ID_DEPENDENCIES;
+		chunks[k].length_dw = sizeof(struct drm_amdgpu_cs_chunk_dep) / 4
+			* num_dependencies;
+		chunks[k].chunk_data =
+			(uint64_t)(uintptr_t)builder->dependencies;
 	}
 
+	cs.in.num_chunks = num_chunks;
+
+	fence_bo = amdgpu_cs_user_fence_prepare(context, ibs_request,
+						fence_info, &fence_cpu);
+
 	r = drmCommandWriteRead(context->dev->fd, DRM_AMDGPU_CS,
 				&cs, sizeof(cs));
-	if (r)
-		goto error_unlock;
+	if (r) {
+		amdgpu_cs_user_fence_track(context, ibs_request, fence_info,
+					   fence_bo, fence_cpu, 0);
+		return r;
+	}
 
-	ibs_request->seq_no = cs.out.handle;
+	for (i = 0; i < number_of_requests; i++)
+		ibs_request[i].seq_no = cs.out.handle;
 
-error_unlock:
-	free(dependencies);
-	return r;
+	amdgpu_cs_user_fence_track(context, ibs_request, fence_info,
+				   fence_bo, fence_cpu, cs.out.handle);
+
+	return 0;
 }
 
 int amdgpu_cs_submit(amdgpu_context_handle context,
@@ -257,7 +557,8 @@ int amdgpu_cs_submit(amdgpu_context_handle context,
 		     struct amdgpu_cs_request *ibs_request,
 		     uint32_t number_of_requests)
 {
-	uint32_t i;
+	uint32_t i, count, num_ibs;
+	bool user_fence;
 	int r;
 
 	if (NULL == context)
@@ -265,14 +566,36 @@ int amdgpu_cs_submit(amdgpu_context_handle context,
 	if (NULL == ibs_request)
 		return -EINVAL;
 
+	pthread_mutex_lock(&context->cs_mutex);
+
 	r = 0;
-	for (i = 0; i < number_of_requests; i++) {
-		r = amdgpu_cs_submit_one(context, ibs_request);
+	for (i = 0; i < number_of_requests; i += count) {
+		r = amdgpu_cs_validate_request(&ibs_request[i]);
+		if (r)
+			break;
+
+		count = 1;
+		num_ibs = ibs_request[i].number_of_ibs;
+		user_fence = ibs_request[i].fence_info.handle != NULL;
+
+		while ((flags & AMDGPU_CS_SUBMIT_MERGE) &&
+		       i + count < number_of_requests &&
+		       !amdgpu_cs_validate_request(&ibs_request[i + count]) &&
+		       amdgpu_cs_can_merge(&ibs_request[i],
+					   &ibs_request[i + count],
+					   num_ibs, user_fence)) {
+			num_ibs += ibs_request[i + count].number_of_ibs;
+			user_fence |= ibs_request[i + count].fence_info.handle != NULL;
+			count++;
+		}
+
+		r = amdgpu_cs_submit_group(context, &ibs_request[i], count);
 		if (r)
 			break;
-		ibs_request++;
 	}
 
+	pthread_mutex_unlock(&context->cs_mutex);
+
 	return r;
 }
 
@@ -332,11 +655,23 @@ static int amdgpu_ioctl_wait_cs(amdgpu_context_handle context,
 	return 0;
 }
 
+static int amdgpu_cs_fence_validate(struct amdgpu_cs_fence *fence)
+{
+	if (NULL == fence->context)
+		return -EINVAL;
+	if (fence->ip_type >= AMDGPU_HW_IP_NUM)
+		return -EINVAL;
+	if (fence->ring >= AMDGPU_CS_MAX_RINGS)
+		return -EINVAL;
+	return 0;
+}
+
 int amdgpu_cs_query_fence_status(struct amdgpu_cs_fence *fence,
 				 uint64_t timeout_ns,
 				 uint64_t flags,
 				 uint32_t *expired)
 {
+	enum amdgpu_cs_fence_state state;
 	bool busy = true;
 	int r;
 
@@ -344,22 +679,149 @@ int amdgpu_cs_query_fence_status(struct amdgpu_cs_fence *fence,
 		return -EINVAL;
 	if (NULL == expired)
 		return -EINVAL;
-	if (NULL == fence->context)
-		return -EINVAL;
-	if (fence->ip_type >= AMDGPU_HW_IP_NUM)
-		return -EINVAL;
-	if (fence->ring >= AMDGPU_CS_MAX_RINGS)
-		return -EINVAL;
+	r = amdgpu_cs_fence_validate(fence);
+	if (r)
+		return r;
 
 	*expired = false;
 
+	state = amdgpu_cs_fence_check(fence);
+	if (state == AMDGPU_CS_FENCE_SIGNALLED) {
+		*expired = true;
+		return 0;
+	}
+	if (state == AMDGPU_CS_FENCE_BUSY && timeout_ns == 0)
+		return 0;
+
 	r = amdgpu_ioctl_wait_cs(fence->context, fence->ip_type,
 				fence->ip_instance, fence->ring,
 			       	fence->fence, timeout_ns, flags, &busy);
 
-	if (!r && !busy)
+	if (!r && !busy) {
 		*expired = true;
+		amdgpu_cs_fence_mark_signalled(fence);
+	}
 
 	return r;
 }
 
+/* Asks the kernel about @fence, waiting until the absolute @deadline. */
+static int amdgpu_cs_fence_wait(struct amdgpu_cs_fence *fence,
+				uint64_t deadline, bool *signalled)
+{
+	bool busy = true;
+	int r;
+
+	r = amdgpu_ioctl_wait_cs(fence->context, fence->ip_type,
+				 fence->ip_instance, fence->ring, fence->fence,
+				 deadline, AMDGPU_QUERY_FENCE_TIMEOUT_IS_ABSOLUTE,
+				 &busy);
+	if (r)
+		return r;
+
+	*signalled = !busy;
+	if (*signalled)
+		amdgpu_cs_fence_mark_signalled(fence);
+	return 0;
+}
+
+int amdgpu_cs_wait_fences(struct amdgpu_cs_fence *fences,
+			  uint32_t fence_count,
+			  bool wait_all,
+			  uint64_t timeout_ns,
+			  uint32_t *status,
+			  uint32_t *first)
+{
+	enum amdgpu_cs_fence_state state;
+	uint64_t deadline, now, delay = 10000;
+	struct timespec ts;
+	uint32_t i, pending = 0;
+	bool signalled;
+	int r;
+
+	if (NULL == fences || 0 == fence_count || NULL == status)
+		return -EINVAL;
+	for (i = 0; i < fence_count; i++) {
+		r = amdgpu_cs_fence_validate(&fences[i]);
+		if (r)
+			return r;
+	}
+
+	*status = 0;
+	if (first)
+		*first = 0;
+
+	/* Start with what can be told without a system call. */
+	for (i = 0; i < fence_count; i++) {
+		state = amdgpu_cs_fence_check(&fences[i]);
+		if (state == AMDGPU_CS_FENCE_SIGNALLED) {
+			if (!wait_all)
+				goto signalled;
+			continue;
+		}
+		if (state == AMDGPU_CS_FENCE_BUSY && wait_all && timeout_ns == 0)
+			return 0;
+		pending++;
+	}
+	if (pending == 0) {
+		i = 0;
+		goto signalled;
+	}
+
+	deadline = timeout_ns ? amdgpu_cs_calculate_timeout(timeout_ns) : 0;
+
+	if (wait_all || fence_count == 1) {
+		for (i = 0; i < fence_count; i++) {
+			/* Waiting for a fence may have signalled later ones. */
+			state = amdgpu_cs_fence_check(&fences[i]);
+			if (state == AMDGPU_CS_FENCE_SIGNALLED)
+				continue;
+			if (state == AMDGPU_CS_FENCE_BUSY && timeout_ns == 0)
+				return 0;
+
+			r = amdgpu_cs_fence_wait(&fences[i], deadline,
+						 &signalled);
+			if (r || !signalled)
+				return r;
+		}
+		i = 0;
+		goto signalled;
+	}
+
+	/* The kernel can only wait for one fence at a time, so poll the
+	 * ones it has to be asked about, backing off up to a millisecond.
+	 * Once backed off, the ones a user fence shows busy are asked about
+	 * too, so that the wait doesn't rely on the user fence alone.
+	 */
+	for (;;) {
+		for (i = 0; i < fence_count; i++) {
+			state = amdgpu_cs_fence_check(&fences[i]);
+			if (state == AMDGPU_CS_FENCE_SIGNALLED)
+				goto signalled;
+			if (state == AMDGPU_CS_FENCE_BUSY && delay < 1000000)
+				continue;
+
+			r = amdgpu_cs_fence_wait(&fences[i], 0, &signalled);
+			if (r)
+				return r;
+			if (signalled)
+				goto signalled;
+		}
+
+		now = amdgpu_cs_calculate_timeout(0);
+		if (now >= deadline)
+			return 0;
+
+		delay = MIN2(delay, deadline - now);
+		ts.tv_sec = delay / 1000000000;
+		ts.tv_nsec = delay % 1000000000;
+		nanosleep(&ts, NULL);
+		delay = MIN2(delay * 2, 1000000);
+	}
+
+signalled:
+	*status = 1;
+	if (first)
+		*first = i;
+	return 0;
+}
@@ -130,6 +130,7 @@ static int amdgpu_get_auth(int fd, int *auth)
 
 static void amdgpu_device_free_internal(amdgpu_device_handle dev)
 {
+	amdgpu_bo_cache_deinit(&dev->bo_cache);
 	amdgpu_vamgr_deinit(dev->vamgr);
 	free(dev->vamgr);
 	amdgpu_vamgr_deinit(dev->vamgr_32);
@@ -240,6 +241,7 @@ int amdgpu_device_initialize(int fd,
 						     handle_compare);
 	dev->bo_handles = util_hash_table_create(handle_hash, handle_compare);
 	pthread_mutex_init(&dev->bo_table_mutex, NULL);
+	amdgpu_bo_cache_init(&dev->bo_cache);
 
 	/* Check if acceleration is working. */
 	r = amdgpu_query_info(dev, AMDGPU_INFO_ACCEL_WORKING, 4, &accel_working);
@@ -46,7 +46,10 @@
 #define AMDGPU_INVALID_VA_ADDRESS	0xffffffffffffffff
 
 struct amdgpu_bo_va_hole {
-	struct list_head list;
+	/* children in the trees sorted by offset and by size */
+	struct amdgpu_bo_va_hole *left[2];
+	struct amdgpu_bo_va_hole *right[2];
+	uint32_t priority;
 	uint64_t offset;
 	uint64_t size;
 };
@@ -55,7 +58,13 @@ struct amdgpu_bo_va_mgr {
 	/* the start virtual address */
 	uint64_t va_offset;
 	uint64_t va_max;
-	struct list_head va_holes;
+	/* treaps of the holes below va_offset, by offset and by size */
+	struct amdgpu_bo_va_hole *va_holes[2];
+	/* holes kept aside so that freeing a range never allocates */
+	struct amdgpu_bo_va_hole *spare_holes;
+	unsigned num_holes;
+	unsigned num_ranges;
+	uint32_t seed;
 	pthread_mutex_t bo_va_mutex;
 	uint32_t va_alignment;
 };
@@ -68,6 +77,36 @@ struct amdgpu_va {
 	struct amdgpu_bo_va_mgr *vamgr;
 };
 
+/* Four size classes per power of two, from 4KB up to 64MB. */
+#define AMDGPU_BO_CACHE_MAX_SIZE	(64 * 1024 * 1024)
+#define AMDGPU_BO_CACHE_NUM_BUCKETS	52
+
+struct amdgpu_bo_cache_bucket {
+	/* cached buffers of this class, least recently freed first */
+	struct list_head list;
+	uint64_t size;
+};
+
+/* The size classes for one combination of heap and allocation flags. */
+struct amdgpu_bo_cache_heap {
+	struct list_head link;
+	uint32_t heap;
+	uint64_t flags;
+	struct amdgpu_bo_cache_bucket buckets[AMDGPU_BO_CACHE_NUM_BUCKETS];
+};
+
+struct amdgpu_bo_cache {
+	pthread_mutex_t mutex;
+	struct list_head heaps;
+	/* all cached buffers, least recently freed first */
+	struct list_head lru;
+	/* 0 when the cache is disabled */
+	uint64_t max_size;
+	/* in milliseconds */
+	uint64_t max_age;
+	struct amdgpu_bo_cache_stats stats;
+};
+
 struct amdgpu_device {
 	atomic_t refcount;
 	int fd;
@@ -87,6 +126,8 @@ struct amdgpu_device {
 	struct amdgpu_bo_va_mgr *vamgr;
 	/** The VA manager for the 32bit address space */
 	struct amdgpu_bo_va_mgr *vamgr_32;
+	/** Freed buffers kept for reuse */
+	struct amdgpu_bo_cache bo_cache;
 };
 
 struct amdgpu_bo {
@@ -101,6 +142,14 @@ struct amdgpu_bo {
 	pthread_mutex_t cpu_access_mutex;
 	void *cpu_ptr;
 	int cpu_map_count;
+
+	/** Size class to return to once freed, NULL if not reusable */
+	struct amdgpu_bo_cache_bucket *cache_bucket;
+	uint64_t phys_alignment;
+	/** Links in the bucket and in the LRU of the cache */
+	struct list_head cache_link;
+	struct list_head cache_lru;
+	uint64_t free_time;
 };
 
 struct amdgpu_bo_list {
@@ -109,10 +158,45 @@ struct amdgpu_bo_list {
 	uint32_t handle;
 };
 
+/* Chunk and dependency storage, kept from one submission to the next. */
+struct amdgpu_cs_builder {
+	uint64_t *chunk_array;
+	struct drm_amdgpu_cs_chunk *chunks;
+	struct drm_amdgpu_cs_chunk_data *chunk_data;
+	unsigned max_chunks;
+	struct drm_amdgpu_cs_chunk_dep *dependencies;
+	unsigned max_dependencies;
+};
+
+/** The user fence a ring was last submitted with */
+struct amdgpu_cs_user_fence {
+	/** Referenced and CPU mapped for as long as it is tracked */
+	amdgpu_bo_handle bo;
+	volatile uint64_t *cpu;
+	/** Every fence from first to last is written to cpu once signalled */
+	uint64_t first;
+	uint64_t last;
+};
+
 struct amdgpu_context {
 	struct amdgpu_device *dev;
 	/* context id*/
 	uint32_t id;
+
+	/** Protects builder */
+	pthread_mutex_t cs_mutex;
+	struct amdgpu_cs_builder builder;
+
+	/** Protects signalled and user_fence, never held while taking
+	 *  another lock */
+	pthread_mutex_t fence_mutex;
+	/** Highest fence known to have signalled on each ring */
+	uint64_t signalled[AMDGPU_HW_IP_NUM][AMDGPU_HW_IP_INSTANCE_MAX_COUNT]
+			 [AMDGPU_CS_MAX_RINGS];
+	/** Only changed with cs_mutex held as well */
+	struct amdgpu_cs_user_fence user_fence[AMDGPU_HW_IP_NUM]
+					      [AMDGPU_HW_IP_INSTANCE_MAX_COUNT]
+					      [AMDGPU_CS_MAX_RINGS];
 };
 
 /**
@@ -121,6 +205,19 @@ struct amdgpu_context {
 
 drm_private void amdgpu_bo_free_internal(amdgpu_bo_handle bo);
 
+drm_private void amdgpu_bo_destroy(amdgpu_bo_handle bo);
+
+drm_private void amdgpu_bo_cache_init(struct amdgpu_bo_cache *cache);
+
+drm_private void amdgpu_bo_cache_deinit(struct amdgpu_bo_cache *cache);
+
+drm_private amdgpu_bo_handle
+amdgpu_bo_cache_get(amdgpu_device_handle dev,
+		    struct amdgpu_bo_alloc_request *request,
+		    struct amdgpu_bo_cache_bucket **bucket);
+
+drm_private bool amdgpu_bo_cache_put(amdgpu_bo_handle bo);
+
 drm_private void amdgpu_vamgr_init(struct amdgpu_bo_va_mgr *mgr, uint64_t start,
 		       uint64_t max, uint64_t alignment);
 
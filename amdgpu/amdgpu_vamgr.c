@@ -44,6 +44,239 @@ int amdgpu_va_range_query(amdgpu_device_handle dev,
 	return -EINVAL;
 }
 
+/*
+ * The holes are kept in two treaps: one sorted by offset, to find the
+ * neighbours of a freed range, and one sorted by size and then offset, for
+ * best-fit allocation.  Both share the priority of the hole.
+ */
+enum { VA_BY_OFFSET, VA_BY_SIZE };
+
+/* Number of holes tried for alignment before asking for a larger one. */
+#define VA_BEST_FIT_TRIES 32
+
+static int va_hole_before(const struct amdgpu_bo_va_hole *a,
+			  const struct amdgpu_bo_va_hole *b, int tree)
+{
+	if (tree == VA_BY_SIZE && a->size != b->size)
+		return a->size < b->size;
+	return a->offset < b->offset;
+}
+
+static struct amdgpu_bo_va_hole *
+va_hole_insert(struct amdgpu_bo_va_hole *root,
+	       struct amdgpu_bo_va_hole *hole, int tree)
+{
+	struct amdgpu_bo_va_hole *child;
+
+	if (!root) {
+		hole->left[tree] = hole->right[tree] = NULL;
+		return hole;
+	}
+
+	if (va_hole_before(hole, root, tree)) {
+		child = va_hole_insert(root->left[tree], hole, tree);
+		root->left[tree] = child;
+		if (child->priority > root->priority) {
+			root->left[tree] = child->right[tree];
+			child->right[tree] = root;
+			return child;
+		}
+	} else {
+		child = va_hole_insert(root->right[tree], hole, tree);
+		root->right[tree] = child;
+		if (child->priority > root->priority) {
+			root->right[tree] = child->left[tree];
+			child->left[tree] = root;
+			return child;
+		}
+	}
+	return root;
+}
+
+static struct amdgpu_bo_va_hole *
+va_hole_join(struct amdgpu_bo_va_hole *a, struct amdgpu_bo_va_hole *b,
+	     int tree)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->priority > b->priority) {
+		a->right[tree] = va_hole_join(a->right[tree], b, tree);
+		return a;
+	}
+	b->left[tree] = va_hole_join(a, b->left[tree], tree);
+	return b;
+}
+
+static struct amdgpu_bo_va_hole *
+va_hole_remove(struct amdgpu_bo_va_hole *root,
+	       struct amdgpu_bo_va_hole *hole, int tree)
+{
+	if (root == hole)
+		return va_hole_join(hole->left[tree], hole->right[tree], tree);
+
+	if (va_hole_before(hole, root, tree))
+		root->left[tree] = va_hole_remove(root->left[tree], hole, tree);
+	else
+		root->right[tree] = va_hole_remove(root->right[tree], hole, tree);
+	return root;
+}
+
+/* Returns the hole with the highest offset that is <= va. */
+static struct amdgpu_bo_va_hole *
+va_hole_floor(struct amdgpu_bo_va_mgr *mgr, uint64_t va)
+{
+	struct amdgpu_bo_va_hole *hole = mgr->va_holes[VA_BY_OFFSET];
+	struct amdgpu_bo_va_hole *found = NULL;
+
+	while (hole) {
+		if (hole->offset <= va) {
+			found = hole;
+			hole = hole->right[VA_BY_OFFSET];
+		} else {
+			hole = hole->left[VA_BY_OFFSET];
+		}
+	}
+	return found;
+}
+
+/* Returns the smallest hole that sorts at or after (size, offset). */
+static struct amdgpu_bo_va_hole *
+va_hole_ceil(struct amdgpu_bo_va_mgr *mgr, uint64_t size, uint64_t offset)
+{
+	struct amdgpu_bo_va_hole *hole = mgr->va_holes[VA_BY_SIZE];
+	struct amdgpu_bo_va_hole *found = NULL;
+
+	while (hole) {
+		if (hole->size > size ||
+		    (hole->size == size && hole->offset >= offset)) {
+			found = hole;
+			hole = hole->left[VA_BY_SIZE];
+		} else {
+			hole = hole->right[VA_BY_SIZE];
+		}
+	}
+	return found;
+}
+
+/* Takes a spare hole for [offset, offset + size) and adds it to the trees. */
+static void va_hole_add(struct amdgpu_bo_va_mgr *mgr, uint64_t offset,
+			uint64_t size)
+{
+	struct amdgpu_bo_va_hole *hole = mgr->spare_holes;
+
+	assert(hole);
+	mgr->spare_holes = hole->left[VA_BY_OFFSET];
+
+	mgr->seed ^= mgr->seed << 13;
+	mgr->seed ^= mgr->seed >> 17;
+	mgr->seed ^= mgr->seed << 5;
+	hole->priority = mgr->seed;
+	hole->offset = offset;
+	hole->size = size;
+
+	mgr->va_holes[VA_BY_OFFSET] =
+		va_hole_insert(mgr->va_holes[VA_BY_OFFSET], hole, VA_BY_OFFSET);
+	mgr->va_holes[VA_BY_SIZE] =
+		va_hole_insert(mgr->va_holes[VA_BY_SIZE], hole, VA_BY_SIZE);
+}
+
+/* Removes a hole from the trees and puts it back with the spares. */
+static void va_hole_del(struct amdgpu_bo_va_mgr *mgr,
+			struct amdgpu_bo_va_hole *hole)
+{
+	mgr->va_holes[VA_BY_OFFSET] =
+		va_hole_remove(mgr->va_holes[VA_BY_OFFSET], hole, VA_BY_OFFSET);
+	mgr->va_holes[VA_BY_SIZE] =
+		va_hole_remove(mgr->va_holes[VA_BY_SIZE], hole, VA_BY_SIZE);
+
+	hole->left[VA_BY_OFFSET] = mgr->spare_holes;
+	mgr->spare_holes = hole;
+}
+
+/*
+ * Moves the edges of a hole.  It can't cross its neighbours, so only its
+ * place in the size tree changes.
+ */
+static void va_hole_set(struct amdgpu_bo_va_mgr *mgr,
+			struct amdgpu_bo_va_hole *hole,
+			uint64_t offset, uint64_t size)
+{
+	mgr->va_holes[VA_BY_SIZE] =
+		va_hole_remove(mgr->va_holes[VA_BY_SIZE], hole, VA_BY_SIZE);
+	hole->offset = offset;
+	hole->size = size;
+	mgr->va_holes[VA_BY_SIZE] =
+		va_hole_insert(mgr->va_holes[VA_BY_SIZE], hole, VA_BY_SIZE);
+}
+
+/* Allocates [offset, offset + size), which lies within the hole. */
+static uint64_t va_hole_take(struct amdgpu_bo_va_mgr *mgr,
+			     struct amdgpu_bo_va_hole *hole,
+			     uint64_t offset, uint64_t size)
+{
+	uint64_t end = hole->offset + hole->size;
+
+	if (offset == hole->offset && offset + size == end) {
+		va_hole_del(mgr, hole);
+	} else if (offset == hole->offset) {
+		va_hole_set(mgr, hole, offset + size, end - offset - size);
+	} else {
+		va_hole_set(mgr, hole, hole->offset, offset - hole->offset);
+		if (offset + size != end)
+			va_hole_add(mgr, offset + size, end - offset - size);
+	}
+	return offset;
+}
+
+static uint64_t va_align(uint64_t offset, uint64_t alignment)
+{
+	uint64_t waste = offset % alignment;
+
+	return waste ? offset + alignment - waste : offset;
+}
+
+static int va_hole_fits(struct amdgpu_bo_va_hole *hole, uint64_t offset,
+			uint64_t size)
+{
+	return offset >= hole->offset &&
+	       offset - hole->offset <= hole->size &&
+	       size <= hole->size - (offset - hole->offset);
+}
+
+/*
+ * Looks for the smallest hole that fits the range once aligned.  Alignment
+ * only makes a handful of holes of the right size unusable, so after a few
+ * tries we settle for the smallest hole that fits whatever its offset.
+ */
+static struct amdgpu_bo_va_hole *
+va_hole_best_fit(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
+		 uint64_t alignment, uint64_t *offset)
+{
+	struct amdgpu_bo_va_hole *hole;
+	int tries;
+
+	hole = va_hole_ceil(mgr, size, 0);
+	for (tries = 0; hole && tries < VA_BEST_FIT_TRIES; tries++) {
+		*offset = va_align(hole->offset, alignment);
+		if (va_hole_fits(hole, *offset, size))
+			return hole;
+		hole = va_hole_ceil(mgr, hole->size, hole->offset + 1);
+	}
+
+	if (!hole || size + alignment - 1 < size)
+		return NULL;
+
+	hole = va_hole_ceil(mgr, size + alignment - 1, 0);
+	if (!hole)
+		return NULL;
+
+	*offset = va_align(hole->offset, alignment);
+	return hole;
+}
+
 drm_private void amdgpu_vamgr_init(struct amdgpu_bo_va_mgr *mgr, uint64_t start,
 			      uint64_t max, uint64_t alignment)
 {
@@ -51,15 +284,32 @@ drm_private void amdgpu_vamgr_init(struct amdgpu_bo_va_mgr *mgr, uint64_t start,
 	mgr->va_max = max;
 	mgr->va_alignment = alignment;
 
-	list_inithead(&mgr->va_holes);
+	mgr->va_holes[VA_BY_OFFSET] = NULL;
+	mgr->va_holes[VA_BY_SIZE] = NULL;
+	mgr->spare_holes = NULL;
+	mgr->num_holes = 0;
+	mgr->num_ranges = 0;
+	mgr->seed = 0x9e3779b9;
 	pthread_mutex_init(&mgr->bo_va_mutex, NULL);
 }
 
+static void va_hole_free_tree(struct amdgpu_bo_va_hole *hole)
+{
+	if (!hole)
+		return;
+
+	va_hole_free_tree(hole->left[VA_BY_OFFSET]);
+	va_hole_free_tree(hole->right[VA_BY_OFFSET]);
+	free(hole);
+}
+
 drm_private void amdgpu_vamgr_deinit(struct amdgpu_bo_va_mgr *mgr)
 {
 	struct amdgpu_bo_va_hole *hole;
-	LIST_FOR_EACH_ENTRY(hole, &mgr->va_holes, list) {
-		list_del(&hole->list);
+
+	va_hole_free_tree(mgr->va_holes[VA_BY_OFFSET]);
+	while ((hole = mgr->spare_holes)) {
+		mgr->spare_holes = hole->left[VA_BY_OFFSET];
 		free(hole);
 	}
 	pthread_mutex_destroy(&mgr->bo_va_mutex);
@@ -69,8 +319,8 @@ drm_private uint64_t
 amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 		     uint64_t alignment, uint64_t base_required)
 {
-	struct amdgpu_bo_va_hole *hole, *n;
-	uint64_t offset = 0, waste = 0;
+	struct amdgpu_bo_va_hole *hole;
+	uint64_t offset = 0;
 
 	alignment = MAX2(alignment, mgr->va_alignment);
 	size = ALIGN(size, mgr->va_alignment);
@@ -79,75 +329,58 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 		return AMDGPU_INVALID_VA_ADDRESS;
 
 	pthread_mutex_lock(&mgr->bo_va_mutex);
-	/* TODO: using more appropriate way to track the holes */
-	/* first look for a hole */
-	LIST_FOR_EACH_ENTRY_SAFE(hole, n, &mgr->va_holes, list) {
-		if (base_required) {
-			if(hole->offset > base_required ||
-				(hole->offset + hole->size) < (base_required + size))
-				continue;
-			waste = base_required - hole->offset;
-			offset = base_required;
-		} else {
-			offset = hole->offset;
-			waste = offset % alignment;
-			waste = waste ? alignment - waste : 0;
-			offset += waste;
-			if (offset >= (hole->offset + hole->size)) {
-				continue;
-			}
-		}
-		if (!waste && hole->size == size) {
-			offset = hole->offset;
-			list_del(&hole->list);
-			free(hole);
+
+	/* Every hole is followed by an allocated range, so keeping a hole
+	 * around for each range means that neither splitting a hole here nor
+	 * punching a new one in amdgpu_vamgr_free_va() has to allocate.
+	 */
+	if (mgr->num_holes <= mgr->num_ranges) {
+		hole = calloc(1, sizeof(struct amdgpu_bo_va_hole));
+		if (!hole) {
 			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
+			return AMDGPU_INVALID_VA_ADDRESS;
 		}
-		if ((hole->size - waste) > size) {
-			if (waste) {
-				n = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-				n->size = waste;
-				n->offset = hole->offset;
-				list_add(&n->list, &hole->list);
-			}
-			hole->size -= (size + waste);
-			hole->offset += size + waste;
-			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
+		hole->left[VA_BY_OFFSET] = mgr->spare_holes;
+		mgr->spare_holes = hole;
+		mgr->num_holes++;
+	}
+
+	/* first look for a hole */
+	if (base_required) {
+		hole = va_hole_floor(mgr, base_required);
+		if (hole && va_hole_fits(hole, base_required, size)) {
+			offset = va_hole_take(mgr, hole, base_required, size);
+			goto out;
 		}
-		if ((hole->size - waste) == size) {
-			hole->size = waste;
-			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
+	} else {
+		hole = va_hole_best_fit(mgr, size, alignment, &offset);
+		if (hole) {
+			offset = va_hole_take(mgr, hole, offset, size);
+			goto out;
 		}
 	}
 
 	if (base_required) {
-		if (base_required < mgr->va_offset)
+		if (base_required < mgr->va_offset) {
+			pthread_mutex_unlock(&mgr->bo_va_mutex);
 			return AMDGPU_INVALID_VA_ADDRESS;
-		offset = mgr->va_offset;
-		waste = base_required - mgr->va_offset;
+		}
+		offset = base_required;
 	} else {
-		offset = mgr->va_offset;
-		waste = offset % alignment;
-		waste = waste ? alignment - waste : 0;
+		offset = va_align(mgr->va_offset, alignment);
 	}
 
-	if (offset + waste + size > mgr->va_max) {
+	if (offset + size > mgr->va_max) {
 		pthread_mutex_unlock(&mgr->bo_va_mutex);
 		return AMDGPU_INVALID_VA_ADDRESS;
 	}
 
-	if (waste) {
-		n = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-		n->size = waste;
-		n->offset = offset;
-		list_add(&n->list, &mgr->va_holes);
-	}
+	if (offset != mgr->va_offset)
+		va_hole_add(mgr, mgr->va_offset, offset - mgr->va_offset);
+	mgr->va_offset = offset + size;
 
-	offset += waste;
-	mgr->va_offset += size + waste;
+out:
+	mgr->num_ranges++;
 	pthread_mutex_unlock(&mgr->bo_va_mutex);
 	return offset;
 }
@@ -155,7 +388,7 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 drm_private void
 amdgpu_vamgr_free_va(struct amdgpu_bo_va_mgr *mgr, uint64_t va, uint64_t size)
 {
-	struct amdgpu_bo_va_hole *hole;
+	struct amdgpu_bo_va_hole *prev, *next;
 
 	if (va == AMDGPU_INVALID_VA_ADDRESS)
 		return;
@@ -163,62 +396,38 @@ amdgpu_vamgr_free_va(struct amdgpu_bo_va_mgr *mgr, uint64_t va, uint64_t size)
 	size = ALIGN(size, mgr->va_alignment);
 
 	pthread_mutex_lock(&mgr->bo_va_mutex);
+
+	prev = va_hole_floor(mgr, va);
+	if (prev && prev->offset + prev->size != va)
+		prev = NULL;
+
 	if ((va + size) == mgr->va_offset) {
 		mgr->va_offset = va;
 		/* Delete uppermost hole if it reaches the new top */
-		if (!LIST_IS_EMPTY(&mgr->va_holes)) {
-			hole = container_of(mgr->va_holes.next, hole, list);
-			if ((hole->offset + hole->size) == va) {
-				mgr->va_offset = hole->offset;
-				list_del(&hole->list);
-				free(hole);
-			}
+		if (prev) {
+			mgr->va_offset = prev->offset;
+			va_hole_del(mgr, prev);
 		}
 	} else {
-		struct amdgpu_bo_va_hole *next;
-
-		hole = container_of(&mgr->va_holes, hole, list);
-		LIST_FOR_EACH_ENTRY(next, &mgr->va_holes, list) {
-			if (next->offset < va)
-				break;
-			hole = next;
-		}
-
-		if (&hole->list != &mgr->va_holes) {
-			/* Grow upper hole if it's adjacent */
-			if (hole->offset == (va + size)) {
-				hole->offset = va;
-				hole->size += size;
-				/* Merge lower hole if it's adjacent */
-				if (next != hole
-						&& &next->list != &mgr->va_holes
-						&& (next->offset + next->size) == va) {
-					next->size += hole->size;
-					list_del(&hole->list);
-					free(hole);
-				}
-				goto out;
-			}
-		}
-
-		/* Grow lower hole if it's adjacent */
-		if (next != hole && &next->list != &mgr->va_holes &&
-				(next->offset + next->size) == va) {
-			next->size += size;
-			goto out;
-		}
+		next = va_hole_floor(mgr, va + size);
+		if (next && next->offset != va + size)
+			next = NULL;
 
-		/* FIXME on allocation failure we just lose virtual address space
-		 * maybe print a warning
-		 */
-		next = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-		if (next) {
-			next->size = size;
-			next->offset = va;
-			list_add(&next->list, &hole->list);
+		if (prev && next) {
+			/* Merge both neighbours into the lower one */
+			size = next->offset + next->size - prev->offset;
+			va_hole_del(mgr, next);
+			va_hole_set(mgr, prev, prev->offset, size);
+		} else if (prev) {
+			va_hole_set(mgr, prev, prev->offset, prev->size + size);
+		} else if (next) {
+			va_hole_set(mgr, next, va, next->size + size);
+		} else {
+			va_hole_add(mgr, va, size);
 		}
 	}
-out:
+
+	mgr->num_ranges--;
 	pthread_mutex_unlock(&mgr->bo_va_mutex);
 }
 
@@ -0,0 +1,356 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Runs libdrm_amdgpu against a stub amdgpu ioctl layer and replays a churn
+ * of short-lived GTT buffers with and without the buffer cache, reporting
+ * the hit rate, the ioctls issued and the time per allocation.  The stub
+ * clears the memory of every buffer it creates, as the kernel does, and
+ * keeps buffers busy for a while after they are handed out.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+#include "test_stub.h"
+
+#define MAX_HANDLE	(1 << 20)
+#define NUM_OPS		50000
+#define NUM_LIVE	64
+#define BUSY_OPS	16	/* stub operations a buffer stays busy for */
+#define FRAME_SIZE	(1920 * 1080 * 3 / 2)
+
+struct fake_bo {
+	void *mem;
+	unsigned last_use;
+};
+
+static struct fake_bo bos[MAX_HANDLE];
+static uint32_t next_handle = 1;
+static unsigned int creates, closes, live_bos;
+static uint32_t seed = 1;
+
+static uint32_t random_u32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int fake_gem_create(union drm_amdgpu_gem_create *args)
+{
+	uint32_t handle = next_handle++;
+
+	if (handle >= MAX_HANDLE) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* The kernel hands out cleared pages. */
+	bos[handle].mem = malloc(args->in.bo_size);
+	if (!bos[handle].mem) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(bos[handle].mem, 0, args->in.bo_size);
+	bos[handle].last_use = stub_ops;
+
+	creates++;
+	live_bos++;
+	memset(args, 0, sizeof(*args));
+	args->out.handle = handle;
+	return 0;
+}
+
+/* A buffer is busy until BUSY_OPS operations after it was handed out. */
+static int fake_gem_wait_idle(union drm_amdgpu_gem_wait_idle *args)
+{
+	struct fake_bo *bo = &bos[args->in.handle];
+
+	if (!bo->mem) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	args->out.status = stub_ops - bo->last_use < BUSY_OPS;
+	if (!args->out.status)
+		bo->last_use = stub_ops;
+	return 0;
+}
+
+static int fake_gem_close(struct drm_gem_close *args)
+{
+	struct fake_bo *bo = &bos[args->handle];
+
+	if (!bo->mem) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	free(bo->mem);
+	bo->mem = NULL;
+	closes++;
+	live_bos--;
+	return 0;
+}
+
+/* The requests the stub device leaves to this test */
+int stub_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_AMDGPU_GEM_CREATE:
+		return fake_gem_create(arg);
+	case DRM_IOCTL_AMDGPU_GEM_WAIT_IDLE:
+		return fake_gem_wait_idle(arg);
+	case DRM_IOCTL_GEM_CLOSE:
+		return fake_gem_close(arg);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/*
+ * What a video transcoder allocates: small parameter buffers, bitstream
+ * chunks of any size and NV12 frames, mostly write-combined GTT.
+ */
+static void random_request(struct amdgpu_bo_alloc_request *req)
+{
+	uint32_t r = random_u32();
+
+	memset(req, 0, sizeof(*req));
+	req->preferred_heap = AMDGPU_GEM_DOMAIN_GTT;
+	req->phys_alignment = 4096;
+	if (r % 4)
+		req->flags = AMDGPU_GEM_CREATE_CPU_GTT_USWC;
+
+	r >>= 2;
+	if (r % 8 < 4)
+		req->alloc_size = (1 + (r >> 3) % 4) * 4096;
+	else if (r % 8 < 7)
+		req->alloc_size = (4 + (r >> 3) % 124) * 4096;
+	else
+		req->alloc_size = FRAME_SIZE;
+}
+
+/* Keeps NUM_LIVE buffers alive, replacing the oldest one at every step. */
+static int churn(amdgpu_device_handle dev, const char *name)
+{
+	static amdgpu_bo_handle live[NUM_LIVE];
+	struct amdgpu_bo_alloc_request req;
+	struct amdgpu_bo_cache_stats before, after;
+	unsigned int i, ioctls = stub_ops;
+	double start, elapsed;
+	int ret = 0;
+
+	amdgpu_bo_cache_query_stats(dev, &before);
+	seed = 1;
+	start = get_time();
+	for (i = 0; i < NUM_OPS && !ret; i++) {
+		amdgpu_bo_handle *bo = &live[i % NUM_LIVE];
+
+		if (*bo)
+			ret |= amdgpu_bo_free(*bo);
+
+		random_request(&req);
+		ret |= amdgpu_bo_alloc(dev, &req, bo);
+	}
+	elapsed = get_time() - start;
+
+	for (i = 0; i < NUM_LIVE; i++) {
+		if (live[i])
+			ret |= amdgpu_bo_free(live[i]);
+		live[i] = NULL;
+	}
+
+	amdgpu_bo_cache_query_stats(dev, &after);
+	printf("%-10s %6.0f ns per alloc/free, %.2f ioctls per alloc, "
+	       "%5.1f%% hits, %" PRIu64 " busy, %u cached (%" PRIu64 " KB)\n",
+	       name, elapsed * 1e9 / NUM_OPS,
+	       (double)(stub_ops - ioctls) / NUM_OPS,
+	       100.0 * (after.hits - before.hits) / NUM_OPS,
+	       after.busy - before.busy, after.count, after.size >> 10);
+
+	return ret;
+}
+
+static int alloc(amdgpu_device_handle dev, uint64_t size, uint32_t heap,
+		 uint64_t flags, amdgpu_bo_handle *bo)
+{
+	struct amdgpu_bo_alloc_request req;
+
+	memset(&req, 0, sizeof(req));
+	req.alloc_size = size;
+	req.preferred_heap = heap;
+	req.flags = flags;
+	return amdgpu_bo_alloc(dev, &req, bo);
+}
+
+/* Frees a buffer and lets enough stub operations pass for it to go idle. */
+static int free_idle(amdgpu_bo_handle bo)
+{
+	int ret = amdgpu_bo_free(bo);
+
+	stub_ops += BUSY_OPS;
+	return ret;
+}
+
+/* Checks what may be reused and what may not. */
+static int test_reuse(amdgpu_device_handle dev)
+{
+	struct amdgpu_bo_cache_stats before, after;
+	amdgpu_bo_handle bo, other;
+	uint32_t shared;
+	int ret = 0;
+
+	ret |= amdgpu_bo_cache_enable(dev, 64 << 20, 60000);
+	amdgpu_bo_cache_query_stats(dev, &before);
+
+	/* Same size class, heap and flags: reused. */
+	ret |= alloc(dev, 36000, AMDGPU_GEM_DOMAIN_GTT, 0, &bo);
+	ret |= free_idle(bo);
+	ret |= alloc(dev, 40960, AMDGPU_GEM_DOMAIN_GTT, 0, &other);
+	ret |= other != bo;
+
+	/* Still busy: not reused. */
+	ret |= amdgpu_bo_free(other);
+	ret |= alloc(dev, 40960, AMDGPU_GEM_DOMAIN_GTT, 0, &bo);
+	ret |= bo == other;
+	ret |= free_idle(bo);
+
+	/* Another heap or other flags: not reused. */
+	ret |= alloc(dev, 40960, AMDGPU_GEM_DOMAIN_VRAM, 0, &bo);
+	ret |= bo == other;
+	ret |= free_idle(bo);
+	ret |= alloc(dev, 40960, AMDGPU_GEM_DOMAIN_GTT,
+		     AMDGPU_GEM_CREATE_CPU_GTT_USWC, &bo);
+	ret |= bo == other;
+	ret |= free_idle(bo);
+
+	amdgpu_bo_cache_query_stats(dev, &after);
+	ret |= after.hits - before.hits != 1 ||
+	       after.misses - before.misses != 4 ||
+	       after.busy - before.busy != 1;
+
+	/* Exported buffers are destroyed when freed. */
+	ret |= alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, 0, &bo);
+	ret |= amdgpu_bo_export(bo, amdgpu_bo_handle_type_kms, &shared);
+	before = after;
+	ret |= amdgpu_bo_free(bo);
+	amdgpu_bo_cache_query_stats(dev, &after);
+	ret |= after.count != before.count;
+
+	ret |= amdgpu_bo_cache_disable(dev);
+	amdgpu_bo_cache_query_stats(dev, &after);
+	ret |= after.count != 0 || after.size != 0;
+
+	if (ret)
+		printf("buffer reuse is wrong\n");
+	return ret;
+}
+
+/* Checks that the cache stays within its budget and its age limit. */
+static int test_limits(amdgpu_device_handle dev)
+{
+	struct timespec delay = { 0, 20 * 1000 * 1000 };
+	struct amdgpu_bo_cache_stats stats;
+	amdgpu_bo_handle handles[32];
+	unsigned int i;
+	int ret = 0;
+
+	ret |= amdgpu_bo_cache_enable(dev, 1 << 20, 60000);
+	for (i = 0; i < 32; i++)
+		ret |= alloc(dev, 64 << 10, AMDGPU_GEM_DOMAIN_GTT, 0, &handles[i]);
+	for (i = 0; i < 32; i++)
+		ret |= amdgpu_bo_free(handles[i]);
+	amdgpu_bo_cache_query_stats(dev, &stats);
+	ret |= stats.size != 1 << 20 || stats.count != 16;
+
+	/* Lowering the age limit lets the next allocation release the
+	 * rest, even though it doesn't hit the cache.
+	 */
+	ret |= amdgpu_bo_cache_enable(dev, 1 << 20, 10);
+	nanosleep(&delay, NULL);
+	ret |= alloc(dev, 4096, AMDGPU_GEM_DOMAIN_VRAM, 0, &handles[0]);
+	amdgpu_bo_cache_query_stats(dev, &stats);
+	ret |= stats.count != 0 || stats.size != 0;
+	ret |= amdgpu_bo_free(handles[0]);
+	amdgpu_bo_cache_query_stats(dev, &stats);
+	ret |= stats.count != 1 || stats.size != 4096;
+
+	ret |= amdgpu_bo_cache_disable(dev);
+
+	if (ret)
+		printf("cache limits are not enforced\n");
+	return ret;
+}
+
+int main(void)
+{
+	amdgpu_device_handle dev;
+	uint32_t major, minor;
+	int fd, ret = 0;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		return 1;
+
+	if (amdgpu_device_initialize(fd, &major, &minor, &dev)) {
+		printf("device initialization failed\n");
+		return 1;
+	}
+
+	ret |= churn(dev, "uncached");
+	ret |= amdgpu_bo_cache_enable(dev, 256 << 20, 1000);
+	ret |= churn(dev, "cached");
+	ret |= amdgpu_bo_cache_disable(dev);
+
+	ret |= test_reuse(dev);
+	ret |= test_limits(dev);
+
+	/* Whatever is still cached goes away with the device. */
+	ret |= amdgpu_bo_cache_enable(dev, 256 << 20, 1000);
+	ret |= churn(dev, "teardown");
+	amdgpu_device_deinitialize(dev);
+	close(fd);
+
+	if (live_bos || creates != closes) {
+		printf("%u buffers leaked\n", live_bos);
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,309 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Drives amdgpu_cs_submit() with the submissions of a video transcoder,
+ * three tiny UVD requests and two VCE requests per frame, against a stub
+ * CS ioctl.  The stub checks that every submission targets a single ring,
+ * that dependencies are neither redundant nor lost, and completes fences a
+ * few frames behind.  Reports ioctls, dependencies and time per frame with
+ * and without AMDGPU_CS_SUBMIT_MERGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+#include "test_stub.h"
+
+#define NUM_FRAMES	100000
+#define UVD_REQUESTS	3
+#define VCE_REQUESTS	2
+#define GPU_LAG		4	/* submissions a ring runs behind */
+#define POLL_LAG	8	/* frames behind the fence that is polled */
+#define MAX_RINGS	8
+
+static uint64_t submitted[STUB_MAX_CTX][AMDGPU_HW_IP_NUM][MAX_RINGS];
+static unsigned int cs_ioctls, wait_ioctls, dependencies, errors;
+
+/* Dependencies must be on other rings, at most one per ring. */
+static void check_dependencies(struct drm_amdgpu_cs_chunk *chunk,
+			       uint32_t ctx_id, unsigned ip_type, uint32_t ring)
+{
+	struct drm_amdgpu_cs_chunk_dep *deps =
+		(struct drm_amdgpu_cs_chunk_dep *)(uintptr_t)chunk->chunk_data;
+	uint32_t i, j, count = chunk->length_dw * 4 / sizeof(*deps);
+
+	for (i = 0; i < count; i++) {
+		if (deps[i].ctx_id >= STUB_MAX_CTX ||
+		    deps[i].handle > submitted[deps[i].ctx_id][deps[i].ip_type]
+					      [deps[i].ring] ||
+		    (deps[i].ctx_id == ctx_id && deps[i].ip_type == ip_type &&
+		     deps[i].ring == ring))
+			errors++;
+
+		for (j = 0; j < i; j++)
+			if (deps[j].ctx_id == deps[i].ctx_id &&
+			    deps[j].ip_type == deps[i].ip_type &&
+			    deps[j].ring == deps[i].ring)
+				errors++;
+	}
+	dependencies += count;
+}
+
+static int fake_cs(union drm_amdgpu_cs *cs)
+{
+	uint64_t *chunk_array = (uint64_t *)(uintptr_t)cs->in.chunks;
+	struct drm_amdgpu_cs_chunk *dep_chunk = NULL;
+	unsigned ip_type = AMDGPU_HW_IP_NUM;
+	uint32_t i, ring = 0, ctx_id = cs->in.ctx_id;
+
+	cs_ioctls++;
+
+	for (i = 0; i < cs->in.num_chunks; i++) {
+		struct drm_amdgpu_cs_chunk *chunk =
+			(struct drm_amdgpu_cs_chunk *)(uintptr_t)chunk_array[i];
+		struct drm_amdgpu_cs_chunk_ib *ib =
+			(struct drm_amdgpu_cs_chunk_ib *)(uintptr_t)chunk->chunk_data;
+
+		if (chunk->chunk_id == AMDGPU_CHUNK_ID_DEPENDENCIES) {
+			dep_chunk = chunk;
+			continue;
+		}
+		if (chunk->chunk_id != AMDGPU_CHUNK_ID_IB)
+			continue;
+
+		if (ip_type == AMDGPU_HW_IP_NUM) {
+			ip_type = ib->ip_type;
+			ring = ib->ring;
+		} else if (ib->ip_type != ip_type || ib->ring != ring) {
+			errors++;
+		}
+	}
+
+	if (ip_type == AMDGPU_HW_IP_NUM || ring >= MAX_RINGS ||
+	    ctx_id >= STUB_MAX_CTX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (dep_chunk)
+		check_dependencies(dep_chunk, ctx_id, ip_type, ring);
+
+	memset(&cs->out, 0, sizeof(cs->out));
+	cs->out.handle = ++submitted[ctx_id][ip_type][ring];
+	return 0;
+}
+
+static int fake_wait_cs(union drm_amdgpu_wait_cs *args)
+{
+	uint64_t handle = args->in.handle;
+	uint64_t last = submitted[args->in.ctx_id][args->in.ip_type]
+				 [args->in.ring];
+
+	wait_ioctls++;
+	memset(&args->out, 0, sizeof(args->out));
+	args->out.status = handle + GPU_LAG > last;
+	return 0;
+}
+
+/* The requests the stub device leaves to this test */
+int stub_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_AMDGPU_CS:
+		return fake_cs(arg);
+	case DRM_IOCTL_AMDGPU_WAIT_CS:
+		return fake_wait_cs(arg);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static void fill_fence(struct amdgpu_cs_fence *fence,
+		       amdgpu_context_handle context,
+		       struct amdgpu_cs_request *request)
+{
+	fence->context = context;
+	fence->ip_type = request->ip_type;
+	fence->ip_instance = request->ip_instance;
+	fence->ring = request->ring;
+	fence->fence = request->seq_no;
+}
+
+/*
+ * Each UVD request waits for the previous one on its ring and for the
+ * encoder to be done with the frame it overwrites; each VCE request waits
+ * for the decoded frame and for a fence polled long ago.
+ */
+static int transcode(amdgpu_context_handle context, uint64_t flags,
+		     const char *name)
+{
+	static struct amdgpu_cs_fence history[POLL_LAG];
+	struct amdgpu_cs_request uvd[UVD_REQUESTS], vce[VCE_REQUESTS];
+	struct amdgpu_cs_fence uvd_deps[UVD_REQUESTS][2];
+	struct amdgpu_cs_fence vce_deps[VCE_REQUESTS][2];
+	struct amdgpu_cs_ib_info ib;
+	unsigned int cs_start = cs_ioctls, wait_start = wait_ioctls;
+	unsigned int dep_start = dependencies, requested = 0;
+	struct amdgpu_cs_fence last_vce, last_uvd;
+	double start, elapsed;
+	uint32_t expired;
+	int i, j, ret = 0;
+
+	memset(&ib, 0, sizeof(ib));
+	ib.ib_mc_address = 0x100000;
+	ib.size = 16;
+
+	memset(uvd, 0, sizeof(uvd));
+	memset(vce, 0, sizeof(vce));
+	memset(&last_vce, 0, sizeof(last_vce));
+	memset(&last_uvd, 0, sizeof(last_uvd));
+	last_vce.context = last_uvd.context = context;
+	last_vce.ip_type = AMDGPU_HW_IP_VCE;
+	last_uvd.ip_type = AMDGPU_HW_IP_UVD;
+	for (i = 0; i < POLL_LAG; i++)
+		history[i] = last_uvd;
+
+	start = get_time();
+	for (i = 0; i < NUM_FRAMES && !ret; i++) {
+		for (j = 0; j < UVD_REQUESTS; j++) {
+			uvd[j].ip_type = AMDGPU_HW_IP_UVD;
+			uvd[j].number_of_ibs = 1;
+			uvd[j].ibs = &ib;
+			uvd[j].number_of_dependencies = 2;
+			uvd[j].dependencies = uvd_deps[j];
+			uvd_deps[j][0] = last_uvd;
+			uvd_deps[j][1] = last_vce;
+		}
+		requested += 2 * UVD_REQUESTS;
+		ret |= amdgpu_cs_submit(context, flags, uvd, UVD_REQUESTS);
+		fill_fence(&last_uvd, context, &uvd[UVD_REQUESTS - 1]);
+
+		for (j = 0; j < VCE_REQUESTS; j++) {
+			vce[j].ip_type = AMDGPU_HW_IP_VCE;
+			vce[j].number_of_ibs = 1;
+			vce[j].ibs = &ib;
+			vce[j].number_of_dependencies = 2;
+			vce[j].dependencies = vce_deps[j];
+			vce_deps[j][0] = last_uvd;
+			vce_deps[j][1] = history[i % POLL_LAG];
+		}
+		requested += 2 * VCE_REQUESTS;
+		ret |= amdgpu_cs_submit(context, flags, vce, VCE_REQUESTS);
+		fill_fence(&last_vce, context, &vce[VCE_REQUESTS - 1]);
+
+		/* Merged requests share the fence of their submission. */
+		if (flags & AMDGPU_CS_SUBMIT_MERGE)
+			ret |= uvd[0].seq_no != last_uvd.fence ||
+			       vce[0].seq_no != last_vce.fence;
+
+		/* The scheduler polls the oldest frame still in flight. */
+		ret |= amdgpu_cs_query_fence_status(&history[i % POLL_LAG],
+						    0, 0, &expired);
+		history[i % POLL_LAG] = last_uvd;
+	}
+	elapsed = get_time() - start;
+
+	printf("%-9s %6.0f ns per frame, %.2f CS ioctls, %.2f wait ioctls, "
+	       "%.2f of %.2f dependencies sent\n", name,
+	       elapsed * 1e9 / NUM_FRAMES,
+	       (double)(cs_ioctls - cs_start) / NUM_FRAMES,
+	       (double)(wait_ioctls - wait_start) / NUM_FRAMES,
+	       (double)(dependencies - dep_start) / NUM_FRAMES,
+	       (double)requested / NUM_FRAMES);
+
+	return ret;
+}
+
+/* Requests that may not be merged must still go out one by one. */
+static int test_no_merge(amdgpu_context_handle context)
+{
+	struct amdgpu_cs_request requests[4];
+	struct amdgpu_cs_ib_info ibs[AMDGPU_CS_MAX_IBS_PER_SUBMIT];
+	unsigned int start = cs_ioctls;
+	int i, ret;
+
+	memset(ibs, 0, sizeof(ibs));
+	memset(requests, 0, sizeof(requests));
+	for (i = 0; i < 4; i++) {
+		requests[i].ip_type = AMDGPU_HW_IP_DMA;
+		requests[i].number_of_ibs = 1;
+		requests[i].ibs = ibs;
+	}
+	requests[1].ring = 1;
+
+	ret = amdgpu_cs_submit(context, AMDGPU_CS_SUBMIT_MERGE, requests, 4);
+	ret |= cs_ioctls - start != 3;
+	ret |= requests[2].seq_no != requests[3].seq_no;
+
+	/* A bad request fails without stopping the ones before it. */
+	requests[3].ring = MAX_RINGS;
+	start = cs_ioctls;
+	ret |= amdgpu_cs_submit(context, AMDGPU_CS_SUBMIT_MERGE,
+				requests, 4) != -EINVAL;
+	ret |= cs_ioctls - start != 3;
+
+	return ret;
+}
+
+int main(void)
+{
+	amdgpu_device_handle dev;
+	amdgpu_context_handle context;
+	uint32_t major, minor;
+	int fd, ret = 0;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		return 1;
+
+	if (amdgpu_device_initialize(fd, &major, &minor, &dev) ||
+	    amdgpu_cs_ctx_create(dev, &context)) {
+		printf("device initialization failed\n");
+		return 1;
+	}
+
+	ret |= transcode(context, 0, "one by one");
+	ret |= transcode(context, AMDGPU_CS_SUBMIT_MERGE, "merged");
+	ret |= test_no_merge(context);
+
+	amdgpu_cs_ctx_free(context);
+	amdgpu_device_deinitialize(dev);
+	close(fd);
+
+	if (ret || errors)
+		printf("bad submissions (%u errors)\n", errors);
+
+	return ret || errors;
+}
@@ -0,0 +1,132 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "xf86drm.h"
+#include "amdgpu_drm.h"
+#include "test_stub.h"
+
+unsigned int stub_ops;
+static uint32_t next_ctx = 1;
+
+double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fake_version(drm_version_t *version)
+{
+	version->version_major = 3;
+	version->name_len = version->date_len = version->desc_len = 1;
+	if (version->name) {
+		version->name[0] = 'a';
+		version->date[0] = '0';
+		version->desc[0] = 'a';
+	}
+}
+
+static int fake_info(struct drm_amdgpu_info *info)
+{
+	void *out = (void *)(uintptr_t)info->return_pointer;
+	struct drm_amdgpu_info_device dev_info;
+
+	switch (info->query) {
+	case AMDGPU_INFO_ACCEL_WORKING:
+		*(uint32_t *)out = 1;
+		return 0;
+	case AMDGPU_INFO_DEV_INFO:
+		memset(&dev_info, 0, sizeof(dev_info));
+		dev_info.virtual_address_offset = 1 << 20;
+		dev_info.virtual_address_max = 1ull << 40;
+		dev_info.virtual_address_alignment = 4096;
+		memcpy(out, &dev_info, info->return_size);
+		return 0;
+	case AMDGPU_INFO_READ_MMR_REG:
+		memset(out, 0, info->return_size);
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static int fake_ctx(union drm_amdgpu_ctx *args)
+{
+	uint32_t id;
+
+	switch (args->in.op) {
+	case AMDGPU_CTX_OP_ALLOC_CTX:
+		if (next_ctx == STUB_MAX_CTX) {
+			errno = ENOMEM;
+			return -1;
+		}
+		id = next_ctx++;
+		memset(args, 0, sizeof(*args));
+		args->out.alloc.ctx_id = id;
+		return 0;
+	case AMDGPU_CTX_OP_FREE_CTX:
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	stub_ops++;
+
+	switch (request) {
+	case DRM_IOCTL_VERSION:
+		fake_version(arg);
+		return 0;
+	case DRM_IOCTL_GET_CLIENT:
+		((drm_client_t *)arg)->auth = 1;
+		return 0;
+	case DRM_IOCTL_AMDGPU_INFO:
+		return fake_info(arg);
+	case DRM_IOCTL_AMDGPU_CTX:
+		return fake_ctx(arg);
+	default:
+		return stub_ioctl(request, arg);
+	}
+}
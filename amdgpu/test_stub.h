@@ -0,0 +1,43 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef TEST_STUB_H
+#define TEST_STUB_H
+
+#include <stdint.h>
+
+/*
+ * A stub amdgpu device shared by the tests: it answers the ioctls
+ * amdgpu_device_initialize() and the context calls issue and hands every
+ * other request to stub_ioctl(), which each test defines.
+ */
+
+#define STUB_MAX_CTX	4	/* context ids are 1 .. STUB_MAX_CTX - 1 */
+
+/* Ioctls issued so far */
+extern unsigned int stub_ops;
+
+double get_time(void);
+
+/* Provided by the test; sets errno and returns -1 for what it rejects. */
+int stub_ioctl(unsigned long request, void *arg);
+
+#endif
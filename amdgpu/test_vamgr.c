@@ -0,0 +1,301 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Churns the VA manager with a random mix of allocations and frees, checks
+ * that the holes and the live ranges always tile the used part of the
+ * address space, and reports how long each operation takes and how
+ * fragmented the holes get.  No GPU is involved.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+#include "amdgpu_internal.h"
+
+#define VA_START	(1ull << 20)
+#define VA_MAX		(1ull << 40)
+#define PAGE		4096
+#define NUM_LIVE	100000
+#define NUM_OPS		1000000
+#define CHECK_EVERY	50000
+
+struct range {
+	uint64_t va;
+	uint64_t size;
+};
+
+static struct range live[NUM_LIVE];
+static unsigned int num_live;
+static uint32_t seed = 1;
+
+static uint32_t random_u32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct range *ra = a, *rb = b;
+
+	return ra->va < rb->va ? -1 : ra->va > rb->va;
+}
+
+struct walk {
+	struct range *holes;
+	unsigned int count;
+	int errors;
+};
+
+/* Collects the holes in offset order, checking both trees on the way. */
+static void walk_holes(struct amdgpu_bo_va_hole *hole, int tree,
+		       struct walk *w, const struct amdgpu_bo_va_hole **last)
+{
+	int i;
+
+	if (!hole)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		struct amdgpu_bo_va_hole *child =
+			i ? hole->right[tree] : hole->left[tree];
+
+		if (child && child->priority > hole->priority)
+			w->errors++;
+	}
+
+	walk_holes(hole->left[tree], tree, w, last);
+
+	if (*last && (tree ? (*last)->size > hole->size ||
+			     ((*last)->size == hole->size &&
+			      (*last)->offset >= hole->offset)
+			   : (*last)->offset >= hole->offset))
+		w->errors++;
+	*last = hole;
+
+	if (tree == 0) {
+		w->holes[w->count].va = hole->offset;
+		w->holes[w->count].size = hole->size;
+	}
+	w->count++;
+
+	walk_holes(hole->right[tree], tree, w, last);
+}
+
+/*
+ * Checks that the holes and the live ranges cover [VA_START, va_offset)
+ * exactly, and that no two holes touch.
+ */
+static int check_mgr(struct amdgpu_bo_va_mgr *mgr)
+{
+	static struct range holes[NUM_LIVE + 1], sorted[NUM_LIVE];
+	const struct amdgpu_bo_va_hole *last;
+	struct walk w = { holes, 0, 0 };
+	unsigned int by_offset, h = 0, r = 0;
+	uint64_t end = VA_START;
+	int prev_hole = 0;
+
+	last = NULL;
+	walk_holes(mgr->va_holes[0], 0, &w, &last);
+	by_offset = w.count;
+	w.count = 0;
+	last = NULL;
+	walk_holes(mgr->va_holes[1], 1, &w, &last);
+	if (w.errors || w.count != by_offset || by_offset > num_live ||
+	    mgr->num_ranges != num_live || mgr->num_holes < num_live)
+		return 1;
+
+	memcpy(sorted, live, num_live * sizeof(*live));
+	qsort(sorted, num_live, sizeof(*sorted), compare_ranges);
+
+	while (h < by_offset || r < num_live) {
+		if (h < by_offset && holes[h].va == end) {
+			if (prev_hole || holes[h].size == 0)
+				return 1;
+			end += holes[h++].size;
+			prev_hole = 1;
+		} else if (r < num_live && sorted[r].va == end) {
+			end += sorted[r++].size;
+			prev_hole = 0;
+		} else {
+			return 1;
+		}
+	}
+
+	return end != mgr->va_offset || prev_hole;
+}
+
+static void report(struct amdgpu_bo_va_mgr *mgr, const char *name,
+		   double elapsed, unsigned int ops)
+{
+	static struct range holes[NUM_LIVE + 1];
+	const struct amdgpu_bo_va_hole *last = NULL;
+	struct walk w = { holes, 0, 0 };
+	uint64_t total = 0, largest = 0;
+	unsigned int i;
+
+	walk_holes(mgr->va_holes[0], 0, &w, &last);
+	for (i = 0; i < w.count; i++) {
+		total += holes[i].size;
+		if (holes[i].size > largest)
+			largest = holes[i].size;
+	}
+
+	printf("%-18s %5.0f ns per op, %6u holes holding %4.1f%% of %" PRIu64
+	       " MB, largest %" PRIu64 " KB\n", name, elapsed * 1e9 / ops,
+	       w.count, 100.0 * total / (mgr->va_offset - VA_START),
+	       (uint64_t)(mgr->va_offset - VA_START) >> 20, largest >> 10);
+}
+
+static uint64_t random_size(void)
+{
+	uint32_t r = random_u32();
+
+	/* Mostly small buffers, with the odd large one. */
+	if (r % 16)
+		return (1 + (r >> 8) % 16) * PAGE;
+	return (1 + (r >> 8) % 512) * PAGE;
+}
+
+/* Large buffers want huge pages, some small ones 64KB pages. */
+static uint64_t random_alignment(uint64_t size)
+{
+	if (size >= 1024 * 1024)
+		return 2 * 1024 * 1024;
+	if (random_u32() % 4 == 0)
+		return 64 * 1024;
+	return PAGE;
+}
+
+/* Allocates or frees one range, drifting towards @target live ranges. */
+static int step(struct amdgpu_bo_va_mgr *mgr, unsigned int target)
+{
+	uint64_t size, alignment, va;
+	unsigned int i;
+
+	if (num_live && (num_live >= target || random_u32() % 4 == 0)) {
+		i = random_u32() % num_live;
+		amdgpu_vamgr_free_va(mgr, live[i].va, live[i].size);
+		live[i] = live[--num_live];
+		return 0;
+	}
+
+	size = random_size();
+	alignment = random_alignment(size);
+	va = amdgpu_vamgr_find_va(mgr, size, alignment, 0);
+	if (va == AMDGPU_INVALID_VA_ADDRESS || va % alignment ||
+	    va < VA_START || va + size > VA_MAX)
+		return 1;
+
+	live[num_live].va = va;
+	live[num_live].size = size;
+	num_live++;
+	return 0;
+}
+
+/* Frees a range and asks for it back at the same address. */
+static int test_base_required(struct amdgpu_bo_va_mgr *mgr)
+{
+	struct range r = live[random_u32() % num_live];
+	uint64_t va;
+
+	amdgpu_vamgr_free_va(mgr, r.va, r.size);
+	va = amdgpu_vamgr_find_va(mgr, r.size, PAGE, r.va);
+
+	/* Inside an allocated range must fail. */
+	if (amdgpu_vamgr_find_va(mgr, PAGE, PAGE, r.va) !=
+	    AMDGPU_INVALID_VA_ADDRESS)
+		return 1;
+
+	return va != r.va;
+}
+
+int main(void)
+{
+	struct amdgpu_bo_va_mgr mgr;
+	double start, first, last;
+	unsigned int i;
+	int ret = 0;
+
+	amdgpu_vamgr_init(&mgr, VA_START, VA_MAX, PAGE);
+
+	/* Fill up, then churn at a steady number of live ranges. */
+	start = get_time();
+	while (num_live < NUM_LIVE && !ret)
+		ret |= step(&mgr, NUM_LIVE);
+	report(&mgr, "fill", get_time() - start, NUM_LIVE);
+	ret |= check_mgr(&mgr);
+
+	start = get_time();
+	for (i = 0; i < NUM_OPS / 10 && !ret; i++)
+		ret |= step(&mgr, NUM_LIVE);
+	first = get_time() - start;
+	report(&mgr, "churn, first 10%", first, NUM_OPS / 10);
+
+	for (; i < NUM_OPS - NUM_OPS / 10 && !ret; i++) {
+		ret |= step(&mgr, NUM_LIVE);
+		if (i % CHECK_EVERY == 0) {
+			ret |= test_base_required(&mgr);
+			ret |= check_mgr(&mgr);
+		}
+	}
+
+	start = get_time();
+	for (; i < NUM_OPS && !ret; i++)
+		ret |= step(&mgr, NUM_LIVE);
+	last = get_time() - start;
+	report(&mgr, "churn, last 10%", last, NUM_OPS / 10);
+	ret |= check_mgr(&mgr);
+
+	/* Giving everything back must leave a single empty range. */
+	while (num_live && !ret)
+		ret |= step(&mgr, 0);
+	ret |= check_mgr(&mgr);
+	ret |= mgr.va_offset != VA_START || mgr.va_holes[0] != NULL;
+
+	amdgpu_vamgr_deinit(&mgr);
+
+	if (ret)
+		printf("VA manager inconsistency\n");
+
+	return ret;
+}
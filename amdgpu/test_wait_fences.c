@@ -0,0 +1,412 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Plays a scheduler that keeps a few hundred jobs in flight on the compute
+ * rings and retires whatever completed at every tick, against a stub CS
+ * ioctl whose "GPU" writes user fences into a file standing in for the
+ * fence buffer.  Checks that amdgpu_cs_wait_fences() never reports a busy
+ * fence as signalled nor misses a signalled one, and reports the wait
+ * ioctls per tick with and without user fences.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xf86drm.h"
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+#include "test_stub.h"
+
+#define NUM_TICKS	2000
+#define NUM_RINGS	8
+#define IN_FLIGHT	256
+#define RUN_PER_TICK	4	/* jobs each ring completes per tick */
+#define HISTORY		1024	/* more than a ring ever has in flight */
+#define PAGE		4096
+
+struct fake_ring {
+	uint64_t submitted;
+	uint64_t completed;
+	/* Byte offset each job writes its fence to, or -1 */
+	int32_t fence_offset[HISTORY];
+};
+
+static struct fake_ring rings[STUB_MAX_CTX][NUM_RINGS];
+static volatile uint64_t *fence_memory;
+static unsigned int wait_ioctls, creates, closes, errors;
+
+/* Completes the jobs of a ring up to @seq, writing their user fences. */
+static void gpu_run(uint32_t ctx_id, uint32_t ring, uint64_t seq)
+{
+	struct fake_ring *r = &rings[ctx_id][ring];
+
+	if (seq > r->submitted)
+		seq = r->submitted;
+
+	while (r->completed < seq) {
+		int32_t offset = r->fence_offset[++r->completed % HISTORY];
+
+		if (offset >= 0)
+			fence_memory[offset / sizeof(uint64_t)] = r->completed;
+	}
+}
+
+static int fake_cs(union drm_amdgpu_cs *cs)
+{
+	uint64_t *chunk_array = (uint64_t *)(uintptr_t)cs->in.chunks;
+	uint32_t i, ring = NUM_RINGS, ctx_id = cs->in.ctx_id;
+	int32_t fence_offset = -1;
+	struct fake_ring *r;
+
+	for (i = 0; i < cs->in.num_chunks; i++) {
+		struct drm_amdgpu_cs_chunk *chunk =
+			(struct drm_amdgpu_cs_chunk *)(uintptr_t)chunk_array[i];
+		void *data = (void *)(uintptr_t)chunk->chunk_data;
+
+		if (chunk->chunk_id == AMDGPU_CHUNK_ID_IB)
+			ring = ((struct drm_amdgpu_cs_chunk_ib *)data)->ring;
+		else if (chunk->chunk_id == AMDGPU_CHUNK_ID_FENCE)
+			fence_offset =
+				((struct drm_amdgpu_cs_chunk_fence *)data)->offset;
+	}
+
+	if (ring >= NUM_RINGS || ctx_id >= STUB_MAX_CTX ||
+	    fence_offset >= PAGE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r = &rings[ctx_id][ring];
+	if (r->submitted - r->completed >= HISTORY - 1) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	memset(&cs->out, 0, sizeof(cs->out));
+	cs->out.handle = ++r->submitted;
+	r->fence_offset[cs->out.handle % HISTORY] = fence_offset;
+	return 0;
+}
+
+/* A wait that may still block lasts until the fence signals. */
+static int fake_wait_cs(union drm_amdgpu_wait_cs *args)
+{
+	uint32_t ctx_id = args->in.ctx_id, ring = args->in.ring;
+	struct timespec ts;
+	uint64_t now;
+
+	if (ctx_id >= STUB_MAX_CTX || ring >= NUM_RINGS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	if (args->in.timeout > now)
+		gpu_run(ctx_id, ring, args->in.handle);
+
+	wait_ioctls++;
+	args->out.status = args->in.handle > rings[ctx_id][ring].completed;
+	return 0;
+}
+
+/* The requests the stub device leaves to this test */
+int stub_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_AMDGPU_GEM_CREATE:
+		memset(arg, 0, sizeof(union drm_amdgpu_gem_create));
+		((union drm_amdgpu_gem_create *)arg)->out.handle = ++creates;
+		return 0;
+	case DRM_IOCTL_AMDGPU_GEM_MMAP:
+		/* Every buffer maps the start of the fence file. */
+		memset(arg, 0, sizeof(union drm_amdgpu_gem_mmap));
+		return 0;
+	case DRM_IOCTL_GEM_CLOSE:
+		closes++;
+		return 0;
+	case DRM_IOCTL_AMDGPU_CS:
+		return fake_cs(arg);
+	case DRM_IOCTL_AMDGPU_WAIT_CS:
+		return fake_wait_cs(arg);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static uint32_t ctx_id(amdgpu_context_handle context,
+		       amdgpu_context_handle *contexts)
+{
+	return context == contexts[0] ? 1 : 2;
+}
+
+/* Submits one job on @ring, with its user fence in slot @ring of @bo. */
+static int submit(amdgpu_context_handle context, amdgpu_bo_handle bo,
+		  uint32_t ring, struct amdgpu_cs_fence *fence)
+{
+	struct amdgpu_cs_request request;
+	struct amdgpu_cs_ib_info ib;
+	int r;
+
+	memset(&ib, 0, sizeof(ib));
+	ib.ib_mc_address = 0x100000;
+	ib.size = 16;
+
+	memset(&request, 0, sizeof(request));
+	request.ip_type = AMDGPU_HW_IP_COMPUTE;
+	request.ring = ring;
+	request.number_of_ibs = 1;
+	request.ibs = &ib;
+	request.fence_info.handle = bo;
+	request.fence_info.offset = ring;
+
+	r = amdgpu_cs_submit(context, 0, &request, 1);
+
+	memset(fence, 0, sizeof(*fence));
+	fence->context = context;
+	fence->ip_type = AMDGPU_HW_IP_COMPUTE;
+	fence->ring = ring;
+	fence->fence = request.seq_no;
+	return r;
+}
+
+static int schedule(amdgpu_context_handle *contexts, int user_fences,
+		    amdgpu_bo_handle bo, const char *name)
+{
+	static struct amdgpu_cs_fence fences[IN_FLIGHT];
+	amdgpu_context_handle context = contexts[!user_fences];
+	uint32_t id = ctx_id(context, contexts);
+	unsigned int start_ioctls = wait_ioctls, retired = 0;
+	uint32_t i, n = 0, next_ring = 0, status, first;
+	double start, elapsed;
+	int tick, ret = 0;
+
+	start = get_time();
+	for (tick = 0; tick < NUM_TICKS && !ret; tick++) {
+		while (n < IN_FLIGHT && !ret)
+			ret |= submit(context, user_fences ? bo : NULL,
+				      next_ring++ % NUM_RINGS, &fences[n++]);
+
+		for (i = 0; i < NUM_RINGS; i++)
+			gpu_run(id, i, rings[id][i].completed + RUN_PER_TICK);
+
+		for (;;) {
+			ret |= amdgpu_cs_wait_fences(fences, n, false, 0,
+						     &status, &first);
+			if (ret || !status)
+				break;
+
+			if (fences[first].fence >
+			    rings[id][fences[first].ring].completed)
+				errors++;
+			fences[first] = fences[--n];
+			retired++;
+		}
+
+		for (i = 0; i < n; i++)
+			if (fences[i].fence <= rings[id][fences[i].ring].completed)
+				errors++;
+	}
+	elapsed = get_time() - start;
+
+	printf("%-16s %6.0f ns per tick, %6.2f wait ioctls per tick, "
+	       "%.1f fences retired per tick\n", name,
+	       elapsed * 1e9 / NUM_TICKS,
+	       (double)(wait_ioctls - start_ioctls) / NUM_TICKS,
+	       (double)retired / NUM_TICKS);
+
+	/* Drain, which lets the stub complete whatever is waited for. */
+	ret |= amdgpu_cs_wait_fences(fences, n, true, AMDGPU_TIMEOUT_INFINITE,
+				     &status, NULL);
+	ret |= !status;
+	for (i = 0; i < n; i++)
+		if (fences[i].fence > rings[id][fences[i].ring].completed)
+			errors++;
+
+	return ret;
+}
+
+/* A user fence only tells about the jobs that write it. */
+static int test_user_fence_runs(amdgpu_context_handle context,
+				amdgpu_bo_handle bo, uint32_t id)
+{
+	struct amdgpu_cs_fence x, y, z, w, pair[2];
+	unsigned int start;
+	uint32_t expired, status, first;
+	double begin;
+	int ret = 0;
+
+	/* Busy and writing the user fence: no need to ask. */
+	ret |= submit(context, bo, 0, &x);
+	start = wait_ioctls;
+	ret |= amdgpu_cs_query_fence_status(&x, 0, 0, &expired);
+	ret |= expired || wait_ioctls != start;
+
+	/* Not writing it: the kernel has to be asked. */
+	ret |= submit(context, NULL, 0, &y);
+	ret |= amdgpu_cs_query_fence_status(&y, 0, 0, &expired);
+	ret |= expired || wait_ioctls != start + 1;
+
+	gpu_run(id, 0, y.fence);
+	ret |= amdgpu_cs_query_fence_status(&x, 0, 0, &expired);
+	ret |= !expired || wait_ioctls != start + 1;
+	ret |= amdgpu_cs_query_fence_status(&y, 0, 0, &expired);
+	ret |= !expired || wait_ioctls != start + 2;
+
+	/* A new run starts after the gap. */
+	ret |= submit(context, bo, 0, &z);
+	ret |= amdgpu_cs_query_fence_status(&z, 0, 0, &expired);
+	ret |= expired || wait_ioctls != start + 2;
+
+	/* Garbage in the slot doesn't signal anything. */
+	fence_memory[2] = ~0ull;
+	ret |= submit(context, bo, 2, &w);
+	ret |= amdgpu_cs_query_fence_status(&w, 0, 0, &expired);
+	ret |= expired;
+
+	/* Waiting for any of them polls until the timeout. */
+	ret |= submit(context, NULL, 1, &pair[1]);
+	pair[0] = z;
+	begin = get_time();
+	ret |= amdgpu_cs_wait_fences(pair, 2, false, 2000000, &status, &first);
+	ret |= status || get_time() - begin < 0.002;
+
+	/* Waiting for all of them blocks on each in turn. */
+	ret |= amdgpu_cs_wait_fences(pair, 2, true, 1000000000, &status, NULL);
+	ret |= !status;
+	ret |= amdgpu_cs_query_fence_status(&w, AMDGPU_TIMEOUT_INFINITE, 0,
+					    &expired);
+	ret |= !expired;
+
+	pair[0] = w;
+	ret |= amdgpu_cs_wait_fences(pair, 2, false, 0, &status, &first);
+	ret |= !status || first != 0;
+
+	/* Waiting forever still asks the kernel about a fence the user
+	 * fence shows busy, here one whose write hasn't landed.
+	 */
+	ret |= submit(context, bo, 4, &pair[0]);
+	ret |= submit(context, NULL, 1, &pair[1]);
+	gpu_run(id, 4, pair[0].fence);
+	fence_memory[4] = 0;
+	ret |= amdgpu_cs_wait_fences(pair, 2, false, AMDGPU_TIMEOUT_INFINITE,
+				     &status, &first);
+	ret |= !status || first != 0;
+	gpu_run(id, 1, pair[1].fence);
+
+	if (ret)
+		printf("user fences misread\n");
+	return ret;
+}
+
+/* A slot holding fences it wasn't written with by this ring is ignored. */
+static int test_stale_user_fence(amdgpu_context_handle context,
+				 amdgpu_bo_handle bo, uint32_t id)
+{
+	struct amdgpu_cs_fence fence;
+	uint32_t expired;
+	int ret = 0;
+
+	/* As left by another context, or the buffer's previous owner. */
+	fence_memory[3] = rings[id][3].submitted + 1;
+	ret |= submit(context, bo, 3, &fence);
+	ret |= amdgpu_cs_query_fence_status(&fence, 0, 0, &expired);
+	ret |= expired;
+
+	gpu_run(id, 3, fence.fence);
+	ret |= amdgpu_cs_query_fence_status(&fence, 0, 0, &expired);
+	ret |= !expired;
+
+	if (ret)
+		printf("stale user fence trusted\n");
+	return ret;
+}
+
+int main(void)
+{
+	amdgpu_device_handle dev;
+	amdgpu_context_handle contexts[2];
+	struct amdgpu_bo_alloc_request req;
+	amdgpu_bo_handle bo, other;
+	uint32_t major, minor;
+	FILE *file;
+	int fd, ret = 0;
+
+	/* The fence buffer, shared by the stub GPU and the library. */
+	file = tmpfile();
+	if (!file)
+		return 1;
+	fd = fileno(file);
+	if (ftruncate(fd, PAGE))
+		return 1;
+	fence_memory = mmap(NULL, PAGE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+	if (fence_memory == MAP_FAILED)
+		return 1;
+
+	memset(&req, 0, sizeof(req));
+	req.alloc_size = PAGE;
+	req.phys_alignment = PAGE;
+	req.preferred_heap = AMDGPU_GEM_DOMAIN_GTT;
+
+	if (amdgpu_device_initialize(fd, &major, &minor, &dev) ||
+	    amdgpu_cs_ctx_create(dev, &contexts[0]) ||
+	    amdgpu_cs_ctx_create(dev, &contexts[1]) ||
+	    amdgpu_bo_alloc(dev, &req, &bo) ||
+	    amdgpu_bo_alloc(dev, &req, &other)) {
+		printf("device initialization failed\n");
+		return 1;
+	}
+
+	ret |= schedule(contexts, 0, bo, "kernel only");
+	ret |= schedule(contexts, 1, bo, "user fences");
+	ret |= test_user_fence_runs(contexts[0], bo, 1);
+	ret |= test_stale_user_fence(contexts[0], other, 1);
+
+	/* The contexts keep the buffers until they go away. */
+	amdgpu_bo_free(bo);
+	amdgpu_bo_free(other);
+	ret |= closes != 0;
+	amdgpu_cs_ctx_free(contexts[0]);
+	amdgpu_cs_ctx_free(contexts[1]);
+	ret |= closes != creates;
+
+	amdgpu_device_deinitialize(dev);
+	munmap((void *)fence_memory, PAGE);
+	fclose(file);
+
+	if (ret || errors)
+		printf("fences misreported (%u errors)\n", errors);
+
+	return ret || errors;
+}
@@ -36,6 +36,8 @@
 static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void bo_del(struct fd_bo *bo);
+static void bo_cache_remove(struct fd_bo *bo);
+static int bo_madvise(struct fd_bo *bo, int willneed);
 
 /* set buffer name, and add to table, call w/ table_lock held: */
 static void set_name(struct fd_bo *bo, uint32_t name)
@@ -45,18 +47,32 @@ static void set_name(struct fd_bo *bo, uint32_t name)
 	drmHashInsert(bo->dev->name_table, name, bo);
 }
 
-/* lookup a buffer, call w/ table_lock held: */
-static struct fd_bo * lookup_bo(void *tbl, uint32_t key)
+/* lookup a buffer, call w/ table_lock held.  Returns whether @key is
+ * known; *bo is then NULL if it was a cached bo whose pages the kernel
+ * reclaimed, which is closed instead:
+ */
+static int lookup_bo(void *tbl, uint32_t key, struct fd_bo **bo)
 {
-	struct fd_bo *bo = NULL;
-	if (!drmHashLookup(tbl, key, (void **)&bo)) {
-		/* found, incr refcnt and return: */
-		bo = fd_bo_ref(bo);
+	*bo = NULL;
+	if (drmHashLookup(tbl, key, (void **)bo))
+		return 0;
 
-		/* don't break the bucket if this bo was found in one */
-		list_delinit(&bo->list);
+	/* don't break the bucket if this bo was found in one, and
+	 * take back the device ref that cached bo's don't hold:
+	 */
+	if (!LIST_IS_EMPTY(&(*bo)->list)) {
+		bo_cache_remove(*bo);
+		if (!bo_madvise(*bo, 1)) {
+			bo_del(*bo);
+			*bo = NULL;
+			return 1;
+		}
+		fd_device_ref((*bo)->dev);
 	}
-	return bo;
+
+	/* found, incr refcnt and return: */
+	fd_bo_ref(*bo);
+	return 1;
 }
 
 /* allocate a new buffer object, call w/ table_lock held */
@@ -78,12 +94,46 @@ static struct fd_bo * bo_from_handle(struct fd_device *dev,
 	bo->handle = handle;
 	atomic_set(&bo->refcnt, 1);
 	list_inithead(&bo->list);
+	list_inithead(&bo->lru);
 	/* add ourself into the handle table: */
 	drmHashInsert(dev->handle_table, handle, bo);
 	return bo;
 }
 
-/* Frees older cached buffers.  Called under table_lock */
+/* Tells the kernel whether the pages of a bo are needed, and returns
+ * whether it still has them.  Called under table_lock
+ */
+static int bo_madvise(struct fd_bo *bo, int willneed)
+{
+	if (!bo->funcs->madvise)
+		return 1;
+	return bo->funcs->madvise(bo, willneed);
+}
+
+/* Called under table_lock */
+static void bo_cache_remove(struct fd_bo *bo)
+{
+	list_delinit(&bo->list);
+	list_delinit(&bo->lru);
+	bo->dev->cache_size -= bo->size;
+}
+
+/* Frees the least recently freed buffers until the rest fit in @size.
+ * Called under table_lock
+ */
+static void trim_bo_cache(struct fd_device *dev, uint64_t size)
+{
+	while (dev->cache_size > size) {
+		struct fd_bo *bo = LIST_ENTRY(struct fd_bo, dev->cache_lru.next, lru);
+
+		bo_cache_remove(bo);
+		bo_del(bo);
+	}
+}
+
+/* Frees older cached buffers, or all of them and the sub-buckets for a
+ * time of 0.  Called under table_lock
+ */
 drm_private void fd_cleanup_bo_cache(struct fd_device *dev, time_t time)
 {
 	int i;
@@ -91,40 +141,89 @@ drm_private void fd_cleanup_bo_cache(struct fd_device *dev, time_t time)
 	if (dev->time == time)
 		return;
 
-	for (i = 0; i < dev->num_buckets; i++) {
-		struct fd_bo_bucket *bucket = &dev->cache_bucket[i];
-		struct fd_bo *bo;
+	while (!LIST_IS_EMPTY(&dev->cache_lru)) {
+		struct fd_bo *bo = LIST_ENTRY(struct fd_bo, dev->cache_lru.next, lru);
 
-		while (!LIST_IS_EMPTY(&bucket->list)) {
-			bo = LIST_ENTRY(struct fd_bo, bucket->list.next, list);
+		/* keep things in cache for at least 1 second: */
+		if (time && ((time - bo->free_time) <= 1))
+			break;
 
-			/* keep things in cache for at least 1 second: */
-			if (time && ((time - bo->free_time) <= 1))
-				break;
+		bo_cache_remove(bo);
+		bo_del(bo);
+	}
 
-			list_del(&bo->list);
-			bo_del(bo);
+	if (!time) {
+		for (i = 0; i < dev->num_buckets; i++) {
+			struct fd_bo_bucket *bucket = &dev->cache_bucket[i];
+			struct fd_bo_sub_bucket *sub, *tmp;
+
+			LIST_FOR_EACH_ENTRY_SAFE(sub, tmp, &bucket->list, link)
+				free(sub);
+			list_inithead(&bucket->list);
 		}
 	}
 
 	dev->time = time;
 }
 
+/* The buckets are 1, 2 and 3 pages, then four per power of two: pages in
+ * (2^b, 2^(b+1)] are rounded up to a multiple of 2^(b-2).
+ */
 static struct fd_bo_bucket * get_bucket(struct fd_device *dev, uint32_t size)
 {
-	int i;
+	uint32_t pages;
+	int b, i;
 
-	/* hmm, this is what intel does, but I suppose we could calculate our
-	 * way to the correct bucket size rather than looping..
-	 */
-	for (i = 0; i < dev->num_buckets; i++) {
-		struct fd_bo_bucket *bucket = &dev->cache_bucket[i];
-		if (bucket->size >= size) {
-			return bucket;
-		}
+	/* checked before rounding up, which could wrap: */
+	if (dev->num_buckets == 0 ||
+	    size > dev->cache_bucket[dev->num_buckets - 1].size)
+		return NULL;
+
+	pages = (size + 4095) / 4096;
+	if (pages == 0)
+		pages = 1;
+
+	if (pages <= 4) {
+		i = pages - 1;
+	} else {
+		b = 31 - __builtin_clz(pages - 1);
+		i = 3 + (b - 2) * 4 + (((pages - 1) >> (b - 2)) & 3) + 1;
+	}
+
+	if (i >= dev->num_buckets)
+		return NULL;
+
+	assert(dev->cache_bucket[i].size >= size);
+	assert(i == 0 || dev->cache_bucket[i - 1].size < size);
+
+	return &dev->cache_bucket[i];
+}
+
+/* The sub-bucket of @bucket for @flags, created on first use if @create.
+ * Called under table_lock
+ */
+static struct fd_bo_sub_bucket * get_sub_bucket(struct fd_bo_bucket *bucket,
+		uint32_t flags, int create)
+{
+	struct fd_bo_sub_bucket *sub;
+
+	LIST_FOR_EACH_ENTRY(sub, &bucket->list, link) {
+		if (sub->flags == flags)
+			return sub;
 	}
 
-	return NULL;
+	if (!create)
+		return NULL;
+
+	sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		return NULL;
+
+	sub->flags = flags;
+	list_inithead(&sub->list);
+	list_add(&sub->link, &bucket->list);
+
+	return sub;
 }
 
 static int is_idle(struct fd_bo *bo)
@@ -135,33 +234,38 @@ static int is_idle(struct fd_bo *bo)
 			DRM_FREEDRENO_PREP_NOSYNC) == 0;
 }
 
+/* Takes a bo allocated with @flags from the bucket.  Render targets take
+ * the most recently freed one, likely still in the GPU's caches, without
+ * stalling on it: the GPU orders its own accesses.  Everything else takes
+ * the least recently freed one, if it is idle.
+ */
 static struct fd_bo *find_in_bucket(struct fd_device *dev,
-		struct fd_bo_bucket *bucket, uint32_t flags)
+		struct fd_bo_bucket *bucket, uint32_t flags, int for_render)
 {
+	struct fd_bo_sub_bucket *sub;
 	struct fd_bo *bo = NULL;
 
-	/* TODO .. if we had an ALLOC_FOR_RENDER flag like intel, we could
-	 * skip the busy check.. if it is only going to be a render target
-	 * then we probably don't need to stall..
-	 *
-	 * NOTE that intel takes ALLOC_FOR_RENDER bo's from the list tail
-	 * (MRU, since likely to be in GPU cache), rather than head (LRU)..
-	 */
 	pthread_mutex_lock(&table_lock);
-	while (!LIST_IS_EMPTY(&bucket->list)) {
-		bo = LIST_ENTRY(struct fd_bo, bucket->list.next, list);
-		if (0 /* TODO: if madvise tells us bo is gone... */) {
-			list_del(&bo->list);
+	sub = get_sub_bucket(bucket, flags, 0);
+	while (sub && !LIST_IS_EMPTY(&sub->list)) {
+		if (for_render) {
+			bo = LIST_ENTRY(struct fd_bo, sub->list.prev, list);
+		} else {
+			bo = LIST_ENTRY(struct fd_bo, sub->list.next, list);
+			if (!is_idle(bo)) {
+				bo = NULL;
+				break;
+			}
+		}
+
+		bo_cache_remove(bo);
+
+		/* the kernel may have reclaimed its pages meanwhile: */
+		if (!bo_madvise(bo, 1)) {
 			bo_del(bo);
 			bo = NULL;
 			continue;
 		}
-		/* TODO check for compatible flags? */
-		if (is_idle(bo)) {
-			list_del(&bo->list);
-			break;
-		}
-		bo = NULL;
 		break;
 	}
 	pthread_mutex_unlock(&table_lock);
@@ -170,26 +274,29 @@ static struct fd_bo *find_in_bucket(struct fd_device *dev,
 }
 
 
-struct fd_bo *
-fd_bo_new(struct fd_device *dev, uint32_t size, uint32_t flags)
+static struct fd_bo *
+bo_new(struct fd_device *dev, uint32_t size, uint32_t flags, int for_render)
 {
 	struct fd_bo *bo = NULL;
 	struct fd_bo_bucket *bucket;
 	uint32_t handle;
 	int ret;
 
-	size = ALIGN(size, 4096);
 	bucket = get_bucket(dev, size);
 
 	/* see if we can be green and recycle: */
 	if (bucket) {
 		size = bucket->size;
-		bo = find_in_bucket(dev, bucket, flags);
+		bo = find_in_bucket(dev, bucket, flags, for_render);
 		if (bo) {
 			atomic_set(&bo->refcnt, 1);
 			fd_device_ref(bo->dev);
 			return bo;
 		}
+	} else {
+		if (size > UINT32_MAX - 4095)
+			return NULL;
+		size = ALIGN(size, 4096);
 	}
 
 	ret = dev->funcs->bo_new_handle(dev, size, flags, &handle);
@@ -198,12 +305,35 @@ fd_bo_new(struct fd_device *dev, uint32_t size, uint32_t flags)
 
 	pthread_mutex_lock(&table_lock);
 	bo = bo_from_handle(dev, size, handle);
-	bo->bo_reuse = 1;
+	if (bo) {
+		bo->bo_reuse = 1;
+		bo->flags = flags;
+	}
 	pthread_mutex_unlock(&table_lock);
 
 	return bo;
 }
 
+struct fd_bo *
+fd_bo_new(struct fd_device *dev, uint32_t size, uint32_t flags)
+{
+	return bo_new(dev, size, flags, 0);
+}
+
+struct fd_bo *
+fd_bo_new_for_render(struct fd_device *dev, uint32_t size, uint32_t flags)
+{
+	return bo_new(dev, size, flags, 1);
+}
+
+void fd_device_set_bo_cache_budget(struct fd_device *dev, uint64_t max_bytes)
+{
+	pthread_mutex_lock(&table_lock);
+	dev->cache_max_size = max_bytes;
+	trim_bo_cache(dev, max_bytes);
+	pthread_mutex_unlock(&table_lock);
+}
+
 struct fd_bo *
 fd_bo_from_handle(struct fd_device *dev, uint32_t handle, uint32_t size)
 {
@@ -211,8 +341,7 @@ fd_bo_from_handle(struct fd_device *dev, uint32_t handle, uint32_t size)
 
 	pthread_mutex_lock(&table_lock);
 
-	bo = lookup_bo(dev->handle_table, handle);
-	if (bo)
+	if (lookup_bo(dev->handle_table, handle, &bo))
 		goto out_unlock;
 
 	bo = bo_from_handle(dev, size, handle);
@@ -236,8 +365,7 @@ fd_bo_from_dmabuf(struct fd_device *dev, int fd)
 		return NULL;
 	}
 
-	bo = lookup_bo(dev->handle_table, handle);
-	if (bo)
+	if (lookup_bo(dev->handle_table, handle, &bo))
 		goto out_unlock;
 
 	/* lseek() to get bo size */
@@ -262,8 +390,7 @@ struct fd_bo * fd_bo_from_name(struct fd_device *dev, uint32_t name)
 	pthread_mutex_lock(&table_lock);
 
 	/* check name table first, to see if bo is already open: */
-	bo = lookup_bo(dev->name_table, name);
-	if (bo)
+	if (lookup_bo(dev->name_table, name, &bo))
 		goto out_unlock;
 
 	if (drmIoctl(dev->fd, DRM_IOCTL_GEM_OPEN, &req)) {
@@ -271,8 +398,7 @@ struct fd_bo * fd_bo_from_name(struct fd_device *dev, uint32_t name)
 		goto out_unlock;
 	}
 
-	bo = lookup_bo(dev->handle_table, req.handle);
-	if (bo)
+	if (lookup_bo(dev->handle_table, req.handle, &bo))
 		goto out_unlock;
 
 	bo = bo_from_handle(dev, req.size, req.handle);
@@ -305,17 +431,27 @@ void fd_bo_del(struct fd_bo *bo)
 
 	pthread_mutex_lock(&table_lock);
 
-	if (bo->bo_reuse) {
+	if (bo->bo_reuse && bo->size <= dev->cache_max_size) {
 		struct fd_bo_bucket *bucket = get_bucket(dev, bo->size);
+		struct fd_bo_sub_bucket *sub = NULL;
+
+		if (bucket)
+			sub = get_sub_bucket(bucket, bo->flags, 1);
 
 		/* see if we can be green and recycle: */
-		if (bucket) {
+		if (sub) {
 			struct timespec time;
 
 			clock_gettime(CLOCK_MONOTONIC, &time);
 
+			/* let the kernel reclaim the pages under pressure: */
+			bo_madvise(bo, 0);
+
 			bo->free_time = time.tv_sec;
-			list_addtail(&bo->list, &bucket->list);
+			list_addtail(&bo->list, &sub->list);
+			list_addtail(&bo->lru, &dev->cache_lru);
+			dev->cache_size += bo->size;
+			trim_bo_cache(dev, dev->cache_max_size);
 			fd_cleanup_bo_cache(dev, time.tv_sec);
 
 			/* bo's in the bucket cache don't have a ref and
@@ -370,6 +506,8 @@ int fd_bo_get_name(struct fd_bo *bo, uint32_t *name)
 
 		pthread_mutex_lock(&table_lock);
 		set_name(bo, req.name);
+		/* others may use it after we free it: */
+		bo->bo_reuse = 0;
 		pthread_mutex_unlock(&table_lock);
 	}
 
@@ -394,7 +532,11 @@ int fd_bo_dmabuf(struct fd_bo *bo)
 			return ret;
 		}
 
+		pthread_mutex_lock(&table_lock);
 		bo->fd = prime_fd;
+		/* others may use it after we free it: */
+		bo->bo_reuse = 0;
+		pthread_mutex_unlock(&table_lock);
 	}
 	return dup(bo->fd);
 }
@@ -78,6 +78,9 @@ init_cache_buckets(struct fd_device *dev)
 		add_bucket(dev, size + size * 2 / 4);
 		add_bucket(dev, size + size * 3 / 4);
 	}
+
+	list_inithead(&dev->cache_lru);
+	dev->cache_max_size = UINT64_MAX;
 }
 
 struct fd_device * fd_device_new(int fd)
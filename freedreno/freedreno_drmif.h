@@ -77,6 +77,8 @@ struct fd_device * fd_device_new_dup(int fd);
 struct fd_device * fd_device_ref(struct fd_device *dev);
 void fd_device_del(struct fd_device *dev);
 int fd_device_fd(struct fd_device *dev);
+/* limit the memory held by cached bo's, by default unlimited: */
+void fd_device_set_bo_cache_budget(struct fd_device *dev, uint64_t max_bytes);
 
 
 /* pipe functions:
@@ -97,6 +99,9 @@ int fd_pipe_wait_timeout(struct fd_pipe *pipe, uint32_t timestamp,
 
 struct fd_bo * fd_bo_new(struct fd_device *dev,
 		uint32_t size, uint32_t flags);
+/* for bo's only the GPU will write to first, like render targets: */
+struct fd_bo * fd_bo_new_for_render(struct fd_device *dev,
+		uint32_t size, uint32_t flags);
 struct fd_bo * fd_bo_from_fbdev(struct fd_pipe *pipe,
 		int fbfd, uint32_t size);
 struct fd_bo *fd_bo_from_handle(struct fd_device *dev,
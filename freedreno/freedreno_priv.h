@@ -63,9 +63,17 @@ struct fd_device_funcs {
 	void (*destroy)(struct fd_device *dev);
 };
 
+/* a size class of the bo cache: */
 struct fd_bo_bucket {
 	uint32_t size;
-	struct list_head list;
+	struct list_head list;   /* sub-buckets, one per set of bo flags */
+};
+
+/* cached bo's of one size class and one set of flags: */
+struct fd_bo_sub_bucket {
+	uint32_t flags;
+	struct list_head link;   /* entry in fd_bo_bucket::list */
+	struct list_head list;   /* bo's, least recently freed first */
 };
 
 struct fd_device {
@@ -89,6 +97,12 @@ struct fd_device {
 	int num_buckets;
 	time_t time;
 
+	/* every cached bo, least recently freed first, and their total size,
+	 * which is trimmed down to cache_max_size:
+	 */
+	struct list_head cache_lru;
+	uint64_t cache_size, cache_max_size;
+
 	int closefd;        /* call close(fd) upon destruction */
 };
 
@@ -130,6 +144,8 @@ struct fd_bo_funcs {
 	int (*offset)(struct fd_bo *bo, uint64_t *offset);
 	int (*cpu_prep)(struct fd_bo *bo, struct fd_pipe *pipe, uint32_t op);
 	void (*cpu_fini)(struct fd_bo *bo);
+	/* returns whether the bo still has its pages, optional: */
+	int (*madvise)(struct fd_bo *bo, int willneed);
 	void (*destroy)(struct fd_bo *bo);
 };
 
@@ -144,7 +160,9 @@ struct fd_bo {
 	const struct fd_bo_funcs *funcs;
 
 	int bo_reuse;
+	uint32_t flags;          /* flags the bo was allocated with */
 	struct list_head list;   /* bucket-list entry */
+	struct list_head lru;    /* fd_device::cache_lru entry */
 	time_t free_time;        /* time when added to bucket-list */
 };
 
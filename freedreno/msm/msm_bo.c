@@ -89,6 +89,30 @@ static void msm_bo_cpu_fini(struct fd_bo *bo)
 	drmCommandWrite(bo->dev->fd, DRM_MSM_GEM_CPU_FINI, &req, sizeof(req));
 }
 
+static int msm_bo_madvise(struct fd_bo *bo, int willneed)
+{
+	struct msm_device *msm_dev = to_msm_device(bo->dev);
+	struct drm_msm_gem_madvise req = {
+			.handle = bo->handle,
+			.madv = willneed ? MSM_MADV_WILLNEED : MSM_MADV_DONTNEED,
+	};
+	int ret;
+
+	/* without madvise, the pages are never reclaimed: */
+	if (msm_dev->no_madvise)
+		return 1;
+
+	ret = drmCommandWriteRead(bo->dev->fd, DRM_MSM_GEM_MADVISE,
+			&req, sizeof(req));
+	if (ret) {
+		if (ret == -EINVAL || ret == -ENOTTY)
+			msm_dev->no_madvise = 1;
+		return 1;
+	}
+
+	return req.retained;
+}
+
 static void msm_bo_destroy(struct fd_bo *bo)
 {
 	struct msm_bo *msm_bo = to_msm_bo(bo);
@@ -100,6 +124,7 @@ static const struct fd_bo_funcs funcs = {
 		.offset = msm_bo_offset,
 		.cpu_prep = msm_bo_cpu_prep,
 		.cpu_fini = msm_bo_cpu_fini,
+		.madvise = msm_bo_madvise,
 		.destroy = msm_bo_destroy,
 };
 
@@ -39,6 +39,7 @@
 
 struct msm_device {
 	struct fd_device base;
+	int no_madvise;     /* kernel predates DRM_MSM_GEM_MADVISE */
 };
 
 static inline struct msm_device * to_msm_device(struct fd_device *x)
@@ -0,0 +1,508 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Runs the freedreno bo cache against a stub msm ioctl layer: checks the
+ * size classes, that bo's are only reused with the flags they were
+ * allocated with, not once the kernel reclaimed their pages and not once
+ * exported, and what the render target path and the byte budget save.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "xf86drm.h"
+#include "freedreno_drmif.h"
+
+#ifndef __user
+#  define __user
+#endif
+
+#include "msm/msm_drm.h"
+
+#define FAKE_FD		42
+#define MAX_HANDLE	(1 << 16)
+#define GPU_LATENCY	3	/* frames a rendered bo stays busy for */
+#define NUM_FRAMES	1000
+#define NUM_OPS		50000
+#define NUM_LIVE	32
+
+struct fake_bo {
+	uint32_t size;
+	unsigned int busy_until;
+	int open, dontneed, purged;
+};
+
+static struct fake_bo bos[MAX_HANDLE];
+static uint32_t next_handle = 1;
+static unsigned int gpu_frame;
+static unsigned int creates, closes;
+static uint64_t resident;
+static uint32_t seed = 1;
+
+static uint32_t random_u32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fake_version(drm_version_t *version)
+{
+	version->version_major = 1;
+	version->name_len = 3;
+	version->date_len = version->desc_len = 1;
+	if (version->name) {
+		memcpy(version->name, "msm", 3);
+		version->date[0] = '0';
+		version->desc[0] = 'm';
+	}
+}
+
+static int fake_gem_new(struct drm_msm_gem_new *req)
+{
+	uint32_t handle = next_handle++;
+
+	if (handle >= MAX_HANDLE) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(&bos[handle], 0, sizeof(bos[handle]));
+	bos[handle].size = req->size;
+	bos[handle].open = 1;
+	resident += req->size;
+	creates++;
+
+	req->handle = handle;
+	return 0;
+}
+
+static int fake_cpu_prep(struct drm_msm_gem_cpu_prep *req)
+{
+	if (!bos[req->handle].open) {
+		errno = ENOENT;
+		return -1;
+	}
+	if ((req->op & MSM_PREP_NOSYNC) &&
+	    bos[req->handle].busy_until > gpu_frame) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+static int fake_madvise(struct drm_msm_gem_madvise *req)
+{
+	struct fake_bo *bo = &bos[req->handle];
+
+	if (!bo->open) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	bo->dontneed = req->madv == MSM_MADV_DONTNEED;
+	req->retained = !bo->purged;
+	return 0;
+}
+
+static int fake_gem_close(struct drm_gem_close *req)
+{
+	struct fake_bo *bo = &bos[req->handle];
+
+	if (!bo->open) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (!bo->purged)
+		resident -= bo->size;
+	bo->open = 0;
+	closes++;
+	return 0;
+}
+
+static int fake_prime_handle_to_fd(struct drm_prime_handle *req)
+{
+	if (!bos[req->handle].open) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	req->fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return req->fd < 0 ? -1 : 0;
+}
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd != FAKE_FD) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (request) {
+	case DRM_IOCTL_VERSION:
+		fake_version(arg);
+		return 0;
+	case DRM_IOCTL_MSM_GEM_NEW:
+		return fake_gem_new(arg);
+	case DRM_IOCTL_MSM_GEM_CPU_PREP:
+		return fake_cpu_prep(arg);
+	case DRM_IOCTL_MSM_GEM_MADVISE:
+		return fake_madvise(arg);
+	case DRM_IOCTL_GEM_CLOSE:
+		return fake_gem_close(arg);
+	case DRM_IOCTL_GEM_FLINK:
+		((struct drm_gem_flink *)arg)->name =
+			((struct drm_gem_flink *)arg)->handle;
+		return 0;
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+		return fake_prime_handle_to_fd(arg);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* What a submit does to a bo, as far as the cache can tell. */
+static void render(struct fd_bo *bo)
+{
+	bos[fd_bo_handle(bo)].busy_until = gpu_frame + GPU_LATENCY;
+}
+
+/* Memory pressure: the kernel drops the pages it was told it may. */
+static void reclaim(void)
+{
+	uint32_t i;
+
+	for (i = 1; i < next_handle; i++) {
+		if (bos[i].open && bos[i].dontneed && !bos[i].purged) {
+			bos[i].purged = 1;
+			resident -= bos[i].size;
+		}
+	}
+}
+
+/* The size a bo of @size pages gets, following the bucket schedule. */
+static uint32_t expected_size(uint32_t pages)
+{
+	uint32_t size;
+
+	if (pages <= 3)
+		return pages * 4096;
+
+	for (size = 4; size <= 16384; size *= 2) {
+		if (pages <= size)
+			return size * 4096;
+		if (pages <= size + size / 4)
+			return (size + size / 4) * 4096;
+		if (pages <= size + size / 2)
+			return (size + size / 2) * 4096;
+		if (pages <= size + size * 3 / 4)
+			return (size + size * 3 / 4) * 4096;
+	}
+
+	return pages * 4096;
+}
+
+static int test_sizes(void)
+{
+	static const uint32_t large[] = { 16384, 16385, 28672, 28673, 40000 };
+	struct fd_device *dev = fd_device_new(FAKE_FD);
+	struct fd_bo *bo;
+	uint32_t pages, i;
+	int ret = 0;
+
+	if (!dev)
+		return 1;
+
+	for (i = 0; i < 4096 + sizeof(large) / sizeof(large[0]); i++) {
+		pages = i < 4096 ? i + 1 : large[i - 4096];
+		bo = fd_bo_new(dev, pages * 4096 - 100, 0);
+		if (!bo || fd_bo_size(bo) != expected_size(pages)) {
+			printf("%u pages: got %u, expected %u\n", pages,
+			       bo ? fd_bo_size(bo) : 0, expected_size(pages));
+			ret = 1;
+		}
+		if (bo)
+			fd_bo_del(bo);
+	}
+
+	/* An empty bo takes a page, one too large for the buckets doesn't
+	 * wrap around to a small one.
+	 */
+	bo = fd_bo_new(dev, 0, 0);
+	ret |= !bo || fd_bo_size(bo) != 4096;
+	if (bo)
+		fd_bo_del(bo);
+	bo = fd_bo_new(dev, UINT32_MAX, 0);
+	ret |= bo != NULL;
+
+	fd_device_del(dev);
+	if (ret)
+		printf("size classes broken\n");
+	return ret;
+}
+
+static int test_flags_and_purge(void)
+{
+	struct fd_device *dev = fd_device_new(FAKE_FD);
+	struct fd_bo *a, *b;
+	uint32_t handle;
+	int ret = 0;
+
+	if (!dev)
+		return 1;
+
+	/* Only bo's with the same flags are reused. */
+	a = fd_bo_new(dev, 65536, DRM_FREEDRENO_GEM_CACHE_WCOMBINE);
+	handle = fd_bo_handle(a);
+	fd_bo_del(a);
+	ret |= !bos[handle].dontneed;
+
+	b = fd_bo_new(dev, 65536, DRM_FREEDRENO_GEM_GPUREADONLY);
+	ret |= fd_bo_handle(b) == handle;
+	a = fd_bo_new(dev, 65536, DRM_FREEDRENO_GEM_CACHE_WCOMBINE);
+	ret |= fd_bo_handle(a) != handle || bos[handle].dontneed;
+
+	/* Bo's whose pages were reclaimed are closed, not reused. */
+	fd_bo_del(a);
+	reclaim();
+	closes = 0;
+	a = fd_bo_new(dev, 65536, DRM_FREEDRENO_GEM_CACHE_WCOMBINE);
+	ret |= fd_bo_handle(a) == handle || closes != 1 || bos[handle].open;
+
+	/* Nor handed back by a lookup. */
+	handle = fd_bo_handle(a);
+	fd_bo_del(a);
+	reclaim();
+	closes = 0;
+	a = fd_bo_from_handle(dev, handle, 65536);
+	ret |= a != NULL || closes != 1;
+
+	fd_bo_del(b);
+	fd_device_del(dev);
+
+	if (ret)
+		printf("flags or purge handling broken\n");
+	return ret;
+}
+
+/* Bo's others may hold are closed when freed, never cached. */
+static int test_exported(void)
+{
+	struct fd_device *dev = fd_device_new(FAKE_FD);
+	struct fd_bo *a, *b;
+	uint32_t name;
+	int fd, ret = 0;
+
+	if (!dev)
+		return 1;
+
+	closes = 0;
+	a = fd_bo_new(dev, 65536, 0);
+	ret |= fd_bo_get_name(a, &name) != 0;
+	fd_bo_del(a);
+	ret |= closes != 1;
+
+	b = fd_bo_new(dev, 65536, 0);
+	fd = fd_bo_dmabuf(b);
+	ret |= fd < 0;
+	if (fd >= 0)
+		close(fd);
+	fd_bo_del(b);
+	ret |= closes != 2;
+
+	fd_device_del(dev);
+
+	if (ret)
+		printf("exported bo's cached\n");
+	return ret;
+}
+
+/*
+ * Three render targets a frame, each busy for a while after the frame.
+ * The MRU path reuses one set of them, LRU needs one per frame in flight.
+ */
+static int run_frames(const char *name, int for_render)
+{
+	struct fd_device *dev = fd_device_new(FAKE_FD);
+	struct fd_bo *targets[3];
+	unsigned int frame, i, sets = for_render ? 1 : GPU_LATENCY;
+	uint64_t frame_size = 0, peak = 0;
+	int ret = 0;
+
+	if (!dev)
+		return 1;
+
+	creates = 0;
+	for (frame = 0; frame < NUM_FRAMES; frame++, gpu_frame++) {
+		for (i = 0; i < 3; i++) {
+			uint32_t size = (1920 * 1080 * 4) >> i;
+
+			if (for_render)
+				targets[i] = fd_bo_new_for_render(dev, size,
+						DRM_FREEDRENO_GEM_CACHE_WCOMBINE);
+			else
+				targets[i] = fd_bo_new(dev, size,
+						DRM_FREEDRENO_GEM_CACHE_WCOMBINE);
+			if (!targets[i]) {
+				ret = 1;
+				goto out;
+			}
+			render(targets[i]);
+		}
+		if (frame == 0)
+			frame_size = resident;
+		if (resident > peak)
+			peak = resident;
+		for (i = 0; i < 3; i++)
+			fd_bo_del(targets[i]);
+	}
+
+	printf("%-28s %5u creates for %u render targets, %5.1f MB resident\n",
+	       name, creates, 3 * NUM_FRAMES, peak / 1048576.0);
+
+	if (creates != 3 * sets || peak != sets * frame_size) {
+		printf("expected %u creates, %.1f MB resident\n", 3 * sets,
+		       sets * frame_size / 1048576.0);
+		ret = 1;
+	}
+
+out:
+	fd_device_del(dev);
+	return ret;
+}
+
+/*
+ * Keeps NUM_LIVE bo's from 4KB to 4MB alive, replacing a random one at
+ * every step, and checks the cache stays within @budget.
+ */
+static int churn(const char *name, uint64_t budget)
+{
+	struct fd_device *dev = fd_device_new(FAKE_FD);
+	struct fd_bo *live[NUM_LIVE] = { NULL };
+	uint64_t held = 0, cached, peak = 0;
+	double start, elapsed;
+	unsigned int i;
+	int ret = 0;
+
+	if (!dev)
+		return 1;
+	if (budget)
+		fd_device_set_bo_cache_budget(dev, budget);
+
+	seed = 1;
+	creates = 0;
+	start = get_time();
+	for (i = 0; i < NUM_OPS; i++) {
+		struct fd_bo **bo = &live[random_u32() % NUM_LIVE];
+		uint32_t r = random_u32();
+
+		if (*bo) {
+			held -= fd_bo_size(*bo);
+			fd_bo_del(*bo);
+		}
+
+		*bo = fd_bo_new(dev, 4096 << (r % 11), 0);
+		if (!*bo) {
+			ret = 1;
+			break;
+		}
+		held += fd_bo_size(*bo);
+
+		cached = resident - held;
+		if (cached > peak)
+			peak = cached;
+	}
+	elapsed = get_time() - start;
+
+	if (budget && peak > budget) {
+		printf("cache grew to %llu bytes\n", (unsigned long long)peak);
+		ret = 1;
+	}
+
+	/* With room for all of them, only the first of each size misses. */
+	if (!budget && creates > NUM_OPS / 100) {
+		printf("%u creates without a budget\n", creates);
+		ret = 1;
+	}
+
+	printf("%-28s %5.1f%% hits, at most %5.1f MB cached, "
+	       "%.0f ns per alloc/free\n", name,
+	       100.0 * (NUM_OPS - creates) / NUM_OPS, peak / 1048576.0,
+	       elapsed * 1e9 / NUM_OPS);
+
+	for (i = 0; i < NUM_LIVE; i++)
+		if (live[i])
+			fd_bo_del(live[i]);
+	fd_device_del(dev);
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_sizes();
+	ret |= test_flags_and_purge();
+	ret |= test_exported();
+
+	ret |= run_frames("render targets, LRU:", 0);
+	ret |= run_frames("render targets, MRU:", 1);
+
+	ret |= churn("4KB to 4MB, unlimited:", 0);
+	ret |= churn("4KB to 4MB, 16MB budget:", 16 << 20);
+
+	/* Everything the cache held was closed with the devices. */
+	ret |= resident != 0;
+
+	return ret;
+}
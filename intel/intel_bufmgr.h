@@ -178,6 +178,23 @@ void drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr,
 					     int limit);
+int drm_intel_bufmgr_gem_set_bo_cache_buckets(drm_intel_bufmgr *bufmgr,
+					      int buckets_per_pot,
+					      unsigned long max_size);
+void drm_intel_bufmgr_gem_set_bo_cache_budget(drm_intel_bufmgr *bufmgr,
+					      uint64_t max_bytes);
+
+typedef struct _drm_intel_bo_cache_stats {
+	unsigned long size;	/* of the buffers in this bucket */
+	unsigned int count;	/* buffers currently cached */
+	uint64_t hits;		/* allocations served from the cache */
+	uint64_t misses;	/* allocations that found nothing to reuse */
+	uint64_t evictions;	/* buffers released without being reused */
+} drm_intel_bo_cache_stats;
+
+int drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+					 drm_intel_bo_cache_stats *stats,
+					 int max_buckets);
 int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo);
 int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo);
 int drm_intel_gem_bo_unmap_gtt(drm_intel_bo *bo);
@@ -257,7 +274,38 @@ void drm_intel_decode_set_dump_past_end(struct drm_intel_decode *ctx,
 void drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 				    uint32_t head, uint32_t tail);
 void drm_intel_decode_set_output_file(struct drm_intel_decode *ctx, FILE *out);
+
+struct drm_intel_decode_field {
+	/** Dword within the packet, or -1 for a diagnostic */
+	int index;
+	uint32_t value;
+	/** Decoded text, including any diagnostics that followed it */
+	const char *text;
+};
+
+struct drm_intel_decode_record {
+	/** GPU address of the packet */
+	uint32_t offset;
+	/** Header dword, which holds the opcode */
+	uint32_t opcode;
+	const char *name;
+	/** Length of the packet in dwords */
+	uint32_t length;
+	const struct drm_intel_decode_field *fields;
+	int num_fields;
+};
+
+typedef void (*drm_intel_decode_record_func)(void *data,
+					     const struct drm_intel_decode_record *record);
+
+void drm_intel_decode_set_record_sink(struct drm_intel_decode *ctx,
+				      drm_intel_decode_record_func func,
+				      void *data);
 void drm_intel_decode(struct drm_intel_decode *ctx);
+int drm_intel_decode_set_batch_file(struct drm_intel_decode *ctx, int fd,
+				    uint32_t hw_offset);
+int drm_intel_decode_chunk(struct drm_intel_decode *ctx, const void *data,
+			   uint32_t hw_offset, uint32_t count);
 
 int drm_intel_reg_read(drm_intel_bufmgr *bufmgr,
 		       uint32_t offset,
@@ -110,6 +110,20 @@ struct block {
 	void *virtual;
 };
 
+/**
+ * A stretch of the aperture, as seen by the eviction planner: either free
+ * space or a single block.
+ */
+struct evict_range {
+	unsigned int ofs, end;
+	/** The block occupying the range, NULL for free space. */
+	struct block *block;
+	/** Weighted bytes that evicting the block costs. */
+	uint64_t cost;
+	/** Set if the block can't be evicted right now. */
+	int busy;
+};
+
 typedef struct _bufmgr_fake {
 	drm_intel_bufmgr bufmgr;
 
@@ -145,6 +159,11 @@ typedef struct _bufmgr_fake {
 	unsigned need_fence:1;
 	int thrashing;
 
+	/** Scratch space for plan_eviction(), grown as needed. */
+	struct block **evict_blocks;
+	struct evict_range *evict_ranges;
+	int evict_size;
+
 	/**
 	 * Driver callback to emit a fence, returning the cookie.
 	 *
@@ -535,56 +554,6 @@ set_dirty(drm_intel_bo *bo)
 	bo_fake->dirty = 1;
 }
 
-static int
-evict_lru(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int max_fence)
-{
-	struct block *block, *tmp;
-
-	DBG("%s\n", __func__);
-
-	DRMLISTFOREACHSAFE(block, tmp, &bufmgr_fake->lru) {
-		drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
-
-		if (bo_fake != NULL && (bo_fake->flags & BM_NO_FENCE_SUBDATA))
-			continue;
-
-		if (block->fence && max_fence && !FENCE_LTE(block->fence,
-							    max_fence))
-			return 0;
-
-		set_dirty(&bo_fake->bo);
-		bo_fake->block = NULL;
-
-		free_block(bufmgr_fake, block, 0);
-		return 1;
-	}
-
-	return 0;
-}
-
-static int
-evict_mru(drm_intel_bufmgr_fake *bufmgr_fake)
-{
-	struct block *block, *tmp;
-
-	DBG("%s\n", __func__);
-
-	DRMLISTFOREACHSAFEREVERSE(block, tmp, &bufmgr_fake->lru) {
-		drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
-
-		if (bo_fake && (bo_fake->flags & BM_NO_FENCE_SUBDATA))
-			continue;
-
-		set_dirty(&bo_fake->bo);
-		bo_fake->block = NULL;
-
-		free_block(bufmgr_fake, block, 0);
-		return 1;
-	}
-
-	return 0;
-}
-
 /**
  * Removes all objects from the fenced list older than the given fence.
  */
@@ -653,6 +622,212 @@ fence_blocks(drm_intel_bufmgr_fake *bufmgr_fake, unsigned fence)
 	assert(DRMLISTEMPTY(&bufmgr_fake->on_hardware));
 }
 
+/* Fences after which an idle block costs half as much to evict. */
+#define EVICT_AGE_HALF	8
+
+/**
+ * What evicting an idle block costs: the bytes that have to be uploaded
+ * again when it is next used (or regenerated, without backing store), plus
+ * those copied out now if the card wrote to it.  With @use_age, blocks
+ * whose last fence is older are cheaper, since they are less likely to be
+ * needed again soon.
+ */
+static uint64_t
+evict_cost(drm_intel_bufmgr_fake *bufmgr_fake, struct block *block,
+	   int use_age)
+{
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
+	uint64_t cost = 0;
+	unsigned int age;
+
+	if (!bo_fake->dirty)
+		cost += block->bo->size;
+	if (bo_fake->card_dirty && !(bo_fake->flags & BM_NO_BACKING_STORE))
+		cost += block->bo->size;
+
+	if (use_age && block->fence &&
+	    FENCE_LTE(block->fence, bufmgr_fake->last_fence)) {
+		age = bufmgr_fake->last_fence - block->fence;
+		cost = cost * EVICT_AGE_HALF / (EVICT_AGE_HALF + age);
+	}
+
+	return cost;
+}
+
+static int
+compare_block_offsets(const void *a, const void *b)
+{
+	const struct block *block_a = *(struct block * const *)a;
+	const struct block *block_b = *(struct block * const *)b;
+
+	return block_a->mem->ofs < block_b->mem->ofs ? -1 :
+	       block_a->mem->ofs > block_b->mem->ofs;
+}
+
+static int
+count_blocks(struct block *list)
+{
+	struct block *block;
+	int count = 0;
+
+	DRMLISTFOREACH(block, list)
+		count++;
+
+	return count;
+}
+
+/**
+ * Finds the cheapest run of free space and idle blocks that holds @size
+ * bytes at @alignment, and stores its first and last index in
+ * evict_ranges.  Returns 0 if there is none, even with every idle block
+ * evicted.
+ */
+static int
+plan_eviction(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int size,
+	      unsigned int alignment, int use_age, int *first, int *last)
+{
+	struct evict_range *ranges;
+	struct block **blocks, *block;
+	unsigned int ofs, start;
+	uint64_t cost, best_cost = UINT64_MAX;
+	int count, n, i, j;
+
+	count = count_blocks(&bufmgr_fake->lru) +
+		count_blocks(&bufmgr_fake->on_hardware) +
+		count_blocks(&bufmgr_fake->fenced);
+
+	if (2 * count + 1 > bufmgr_fake->evict_size) {
+		int new_size = 2 * (2 * count + 1);
+
+		blocks = realloc(bufmgr_fake->evict_blocks,
+				 new_size * sizeof(*blocks));
+		if (!blocks)
+			return 0;
+		bufmgr_fake->evict_blocks = blocks;
+
+		ranges = realloc(bufmgr_fake->evict_ranges,
+				 new_size * sizeof(*ranges));
+		if (!ranges)
+			return 0;
+		bufmgr_fake->evict_ranges = ranges;
+
+		bufmgr_fake->evict_size = new_size;
+	}
+	blocks = bufmgr_fake->evict_blocks;
+	ranges = bufmgr_fake->evict_ranges;
+
+	n = 0;
+	DRMLISTFOREACH(block, &bufmgr_fake->lru)
+		blocks[n++] = block;
+	DRMLISTFOREACH(block, &bufmgr_fake->on_hardware)
+		blocks[n++] = block;
+	DRMLISTFOREACH(block, &bufmgr_fake->fenced)
+		blocks[n++] = block;
+	qsort(blocks, count, sizeof(*blocks), compare_block_offsets);
+
+	/* Lay the aperture out in address order, gaps included. */
+	n = 0;
+	ofs = bufmgr_fake->low_offset;
+	for (i = 0; i <= count; i++) {
+		unsigned int end = i < count ?
+			(unsigned int)blocks[i]->mem->ofs :
+			(unsigned int)(bufmgr_fake->low_offset +
+				       bufmgr_fake->size);
+
+		if (end > ofs) {
+			ranges[n].ofs = ofs;
+			ranges[n].end = end;
+			ranges[n].block = NULL;
+			ranges[n].cost = 0;
+			ranges[n].busy = 0;
+			n++;
+		}
+		if (i == count)
+			break;
+
+		block = blocks[i];
+		ranges[n].ofs = block->mem->ofs;
+		ranges[n].end = block->mem->ofs + block->mem->size;
+		ranges[n].block = block;
+		ranges[n].busy = block->on_hardware || block->fenced ||
+			!block->bo ||
+			(((drm_intel_bo_fake *) block->bo)->flags &
+			 BM_NO_FENCE_SUBDATA);
+		ranges[n].cost = ranges[n].busy ? 0 :
+			evict_cost(bufmgr_fake, block, use_age);
+		ofs = ranges[n].end;
+		n++;
+	}
+
+	/* Slide a window [i, j) over the runs of evictable ranges: for each
+	 * i, j is the first range past the end of an allocation aligned
+	 * from the start of i.  Both only move forward.
+	 */
+	cost = 0;
+	for (i = 0, j = 0; i < n; i++) {
+		if (ranges[i].busy) {
+			j = i + 1;
+			cost = 0;
+			continue;
+		}
+
+		start = ALIGN(ranges[i].ofs, alignment);
+		while (j < n && !ranges[j].busy &&
+		       (j == i || ranges[j - 1].end < start + size)) {
+			cost += ranges[j].cost;
+			j++;
+		}
+
+		if (ranges[j - 1].end >= start + size && cost < best_cost) {
+			best_cost = cost;
+			*first = i;
+			*last = j - 1;
+		}
+
+		cost -= ranges[i].cost;
+	}
+
+	return best_cost != UINT64_MAX;
+}
+
+/**
+ * Evicts the cheapest run of idle blocks that leaves room for @bo, all
+ * at once, and allocates it there.
+ */
+static int
+evict_range_and_alloc_block(drm_intel_bo *bo, int use_age)
+{
+	drm_intel_bufmgr_fake *bufmgr_fake =
+	    (drm_intel_bufmgr_fake *) bo->bufmgr;
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) bo;
+	unsigned int sz = ALIGN(bo->size, bo_fake->alignment);
+	int first, last, i;
+
+	if (!plan_eviction(bufmgr_fake, sz, bo_fake->alignment, use_age,
+			   &first, &last))
+		return 0;
+
+	DBG("%s: evicting 0x%x-0x%x\n", __func__,
+	    bufmgr_fake->evict_ranges[first].ofs,
+	    bufmgr_fake->evict_ranges[last].end);
+
+	for (i = first; i <= last; i++) {
+		struct block *block = bufmgr_fake->evict_ranges[i].block;
+		drm_intel_bo_fake *victim;
+
+		if (!block)
+			continue;
+
+		victim = (drm_intel_bo_fake *) block->bo;
+		set_dirty(&victim->bo);
+		victim->block = NULL;
+
+		free_block(bufmgr_fake, block, 0);
+	}
+
+	return alloc_block(bo);
+}
+
 static int
 evict_and_alloc_block(drm_intel_bo *bo)
 {
@@ -667,14 +842,12 @@ evict_and_alloc_block(drm_intel_bo *bo)
 	if (alloc_block(bo))
 		return 1;
 
-	/* If we're not thrashing, allow lru eviction to dig deeper into
-	 * recently used textures.  We'll probably be thrashing soon:
+	/* If we're not thrashing, allow eviction to dig deeper into
+	 * recently used textures, sparing the most recent ones.  We'll
+	 * probably be thrashing soon:
 	 */
-	if (!bufmgr_fake->thrashing) {
-		while (evict_lru(bufmgr_fake, 0))
-			if (alloc_block(bo))
-				return 1;
-	}
+	if (!bufmgr_fake->thrashing && evict_range_and_alloc_block(bo, 1))
+		return 1;
 
 	/* Keep thrashing counter alive?
 	 */
@@ -708,9 +881,11 @@ evict_and_alloc_block(drm_intel_bo *bo)
 			return 1;
 	}
 
-	while (evict_mru(bufmgr_fake))
-		if (alloc_block(bo))
-			return 1;
+	/* Everything is cycling through the aperture, so recency says
+	 * little: evict whatever moves the fewest bytes.
+	 */
+	if (evict_range_and_alloc_block(bo, 0))
+		return 1;
 
 	DBG("%s 0x%lx bytes failed\n", __func__, bo->size);
 
@@ -1236,6 +1411,10 @@ drm_intel_fake_fence_validated(drm_intel_bufmgr *bufmgr)
 	cookie = _fence_emit_internal(bufmgr_fake);
 	fence_blocks(bufmgr_fake, cookie);
 
+	/* Stop thrashing once 20 batches went by without it. */
+	if (bufmgr_fake->thrashing)
+		bufmgr_fake->thrashing--;
+
 	DBG("drm_fence_validated: 0x%08x cookie\n", cookie);
 }
 
@@ -1246,6 +1425,8 @@ drm_intel_fake_destroy(drm_intel_bufmgr *bufmgr)
 
 	pthread_mutex_destroy(&bufmgr_fake->lock);
 	mmDestroy(bufmgr_fake->heap);
+	free(bufmgr_fake->evict_blocks);
+	free(bufmgr_fake->evict_ranges);
 	free(bufmgr);
 }
 
@@ -44,6 +44,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
@@ -88,6 +89,55 @@ typedef struct _drm_intel_bo_gem drm_intel_bo_gem;
 struct drm_intel_gem_bo_bucket {
 	drmMMListHead head;
 	unsigned long size;
+	unsigned int count;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/**
+ * Buffers entering the cache are marked DONTNEED in batches: either once
+ * this many are waiting, or once they add up to DRM_INTEL_GEM_MADVISE_BYTES.
+ * A buffer reused before that never needs the madvise ioctls at all.
+ */
+#define DRM_INTEL_GEM_MADVISE_BATCH 16
+#define DRM_INTEL_GEM_MADVISE_BYTES (16 * 1024 * 1024)
+
+/**
+ * Buffers of up to DRM_INTEL_GEM_MAGAZINE_MAX_SIZE are recycled through a
+ * small per-thread stack for each bucket, a magazine, before they reach
+ * the shared cache, so that allocating and freeing a small buffer takes
+ * no lock.  An empty magazine is refilled with up to half a magazine from
+ * the shared bucket, and a full one gives its older half back, each under
+ * a single lock.
+ *
+ * Buffers sitting in magazines are never marked DONTNEED, don't expire and
+ * don't count against the cache budget; there are at most
+ * DRM_INTEL_GEM_MAGAZINE_SIZE of them per bucket and thread.
+ *
+ * Only the owning thread touches a magazine without the lock.  It copies
+ * its counters to the published ones whenever it takes the lock anyway,
+ * and drm_intel_bufmgr_gem_get_cache_stats() reports those.
+ */
+#define DRM_INTEL_GEM_MAGAZINE_SIZE 8
+#define DRM_INTEL_GEM_MAGAZINE_BUCKETS 16
+#define DRM_INTEL_GEM_MAGAZINE_MAX_SIZE (64 * 1024)
+
+struct drm_intel_gem_bo_magazine {
+	drm_intel_bo_gem *bos[DRM_INTEL_GEM_MAGAZINE_SIZE];
+	int count;
+	uint64_t hits;
+
+	/** Copies of count and hits, protected by bufmgr_gem->lock */
+	int published_count;
+	uint64_t published_hits;
+};
+
+struct drm_intel_gem_thread_cache {
+	/** Link in bufmgr_gem->thread_caches */
+	drmMMListHead link;
+	struct _drm_intel_bufmgr_gem *bufmgr_gem;
+	struct drm_intel_gem_bo_magazine magazines[DRM_INTEL_GEM_MAGAZINE_BUCKETS];
 };
 
 typedef struct _drm_intel_bufmgr_gem {
@@ -107,14 +157,53 @@ typedef struct _drm_intel_bufmgr_gem {
 	int exec_size;
 	int exec_count;
 
-	/** Array of lists of cached gem objects of power-of-two sizes */
-	struct drm_intel_gem_bo_bucket cache_bucket[14 * 4];
+	/**
+	 * Array of lists of cached gem objects, see
+	 * drm_intel_gem_bo_bucket_index() for the sizes.  The schedule is
+	 * fixed once the first buffer has been allocated, after which the
+	 * array is looked up without the lock.
+	 */
+	struct drm_intel_gem_bo_bucket *cache_bucket;
 	int num_buckets;
+	int bucket_shift;
+	/* Set under the lock, read without it by allocation */
+	atomic_t cache_bucket_fixed;
 	time_t time;
 
+	/**
+	 * All cached buffers, least recently freed first.  The ones not
+	 * yet marked DONTNEED are always at the tail.
+	 */
+	drmMMListHead cache_lru;
+	uint64_t cache_size;
+	uint64_t cache_max_size;
+	uint64_t cache_unadvised_size;
+	int cache_unadvised;
+
+	/**
+	 * Per-thread magazines, keyed by thread_cache_key.  They index
+	 * cache_bucket, which is fixed by the time the first one is filled.
+	 *
+	 * Threads may still be exiting when the bufmgr is destroyed, so the
+	 * lock, the key and this struct stay around until the last thread
+	 * cache is gone.  thread_caches_orphaned is set once destroy took
+	 * the magazines back, thread_caches_released once it is done with
+	 * everything else; whoever then unlinks the last cache frees them.
+	 */
+	pthread_key_t thread_cache_key;
+	drmMMListHead thread_caches;
+	bool has_thread_caches;
+	bool thread_caches_orphaned;
+	bool thread_caches_released;
+
 	drmMMListHead managers;
 
-	drmMMListHead named;
+	/**
+	 * Flinked and prime imported or exported buffers, by global name
+	 * and by gem handle, so that each kernel object gets a single bo.
+	 */
+	void *name_table;
+	void *handle_table;
 	drmMMListHead vma_cache;
 	int vma_count, vma_open, vma_max;
 
@@ -131,6 +220,11 @@ typedef struct _drm_intel_bufmgr_gem {
 	unsigned int no_exec : 1;
 	unsigned int has_vebox : 1;
 	bool fenced_relocs;
+	/* Cleared, under the lock, once a kernel rejected I915_EXEC_NO_RELOC
+	 * or EXEC_OBJECT_WRITE; kept out of the bitfield so that doing so
+	 * can't race with writers of its neighbours.
+	 */
+	bool has_exec_no_reloc;
 
 	struct {
 		void *ptr;
@@ -155,11 +249,8 @@ struct _drm_intel_bo_gem {
 
 	/**
 	 * Kenel-assigned global name for this object
-         *
-         * List contains both flink named and prime fd'd objects
 	 */
 	unsigned int global_name;
-	drmMMListHead name_list;
 
 	/**
 	 * Index of the buffer within the validation list while preparing a
@@ -198,6 +289,8 @@ struct _drm_intel_bo_gem {
 
 	/** BO cache list */
 	drmMMListHead head;
+	/** Link in bufmgr_gem->cache_lru while in the BO cache */
+	drmMMListHead lru;
 
 	/**
 	 * Boolean of whether this BO and its children have been included in
@@ -236,6 +329,11 @@ struct _drm_intel_bo_gem {
 	 */
 	bool is_userptr;
 
+	/**
+	 * Boolean of whether this cached buffer has been marked DONTNEED
+	 */
+	bool purgeable;
+
 	/**
 	 * Size in bytes of this buffer and its relocation descendents.
 	 *
@@ -272,6 +370,8 @@ drm_intel_gem_bo_set_tiling_internal(drm_intel_bo *bo,
 static void drm_intel_gem_bo_unreference_locked_timed(drm_intel_bo *bo,
 						      time_t time);
 
+static void drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time);
+
 static void drm_intel_gem_bo_unreference(drm_intel_bo *bo);
 
 static void drm_intel_gem_bo_free(drm_intel_bo *bo);
@@ -363,21 +463,48 @@ drm_intel_gem_bo_tile_pitch(drm_intel_bufmgr_gem *bufmgr_gem,
 	return i;
 }
 
+/**
+ * Returns the index of the smallest cache bucket holding at least @pages
+ * pages, and its size in pages.
+ *
+ * Bucket sizes are spaced like floating point numbers with @shift mantissa
+ * bits: every size up to 2^shift pages has a bucket of its own, and every
+ * further power of two is split into 2^shift evenly spaced sizes.  With
+ * shift = 2 that gives 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20... pages.
+ */
+static int
+drm_intel_gem_bo_bucket_index(int shift, unsigned long pages,
+			      unsigned long *bucket_pages)
+{
+	unsigned long q;
+	int order;
+
+	if (pages <= 1UL << shift) {
+		*bucket_pages = pages ? pages : 1;
+		return *bucket_pages - 1;
+	}
+
+	/* Round pages - 1 down to (shift + 1) significant bits, then up. */
+	order = sizeof(long) * 8 - 1 - __builtin_clzl(pages - 1);
+	q = ((pages - 1) >> (order - shift)) + 1;
+	*bucket_pages = q << (order - shift);
+
+	return ((order - shift) << shift) + q - 1;
+}
+
 static struct drm_intel_gem_bo_bucket *
 drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 				 unsigned long size)
 {
+	unsigned long pages;
 	int i;
 
-	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
-		struct drm_intel_gem_bo_bucket *bucket =
-		    &bufmgr_gem->cache_bucket[i];
-		if (bucket->size >= size) {
-			return bucket;
-		}
-	}
+	i = drm_intel_gem_bo_bucket_index(bufmgr_gem->bucket_shift,
+					  (size + 4095) / 4096, &pages);
+	if (i >= bufmgr_gem->num_buckets)
+		return NULL;
 
-	return NULL;
+	return &bufmgr_gem->cache_bucket[i];
 }
 
 static void
@@ -467,17 +594,32 @@ drm_intel_add_validate_buffer(drm_intel_bo *bo)
 	bufmgr_gem->exec_count++;
 }
 
+/**
+ * Adds the given buffer to the execbuffer2 validation list.
+ *
+ * Each entry carries the offset the buffer was last seen at, which is what
+ * the relocations pointing at it were written with, so that the kernel can
+ * skip relocation processing when nothing moved (I915_EXEC_NO_RELOC).  As
+ * the kernel then never sees the write domains of the relocations, buffers
+ * written through one are flagged EXEC_OBJECT_WRITE.
+ */
 static void
-drm_intel_add_validate_buffer2(drm_intel_bo *bo, int need_fence)
+drm_intel_add_validate_buffer2(drm_intel_bo *bo, int need_fence, int write)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 	int index;
 
+	if (!bufmgr_gem->has_exec_no_reloc)
+		write = 0;
+
 	if (bo_gem->validate_index != -1) {
 		if (need_fence)
 			bufmgr_gem->exec2_objects[bo_gem->validate_index].flags |=
 				EXEC_OBJECT_NEEDS_FENCE;
+		if (write)
+			bufmgr_gem->exec2_objects[bo_gem->validate_index].flags |=
+				EXEC_OBJECT_WRITE;
 		return;
 	}
 
@@ -504,7 +646,7 @@ drm_intel_add_validate_buffer2(drm_intel_bo *bo, int need_fence)
 	bufmgr_gem->exec2_objects[index].relocation_count = bo_gem->reloc_count;
 	bufmgr_gem->exec2_objects[index].relocs_ptr = (uintptr_t)bo_gem->relocs;
 	bufmgr_gem->exec2_objects[index].alignment = bo->align;
-	bufmgr_gem->exec2_objects[index].offset = 0;
+	bufmgr_gem->exec2_objects[index].offset = bo->offset64;
 	bufmgr_gem->exec_bos[index] = bo;
 	bufmgr_gem->exec2_objects[index].flags = 0;
 	bufmgr_gem->exec2_objects[index].rsvd1 = 0;
@@ -513,9 +655,33 @@ drm_intel_add_validate_buffer2(drm_intel_bo *bo, int need_fence)
 		bufmgr_gem->exec2_objects[index].flags |=
 			EXEC_OBJECT_NEEDS_FENCE;
 	}
+	if (write)
+		bufmgr_gem->exec2_objects[index].flags |= EXEC_OBJECT_WRITE;
 	bufmgr_gem->exec_count++;
 }
 
+/**
+ * Drops I915_EXEC_NO_RELOC and EXEC_OBJECT_WRITE from an execbuffer2 call,
+ * returning whether it used either of them.
+ */
+static bool
+drm_intel_gem_strip_no_reloc(drm_intel_bufmgr_gem *bufmgr_gem,
+			     struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	bool used = execbuf->flags & I915_EXEC_NO_RELOC;
+	int i;
+
+	execbuf->flags &= ~I915_EXEC_NO_RELOC;
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		if (bufmgr_gem->exec2_objects[i].flags & EXEC_OBJECT_WRITE) {
+			bufmgr_gem->exec2_objects[i].flags &= ~EXEC_OBJECT_WRITE;
+			used = true;
+		}
+	}
+
+	return used;
+}
+
 #define RELOC_BUF_SIZE(x) ((I915_RELOC_HEADER + x * I915_RELOC0_STRIDE) * \
 	sizeof(uint32_t))
 
@@ -633,6 +799,94 @@ drm_intel_gem_bo_madvise(drm_intel_bo *bo, int madv)
 		 madv);
 }
 
+static void
+drm_intel_gem_bo_cache_remove(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	struct drm_intel_gem_bo_bucket *bucket =
+	    drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+
+	DRMLISTDEL(&bo_gem->head);
+	DRMLISTDEL(&bo_gem->lru);
+	bucket->count--;
+	bufmgr_gem->cache_size -= bo_gem->bo.size;
+
+	if (!bo_gem->purgeable) {
+		bufmgr_gem->cache_unadvised--;
+		bufmgr_gem->cache_unadvised_size -= bo_gem->bo.size;
+	}
+}
+
+static void
+drm_intel_gem_bo_cache_evict(drm_intel_bufmgr_gem *bufmgr_gem,
+			     drm_intel_bo_gem *bo_gem)
+{
+	struct drm_intel_gem_bo_bucket *bucket =
+	    drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+
+	bucket->evictions++;
+	drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
+	drm_intel_gem_bo_free(&bo_gem->bo);
+}
+
+/* Marks the buffers waiting at the tail of the LRU DONTNEED. */
+static void
+drm_intel_gem_bo_cache_advise(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	drmMMListHead *pos = bufmgr_gem->cache_lru.prev;
+
+	while (pos != &bufmgr_gem->cache_lru) {
+		drm_intel_bo_gem *bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+							pos, lru);
+
+		if (bo_gem->purgeable)
+			break;
+
+		pos = pos->prev;
+		if (drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+						      I915_MADV_DONTNEED)) {
+			bo_gem->purgeable = true;
+			bufmgr_gem->cache_unadvised--;
+			bufmgr_gem->cache_unadvised_size -= bo_gem->bo.size;
+		} else {
+			drm_intel_gem_bo_cache_evict(bufmgr_gem, bo_gem);
+		}
+	}
+}
+
+/* Evicts the least recently freed buffers until the cache fits in @size. */
+static void
+drm_intel_gem_bo_cache_shrink(drm_intel_bufmgr_gem *bufmgr_gem, uint64_t size)
+{
+	while (bufmgr_gem->cache_size > size) {
+		drm_intel_bo_gem *bo_gem;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bufmgr_gem->cache_lru.next, lru);
+		drm_intel_gem_bo_cache_evict(bufmgr_gem, bo_gem);
+	}
+}
+
+static void
+drm_intel_gem_bo_cache_add(drm_intel_bufmgr_gem *bufmgr_gem,
+			   struct drm_intel_gem_bo_bucket *bucket,
+			   drm_intel_bo_gem *bo_gem)
+{
+	bo_gem->purgeable = false;
+	DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+	DRMLISTADDTAIL(&bo_gem->lru, &bufmgr_gem->cache_lru);
+	bucket->count++;
+	bufmgr_gem->cache_size += bo_gem->bo.size;
+	bufmgr_gem->cache_unadvised++;
+	bufmgr_gem->cache_unadvised_size += bo_gem->bo.size;
+
+	drm_intel_gem_bo_cache_shrink(bufmgr_gem, bufmgr_gem->cache_max_size);
+
+	if (bufmgr_gem->cache_unadvised >= DRM_INTEL_GEM_MADVISE_BATCH ||
+	    bufmgr_gem->cache_unadvised_size >= DRM_INTEL_GEM_MADVISE_BYTES)
+		drm_intel_gem_bo_cache_advise(bufmgr_gem);
+}
+
 /* drop the oldest entries that have been purged by the kernel */
 static void
 drm_intel_gem_bo_cache_purge_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
@@ -643,13 +897,225 @@ drm_intel_gem_bo_cache_purge_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
 
 		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
 				      bucket->head.next, head);
-		if (drm_intel_gem_bo_madvise_internal
+		if (!bo_gem->purgeable ||
+		    drm_intel_gem_bo_madvise_internal
 		    (bufmgr_gem, bo_gem, I915_MADV_DONTNEED))
 			break;
 
-		DRMLISTDEL(&bo_gem->head);
+		drm_intel_gem_bo_cache_evict(bufmgr_gem, bo_gem);
+	}
+}
+
+/* Frees every buffer held in @tc's magazines.  Called with the lock held. */
+static void
+drm_intel_gem_thread_cache_free(struct drm_intel_gem_thread_cache *tc)
+{
+	int i;
+
+	for (i = 0; i < DRM_INTEL_GEM_MAGAZINE_BUCKETS; i++) {
+		struct drm_intel_gem_bo_magazine *mag = &tc->magazines[i];
+
+		while (mag->count > 0)
+			drm_intel_gem_bo_free(&mag->bos[--mag->count]->bo);
+		mag->hits = 0;
+	}
+}
+
+/* Makes @mag's counters visible to other threads.  Called with the lock held. */
+static void
+drm_intel_gem_bo_magazine_publish(struct drm_intel_gem_bo_magazine *mag)
+{
+	mag->published_count = mag->count;
+	mag->published_hits = mag->hits;
+}
+
+/*
+ * Moves the @count oldest buffers of @mag back into the shared cache.
+ * Called with the lock held.
+ */
+static void
+drm_intel_gem_bo_magazine_drain(drm_intel_bufmgr_gem *bufmgr_gem,
+				struct drm_intel_gem_bo_bucket *bucket,
+				struct drm_intel_gem_bo_magazine *mag,
+				int count, time_t time)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		mag->bos[i]->free_time = time;
+		drm_intel_gem_bo_cache_add(bufmgr_gem, bucket, mag->bos[i]);
+	}
+
+	mag->count -= count;
+	memmove(mag->bos, mag->bos + count, mag->count * sizeof(mag->bos[0]));
+	drm_intel_gem_bo_magazine_publish(mag);
+}
+
+/*
+ * Refills an empty magazine with the most recently freed buffers of
+ * @bucket that are not marked DONTNEED yet, as those need no ioctl to be
+ * reused.  Called with the lock held.
+ */
+static void
+drm_intel_gem_bo_magazine_refill(drm_intel_bufmgr_gem *bufmgr_gem,
+				 struct drm_intel_gem_bo_bucket *bucket,
+				 struct drm_intel_gem_bo_magazine *mag)
+{
+	int n = DRM_INTEL_GEM_MAGAZINE_SIZE / 2;
+
+	if (mag->count > 0) {
+		drm_intel_gem_bo_magazine_publish(mag);
+		return;
+	}
+
+	/* Keep the most recently freed buffer on top of the stack. */
+	while (n > 0 && !DRMLISTEMPTY(&bucket->head)) {
+		drm_intel_bo_gem *bo_gem;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bucket->head.prev, head);
+		if (bo_gem->purgeable)
+			break;
+
+		drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
+		mag->bos[--n] = bo_gem;
+	}
+
+	mag->count = DRM_INTEL_GEM_MAGAZINE_SIZE / 2 - n;
+	memmove(mag->bos, mag->bos + n, mag->count * sizeof(mag->bos[0]));
+	drm_intel_gem_bo_magazine_publish(mag);
+}
+
+/* Frees what a destroyed bufmgr kept for its thread caches. */
+static void
+drm_intel_gem_thread_caches_fini(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	pthread_key_delete(bufmgr_gem->thread_cache_key);
+	pthread_mutex_destroy(&bufmgr_gem->lock);
+	free(bufmgr_gem);
+}
+
+/*
+ * pthread key destructor: gives the magazines of an exiting thread back,
+ * unless the bufmgr is being destroyed, which took them already.
+ */
+static void
+drm_intel_gem_thread_cache_destroy(void *data)
+{
+	struct drm_intel_gem_thread_cache *tc = data;
+	drm_intel_bufmgr_gem *bufmgr_gem = tc->bufmgr_gem;
+	struct timespec time;
+	bool last;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+
+	for (i = 0; i < DRM_INTEL_GEM_MAGAZINE_BUCKETS; i++) {
+		struct drm_intel_gem_bo_magazine *mag = &tc->magazines[i];
+
+		if (bufmgr_gem->thread_caches_orphaned ||
+		    i >= bufmgr_gem->num_buckets)
+			break;
+
+		bufmgr_gem->cache_bucket[i].hits += mag->hits;
+		drm_intel_gem_bo_magazine_drain(bufmgr_gem,
+						&bufmgr_gem->cache_bucket[i],
+						mag, mag->count, time.tv_sec);
+	}
+	drm_intel_gem_thread_cache_free(tc);
+	DRMLISTDEL(&tc->link);
+	last = bufmgr_gem->thread_caches_released &&
+	       DRMLISTEMPTY(&bufmgr_gem->thread_caches);
+
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	free(tc);
+	if (last)
+		drm_intel_gem_thread_caches_fini(bufmgr_gem);
+}
+
+/*
+ * Returns the calling thread's magazine for @bucket, or NULL if buffers of
+ * that size go straight to the shared cache.
+ */
+static struct drm_intel_gem_bo_magazine *
+drm_intel_gem_bo_magazine_for_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
+				     struct drm_intel_gem_bo_bucket *bucket)
+{
+	struct drm_intel_gem_thread_cache *tc;
+	int i;
+
+	if (!bufmgr_gem->has_thread_caches || !bufmgr_gem->bo_reuse ||
+	    bucket == NULL || bucket->size > DRM_INTEL_GEM_MAGAZINE_MAX_SIZE)
+		return NULL;
+
+	i = bucket - bufmgr_gem->cache_bucket;
+	if (i >= DRM_INTEL_GEM_MAGAZINE_BUCKETS)
+		return NULL;
+
+	tc = pthread_getspecific(bufmgr_gem->thread_cache_key);
+	if (tc != NULL)
+		return &tc->magazines[i];
+
+	tc = calloc(1, sizeof(*tc));
+	if (tc == NULL)
+		return NULL;
+
+	if (pthread_setspecific(bufmgr_gem->thread_cache_key, tc)) {
+		free(tc);
+		return NULL;
+	}
+
+	tc->bufmgr_gem = bufmgr_gem;
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	DRMLISTADD(&tc->link, &bufmgr_gem->thread_caches);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return &tc->magazines[i];
+}
+
+/*
+ * Takes a buffer out of the calling thread's magazine, following the same
+ * policy as the shared buckets: the most recently freed buffer for render
+ * targets, the oldest one if it is idle otherwise.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_magazine_get(drm_intel_bufmgr_gem *bufmgr_gem,
+			      struct drm_intel_gem_bo_magazine *mag,
+			      bool for_render,
+			      uint32_t tiling_mode,
+			      unsigned long stride)
+{
+	drm_intel_bo_gem *bo_gem;
+
+	while (mag->count > 0) {
+		if (for_render) {
+			bo_gem = mag->bos[--mag->count];
+		} else {
+			bo_gem = mag->bos[0];
+			if (drm_intel_gem_bo_busy(&bo_gem->bo))
+				return NULL;
+
+			mag->count--;
+			memmove(mag->bos, mag->bos + 1,
+				mag->count * sizeof(mag->bos[0]));
+		}
+
+		if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
+							 tiling_mode,
+							 stride) == 0) {
+			mag->hits++;
+			return bo_gem;
+		}
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
 		drm_intel_gem_bo_free(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 	}
+
+	return NULL;
 }
 
 static drm_intel_bo *
@@ -666,6 +1132,7 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 	unsigned int page_size = getpagesize();
 	int ret;
 	struct drm_intel_gem_bo_bucket *bucket;
+	struct drm_intel_gem_bo_magazine *mag;
 	bool alloc_from_cache;
 	unsigned long bo_size;
 	bool for_render = false;
@@ -673,6 +1140,13 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 	if (flags & BO_ALLOC_FOR_RENDER)
 		for_render = true;
 
+	/* Once this is set under the lock, the buckets never change. */
+	if (!atomic_read(&bufmgr_gem->cache_bucket_fixed)) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		atomic_set(&bufmgr_gem->cache_bucket_fixed, 1);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
 	/* Round the allocated size up to a power of two number of pages. */
 	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, size);
 
@@ -687,6 +1161,18 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 		bo_size = bucket->size;
 	}
 
+	/* Try the calling thread's magazine first, which needs no lock. */
+	mag = drm_intel_gem_bo_magazine_for_bucket(bufmgr_gem, bucket);
+	if (mag != NULL) {
+		bo_gem = drm_intel_gem_bo_magazine_get(bufmgr_gem, mag,
+						       for_render,
+						       tiling_mode, stride);
+		if (bo_gem != NULL) {
+			bo_gem->bo.align = alignment;
+			goto init;
+		}
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	/* Get a buffer out of the cache if available */
 retry:
@@ -699,7 +1185,7 @@ retry:
 			 */
 			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
 					      bucket->head.prev, head);
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
 			alloc_from_cache = true;
 			bo_gem->bo.align = alignment;
 		} else {
@@ -715,13 +1201,16 @@ retry:
 					      bucket->head.next, head);
 			if (!drm_intel_gem_bo_busy(&bo_gem->bo)) {
 				alloc_from_cache = true;
-				DRMLISTDEL(&bo_gem->head);
+				drm_intel_gem_bo_cache_remove(bufmgr_gem,
+							      bo_gem);
 			}
 		}
 
 		if (alloc_from_cache) {
-			if (!drm_intel_gem_bo_madvise_internal
+			if (bo_gem->purgeable &&
+			    !drm_intel_gem_bo_madvise_internal
 			    (bufmgr_gem, bo_gem, I915_MADV_WILLNEED)) {
+				bucket->evictions++;
 				drm_intel_gem_bo_free(&bo_gem->bo);
 				drm_intel_gem_bo_cache_purge_bucket(bufmgr_gem,
 								    bucket);
@@ -736,6 +1225,12 @@ retry:
 			}
 		}
 	}
+	if (alloc_from_cache)
+		bucket->hits++;
+	else if (bucket != NULL)
+		bucket->misses++;
+	if (mag != NULL)
+		drm_intel_gem_bo_magazine_refill(bufmgr_gem, bucket, mag);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	if (!alloc_from_cache) {
@@ -768,7 +1263,6 @@ retry:
 
 		/* drm_intel_gem_bo_free calls DRMLISTDEL() for an uninitialized
 		   list (vma_list), so better set the list head here */
-		DRMINITLISTHEAD(&bo_gem->name_list);
 		DRMINITLISTHEAD(&bo_gem->vma_list);
 		if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
 							 tiling_mode,
@@ -778,6 +1272,7 @@ retry:
 		}
 	}
 
+init:
 	bo_gem->name = name;
 	atomic_set(&bo_gem->refcount, 1);
 	bo_gem->validate_index = -1;
@@ -921,7 +1416,6 @@ drm_intel_gem_bo_alloc_userptr(drm_intel_bufmgr *bufmgr,
 	bo_gem->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
 	bo_gem->stride       = 0;
 
-	DRMINITLISTHEAD(&bo_gem->name_list);
 	DRMINITLISTHEAD(&bo_gem->vma_list);
 
 	bo_gem->name = name;
@@ -1022,24 +1516,14 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	int ret;
 	struct drm_gem_open open_arg;
 	struct drm_i915_gem_get_tiling get_tiling;
-	drmMMListHead *list;
+	void *value;
 
-	/* At the moment most applications only have a few named bo.
-	 * For instance, in a DRI client only the render buffers passed
-	 * between X and the client are named. And since X returns the
-	 * alternating names for the front/back buffer a linear search
-	 * provides a sufficiently fast match.
-	 */
 	pthread_mutex_lock(&bufmgr_gem->lock);
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->global_name == handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	if (drmHashLookup(bufmgr_gem->name_table, handle, &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	memclear(open_arg);
@@ -1053,19 +1537,15 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 		pthread_mutex_unlock(&bufmgr_gem->lock);
 		return NULL;
 	}
-        /* Now see if someone has used a prime handle to get this
-         * object from the kernel before by looking through the list
-         * again for a matching gem_handle
-         */
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->gem_handle == open_arg.handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	/* Now see if someone has used a prime handle to get this
+	 * object from the kernel before.
+	 */
+	if (drmHashLookup(bufmgr_gem->handle_table, open_arg.handle,
+			  &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	bo_gem = calloc(1, sizeof(*bo_gem));
@@ -1086,6 +1566,14 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	bo_gem->bo.handle = open_arg.handle;
 	bo_gem->global_name = handle;
 	bo_gem->reusable = false;
+	DRMINITLISTHEAD(&bo_gem->vma_list);
+
+	if (drmHashInsert(bufmgr_gem->name_table, handle, bo_gem) ||
+	    drmHashInsert(bufmgr_gem->handle_table, open_arg.handle, bo_gem)) {
+		drm_intel_gem_bo_unreference_final(&bo_gem->bo, 0);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return NULL;
+	}
 
 	memclear(get_tiling);
 	get_tiling.handle = bo_gem->gem_handle;
@@ -1093,7 +1581,7 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 		       DRM_IOCTL_I915_GEM_GET_TILING,
 		       &get_tiling);
 	if (ret != 0) {
-		drm_intel_gem_bo_unreference(&bo_gem->bo);
+		drm_intel_gem_bo_unreference_final(&bo_gem->bo, 0);
 		pthread_mutex_unlock(&bufmgr_gem->lock);
 		return NULL;
 	}
@@ -1102,8 +1590,6 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	/* XXX stride is unknown */
 	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem, 0);
 
-	DRMINITLISTHEAD(&bo_gem->vma_list);
-	DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 	DBG("bo_create_from_handle: %d (%s)\n", handle, bo_gem->name);
 
@@ -1158,32 +1644,39 @@ drm_intel_gem_bo_mark_mmaps_incoherent(drm_intel_bo *bo)
 static void
 drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 {
-	int i;
-
 	if (bufmgr_gem->time == time)
 		return;
 
-	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
-		struct drm_intel_gem_bo_bucket *bucket =
-		    &bufmgr_gem->cache_bucket[i];
-
-		while (!DRMLISTEMPTY(&bucket->head)) {
-			drm_intel_bo_gem *bo_gem;
-
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.next, head);
-			if (time - bo_gem->free_time <= 1)
-				break;
+	while (!DRMLISTEMPTY(&bufmgr_gem->cache_lru)) {
+		drm_intel_bo_gem *bo_gem;
 
-			DRMLISTDEL(&bo_gem->head);
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bufmgr_gem->cache_lru.next, lru);
+		if (time - bo_gem->free_time <= 1)
+			break;
 
-			drm_intel_gem_bo_free(&bo_gem->bo);
-		}
+		drm_intel_gem_bo_cache_evict(bufmgr_gem, bo_gem);
 	}
 
+	/* Don't leave a partial batch unpurgeable for long. */
+	drm_intel_gem_bo_cache_advise(bufmgr_gem);
+
 	bufmgr_gem->time = time;
 }
 
+static void
+drm_intel_gem_bo_cache_free_all(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	while (!DRMLISTEMPTY(&bufmgr_gem->cache_lru)) {
+		drm_intel_bo_gem *bo_gem;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bufmgr_gem->cache_lru.next, lru);
+		drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
+		drm_intel_gem_bo_free(&bo_gem->bo);
+	}
+}
+
 static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 {
 	int limit;
@@ -1285,19 +1778,27 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 	}
 
-	DRMLISTDEL(&bo_gem->name_list);
+	/* Only shared buffers, which are never reused, are in the tables. */
+	if (!bo_gem->reusable) {
+		if (bo_gem->global_name)
+			drmHashDelete(bufmgr_gem->name_table,
+				      bo_gem->global_name);
+		drmHashDelete(bufmgr_gem->handle_table, bo_gem->gem_handle);
+	}
 
 	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo->size);
-	/* Put the buffer into our internal cache for reuse if we can. */
+	/* Put the buffer into our internal cache for reuse if we can.  The
+	 * lookup rounds up, so the size check keeps a buffer that isn't
+	 * exactly a bucket size from being handed out as a larger one.
+	 */
 	if (bufmgr_gem->bo_reuse && bo_gem->reusable && bucket != NULL &&
-	    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
-					      I915_MADV_DONTNEED)) {
+	    bucket->size == bo->size) {
 		bo_gem->free_time = time;
 
 		bo_gem->name = NULL;
 		bo_gem->validate_index = -1;
 
-		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+		drm_intel_gem_bo_cache_add(bufmgr_gem, bucket, bo_gem);
 	} else {
 		drm_intel_gem_bo_free(bo);
 	}
@@ -1313,6 +1814,60 @@ static void drm_intel_gem_bo_unreference_locked_timed(drm_intel_bo *bo,
 		drm_intel_gem_bo_unreference_final(bo, time);
 }
 
+/*
+ * Drops the last reference to a plain buffer into the calling thread's
+ * magazine.  Returns false if the buffer has to go through
+ * drm_intel_gem_bo_unreference_final() instead, with the reference still
+ * held.
+ */
+static bool
+drm_intel_gem_bo_magazine_put(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	struct drm_intel_gem_bo_bucket *bucket;
+	struct drm_intel_gem_bo_magazine *mag;
+
+	/* Anything with relocations or mappings to release, and shared
+	 * buffers, need the lock.
+	 */
+	if (!bo_gem->reusable || bo_gem->reloc_count || bo_gem->map_count)
+		return false;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	if (bucket == NULL || bucket->size != bo_gem->bo.size)
+		return false;
+
+	mag = drm_intel_gem_bo_magazine_for_bucket(bufmgr_gem, bucket);
+	if (mag == NULL)
+		return false;
+
+	if (!atomic_dec_and_test(&bo_gem->refcount))
+		return true;
+
+	free(bo_gem->reloc_target_info);
+	bo_gem->reloc_target_info = NULL;
+	free(bo_gem->relocs);
+	bo_gem->relocs = NULL;
+	bo_gem->used_as_reloc_target = false;
+	bo_gem->name = NULL;
+	bo_gem->validate_index = -1;
+
+	if (mag->count == DRM_INTEL_GEM_MAGAZINE_SIZE) {
+		struct timespec time;
+
+		clock_gettime(CLOCK_MONOTONIC, &time);
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_bo_magazine_drain(bufmgr_gem, bucket, mag,
+						DRM_INTEL_GEM_MAGAZINE_SIZE / 2,
+						time.tv_sec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	mag->bos[mag->count++] = bo_gem;
+	return true;
+}
+
 static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
@@ -1324,6 +1879,9 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 		    (drm_intel_bufmgr_gem *) bo->bufmgr;
 		struct timespec time;
 
+		if (drm_intel_gem_bo_magazine_put(bufmgr_gem, bo_gem))
+			return;
+
 		clock_gettime(CLOCK_MONOTONIC, &time);
 
 		pthread_mutex_lock(&bufmgr_gem->lock);
@@ -1809,29 +2367,33 @@ static void
 drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_gem_thread_cache *tc;
 	struct drm_gem_close close_bo;
-	int i, ret;
+	bool last;
+	int ret;
 
 	free(bufmgr_gem->exec2_objects);
 	free(bufmgr_gem->exec_objects);
 	free(bufmgr_gem->exec_bos);
 
-	pthread_mutex_destroy(&bufmgr_gem->lock);
+	/* Take back the buffers in every thread's magazines.  A thread may
+	 * be exiting right now, or exit later: its key destructor then only
+	 * frees its cache, and the last one frees the lock and the struct.
+	 */
+	if (bufmgr_gem->has_thread_caches) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTFOREACHENTRY(tc, &bufmgr_gem->thread_caches, link)
+			drm_intel_gem_thread_cache_free(tc);
+		bufmgr_gem->thread_caches_orphaned = true;
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
 
 	/* Free any cached buffer objects we were going to reuse */
-	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
-		struct drm_intel_gem_bo_bucket *bucket =
-		    &bufmgr_gem->cache_bucket[i];
-		drm_intel_bo_gem *bo_gem;
+	drm_intel_gem_bo_cache_free_all(bufmgr_gem);
+	free(bufmgr_gem->cache_bucket);
 
-		while (!DRMLISTEMPTY(&bucket->head)) {
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.next, head);
-			DRMLISTDEL(&bo_gem->head);
-
-			drm_intel_gem_bo_free(&bo_gem->bo);
-		}
-	}
+	drmHashDestroy(bufmgr_gem->name_table);
+	drmHashDestroy(bufmgr_gem->handle_table);
 
 	/* Release userptr bo kept hanging around for optimisation. */
 	if (bufmgr_gem->userptr_active.ptr) {
@@ -1845,6 +2407,17 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 				"i915 kernel driver may not be sane!\n", errno);
 	}
 
+	if (bufmgr_gem->has_thread_caches) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		bufmgr_gem->thread_caches_released = true;
+		last = DRMLISTEMPTY(&bufmgr_gem->thread_caches);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		if (last)
+			drm_intel_gem_thread_caches_fini(bufmgr_gem);
+		return;
+	}
+
+	pthread_mutex_destroy(&bufmgr_gem->lock);
 	free(bufmgr);
 }
 
@@ -2011,6 +2584,9 @@ drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
  * Walk the tree of relocations rooted at BO and accumulate the list of
  * validations to be performed and update the relocation buffers with
  * index values into the validation list.
+ *
+ * A target is only added to the list once its own subtree has been, so a
+ * target that is already on the list needs no further walking.
  */
 static void
 drm_intel_gem_bo_process_reloc(drm_intel_bo *bo)
@@ -2021,14 +2597,15 @@ drm_intel_gem_bo_process_reloc(drm_intel_bo *bo)
 	if (bo_gem->relocs == NULL)
 		return;
 
+	drm_intel_gem_bo_mark_mmaps_incoherent(bo);
+
 	for (i = 0; i < bo_gem->reloc_count; i++) {
 		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
 
-		if (target_bo == bo)
+		if (target_bo == bo ||
+		    to_bo_gem(target_bo)->validate_index != -1)
 			continue;
 
-		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
-
 		/* Continue walking the tree depth-first. */
 		drm_intel_gem_bo_process_reloc(target_bo);
 
@@ -2037,33 +2614,48 @@ drm_intel_gem_bo_process_reloc(drm_intel_bo *bo)
 	}
 }
 
-static void
+/**
+ * Like drm_intel_gem_bo_process_reloc(), for execbuffer2.
+ *
+ * Returns true if any relocation in the tree was written with a presumed
+ * offset that is no longer the target's offset, in which case the kernel
+ * has to process the relocations.
+ */
+static bool
 drm_intel_gem_bo_process_reloc2(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+	bool stale = false;
 	int i;
 
 	if (bo_gem->relocs == NULL)
-		return;
+		return false;
+
+	drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 
 	for (i = 0; i < bo_gem->reloc_count; i++) {
 		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
-		int need_fence;
+		int need_fence, write;
+
+		if (bo_gem->relocs[i].presumed_offset != target_bo->offset64)
+			stale = true;
 
 		if (target_bo == bo)
 			continue;
 
-		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
-
 		/* Continue walking the tree depth-first. */
-		drm_intel_gem_bo_process_reloc2(target_bo);
+		if (to_bo_gem(target_bo)->validate_index == -1)
+			stale |= drm_intel_gem_bo_process_reloc2(target_bo);
 
 		need_fence = (bo_gem->reloc_target_info[i].flags &
 			      DRM_INTEL_RELOC_FENCE);
+		write = bo_gem->relocs[i].write_domain != 0;
 
 		/* Add the target to the validate list */
-		drm_intel_add_validate_buffer2(target_bo, need_fence);
+		drm_intel_add_validate_buffer2(target_bo, need_fence, write);
 	}
+
+	return stale;
 }
 
 
@@ -2190,6 +2782,7 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	struct drm_i915_gem_execbuffer2 execbuf;
+	bool stale;
 	int ret = 0;
 	int i;
 
@@ -2218,12 +2811,12 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	/* Update indices and set up the validate list. */
-	drm_intel_gem_bo_process_reloc2(bo);
+	stale = drm_intel_gem_bo_process_reloc2(bo);
 
 	/* Add the batch buffer to the validation list.  There are no relocations
 	 * pointing to it.
 	 */
-	drm_intel_add_validate_buffer2(bo, 0);
+	drm_intel_add_validate_buffer2(bo, 0, 0);
 
 	memclear(execbuf);
 	execbuf.buffers_ptr = (uintptr_t)bufmgr_gem->exec2_objects;
@@ -2235,6 +2828,12 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 	execbuf.DR1 = 0;
 	execbuf.DR4 = DR4;
 	execbuf.flags = flags;
+	/* If every relocation already holds the address its target was
+	 * last seen at, the kernel only needs to look at them if something
+	 * has to move.
+	 */
+	if (bufmgr_gem->has_exec_no_reloc && !stale)
+		execbuf.flags |= I915_EXEC_NO_RELOC;
 	if (ctx == NULL)
 		i915_execbuffer2_set_context_id(execbuf, 0);
 	else
@@ -2247,6 +2846,18 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 	ret = drmIoctl(bufmgr_gem->fd,
 		       DRM_IOCTL_I915_GEM_EXECBUFFER2,
 		       &execbuf);
+	if (ret != 0 && errno == EINVAL &&
+	    drm_intel_gem_strip_no_reloc(bufmgr_gem, &execbuf)) {
+		/* Kernels between NO_RELOC and EXEC_OBJECT_WRITE reject the
+		 * latter.  Only stop using both if that is what failed: a
+		 * batch the kernel rejects for another reason fails again.
+		 */
+		ret = drmIoctl(bufmgr_gem->fd,
+			       DRM_IOCTL_I915_GEM_EXECBUFFER2,
+			       &execbuf);
+		if (ret == 0)
+			bufmgr_gem->has_exec_no_reloc = false;
+	}
 	if (ret != 0) {
 		ret = -errno;
 		if (ret == -ENOSPC) {
@@ -2431,7 +3042,7 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	uint32_t handle;
 	drm_intel_bo_gem *bo_gem;
 	struct drm_i915_gem_get_tiling get_tiling;
-	drmMMListHead *list;
+	void *value;
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	ret = drmPrimeFDToHandle(bufmgr_gem->fd, prime_fd, &handle);
@@ -2446,15 +3057,11 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	 * for named buffers, we must not create two bo's pointing at the same
 	 * kernel object
 	 */
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->gem_handle == handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	if (drmHashLookup(bufmgr_gem->handle_table, handle, &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	bo_gem = calloc(1, sizeof(*bo_gem));
@@ -2488,7 +3095,11 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	bo_gem->reusable = false;
 
 	DRMINITLISTHEAD(&bo_gem->vma_list);
-	DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	if (drmHashInsert(bufmgr_gem->handle_table, handle, bo_gem)) {
+		drm_intel_gem_bo_unreference_final(&bo_gem->bo, 0);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return NULL;
+	}
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	memclear(get_tiling);
@@ -2515,18 +3126,25 @@ drm_intel_bo_gem_export_to_prime(drm_intel_bo *bo, int *prime_fd)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
+	int ret = 0;
+
+	/* Register the buffer before the fd exists, so that an import of
+	 * it finds this bo.
+	 */
 	pthread_mutex_lock(&bufmgr_gem->lock);
-        if (DRMLISTEMPTY(&bo_gem->name_list))
-                DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	if (drmHashInsert(bufmgr_gem->handle_table, bo_gem->gem_handle,
+			  bo_gem) < 0) {
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return -ENOMEM;
+	}
+	bo_gem->reusable = false;
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	if (drmPrimeHandleToFD(bufmgr_gem->fd, bo_gem->gem_handle,
 			       DRM_CLOEXEC, prime_fd) != 0)
-		return -errno;
-
-	bo_gem->reusable = false;
+		ret = -errno;
 
-	return 0;
+	return ret;
 }
 
 static int
@@ -2550,11 +3168,17 @@ drm_intel_gem_bo_flink(drm_intel_bo *bo, uint32_t * name)
 			return -errno;
 		}
 
+		if (drmHashInsert(bufmgr_gem->name_table, flink.name,
+				  bo_gem) < 0 ||
+		    drmHashInsert(bufmgr_gem->handle_table,
+				  bo_gem->gem_handle, bo_gem) < 0) {
+			drmHashDelete(bufmgr_gem->name_table, flink.name);
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+			return -ENOMEM;
+		}
+
 		bo_gem->global_name = flink.name;
 		bo_gem->reusable = false;
-
-                if (DRMLISTEMPTY(&bo_gem->name_list))
-                        DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
 		pthread_mutex_unlock(&bufmgr_gem->lock);
 	}
 
@@ -2817,43 +3441,137 @@ drm_intel_gem_bo_references(drm_intel_bo *bo, drm_intel_bo *target_bo)
 	return 0;
 }
 
-static void
-add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, int size)
+static int
+init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem, int shift,
+		   unsigned long cache_max_size)
 {
-	unsigned int i = bufmgr_gem->num_buckets;
+	struct drm_intel_gem_bo_bucket *buckets;
+	unsigned long pages;
+	int i, count;
+
+	count = drm_intel_gem_bo_bucket_index(shift,
+					      (cache_max_size + 4095) / 4096,
+					      &pages) + 1;
+
+	buckets = calloc(count, sizeof(*buckets));
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	for (i = 0, pages = 1; i < count; i++) {
+		drm_intel_gem_bo_bucket_index(shift, pages, &pages);
+		DRMINITLISTHEAD(&buckets[i].head);
+		buckets[i].size = pages * 4096;
+		pages++;
+	}
+
+	drm_intel_gem_bo_cache_free_all(bufmgr_gem);
+	free(bufmgr_gem->cache_bucket);
 
-	assert(i < ARRAY_SIZE(bufmgr_gem->cache_bucket));
+	bufmgr_gem->cache_bucket = buckets;
+	bufmgr_gem->num_buckets = count;
+	bufmgr_gem->bucket_shift = shift;
 
-	DRMINITLISTHEAD(&bufmgr_gem->cache_bucket[i].head);
-	bufmgr_gem->cache_bucket[i].size = size;
-	bufmgr_gem->num_buckets++;
+	return 0;
 }
 
-static void
-init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem)
+/**
+ * Sets the sizes of the buffers kept for reuse.
+ *
+ * Each power of two is split into @buckets_per_pot sizes, which must be a
+ * power of two no larger than 64, and buffers larger than @max_size (after
+ * rounding up to a bucket size) are never cached.  The default is 4
+ * buckets per power of two up to 112MB.
+ *
+ * Allocation looks the buckets up without taking the lock, so the
+ * schedule can only be set before the first buffer is allocated, right
+ * after drm_intel_bufmgr_gem_init().  Returns -EBUSY after that.
+ */
+int
+drm_intel_bufmgr_gem_set_bo_cache_buckets(drm_intel_bufmgr *bufmgr,
+					  int buckets_per_pot,
+					  unsigned long max_size)
 {
-	unsigned long size, cache_max_size = 64 * 1024 * 1024;
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	int ret;
 
-	/* OK, so power of two buckets was too wasteful of memory.
-	 * Give 3 other sizes between each power of two, to hopefully
-	 * cover things accurately enough.  (The alternative is
-	 * probably to just go for exact matching of sizes, and assume
-	 * that for things like composited window resize the tiled
-	 * width/height alignment and rounding of sizes to pages will
-	 * get us useful cache hit rates anyway)
-	 */
-	add_bucket(bufmgr_gem, 4096);
-	add_bucket(bufmgr_gem, 4096 * 2);
-	add_bucket(bufmgr_gem, 4096 * 3);
+	if (buckets_per_pot <= 0 || buckets_per_pot > 64 ||
+	    (buckets_per_pot & (buckets_per_pot - 1)))
+		return -EINVAL;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (atomic_read(&bufmgr_gem->cache_bucket_fixed)) {
+		ret = -EBUSY;
+	} else {
+		ret = init_cache_buckets(bufmgr_gem, ffs(buckets_per_pot) - 1,
+					 max_size);
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return ret;
+}
+
+/**
+ * Limits the total size of the buffers kept for reuse to @max_bytes.
+ *
+ * When the cache grows past the limit, the least recently freed buffers
+ * are released first, whichever bucket they are in.  The default is
+ * UINT64_MAX, leaving only the one second expiry.
+ */
+void
+drm_intel_bufmgr_gem_set_bo_cache_budget(drm_intel_bufmgr *bufmgr,
+					 uint64_t max_bytes)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
 
-	/* Initialize the linked lists for BO reuse cache. */
-	for (size = 4 * 4096; size <= cache_max_size; size *= 2) {
-		add_bucket(bufmgr_gem, size);
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->cache_max_size = max_bytes;
+	drm_intel_gem_bo_cache_shrink(bufmgr_gem, max_bytes);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
 
-		add_bucket(bufmgr_gem, size + size * 1 / 4);
-		add_bucket(bufmgr_gem, size + size * 2 / 4);
-		add_bucket(bufmgr_gem, size + size * 3 / 4);
+/**
+ * Reports the state of each bucket of the buffer cache.
+ *
+ * Fills in at most @max_buckets entries of @stats, smallest size first,
+ * and returns the total number of buckets.  Buffers held in the
+ * per-thread magazines are included as of the last time their thread
+ * took the lock, so the counts for the smallest buckets may lag behind
+ * while other threads are allocating.
+ */
+int
+drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+				     drm_intel_bo_cache_stats *stats,
+				     int max_buckets)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	struct drm_intel_gem_thread_cache *tc;
+	int i, count;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+
+	count = bufmgr_gem->num_buckets;
+	for (i = 0; stats != NULL && i < count && i < max_buckets; i++) {
+		struct drm_intel_gem_bo_bucket *bucket =
+		    &bufmgr_gem->cache_bucket[i];
+
+		stats[i].size = bucket->size;
+		stats[i].count = bucket->count;
+		stats[i].hits = bucket->hits;
+		stats[i].misses = bucket->misses;
+		stats[i].evictions = bucket->evictions;
+
+		if (i >= DRM_INTEL_GEM_MAGAZINE_BUCKETS)
+			continue;
+
+		DRMLISTFOREACHENTRY(tc, &bufmgr_gem->thread_caches, link) {
+			stats[i].count += tc->magazines[i].published_count;
+			stats[i].hits += tc->magazines[i].published_hits;
+		}
 	}
+
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return count;
 }
 
 void
@@ -3257,6 +3975,10 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
 	bufmgr_gem->has_vebox = (ret == 0) & (*gp.value > 0);
 
+	gp.param = I915_PARAM_HAS_EXEC_NO_RELOC;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_exec_no_reloc = (ret == 0) & (*gp.value > 0);
+
 	if (bufmgr_gem->gen < 4) {
 		gp.param = I915_PARAM_NUM_FENCES_AVAIL;
 		gp.value = &bufmgr_gem->available_fences;
@@ -3327,12 +4049,41 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	    drm_intel_gem_get_pipe_from_crtc_id;
 	bufmgr_gem->bufmgr.bo_references = drm_intel_gem_bo_references;
 
-	DRMINITLISTHEAD(&bufmgr_gem->named);
-	init_cache_buckets(bufmgr_gem);
+	bufmgr_gem->name_table = drmHashCreate();
+	bufmgr_gem->handle_table = drmHashCreate();
+	if (!bufmgr_gem->name_table || !bufmgr_gem->handle_table) {
+		if (bufmgr_gem->name_table)
+			drmHashDestroy(bufmgr_gem->name_table);
+		if (bufmgr_gem->handle_table)
+			drmHashDestroy(bufmgr_gem->handle_table);
+		pthread_mutex_destroy(&bufmgr_gem->lock);
+		free(bufmgr_gem);
+		bufmgr_gem = NULL;
+		goto exit;
+	}
+	DRMINITLISTHEAD(&bufmgr_gem->cache_lru);
+	bufmgr_gem->cache_max_size = UINT64_MAX;
+	/* 4 sizes per power of two, up to the largest bucket of the
+	 * original 64MB schedule.
+	 */
+	if (init_cache_buckets(bufmgr_gem, 2, 112 * 1024 * 1024)) {
+		drmHashDestroy(bufmgr_gem->name_table);
+		drmHashDestroy(bufmgr_gem->handle_table);
+		pthread_mutex_destroy(&bufmgr_gem->lock);
+		free(bufmgr_gem);
+		bufmgr_gem = NULL;
+		goto exit;
+	}
 
 	DRMINITLISTHEAD(&bufmgr_gem->vma_cache);
 	bufmgr_gem->vma_max = -1; /* unlimited by default */
 
+	/* Without a key, every buffer goes through the shared cache. */
+	DRMINITLISTHEAD(&bufmgr_gem->thread_caches);
+	bufmgr_gem->has_thread_caches =
+	    pthread_key_create(&bufmgr_gem->thread_cache_key,
+			       drm_intel_gem_thread_cache_destroy) == 0;
+
 	DRMLISTADD(&bufmgr_gem->managers, &bufmgr_list);
 
 exit:
@@ -26,6 +26,7 @@
 #include "config.h"
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 
@@ -33,13 +34,148 @@
 #include "libdrm_macros.h"
 #include "mm.h"
 
+/*
+ * Free blocks are kept in segregated lists, two-level segregated fit style:
+ * the first level is the power of two of the block size, the second level
+ * splits each power of two into MM_SL_COUNT equal ranges.  Two bitmaps say
+ * which lists are non-empty, so finding a list whose blocks are all large
+ * enough, splitting and freeing are constant time.
+ *
+ * Blocks are still chained in address order through next/prev, which is
+ * what merging with the neighbours of a freed block uses.  next_free and
+ * prev_free link the blocks of one size class, NULL terminated.
+ */
+#define MM_SL_BITS	4
+#define MM_SL_COUNT	(1 << MM_SL_BITS)
+#define MM_FL_COUNT	(32 - MM_SL_BITS)
+
+struct mm_heap {
+	struct mem_block head;
+	int ofs;
+	uint32_t fl_bitmap;
+	uint32_t sl_bitmap[MM_FL_COUNT];
+	struct mem_block *free[MM_FL_COUNT][MM_SL_COUNT];
+};
+
+static inline struct mm_heap *to_mm_heap(struct mem_block *heap)
+{
+	return (struct mm_heap *)heap;
+}
+
+/* The size class a block of 'size' bytes is kept in. */
+static void mapping_insert(unsigned int size, int *fl, int *sl)
+{
+	int msb;
+
+	if (size < MM_SL_COUNT) {
+		*fl = 0;
+		*sl = size;
+		return;
+	}
+
+	msb = 31 - __builtin_clz(size);
+	*fl = msb - MM_SL_BITS + 1;
+	*sl = (size >> (msb - MM_SL_BITS)) ^ MM_SL_COUNT;
+}
+
+/*
+ * The first size class whose blocks all hold 'size' bytes.  Returns 0 if
+ * there is no such class.
+ */
+static int mapping_search(unsigned int size, int *fl, int *sl)
+{
+	if (size >= MM_SL_COUNT) {
+		int msb = 31 - __builtin_clz(size);
+
+		size += (1u << (msb - MM_SL_BITS)) - 1;
+		if (size < (1u << msb))
+			return 0;
+	}
+
+	mapping_insert(size, fl, sl);
+	return *fl < MM_FL_COUNT;
+}
+
+/* The first non-empty size class at or above (fl, sl), if any. */
+static int find_free_list(struct mm_heap *mm, int *fl, int *sl)
+{
+	uint32_t sl_map, fl_map;
+
+	if (*sl >= MM_SL_COUNT) {
+		*fl += 1;
+		*sl = 0;
+	}
+	if (*fl >= MM_FL_COUNT)
+		return 0;
+
+	sl_map = mm->sl_bitmap[*fl] & (~0u << *sl);
+	if (!sl_map) {
+		if (*fl + 1 >= MM_FL_COUNT)
+			return 0;
+		fl_map = mm->fl_bitmap & (~0u << (*fl + 1));
+		if (!fl_map)
+			return 0;
+
+		*fl = __builtin_ctz(fl_map);
+		sl_map = mm->sl_bitmap[*fl];
+	}
+
+	*sl = __builtin_ctz(sl_map);
+	return 1;
+}
+
+static void insert_free(struct mem_block *p)
+{
+	struct mm_heap *mm = to_mm_heap(p->heap);
+	int fl, sl;
+
+	mapping_insert(p->size, &fl, &sl);
+
+	p->free = 1;
+	p->prev_free = NULL;
+	p->next_free = mm->free[fl][sl];
+	if (p->next_free)
+		p->next_free->prev_free = p;
+	mm->free[fl][sl] = p;
+
+	mm->fl_bitmap |= 1u << fl;
+	mm->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void remove_free(struct mem_block *p)
+{
+	struct mm_heap *mm = to_mm_heap(p->heap);
+	int fl, sl;
+
+	mapping_insert(p->size, &fl, &sl);
+
+	if (p->next_free)
+		p->next_free->prev_free = p->prev_free;
+	if (p->prev_free) {
+		p->prev_free->next_free = p->next_free;
+	} else {
+		mm->free[fl][sl] = p->next_free;
+		if (!mm->free[fl][sl]) {
+			mm->sl_bitmap[fl] &= ~(1u << sl);
+			if (!mm->sl_bitmap[fl])
+				mm->fl_bitmap &= ~(1u << fl);
+		}
+	}
+
+	p->free = 0;
+	p->next_free = NULL;
+	p->prev_free = NULL;
+}
+
 drm_private void mmDumpMemInfo(const struct mem_block *heap)
 {
 	drmMsg("Memory heap %p:\n", (void *)heap);
 	if (heap == 0) {
 		drmMsg("  heap == 0\n");
 	} else {
+		const struct mm_heap *mm = (const struct mm_heap *)heap;
 		const struct mem_block *p;
+		int fl, sl;
 
 		for (p = heap->next; p != heap; p = p->next) {
 			drmMsg("  Offset:%08x, Size:%08x, %c%c\n", p->ofs,
@@ -49,10 +185,15 @@ drm_private void mmDumpMemInfo(const struct mem_block *heap)
 
 		drmMsg("\nFree list:\n");
 
-		for (p = heap->next_free; p != heap; p = p->next_free) {
-			drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n", p->ofs,
-			       p->size, p->free ? 'F' : '.',
-			       p->reserved ? 'R' : '.');
+		for (fl = 0; fl < MM_FL_COUNT; fl++) {
+			for (sl = 0; sl < MM_SL_COUNT; sl++) {
+				for (p = mm->free[fl][sl]; p; p = p->next_free) {
+					drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n",
+					       p->ofs, p->size,
+					       p->free ? 'F' : '.',
+					       p->reserved ? 'R' : '.');
+				}
+			}
 		}
 
 	}
@@ -61,167 +202,158 @@ drm_private void mmDumpMemInfo(const struct mem_block *heap)
 
 drm_private struct mem_block *mmInit(int ofs, int size)
 {
+	struct mm_heap *mm;
 	struct mem_block *heap, *block;
 
 	if (size <= 0)
 		return NULL;
 
-	heap = (struct mem_block *)calloc(1, sizeof(struct mem_block));
-	if (!heap)
+	mm = (struct mm_heap *)calloc(1, sizeof(struct mm_heap));
+	if (!mm)
 		return NULL;
 
 	block = (struct mem_block *)calloc(1, sizeof(struct mem_block));
 	if (!block) {
-		free(heap);
+		free(mm);
 		return NULL;
 	}
 
+	heap = &mm->head;
 	heap->next = block;
 	heap->prev = block;
-	heap->next_free = block;
-	heap->prev_free = block;
+	mm->ofs = ofs;
 
 	block->heap = heap;
 	block->next = heap;
 	block->prev = heap;
-	block->next_free = heap;
-	block->prev_free = heap;
 
 	block->ofs = ofs;
 	block->size = size;
-	block->free = 1;
+	insert_free(block);
 
 	return heap;
 }
 
+/* Where a block of 'size' bytes would go in p, or -1 if it doesn't fit. */
+static int FitBlock(const struct mem_block *p, int size, int mask,
+		    int startSearch)
+{
+	int64_t startofs = p->ofs > startSearch ? p->ofs : startSearch;
+
+	startofs = (startofs + mask) & ~(int64_t)mask;
+	if (startofs + size > (int64_t)p->ofs + p->size)
+		return -1;
+
+	return startofs;
+}
+
+/*
+ * Carves [startofs, startofs + size) out of the free block p, and returns
+ * the new allocated block.  What is left on either side stays free.
+ */
 static struct mem_block *SliceBlock(struct mem_block *p,
-				    int startofs, int size,
-				    int reserved, int alignment)
+				    int startofs, int size)
 {
-	struct mem_block *newblock;
+	struct mem_block *left = NULL, *right = NULL;
 
-	/* break left  [p, newblock, p->next], then p = newblock */
+	/* Allocate first, so that a failure leaves the heap untouched. */
 	if (startofs > p->ofs) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		left = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+		if (!left)
 			return NULL;
-		newblock->ofs = startofs;
-		newblock->size = p->size - (startofs - p->ofs);
-		newblock->free = 1;
-		newblock->heap = p->heap;
-
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
-
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
-
-		p->size -= newblock->size;
-		p = newblock;
 	}
-
-	/* break right, also [p, newblock, p->next] */
-	if (size < p->size) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+	if (startofs + size < p->ofs + p->size) {
+		right = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+		if (!right) {
+			free(left);
 			return NULL;
-		newblock->ofs = startofs + size;
-		newblock->size = p->size - size;
-		newblock->free = 1;
-		newblock->heap = p->heap;
+		}
+	}
 
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
+	remove_free(p);
 
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+	/* break left  [left, p, p->next] */
+	if (left) {
+		left->ofs = p->ofs;
+		left->size = startofs - p->ofs;
+		left->heap = p->heap;
 
-		p->size = size;
+		left->next = p;
+		left->prev = p->prev;
+		p->prev->next = left;
+		p->prev = left;
+
+		p->ofs = startofs;
+		p->size -= left->size;
+		insert_free(left);
 	}
 
-	/* p = middle block */
-	p->free = 0;
+	/* break right [p, right, p->next] */
+	if (right) {
+		right->ofs = startofs + size;
+		right->size = p->size - size;
+		right->heap = p->heap;
 
-	/* Remove p from the free list: 
-	 */
-	p->next_free->prev_free = p->prev_free;
-	p->prev_free->next_free = p->next_free;
+		right->next = p->next;
+		right->prev = p;
+		p->next->prev = right;
+		p->next = right;
 
-	p->next_free = 0;
-	p->prev_free = 0;
+		p->size = size;
+		insert_free(right);
+	}
 
-	p->reserved = reserved;
+	p->reserved = 0;
 	return p;
 }
 
 drm_private struct mem_block *mmAllocMem(struct mem_block *heap, int size,
 					 int align2, int startSearch)
 {
+	struct mm_heap *mm;
 	struct mem_block *p;
-	const int mask = (1 << align2) - 1;
-	int startofs = 0;
-	int endofs;
+	int mask, startofs, fl, sl;
 
-	if (!heap || align2 < 0 || size <= 0)
+	if (!heap || align2 < 0 || align2 > 30 || size <= 0)
 		return NULL;
 
-	for (p = heap->next_free; p != heap; p = p->next_free) {
-		assert(p->free);
+	mm = to_mm_heap(heap);
+	mask = (1 << align2) - 1;
 
-		startofs = (p->ofs + mask) & ~mask;
-		if (startofs < startSearch) {
-			startofs = startSearch;
-		}
-		endofs = startofs + size;
-		if (endofs <= (p->ofs + p->size))
-			break;
+	/* Without a start restriction, any block in the first class that
+	 * holds the size plus the worst case alignment padding will do.
+	 */
+	if (startSearch <= mm->ofs &&
+	    mapping_search((unsigned int)size + mask, &fl, &sl) &&
+	    find_free_list(mm, &fl, &sl)) {
+		p = mm->free[fl][sl];
+		startofs = FitBlock(p, size, mask, startSearch);
+		assert(startofs >= 0);
+		return SliceBlock(p, startofs, size);
 	}
 
-	if (p == heap)
-		return NULL;
-
-	assert(p->free);
-	p = SliceBlock(p, startofs, size, 0, mask + 1);
-
-	return p;
-}
-
-static int Join2Blocks(struct mem_block *p)
-{
-	/* XXX there should be some assertions here */
-
-	/* NOTE: heap->free == 0 */
-
-	if (p->free && p->next->free) {
-		struct mem_block *q = p->next;
-
-		assert(p->ofs + p->size == q->ofs);
-		p->size += q->size;
-
-		p->next = q->next;
-		q->next->prev = p;
-
-		q->next_free->prev_free = q->prev_free;
-		q->prev_free->next_free = q->next_free;
-
-		free(q);
-		return 1;
+	/* Otherwise look at every block that is large enough, smallest
+	 * classes first, for one where the aligned range fits.
+	 */
+	mapping_insert(size, &fl, &sl);
+	while (find_free_list(mm, &fl, &sl)) {
+		for (p = mm->free[fl][sl]; p; p = p->next_free) {
+			assert(p->free);
+
+			startofs = FitBlock(p, size, mask, startSearch);
+			if (startofs >= 0)
+				return SliceBlock(p, startofs, size);
+		}
+		sl++;
 	}
-	return 0;
+
+	return NULL;
 }
 
 drm_private int mmFreeMem(struct mem_block *b)
 {
+	struct mem_block *q;
+
 	if (!b)
 		return 0;
 
@@ -234,15 +366,29 @@ drm_private int mmFreeMem(struct mem_block *b)
 		return -1;
 	}
 
-	b->free = 1;
-	b->next_free = b->heap->next_free;
-	b->prev_free = b->heap;
-	b->next_free->prev_free = b;
-	b->prev_free->next_free = b;
+	/* NOTE: heap->free == 0, so the list head is never merged. */
+	q = b->next;
+	if (q->free) {
+		assert(b->ofs + b->size == q->ofs);
+		remove_free(q);
+		b->size += q->size;
+		b->next = q->next;
+		q->next->prev = b;
+		free(q);
+	}
+
+	q = b->prev;
+	if (q->free) {
+		assert(q->ofs + q->size == b->ofs);
+		remove_free(q);
+		q->size += b->size;
+		q->next = b->next;
+		b->next->prev = q;
+		free(b);
+		b = q;
+	}
 
-	Join2Blocks(b);
-	if (b->prev != b->heap)
-		Join2Blocks(b->prev);
+	insert_free(b);
 
 	return 0;
 }
@@ -260,5 +406,5 @@ drm_private void mmDestroy(struct mem_block *heap)
 		p = next;
 	}
 
-	free(heap);
+	free(to_mm_heap(heap));
 }
@@ -59,6 +59,7 @@ drm_private extern struct mem_block *mmInit(int ofs, int size);
  *       	align2 = 2^align2 bytes alignment
  *		startSearch = linear offset from start of heap to begin search
  * return: pointer to the allocated block, 0 if error
+ * The block starts at the first aligned offset at or after startSearch.
  */
 drm_private extern struct mem_block *mmAllocMem(struct mem_block *heap,
 						int size, int align2,
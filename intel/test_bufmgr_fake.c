@@ -0,0 +1,213 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Replays a texturing workload through drm_intel_bufmgr_fake, with the
+ * exec and fence callbacks standing in for the hardware, and reports how
+ * many bytes the aperture eviction policy makes it upload.
+ *
+ * Every frame samples a hot set of textures and a few cold ones.  After
+ * each batch the fake hardware poisons the first word of every texture it
+ * sampled; a texture whose first word is back to its own signature at the
+ * next batch was uploaded again, one still poisoned stayed resident.
+ * Anything else means two textures were placed on top of each other.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "i915_drm.h"
+#include "intel_bufmgr.h"
+
+#define APERTURE_SIZE	(24 << 20)
+#define NUM_TEXTURES	256
+#define NUM_HOT		32
+#define DRAWS_PER_FRAME	24
+#define TEX_PER_DRAW	8
+#define NUM_FRAMES	300
+#define POISON		0xdeadbeef
+
+static uint8_t *aperture;
+static drm_intel_bo *textures[NUM_TEXTURES];
+static int draw[TEX_PER_DRAW];
+static unsigned int fence_seq;
+static uint64_t uploaded, sampled;
+static unsigned int errors;
+
+static uint32_t signature(int i)
+{
+	return 0x1000 + i;
+}
+
+static unsigned int fence_emit(void *priv)
+{
+	return ++fence_seq;
+}
+
+static void fence_wait(unsigned int fence, void *priv)
+{
+}
+
+static int exec(drm_intel_bo *batch, unsigned int used, void *priv)
+{
+	int i, k;
+
+	for (i = 0; i < TEX_PER_DRAW; i++) {
+		drm_intel_bo *bo = textures[draw[i]];
+		uint32_t *first;
+
+		if (bo->offset + bo->size > APERTURE_SIZE) {
+			errors++;
+			continue;
+		}
+
+		/* Textures of one batch must not overlap. */
+		for (k = 0; k < i; k++) {
+			drm_intel_bo *other = textures[draw[k]];
+
+			if (bo->offset < other->offset + other->size &&
+			    other->offset < bo->offset + bo->size)
+				errors++;
+		}
+
+		first = (uint32_t *)(aperture + bo->offset);
+		if (*first == signature(draw[i]))
+			uploaded += bo->size;
+		else if (*first != POISON)
+			errors++;
+		*first = POISON;
+
+		sampled += bo->size;
+	}
+
+	return 0;
+}
+
+static unsigned long texture_size(int i)
+{
+	uint32_t r = (i + 1) * 2654435761u;
+
+	return (64 * 1024) << ((r >> 8) % 5);
+}
+
+/* Mostly hot textures, a few cold ones, never the same one twice. */
+static void pick_textures(void)
+{
+	int i, k;
+
+	for (i = 0; i < TEX_PER_DRAW; i++) {
+		do {
+			if (rand() % 4)
+				draw[i] = rand() % NUM_HOT;
+			else
+				draw[i] = NUM_HOT + rand() % (NUM_TEXTURES - NUM_HOT);
+
+			for (k = 0; k < i && draw[k] != draw[i]; k++)
+				;
+		} while (k < i);
+	}
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	static uint8_t commands[4096];
+	drm_intel_bufmgr *bufmgr;
+	drm_intel_bo *batch;
+	double start, elapsed;
+	int frame, d, i;
+
+	aperture = calloc(1, APERTURE_SIZE);
+	if (!aperture)
+		return 1;
+
+	bufmgr = drm_intel_bufmgr_fake_init(-1, 0, aperture, APERTURE_SIZE,
+					    NULL);
+	if (!bufmgr)
+		return 1;
+	drm_intel_bufmgr_fake_set_fence_callback(bufmgr, fence_emit,
+						 fence_wait, NULL);
+	drm_intel_bufmgr_fake_set_exec_callback(bufmgr, exec, NULL);
+
+	for (i = 0; i < NUM_TEXTURES; i++) {
+		uint32_t sig = signature(i);
+
+		textures[i] = drm_intel_bo_alloc(bufmgr, "texture",
+						 texture_size(i), 4096);
+		drm_intel_bo_subdata(textures[i], 0, sizeof(sig), &sig);
+	}
+
+	srand(1);
+	start = get_time();
+	for (frame = 0; frame < NUM_FRAMES; frame++) {
+		for (d = 0; d < DRAWS_PER_FRAME; d++) {
+			batch = drm_intel_bo_alloc(bufmgr, "batch",
+						   sizeof(commands), 4096);
+			drm_intel_bo_subdata(batch, 0, sizeof(commands),
+					     commands);
+
+			pick_textures();
+			for (i = 0; i < TEX_PER_DRAW; i++)
+				drm_intel_bo_emit_reloc(batch, i * 4,
+							textures[draw[i]], 0,
+							I915_GEM_DOMAIN_SAMPLER,
+							0);
+
+			if (drm_intel_bo_exec(batch, sizeof(commands), NULL,
+					      0, 0))
+				errors++;
+			drm_intel_bo_unreference(batch);
+		}
+	}
+	elapsed = get_time() - start;
+
+	printf("%d frames: %.1f MB sampled, %.1f MB uploaded per frame, "
+	       "%.1f%% of uploads saved, %.0f us per frame\n", NUM_FRAMES,
+	       sampled / 1048576.0 / NUM_FRAMES,
+	       uploaded / 1048576.0 / NUM_FRAMES,
+	       100.0 * (sampled - uploaded) / sampled,
+	       elapsed * 1e6 / NUM_FRAMES);
+
+	for (i = 0; i < NUM_TEXTURES; i++)
+		drm_intel_bo_unreference(textures[i]);
+	drm_intel_bufmgr_destroy(bufmgr);
+	free(aperture);
+
+	if (errors)
+		printf("%u errors\n", errors);
+
+	return errors != 0;
+}
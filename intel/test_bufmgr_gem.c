@@ -0,0 +1,743 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Runs drm_intel_bufmgr_gem against a stub i915 ioctl layer and reports how
+ * well the buffer cache does on a synthetic allocation trace, how fast many
+ * threads can allocate and free small buffers at once, and what it costs
+ * to submit batches with and without I915_EXEC_NO_RELOC.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "xf86drm.h"
+#include "i915_drm.h"
+#include "intel_bufmgr.h"
+#include "intel_chipset.h"
+
+#define FAKE_FD		42
+#define FAKE_FD_NO_RELOC 43	/* a kernel without I915_EXEC_NO_RELOC */
+#define TRACE_LENGTH	20000
+#define TRACE_LIVE	16
+#define NUM_SHARED	2000
+#define NUM_THREADS	16
+#define THREAD_PAIRS	20000
+#define THREAD_LIVE	4
+#define MAX_HANDLE	(1 << 20)
+#define NUM_TEXTURES	64
+#define BATCH_RELOCS	256
+#define NUM_BATCHES	5000
+
+/* Flink names and prime fds x both refer to kernel object SHARED_HANDLE(x). */
+#define SHARED_HANDLE(x)	(0x100000 + (x))
+#define SHARED_FD(i)		(50000 + (i))
+
+static unsigned int creates;
+static unsigned int closes;
+static unsigned int madvises;
+static unsigned int opens;
+
+/* Which thread, if any, currently holds each gem handle. */
+static uint8_t owner[MAX_HANDLE];
+
+static unsigned int exec_errors;
+static unsigned long relocs_processed;
+
+/* Every buffer lives at an address derived from its handle, forever. */
+static uint64_t fake_offset(uint32_t handle)
+{
+	return (uint64_t)handle << 16;
+}
+
+/*
+ * Checks the validation list the way the kernel would, moves every buffer
+ * to its fake address and, unless told it may skip them, processes and
+ * writes back the relocations.  Skipped relocations are still checked, so
+ * the time per batch is about the same either way; what NO_RELOC saves a
+ * real kernel is the relocations processed.
+ */
+static int fake_execbuffer2(struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	static uint16_t index[MAX_HANDLE];
+	struct drm_i915_gem_exec_object2 *objs =
+		(struct drm_i915_gem_exec_object2 *)(uintptr_t)execbuf->buffers_ptr;
+	bool moved = false;
+	uint32_t i, j;
+
+	/* Batches must end on a qword boundary. */
+	if (execbuf->batch_len & 7) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < execbuf->buffer_count; i++) {
+		if (objs[i].handle >= MAX_HANDLE || index[objs[i].handle]) {
+			exec_errors++;
+			return 0;
+		}
+		index[objs[i].handle] = i + 1;
+
+		if (objs[i].offset != fake_offset(objs[i].handle)) {
+			objs[i].offset = fake_offset(objs[i].handle);
+			moved = true;
+		}
+	}
+
+	for (i = 0; i < execbuf->buffer_count; i++) {
+		struct drm_i915_gem_relocation_entry *relocs =
+			(struct drm_i915_gem_relocation_entry *)(uintptr_t)objs[i].relocs_ptr;
+
+		for (j = 0; j < objs[i].relocation_count; j++) {
+			uint32_t target = relocs[j].target_handle;
+
+			/* Written buffers must say so when relocations
+			 * may be skipped.
+			 */
+			if (!index[target] ||
+			    ((execbuf->flags & I915_EXEC_NO_RELOC) &&
+			     relocs[j].write_domain &&
+			     !(objs[index[target] - 1].flags & EXEC_OBJECT_WRITE)))
+				exec_errors++;
+
+			if (moved || !(execbuf->flags & I915_EXEC_NO_RELOC)) {
+				relocs[j].presumed_offset = fake_offset(target);
+				relocs_processed++;
+			} else if (relocs[j].presumed_offset != fake_offset(target)) {
+				exec_errors++;
+			}
+		}
+	}
+
+	for (i = 0; i < execbuf->buffer_count; i++)
+		index[objs[i].handle] = 0;
+	return 0;
+}
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	static uint32_t next_handle;
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd != FAKE_FD && fd != FAKE_FD_NO_RELOC) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (request) {
+	case DRM_IOCTL_I915_GETPARAM: {
+		drm_i915_getparam_t *gp = arg;
+
+		if (fd == FAKE_FD_NO_RELOC &&
+		    gp->param == I915_PARAM_HAS_EXEC_NO_RELOC) {
+			errno = EINVAL;
+			return -1;
+		}
+		*gp->value = gp->param == I915_PARAM_CHIPSET_ID ?
+			     PCI_CHIP_SKYLAKE_DT_GT2 : 1;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_GET_APERTURE: {
+		struct drm_i915_gem_get_aperture *aperture = arg;
+
+		aperture->aper_size = 4ull << 30;
+		aperture->aper_available_size = 4ull << 30;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_CREATE: {
+		struct drm_i915_gem_create *create = arg;
+
+		create->handle = __sync_add_and_fetch(&next_handle, 1);
+		__sync_fetch_and_add(&creates, 1);
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_MADVISE: {
+		struct drm_i915_gem_madvise *madv = arg;
+
+		madv->retained = 1;
+		__sync_fetch_and_add(&madvises, 1);
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_BUSY: {
+		struct drm_i915_gem_busy *busy = arg;
+
+		busy->busy = 0;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_OPEN: {
+		struct drm_gem_open *open_arg = arg;
+
+		open_arg->handle = SHARED_HANDLE(open_arg->name);
+		open_arg->size = 4096;
+		opens++;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_FLINK: {
+		struct drm_gem_flink *flink = arg;
+
+		flink->name = flink->handle + 7;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+		struct drm_prime_handle *prime = arg;
+
+		prime->handle = SHARED_HANDLE(prime->fd);
+		opens++;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+		struct drm_prime_handle *prime = arg;
+
+		prime->fd = prime->handle + 9;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_GET_TILING: {
+		struct drm_i915_gem_get_tiling *tiling = arg;
+
+		tiling->tiling_mode = I915_TILING_NONE;
+		tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_EXECBUFFER2:
+		return fake_execbuffer2(arg);
+	case DRM_IOCTL_GEM_CLOSE:
+		__sync_fetch_and_add(&closes, 1);
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A bufmgr with reuse enabled and, if buckets_per_pot is set, its own
+ * bucket schedule, which can't change once buffers have been allocated.
+ */
+static drm_intel_bufmgr *create_bufmgr(int buckets_per_pot,
+				       unsigned long max_size)
+{
+	drm_intel_bufmgr *bufmgr;
+
+	bufmgr = drm_intel_bufmgr_gem_init(FAKE_FD, 4096);
+	if (!bufmgr)
+		return NULL;
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	if (buckets_per_pot &&
+	    drm_intel_bufmgr_gem_set_bo_cache_buckets(bufmgr, buckets_per_pot,
+						      max_size)) {
+		drm_intel_bufmgr_destroy(bufmgr);
+		return NULL;
+	}
+
+	return bufmgr;
+}
+
+static int check_bucket_sizes(drm_intel_bufmgr *bufmgr)
+{
+	static const struct {
+		unsigned long size, expected;
+	} sizes[] = {
+		{ 1, 4096 },
+		{ 4096 * 5, 4096 * 5 },
+		{ 4096 * 8 + 1, 4096 * 10 },
+		{ 4096 * 17, 4096 * 20 },
+		{ 100 << 20, 112 << 20 },
+		{ (112 << 20) + 1, (112 << 20) + 1 },
+	};
+	drm_intel_bo *bo;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bo = drm_intel_bo_alloc(bufmgr, "size", sizes[i].size, 0);
+		if (!bo || bo->size != sizes[i].expected) {
+			printf("size %lu: got %lu, expected %lu\n",
+			       sizes[i].size, bo ? bo->size : 0,
+			       sizes[i].expected);
+			ret = 1;
+		}
+		drm_intel_bo_unreference(bo);
+	}
+
+	return ret;
+}
+
+/*
+ * Mostly small staging buffers, with the odd 4K or 8K video surface:
+ * NV12 and RGBA at 3840x2160 and 7680x4320, and P010 at 8K.
+ */
+static unsigned long trace_size(unsigned int i)
+{
+	static const unsigned long surfaces[] = {
+		3840 * 2160 * 3 / 2, 3840 * 2160 * 4,
+		7680 * 4320 * 3 / 2, 7680 * 4320 * 4, 7680 * 4320 * 3,
+	};
+	unsigned int r = (i * 2654435761u) >> 8;
+
+	if (r % 8 == 0)
+		return surfaces[(r >> 3) % 5];
+
+	return 4096 + (r >> 3) % (256 * 1024);
+}
+
+static void run_trace(drm_intel_bufmgr *bufmgr, const char *name)
+{
+	drm_intel_bo *live[TRACE_LIVE] = { NULL };
+	double start, elapsed;
+	unsigned int i;
+
+	creates = 0;
+	start = get_time();
+	for (i = 0; i < TRACE_LENGTH; i++) {
+		drm_intel_bo_unreference(live[i % TRACE_LIVE]);
+		live[i % TRACE_LIVE] = drm_intel_bo_alloc(bufmgr, "trace",
+							  trace_size(i), 0);
+	}
+	elapsed = get_time() - start;
+
+	for (i = 0; i < TRACE_LIVE; i++)
+		drm_intel_bo_unreference(live[i]);
+
+	printf("%-24s %5.1f%% hits, %.0f ns per alloc/free\n", name,
+	       100.0 * (TRACE_LENGTH - creates) / TRACE_LENGTH,
+	       elapsed * 1e9 / TRACE_LENGTH);
+}
+
+static int find_bucket(drm_intel_bo_cache_stats *stats, int count,
+		       unsigned long size)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (stats[i].size == size)
+			return i;
+
+	return 0;
+}
+
+static int test_budget(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo_cache_stats stats[64];
+	drm_intel_bo *bos[64];
+	uint64_t cached = 0, evictions;
+	int count, i, b, ret = 0;
+
+	/* The buffers are too large for the per-thread magazines, which
+	 * are not accounted against the budget.
+	 */
+	drm_intel_bufmgr_gem_set_bo_cache_budget(bufmgr, 2 << 20);
+
+	for (i = 0; i < 64; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "budget", 128 * 1024, 0);
+	for (i = 0; i < 64; i++)
+		drm_intel_bo_unreference(bos[i]);
+
+	count = drm_intel_bufmgr_gem_get_cache_stats(bufmgr, stats, 64);
+	for (i = 0; i < count && i < 64; i++)
+		cached += (uint64_t)stats[i].size * stats[i].count;
+	b = find_bucket(stats, count, 128 * 1024);
+	ret |= cached > 2 << 20;
+	ret |= stats[b].count != 16 || stats[b].evictions != 48 ||
+	       stats[b].misses != 64;
+	evictions = stats[b].evictions;
+
+	/* A buffer freed and reused straight away is never marked
+	 * DONTNEED, and so never needs to be marked WILLNEED either.  The
+	 * first two rounds may still flush a partial batch of the buffers
+	 * above, and take the hot buffer back from it.
+	 */
+	for (i = 0; i < 1002; i++) {
+		if (i == 2)
+			madvises = 0;
+		drm_intel_bo_unreference(drm_intel_bo_alloc(bufmgr, "hot",
+							    80 * 1024, 0));
+	}
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, stats, 64);
+	b = find_bucket(stats, count, 80 * 1024);
+	ret |= stats[b].hits != 1001 || stats[b].misses != 1;
+
+	printf("2MB budget: %llu bytes cached, %llu evictions; "
+	       "%u madvise ioctls for 1000 alloc/free pairs\n",
+	       (unsigned long long)cached, (unsigned long long)evictions,
+	       madvises);
+	ret |= madvises != 0;
+
+	drm_intel_bufmgr_gem_set_bo_cache_budget(bufmgr, UINT64_MAX);
+
+	return ret;
+}
+
+/*
+ * Imports NUM_SHARED buffers by name, then looks all of them up again by
+ * name and by prime fd, the way a compositor sees the same client buffers
+ * every frame.
+ */
+static int test_import(drm_intel_bufmgr *bufmgr)
+{
+	static drm_intel_bo *bos[NUM_SHARED];
+	drm_intel_bo *bo;
+	double start, first, again;
+	uint32_t name;
+	int fd, i, ret = 0;
+
+	opens = 0;
+	start = get_time();
+	for (i = 0; i < NUM_SHARED; i++)
+		bos[i] = drm_intel_bo_gem_create_from_name(bufmgr, "shared",
+							   SHARED_FD(i));
+	first = get_time() - start;
+	ret |= opens != NUM_SHARED;
+
+	start = get_time();
+	for (i = 0; i < NUM_SHARED; i++) {
+		ret |= drm_intel_bo_gem_create_from_name(bufmgr, "shared",
+							 SHARED_FD(i)) != bos[i];
+		ret |= drm_intel_bo_gem_create_from_prime(bufmgr, SHARED_FD(i),
+							  4096) != bos[i];
+	}
+	again = get_time() - start;
+	ret |= opens != 2 * NUM_SHARED;
+
+	for (i = 0; i < NUM_SHARED; i++) {
+		drm_intel_bo_unreference(bos[i]);
+		drm_intel_bo_unreference(bos[i]);
+		drm_intel_bo_unreference(bos[i]);
+	}
+
+	/* Once released, a name must reach the kernel again. */
+	bo = drm_intel_bo_gem_create_from_name(bufmgr, "shared", SHARED_FD(0));
+	ret |= !bo || opens != 2 * NUM_SHARED + 1;
+	drm_intel_bo_unreference(bo);
+
+	/* Exported buffers must be found by their flink name. */
+	bo = drm_intel_bo_alloc(bufmgr, "exported", 4096, 0);
+	ret |= drm_intel_bo_flink(bo, &name) != 0;
+	ret |= drm_intel_bo_gem_export_to_prime(bo, &fd) != 0;
+	ret |= drm_intel_bo_gem_create_from_name(bufmgr, "flink", name) != bo;
+	drm_intel_bo_unreference(bo);
+	drm_intel_bo_unreference(bo);
+
+	printf("%d shared buffers: %.0f ns per new import, "
+	       "%.0f ns per repeated import\n", NUM_SHARED,
+	       first * 1e9 / NUM_SHARED, again * 1e9 / (2 * NUM_SHARED));
+
+	return ret;
+}
+
+struct thread_args {
+	drm_intel_bufmgr *bufmgr;
+	unsigned long min_size, max_size;
+	int id, errors;
+};
+
+/*
+ * Allocates and frees THREAD_PAIRS buffers, keeping THREAD_LIVE of them
+ * around, and checks that no buffer is ever handed to two threads.
+ */
+static void *alloc_thread(void *data)
+{
+	struct thread_args *args = data;
+	drm_intel_bo *live[THREAD_LIVE] = { NULL };
+	unsigned long range = args->max_size - args->min_size;
+	drm_intel_bo *bo;
+	unsigned int i, r;
+
+	for (i = 0; i < THREAD_PAIRS; i++) {
+		bo = live[i % THREAD_LIVE];
+		if (bo) {
+			owner[bo->handle] = 0;
+			drm_intel_bo_unreference(bo);
+		}
+
+		r = ((i + args->id * THREAD_PAIRS) * 2654435761u) >> 8;
+		bo = drm_intel_bo_alloc(args->bufmgr, "thread",
+					args->min_size + r % (range + 1), 0);
+		if (!bo || bo->handle >= MAX_HANDLE ||
+		    !__sync_bool_compare_and_swap(&owner[bo->handle], 0,
+						  args->id + 1)) {
+			args->errors++;
+			bo = NULL;
+		}
+		live[i % THREAD_LIVE] = bo;
+	}
+
+	for (i = 0; i < THREAD_LIVE; i++) {
+		if (live[i]) {
+			owner[live[i]->handle] = 0;
+			drm_intel_bo_unreference(live[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static int run_threads(const char *name,
+		       unsigned long min_size, unsigned long max_size)
+{
+	struct thread_args args[NUM_THREADS];
+	pthread_t threads[NUM_THREADS];
+	drm_intel_bo_cache_stats stats[64];
+	drm_intel_bufmgr *bufmgr;
+	uint64_t allocs = 0;
+	double start, elapsed;
+	int count, i, ret = 0;
+
+	/* Fresh counters, and no magazines left from the previous run. */
+	bufmgr = create_bufmgr(0, 0);
+	if (!bufmgr)
+		return 1;
+
+	creates = 0;
+	start = get_time();
+	for (i = 0; i < NUM_THREADS; i++) {
+		args[i].bufmgr = bufmgr;
+		args[i].min_size = min_size;
+		args[i].max_size = max_size;
+		args[i].id = i;
+		args[i].errors = 0;
+		if (pthread_create(&threads[i], NULL, alloc_thread, &args[i]))
+			return 1;
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		ret |= args[i].errors != 0;
+	}
+	elapsed = get_time() - start;
+
+	/* Every allocation is either a hit or a miss, wherever it was
+	 * served from, and exiting threads hand their magazines back.
+	 */
+	count = drm_intel_bufmgr_gem_get_cache_stats(bufmgr, stats, 64);
+	for (i = 0; i < count && i < 64; i++)
+		allocs += stats[i].hits + stats[i].misses;
+	ret |= allocs != NUM_THREADS * THREAD_PAIRS;
+
+	printf("%d threads, %-18s %6u creates, %.0f ns per alloc/free\n",
+	       NUM_THREADS, name, creates,
+	       elapsed * 1e9 / (NUM_THREADS * THREAD_PAIRS));
+
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	return ret;
+}
+
+static pthread_barrier_t exit_barrier;
+
+/* Fills its magazine, then outlives the bufmgr. */
+static void *exit_late_thread(void *data)
+{
+	drm_intel_bo *bo;
+
+	bo = drm_intel_bo_alloc(data, "late", 4096, 0);
+	drm_intel_bo_unreference(bo);
+
+	pthread_barrier_wait(&exit_barrier);
+	pthread_barrier_wait(&exit_barrier);
+
+	/* The key destructor runs after the bufmgr was destroyed. */
+	return NULL;
+}
+
+/*
+ * A thread may exit, and run its key destructor, after the bufmgr is gone:
+ * destroy takes its magazine back, the destructor frees what is left.
+ */
+static int test_exit_after_destroy(void)
+{
+	drm_intel_bufmgr *bufmgr;
+	pthread_t thread;
+	int ret = 0;
+
+	bufmgr = create_bufmgr(0, 0);
+	if (!bufmgr)
+		return 1;
+
+	if (pthread_barrier_init(&exit_barrier, NULL, 2))
+		return 1;
+	creates = closes = 0;
+	if (pthread_create(&thread, NULL, exit_late_thread, bufmgr))
+		return 1;
+
+	pthread_barrier_wait(&exit_barrier);
+	drm_intel_bufmgr_destroy(bufmgr);
+	ret |= creates != 1 || closes != 1;
+	pthread_barrier_wait(&exit_barrier);
+
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&exit_barrier);
+
+	if (ret)
+		printf("magazine of a thread outliving its bufmgr leaked\n");
+	return ret;
+}
+
+/*
+ * Submits NUM_BATCHES batches, each pointing BATCH_RELOCS times at a state
+ * buffer and at the NUM_TEXTURES textures the state buffer points at, and
+ * writing to a render target.  They follow a batch the kernel rejects,
+ * which must not make the bufmgr give up on NO_RELOC.
+ */
+static int run_exec(int fd, const char *name)
+{
+	drm_intel_bufmgr *bufmgr;
+	drm_intel_bo *textures[NUM_TEXTURES], *state, *target, *batch;
+	double start, elapsed;
+	int i, j, ret = 0;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (!bufmgr)
+		return 1;
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	state = drm_intel_bo_alloc(bufmgr, "state", 4096, 0);
+	target = drm_intel_bo_alloc(bufmgr, "target", 4096 * 64, 0);
+	for (i = 0; i < NUM_TEXTURES; i++) {
+		textures[i] = drm_intel_bo_alloc(bufmgr, "texture", 4096 * 16, 0);
+		ret |= drm_intel_bo_emit_reloc(state, i * 8, textures[i], 0,
+					       I915_GEM_DOMAIN_SAMPLER, 0);
+	}
+
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 0);
+	ret |= drm_intel_bo_emit_reloc(batch, 0, target, 0,
+				       I915_GEM_DOMAIN_RENDER,
+				       I915_GEM_DOMAIN_RENDER);
+	ret |= drm_intel_bo_exec(batch, 4, NULL, 0, 0) != -EINVAL;
+	drm_intel_bo_unreference(batch);
+
+	exec_errors = 0;
+	relocs_processed = 0;
+	start = get_time();
+	for (i = 0; i < NUM_BATCHES; i++) {
+		batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 0);
+		for (j = 0; j < BATCH_RELOCS; j++) {
+			drm_intel_bo *bo = j & 1 ? state :
+					   textures[j / 2 % NUM_TEXTURES];
+
+			ret |= drm_intel_bo_emit_reloc(batch, j * 4, bo, 0,
+						       I915_GEM_DOMAIN_SAMPLER,
+						       0);
+		}
+		ret |= drm_intel_bo_emit_reloc(batch, 4092, target, 0,
+					       I915_GEM_DOMAIN_RENDER,
+					       I915_GEM_DOMAIN_RENDER);
+		ret |= drm_intel_bo_exec(batch, 4096, NULL, 0, 0);
+		drm_intel_bo_unreference(batch);
+	}
+	elapsed = get_time() - start;
+
+	ret |= target->offset64 != fake_offset(target->handle);
+
+	printf("%-26s %7.1f relocations processed per batch, "
+	       "%.2f us per batch\n", name,
+	       (double)relocs_processed / NUM_BATCHES,
+	       elapsed * 1e6 / NUM_BATCHES);
+
+	drm_intel_bo_unreference(state);
+	drm_intel_bo_unreference(target);
+	for (i = 0; i < NUM_TEXTURES; i++)
+		drm_intel_bo_unreference(textures[i]);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	return ret || exec_errors;
+}
+
+int main(void)
+{
+	drm_intel_bufmgr *bufmgr;
+	unsigned int default_creates;
+	int ret = 0;
+
+	bufmgr = create_bufmgr(0, 0);
+	if (!bufmgr)
+		return 1;
+
+	ret |= drm_intel_bufmgr_gem_set_bo_cache_buckets(bufmgr, 3, 0) != -EINVAL;
+	ret |= check_bucket_sizes(bufmgr);
+	run_trace(bufmgr, "default buckets:");
+	default_creates = creates;
+
+	/* The schedule is fixed once buffers have been allocated. */
+	ret |= drm_intel_bufmgr_gem_set_bo_cache_buckets(bufmgr, 4,
+							 512 << 20) != -EBUSY;
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr(4, 512 << 20);
+	if (!bufmgr)
+		return 1;
+	run_trace(bufmgr, "4 per pot up to 512MB:");
+	ret |= creates >= default_creates;
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr(16, 512 << 20);
+	if (!bufmgr)
+		return 1;
+	run_trace(bufmgr, "16 per pot up to 512MB:");
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr(0, 0);
+	if (!bufmgr)
+		return 1;
+	ret |= test_budget(bufmgr);
+	ret |= test_import(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	ret |= run_threads("4KB to 64KB:", 4096, 64 * 1024);
+	ret |= run_threads("128KB to 256KB:", 128 * 1024, 256 * 1024);
+	ret |= test_exit_after_destroy();
+
+	/* Without NO_RELOC the kernel looks at every relocation of every
+	 * batch, with it only at those of the first one.
+	 */
+	ret |= run_exec(FAKE_FD_NO_RELOC, "execbuffer2:");
+	ret |= relocs_processed !=
+	       NUM_BATCHES * (BATCH_RELOCS + 1 + NUM_TEXTURES);
+	ret |= run_exec(FAKE_FD, "execbuffer2 with NO_RELOC:");
+	ret |= relocs_processed != BATCH_RELOCS + 1 + NUM_TEXTURES;
+
+	return ret;
+}
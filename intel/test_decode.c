@@ -28,10 +28,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <err.h>
 
 #include "libdrm_macros.h"
@@ -39,6 +41,21 @@
 #include "intel_chipset.h"
 
 #define HW_OFFSET 0x12300000
+#define NUM_THREADS 4
+#define BENCH_SECONDS 0.25
+#define MI_BATCH_BUFFER_END 0x05000000
+/* Enough to cross several of the decoder's chunk windows. */
+#define BIG_BATCH_COUNT (1 << 20)
+#define BIG_CHUNK_COUNT 4093
+
+struct sink_thread {
+	uint16_t devid;
+	void *batch_ptr;
+	size_t batch_size;
+	const char *ref;
+	int mismatch;
+	FILE *out;
+};
 
 static void
 usage(void)
@@ -46,6 +63,7 @@ usage(void)
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "  test_decode <batch>\n");
 	fprintf(stderr, "  test_decode <batch> -dump\n");
+	fprintf(stderr, "  test_decode <batch> -bench\n");
 	exit(1);
 }
 
@@ -71,23 +89,256 @@ read_file(const char *filename, void **ptr, size_t *size)
 	close(fd);
 }
 
+static void
+map_batch(struct drm_intel_decode *ctx, const char *filename)
+{
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		errx(1, "couldn't open `%s'", filename);
+
+	if (drm_intel_decode_set_batch_file(ctx, fd, HW_OFFSET))
+		errx(1, "couldn't map `%s'", filename);
+
+	close(fd);
+}
+
 static void
 dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 {
-	void *batch_ptr;
-	size_t batch_size;
+	map_batch(ctx, batch_filename);
+	drm_intel_decode_set_output_file(ctx, stdout);
 
-	read_file(batch_filename, &batch_ptr, &batch_size);
+	drm_intel_decode(ctx);
+}
 
-	drm_intel_decode_set_batch_pointer(ctx, batch_ptr, HW_OFFSET,
-					   batch_size / 4);
+static double
+get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Decodes the batch to /dev/null for a while and reports the throughput. */
+static void
+bench_batch(struct drm_intel_decode *ctx, const char *batch_filename)
+{
+	struct stat st;
+	double start, elapsed;
+	unsigned long passes = 0;
+	FILE *out;
+
+	if (stat(batch_filename, &st))
+		errx(1, "couldn't stat `%s'", batch_filename);
+
+	out = fopen("/dev/null", "w");
+	if (!out)
+		errx(1, "couldn't open /dev/null");
+
+	map_batch(ctx, batch_filename);
+	drm_intel_decode_set_output_file(ctx, out);
+
+	start = get_time();
+	do {
+		drm_intel_decode(ctx);
+		passes++;
+		elapsed = get_time() - start;
+	} while (elapsed < BENCH_SECONDS);
+
+	printf("%s: %lu passes, %.2f MB/s\n", batch_filename, passes,
+	       passes * st.st_size / elapsed / (1024 * 1024));
+
+	fclose(out);
+}
+
+/* Prints a record the way the text decoder would have. */
+static void
+print_record(void *data, const struct drm_intel_decode_record *record)
+{
+	struct sink_thread *t = data;
+	int i;
+
+	for (i = 0; i < record->num_fields; i++) {
+		const struct drm_intel_decode_field *field = &record->fields[i];
+
+		if (field->index >= 0)
+			fprintf(t->out, "0x%08x:      0x%08x: %s",
+				record->offset + field->index * 4,
+				field->value, field->index == 0 ? "" : "   ");
+		fputs(field->text, t->out);
+	}
+}
+
+static void *
+sink_thread(void *data)
+{
+	struct sink_thread *t = data;
+	struct drm_intel_decode *ctx;
+	char *ptr = NULL;
+	size_t size;
+
+	t->mismatch = 1;
+	t->out = NULL;
+#ifdef HAVE_OPEN_MEMSTREAM
+	t->out = open_memstream(&ptr, &size);
+#endif
+	if (!t->out)
+		return NULL;
+
+	ctx = drm_intel_decode_context_alloc(t->devid);
+	if (!ctx) {
+		fclose(t->out);
+		free(ptr);
+		return NULL;
+	}
+
+	drm_intel_decode_set_batch_pointer(ctx, t->batch_ptr, HW_OFFSET,
+					   t->batch_size / 4);
+	drm_intel_decode_set_record_sink(ctx, print_record, t);
+	drm_intel_decode(ctx);
+	drm_intel_decode_context_free(ctx);
+
+	fclose(t->out);
+	t->mismatch = strcmp(t->ref, ptr) != 0;
+	free(ptr);
+
+	return NULL;
+}
+
+/*
+ * Decodes the batch into records from several threads at once, and checks
+ * that every one of them still adds up to the reference text.
+ */
+static void
+compare_records(uint16_t devid, void *batch_ptr, size_t batch_size,
+		const char *ref, const char *ref_filename)
+{
+	struct sink_thread threads[NUM_THREADS];
+	pthread_t ids[NUM_THREADS];
+	int i;
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		threads[i].devid = devid;
+		threads[i].batch_ptr = batch_ptr;
+		threads[i].batch_size = batch_size;
+		threads[i].ref = ref;
+		if (pthread_create(&ids[i], NULL, sink_thread, &threads[i]))
+			errx(1, "couldn't create decode thread");
+	}
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(ids[i], NULL);
+		if (threads[i].mismatch) {
+			fprintf(stderr, "Record decode mismatch with "
+				"reference `%s'.\n", ref_filename);
+			exit(1);
+		}
+	}
+}
+
+/* Hashes the text of each record, as print_record() would lay it out. */
+static void
+hash_record(void *data, const struct drm_intel_decode_record *record)
+{
+	uint64_t *hash = data;
+	char prefix[64];
+	const char *c;
+	int i;
+
+	for (i = 0; i < record->num_fields; i++) {
+		const struct drm_intel_decode_field *field = &record->fields[i];
+
+		prefix[0] = '\0';
+		if (field->index >= 0)
+			snprintf(prefix, sizeof(prefix), "0x%08x:      0x%08x: %s",
+				 record->offset + field->index * 4,
+				 field->value, field->index == 0 ? "" : "   ");
+
+		for (c = prefix; *c; c++)
+			*hash = (*hash ^ (unsigned char)*c) * 0x100000001b3ull;
+		for (c = field->text; *c; c++)
+			*hash = (*hash ^ (unsigned char)*c) * 0x100000001b3ull;
+	}
+}
+
+/*
+ * Checks that feeding the batch to drm_intel_decode_chunk() a few dwords
+ * at a time matches the reference, and that a batch much larger than the
+ * decoder's window decodes the same in chunks as it does in one go.
+ */
+static void
+compare_chunks(uint16_t devid, uint32_t *batch, size_t batch_size,
+	       const char *ref, const char *ref_filename)
+{
+	struct drm_intel_decode *ctx;
+	uint32_t count = batch_size / 4, *big;
+	uint64_t whole_hash = 0xcbf29ce484222325ull, chunk_hash = whole_hash;
+	FILE *out = NULL;
+	char *ptr = NULL;
+	size_t size, i;
+
+	ctx = drm_intel_decode_context_alloc(devid);
+#ifdef HAVE_OPEN_MEMSTREAM
+	out = open_memstream(&ptr, &size);
+#endif
+	if (!ctx || !out)
+		errx(1, "couldn't set up chunked decode");
+
+	drm_intel_decode_set_output_file(ctx, out);
+	for (i = 0; i < count; i += 3)
+		drm_intel_decode_chunk(ctx, batch + i, HW_OFFSET + i * 4,
+				       count - i < 3 ? count - i : 3);
+	drm_intel_decode_chunk(ctx, NULL, 0, 0);
 	drm_intel_decode_set_output_file(ctx, stdout);
+	fclose(out);
 
+	if (strcmp(ref, ptr) != 0) {
+		fprintf(stderr, "Chunked decode mismatch with reference `%s'.\n",
+			ref_filename);
+		exit(1);
+	}
+	free(ptr);
+
+	/* Repeat the batch without its MI_BATCH_BUFFER_END, so that packets
+	 * keep straddling the chunks all the way through.
+	 */
+	big = malloc(BIG_BATCH_COUNT * 4);
+	if (!big)
+		errx(1, "couldn't allocate big batch");
+	for (i = 0; i < BIG_BATCH_COUNT; i++) {
+		big[i] = batch[i % count];
+		if (big[i] == MI_BATCH_BUFFER_END)
+			big[i] = 0;
+	}
+
+	drm_intel_decode_set_record_sink(ctx, hash_record, &whole_hash);
+	drm_intel_decode_set_batch_pointer(ctx, big, HW_OFFSET,
+					   BIG_BATCH_COUNT);
 	drm_intel_decode(ctx);
+
+	drm_intel_decode_set_record_sink(ctx, hash_record, &chunk_hash);
+	for (i = 0; i < BIG_BATCH_COUNT; i += BIG_CHUNK_COUNT)
+		drm_intel_decode_chunk(ctx, big + i, HW_OFFSET + i * 4,
+				       BIG_BATCH_COUNT - i < BIG_CHUNK_COUNT ?
+				       BIG_BATCH_COUNT - i : BIG_CHUNK_COUNT);
+	drm_intel_decode_chunk(ctx, NULL, 0, 0);
+
+	drm_intel_decode_context_free(ctx);
+	free(big);
+
+	if (whole_hash != chunk_hash) {
+		fprintf(stderr, "Chunked decode of a big batch built from `%s' "
+			"doesn't match.\n", ref_filename);
+		exit(1);
+	}
 }
 
 static void
-compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
+compare_batch(struct drm_intel_decode *ctx, uint16_t devid,
+	      const char *batch_filename)
 {
 	FILE *out = NULL;
 	void *ptr, *ref_ptr, *batch_ptr;
@@ -116,8 +367,7 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	exit(77);
 #endif
 
-	drm_intel_decode_set_batch_pointer(ctx, batch_ptr, HW_OFFSET,
-					   batch_size / 4);
+	map_batch(ctx, batch_filename);
 	drm_intel_decode_set_output_file(ctx, out);
 
 	drm_intel_decode(ctx);
@@ -130,6 +380,9 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 		exit(1);
 	}
 
+	compare_records(devid, batch_ptr, batch_size, ref_ptr, ref_filename);
+	compare_chunks(devid, batch_ptr, batch_size, ref_ptr, ref_filename);
+
 	fclose(out);
 	free(ref_filename);
 	free(ptr);
@@ -186,10 +439,12 @@ main(int argc, char **argv)
 	if (argc == 3) {
 		if (strcmp(argv[2], "-dump") == 0)
 			dump_batch(ctx, argv[1]);
+		else if (strcmp(argv[2], "-bench") == 0)
+			bench_batch(ctx, argv[1]);
 		else
 			usage();
 	} else {
-		compare_batch(ctx, argv[1]);
+		compare_batch(ctx, devid, argv[1]);
 	}
 
 	drm_intel_decode_context_free(ctx);
@@ -0,0 +1,279 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Checks the mm.c heap against the mmAllocMem() contract, and reports how
+ * fast it allocates and how fragmented it gets when a fake-bufmgr sized
+ * aperture sees long texture churn.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mm.h"
+
+#define HEAP_OFS	(64 * 1024)
+#define HEAP_SIZE	(256 << 20)
+#define NUM_SLOTS	1024
+#define NUM_OPS		200000
+
+struct heap_info {
+	int blocks, free_blocks;
+	int free_size, largest_free;
+};
+
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Walks the blocks in address order, checking that they tile the heap and
+ * that no two free blocks are left side by side.
+ */
+static int check_heap(struct mem_block *heap, struct heap_info *info)
+{
+	struct mem_block *p;
+	int ofs = HEAP_OFS;
+
+	info->blocks = info->free_blocks = 0;
+	info->free_size = info->largest_free = 0;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		if (p->ofs != ofs || p->size <= 0 || p->heap != heap ||
+		    p->prev->next != p || (p->free && p->prev->free)) {
+			printf("bad block at 0x%x\n", ofs);
+			return 1;
+		}
+		ofs += p->size;
+
+		info->blocks++;
+		if (p->free) {
+			info->free_blocks++;
+			info->free_size += p->size;
+			if (p->size > info->largest_free)
+				info->largest_free = p->size;
+		}
+	}
+
+	if (ofs != HEAP_OFS + HEAP_SIZE) {
+		printf("blocks end at 0x%x\n", ofs);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Whether any free block could hold the request, the slow way. */
+static int could_fit(struct mem_block *heap, int size, int align2,
+		     int startSearch)
+{
+	struct mem_block *p;
+	int64_t start;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		if (!p->free)
+			continue;
+
+		start = p->ofs > startSearch ? p->ofs : startSearch;
+		start = (start + (1 << align2) - 1) & ~(((int64_t)1 << align2) - 1);
+		if (start + size <= (int64_t)p->ofs + p->size)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int check_block(struct mem_block *heap, struct mem_block *b, int size,
+		       int align2, int startSearch)
+{
+	if (!b)
+		return could_fit(heap, size, align2, startSearch);
+
+	return b->free || b->size != size || b->ofs < startSearch ||
+	       (b->ofs & ((1 << align2) - 1));
+}
+
+static int test_contract(void)
+{
+	struct mem_block *heap, *a, *b, *c;
+	struct heap_info info;
+	int ret = 0;
+
+	heap = mmInit(HEAP_OFS, HEAP_SIZE);
+	if (!heap)
+		return 1;
+
+	ret |= mmAllocMem(heap, 0, 0, 0) != NULL;
+	ret |= mmAllocMem(heap, 4096, -1, 0) != NULL;
+	ret |= mmAllocMem(heap, HEAP_SIZE + 1, 0, 0) != NULL;
+	ret |= mmAllocMem(heap, 4096, 0, HEAP_OFS + HEAP_SIZE) != NULL;
+
+	a = mmAllocMem(heap, 100, 0, 0);
+	ret |= check_block(heap, a, 100, 0, 0);
+	b = mmAllocMem(heap, 4096, 16, 0);
+	ret |= check_block(heap, b, 4096, 16, 0);
+	c = mmAllocMem(heap, 4096, 12, HEAP_OFS + 12345);
+	ret |= check_block(heap, c, 4096, 12, HEAP_OFS + 12345);
+
+	/* The whole heap, then nothing more. */
+	ret |= mmFreeMem(a) | mmFreeMem(b) | mmFreeMem(c);
+	a = mmAllocMem(heap, HEAP_SIZE, 0, 0);
+	ret |= check_block(heap, a, HEAP_SIZE, 0, 0);
+	ret |= mmAllocMem(heap, 1, 0, 0) != NULL;
+	ret |= mmFreeMem(a);
+	ret |= mmFreeMem(a) != -1;
+
+	ret |= check_heap(heap, &info);
+	ret |= info.blocks != 1 || info.free_size != HEAP_SIZE;
+
+	/* An exact fit is found even when the fast path can't see it. */
+	a = mmAllocMem(heap, 4096, 12, 0);
+	b = mmAllocMem(heap, 4096, 12, 0);
+	c = mmAllocMem(heap, HEAP_SIZE - 8192, 12, 0);
+	ret |= !a || !b || !c;
+	mmFreeMem(b);
+	b = mmAllocMem(heap, 4096, 12, 0);
+	ret |= check_block(heap, b, 4096, 12, 0);
+	mmFreeMem(a);
+	mmFreeMem(b);
+	mmFreeMem(c);
+
+	mmDestroy(heap);
+
+	if (ret)
+		printf("mmAllocMem contract broken\n");
+
+	return ret;
+}
+
+/*
+ * Textures from 4KB to 7MB, mostly below 256KB, all 4KB aligned and some
+ * of them 64KB aligned.  The live set fills about three quarters of the
+ * heap.  Some requests only take the top half of the heap.
+ */
+static void next_request(int *size, int *align2, int *startSearch,
+			 int restricted)
+{
+	uint32_t r = next_rand();
+
+	*size = 4096 << (r % 16 ? (r >> 4) % 6 : 6 + (r >> 4) % 5);
+	*size += (r >> 8) % 4 * (*size / 4);
+	*align2 = (r >> 16) % 4 ? 12 : 16;
+	*startSearch = restricted && (r >> 20) % 4 == 0 ?
+		       HEAP_OFS + HEAP_SIZE / 2 : 0;
+}
+
+/*
+ * Replaces random slots NUM_OPS times, once timing it and once checking
+ * every result, and reports the state of the heap at the end.
+ */
+static int run_churn(const char *name, int restricted)
+{
+	struct mem_block *heap, *slots[NUM_SLOTS];
+	int size, align2, startSearch;
+	double alloc_time = 0, free_time = 0, start;
+	unsigned int failed = 0;
+	struct heap_info info, check;
+	int pass, i, ret = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+		heap = mmInit(HEAP_OFS, HEAP_SIZE);
+		if (!heap)
+			return 1;
+		for (i = 0; i < NUM_SLOTS; i++)
+			slots[i] = NULL;
+
+		rand_state = 1;
+		for (i = 0; i < NUM_OPS; i++) {
+			struct mem_block **slot = &slots[next_rand() % NUM_SLOTS];
+
+			next_request(&size, &align2, &startSearch, restricted);
+
+			if (pass == 0) {
+				start = get_time();
+				mmFreeMem(*slot);
+				free_time += get_time() - start;
+
+				start = get_time();
+				*slot = mmAllocMem(heap, size, align2,
+						   startSearch);
+				alloc_time += get_time() - start;
+
+				failed += !*slot;
+			} else {
+				mmFreeMem(*slot);
+				*slot = mmAllocMem(heap, size, align2,
+						   startSearch);
+				ret |= check_block(heap, *slot, size, align2,
+						   startSearch);
+				if (i % 1000 == 0)
+					ret |= check_heap(heap, &check);
+			}
+		}
+
+		/* Report where the timed pass ended up. */
+		if (pass == 0)
+			ret |= check_heap(heap, &info);
+		for (i = 0; i < NUM_SLOTS; i++)
+			mmFreeMem(slots[i]);
+		mmDestroy(heap);
+	}
+
+	printf("%-24s %4.0f ns per alloc, %3.0f ns per free, %5u failed, "
+	       "%4d free blocks, largest %4.1f%% of free space\n", name,
+	       alloc_time * 1e9 / NUM_OPS, free_time * 1e9 / NUM_OPS, failed,
+	       info.free_blocks,
+	       info.free_size ? 100.0 * info.largest_free / info.free_size : 0);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_contract();
+	ret |= run_churn("texture churn:", 0);
+	ret |= run_churn("with start restrictions:", 1);
+
+	return ret;
+}
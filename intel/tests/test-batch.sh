@@ -5,6 +5,12 @@ TEST_FILENAME=`echo "$0" | sed 's|.sh||'`
 
 ret=$?
 
+# report the decode throughput alongside the result, if asked to with
+# TEST_DECODE_BENCH=1.
+if test $ret = 0 && test -n "$TEST_DECODE_BENCH"; then
+    ./test_decode $TEST_FILENAME -bench
+fi
+
 # pretty-print a diff showing what happened, and leave the dumped
 # around for possibly moving over the ref.
 if test $ret = 1; then
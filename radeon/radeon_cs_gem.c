@@ -36,7 +36,6 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
 #include <sys/ioctl.h>
 #include "radeon_cs.h"
 #include "radeon_cs_int.h"
@@ -79,10 +78,13 @@ struct cs_gem {
     unsigned                    nrelocs;
     uint32_t                    *relocs;
     struct radeon_bo_int        **relocs_bo;
+    /* open addressing table of reloc index + 1, keyed by bo handle */
+    uint32_t                    *reloc_hash;
+    unsigned                    reloc_hash_bits;
 };
 
-static pthread_mutex_t id_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint32_t cs_id_source = 0;
+/* One bit per cs, for the reloc_in_cs filter of the bos */
+static atomic_t cs_id_source;
 
 /**
  * result is undefined if called with ~0
@@ -95,22 +97,23 @@ static uint32_t get_first_zero(const uint32_t n)
 
 /**
  * Returns a free id for cs.
- * If there is no free id we return zero
+ * If there is no free id we return zero, and the cs looks its relocs up
+ * without the reloc_in_cs filter.
  **/
 static uint32_t generate_id(void)
 {
-    uint32_t r = 0;
-    pthread_mutex_lock( &id_mutex );
-    /* check for free ids */
-    if (cs_id_source != ~r) {
-        /* find first zero bit */
-        r = get_first_zero(cs_id_source);
-
-        /* set id as reserved */
-        cs_id_source |= r;
+    uint32_t old, r;
+
+    for (;;) {
+        old = atomic_read(&cs_id_source);
+        /* check for free ids */
+        if (old == ~0u)
+            return 0;
+        /* find first zero bit and set it as reserved */
+        r = get_first_zero(old);
+        if (atomic_cmpxchg_bool(&cs_id_source, old, old | r))
+            return r;
     }
-    pthread_mutex_unlock( &id_mutex );
-    return r;
 }
 
 /**
@@ -118,11 +121,85 @@ static uint32_t generate_id(void)
  **/
 static void free_id(uint32_t id)
 {
-    pthread_mutex_lock( &id_mutex );
+    atomic_dec(&cs_id_source, id);
+}
+
+static unsigned cs_gem_reloc_slot(struct cs_gem *csg, uint32_t handle)
+{
+    return (handle * 2654435761u) >> (32 - csg->reloc_hash_bits);
+}
+
+/**
+ * Returns the reloc of handle in this cs, or NULL if there is none.
+ **/
+static struct cs_reloc_gem *cs_gem_find_reloc(struct cs_gem *csg,
+                                              uint32_t handle,
+                                              uint32_t *idx)
+{
+    unsigned mask = (1 << csg->reloc_hash_bits) - 1;
+    unsigned slot = cs_gem_reloc_slot(csg, handle);
+    struct cs_reloc_gem *reloc;
 
-    cs_id_source &= ~id;
+    for (; csg->reloc_hash[slot]; slot = (slot + 1) & mask) {
+        *idx = (csg->reloc_hash[slot] - 1) * RELOC_SIZE;
+        reloc = (struct cs_reloc_gem*)&csg->relocs[*idx];
+        if (reloc->handle == handle)
+            return reloc;
+    }
+    return NULL;
+}
+
+static void cs_gem_hash_reloc(struct cs_gem *csg, unsigned i)
+{
+    uint32_t handle = ((struct cs_reloc_gem*)&csg->relocs[i * RELOC_SIZE])->handle;
+    unsigned mask = (1 << csg->reloc_hash_bits) - 1;
+    unsigned slot = cs_gem_reloc_slot(csg, handle);
+    struct cs_reloc_gem *reloc;
 
-    pthread_mutex_unlock( &id_mutex );
+    for (; csg->reloc_hash[slot]; slot = (slot + 1) & mask) {
+        reloc = (struct cs_reloc_gem*)
+            &csg->relocs[(csg->reloc_hash[slot] - 1) * RELOC_SIZE];
+        if (reloc->handle == handle)
+            break;
+    }
+    csg->reloc_hash[slot] = i + 1;
+}
+
+/**
+ * Doubles the room for relocs, keeping the hash at most half full.
+ **/
+static int cs_gem_grow_relocs(struct cs_gem *csg)
+{
+    unsigned nrelocs = csg->nrelocs * 2, i;
+    struct radeon_bo_int **relocs_bo;
+    uint32_t *relocs, *hash;
+
+    hash = (uint32_t*)calloc(2 * nrelocs, sizeof(uint32_t));
+    if (hash == NULL) {
+        return -ENOMEM;
+    }
+    relocs_bo = (struct radeon_bo_int**)realloc(csg->relocs_bo,
+                                                nrelocs * sizeof(void*));
+    if (relocs_bo == NULL) {
+        free(hash);
+        return -ENOMEM;
+    }
+    csg->relocs_bo = relocs_bo;
+    relocs = (uint32_t*)realloc(csg->relocs, nrelocs * RELOC_SIZE * 4);
+    if (relocs == NULL) {
+        free(hash);
+        return -ENOMEM;
+    }
+    csg->base.relocs = csg->relocs = relocs;
+    csg->nrelocs = nrelocs;
+    csg->chunks[1].chunk_data = (uint64_t)(uintptr_t)csg->relocs;
+
+    free(csg->reloc_hash);
+    csg->reloc_hash = hash;
+    csg->reloc_hash_bits++;
+    for (i = 0; i < csg->base.crelocs; i++)
+        cs_gem_hash_reloc(csg, i);
+    return 0;
 }
 
 static struct radeon_cs_int *cs_gem_create(struct radeon_cs_manager *csm,
@@ -163,6 +240,15 @@ static struct radeon_cs_int *cs_gem_create(struct radeon_cs_manager *csm,
         free(csg);
         return NULL;
     }
+    csg->reloc_hash_bits = 9;
+    csg->reloc_hash = (uint32_t*)calloc(2 * csg->nrelocs, sizeof(uint32_t));
+    if (csg->reloc_hash == NULL) {
+        free(csg->relocs);
+        free(csg->relocs_bo);
+        free(csg->base.packets);
+        free(csg);
+        return NULL;
+    }
     csg->chunks[0].chunk_id = RADEON_CHUNK_ID_IB;
     csg->chunks[0].length_dw = 0;
     csg->chunks[0].chunk_data = (uint64_t)(uintptr_t)csg->base.packets;
@@ -182,7 +268,6 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     struct cs_gem *csg = (struct cs_gem*)cs;
     struct cs_reloc_gem *reloc;
     uint32_t idx;
-    unsigned i;
 
     assert(boi->space_accounted);
 
@@ -200,64 +285,48 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
         return -EINVAL;
     }
     /* use bit field hash function to determine
-       if this bo is for sure not in this cs.*/
-    if ((atomic_read((atomic_t *)radeon_gem_get_reloc_in_cs(bo)) & cs->id)) {
-        /* check if bo is already referenced.
-         * Scanning from end to begin reduces cycles with mesa because
-         * it often relocates same shared dma bo again. */
-        for(i = cs->crelocs; i != 0;) {
-            --i;
-            idx = i * RELOC_SIZE;
-            reloc = (struct cs_reloc_gem*)&csg->relocs[idx];
-            if (reloc->handle == bo->handle) {
-                /* Check domains must be in read or write. As we check already
-                 * checked that in argument one of the read or write domain was
-                 * set we only need to check that if previous reloc as the read
-                 * domain set then the read_domain should also be set for this
-                 * new relocation.
-                 */
-                /* the DDX expects to read and write from same pixmap */
-                if (write_domain && (reloc->read_domain & write_domain)) {
-                    reloc->read_domain = 0;
-                    reloc->write_domain = write_domain;
-                } else if (read_domain & reloc->write_domain) {
-                    reloc->read_domain = 0;
-                } else {
-                    if (write_domain != reloc->write_domain)
-                        return -EINVAL;
-                    if (read_domain != reloc->read_domain)
-                        return -EINVAL;
-                }
-
-                reloc->read_domain |= read_domain;
-                reloc->write_domain |= write_domain;
-                /* update flags */
-                reloc->flags |= (flags & reloc->flags);
-                /* write relocation packet */
-                radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
-                radeon_cs_write_dword((struct radeon_cs *)cs, idx);
-                return 0;
+       if this bo is for sure not in this cs, when the cs has a bit.*/
+    if (!cs->id ||
+        (atomic_read((atomic_t *)radeon_gem_get_reloc_in_cs(bo)) & cs->id)) {
+        /* check if bo is already referenced. Relocs that were emitted
+         * have dropped their bo, whose handle may have been reused. */
+        reloc = cs_gem_find_reloc(csg, bo->handle, &idx);
+        if (reloc && csg->relocs_bo[idx / RELOC_SIZE]) {
+            /* Check domains must be in read or write. As we check already
+             * checked that in argument one of the read or write domain was
+             * set we only need to check that if previous reloc as the read
+             * domain set then the read_domain should also be set for this
+             * new relocation.
+             */
+            /* the DDX expects to read and write from same pixmap */
+            if (write_domain && (reloc->read_domain & write_domain)) {
+                reloc->read_domain = 0;
+                reloc->write_domain = write_domain;
+            } else if (read_domain & reloc->write_domain) {
+                reloc->read_domain = 0;
+            } else {
+                if (write_domain != reloc->write_domain)
+                    return -EINVAL;
+                if (read_domain != reloc->read_domain)
+                    return -EINVAL;
             }
+
+            reloc->read_domain |= read_domain;
+            reloc->write_domain |= write_domain;
+            /* update flags */
+            reloc->flags |= (flags & reloc->flags);
+            /* write relocation packet */
+            radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
+            radeon_cs_write_dword((struct radeon_cs *)cs, idx);
+            return 0;
         }
     }
-    /* new relocation */
+    /* new relocation, growing geometrically so that long cs stay linear */
     if (csg->base.crelocs >= csg->nrelocs) {
-        /* allocate more memory (TODO: should use a slab allocatore maybe) */
-        uint32_t *tmp, size;
-        size = ((csg->nrelocs + 1) * sizeof(struct radeon_bo*));
-        tmp = (uint32_t*)realloc(csg->relocs_bo, size);
-        if (tmp == NULL) {
-            return -ENOMEM;
-        }
-        csg->relocs_bo = (struct radeon_bo_int **)tmp;
-        size = ((csg->nrelocs + 1) * RELOC_SIZE * 4);
-        tmp = (uint32_t*)realloc(csg->relocs, size);
-        if (tmp == NULL) {
-            return -ENOMEM;
+        int r = cs_gem_grow_relocs(csg);
+        if (r) {
+            return r;
         }
-        cs->relocs = csg->relocs = tmp;
-        csg->nrelocs += 1;
-        csg->chunks[1].chunk_data = (uint64_t)(uintptr_t)csg->relocs;
     }
     csg->relocs_bo[csg->base.crelocs] = boi;
     idx = (csg->base.crelocs++) * RELOC_SIZE;
@@ -266,6 +335,7 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     reloc->read_domain = read_domain;
     reloc->write_domain = write_domain;
     reloc->flags = flags;
+    cs_gem_hash_reloc(csg, csg->base.crelocs - 1);
     csg->chunks[1].length_dw += RELOC_SIZE;
     radeon_bo_ref(bo);
     /* bo might be referenced from another context so have to use atomic opertions */
@@ -437,6 +507,8 @@ static int cs_gem_emit(struct radeon_cs_int *cs)
 #if CS_BOF_DUMP
     cs_gem_dump_bof(cs);
 #endif
+    /* cs_gem_begin may have moved the packets */
+    csg->chunks[0].chunk_data = (uint64_t)(uintptr_t)cs->packets;
     csg->chunks[0].length_dw = cs->cdw;
 
     chunk_array[0] = (uint64_t)(uintptr_t)&csg->chunks[0];
@@ -466,6 +538,7 @@ static int cs_gem_destroy(struct radeon_cs_int *cs)
     struct cs_gem *csg = (struct cs_gem*)cs;
 
     free_id(cs->id);
+    free(csg->reloc_hash);
     free(csg->relocs_bo);
     free(cs->relocs);
     free(cs->packets);
@@ -488,6 +561,10 @@ static int cs_gem_erase(struct radeon_cs_int *cs)
             }
         }
     }
+    if (cs->crelocs) {
+        memset(csg->reloc_hash, 0,
+               sizeof(uint32_t) << csg->reloc_hash_bits);
+    }
     cs->relocs_total_size = 0;
     cs->cdw = 0;
     cs->section_ndw = 0;
@@ -0,0 +1,261 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Exercises drmModeAtomicCommit() and drmModeAtomicStateCommit() against a
+ * stub DRM_IOCTL_MODE_ATOMIC and reports how long a commit takes.  The stub
+ * checks that the arrays handed to the kernel are sorted, free of
+ * duplicates and carry the last value set for every (object, property)
+ * pair.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#define NUM_OBJECTS	8
+#define NUM_PROPS	32
+#define NUM_REPEATS	4
+#define NUM_COMMITS	20000
+
+static unsigned int errors;
+static unsigned int commits;
+static uint32_t last_count_props;
+
+static uint64_t expected_value(uint32_t obj, uint32_t prop, int repeat)
+{
+	return ((uint64_t)obj << 32) | (prop << 8) | repeat;
+}
+
+static void check_atomic(struct drm_mode_atomic *atomic)
+{
+	uint32_t *objs = (uint32_t *)(uintptr_t)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)(uintptr_t)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)(uintptr_t)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+	uint32_t i, j, k = 0;
+
+	commits++;
+
+	for (i = 0, last_count_props = 0; i < atomic->count_objs; i++)
+		last_count_props += count_props[i];
+
+	if (atomic->count_objs != NUM_OBJECTS) {
+		errors++;
+		return;
+	}
+
+	for (i = 0; i < atomic->count_objs; i++) {
+		if (objs[i] != i + 1 || count_props[i] != NUM_PROPS) {
+			errors++;
+			return;
+		}
+
+		for (j = 0; j < count_props[i]; j++, k++) {
+			if (props[k] != j + 1 ||
+			    values[k] != expected_value(objs[i], props[k],
+							NUM_REPEATS - 1)) {
+				errors++;
+				return;
+			}
+		}
+	}
+}
+
+static void check_delta(struct drm_mode_atomic *atomic)
+{
+	uint32_t *objs = (uint32_t *)(uintptr_t)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)(uintptr_t)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)(uintptr_t)atomic->props_ptr;
+	uint32_t i, j, k = 0;
+
+	commits++;
+
+	for (i = 0, last_count_props = 0; i < atomic->count_objs; i++) {
+		if (i && objs[i] <= objs[i - 1])
+			errors++;
+		for (j = 0; j < count_props[i]; j++, k++)
+			if (j && props[k] <= props[k - 1])
+				errors++;
+		last_count_props += count_props[i];
+	}
+}
+
+static void (*check)(struct drm_mode_atomic *atomic) = check_atomic;
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (request != DRM_IOCTL_MODE_ATOMIC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	check(arg);
+	return 0;
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static drmModeAtomicReqPtr build_request(void)
+{
+	drmModeAtomicReqPtr req;
+	uint32_t obj, prop;
+	int repeat;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return NULL;
+
+	/* Add the properties back to front, setting each one several times. */
+	for (repeat = 0; repeat < NUM_REPEATS; repeat++)
+		for (obj = NUM_OBJECTS; obj > 0; obj--)
+			for (prop = NUM_PROPS; prop > 0; prop--)
+				drmModeAtomicAddProperty(req, obj, prop,
+							 expected_value(obj, prop, repeat));
+
+	return req;
+}
+
+static int test_state(void)
+{
+	drmModeAtomicStatePtr state;
+	double start, elapsed;
+	uint32_t obj, prop;
+	int i, ret = 0;
+
+	check = check_delta;
+	commits = 0;
+
+	state = drmModeAtomicStateAlloc();
+	if (!state)
+		return 1;
+
+	for (obj = NUM_OBJECTS; obj > 0; obj--)
+		for (prop = NUM_PROPS; prop > 0; prop--)
+			drmModeAtomicStateSetProperty(state, obj, prop,
+						      expected_value(obj, prop, 0));
+
+	/* The first commit sends everything, in order. */
+	check = check_atomic;
+	for (obj = 1; obj <= NUM_OBJECTS; obj++)
+		for (prop = 1; prop <= NUM_PROPS; prop++)
+			drmModeAtomicStateSetProperty(state, obj, prop,
+						      expected_value(obj, prop,
+								     NUM_REPEATS - 1));
+	ret |= drmModeAtomicStateCommit(-1, state, 0, NULL);
+	ret |= errors || last_count_props != NUM_OBJECTS * NUM_PROPS;
+	check = check_delta;
+
+	/* Setting the same values again must not reach the kernel. */
+	drmModeAtomicStateSetProperty(state, 1, 1,
+				      expected_value(1, 1, NUM_REPEATS - 1));
+	ret |= drmModeAtomicStateCommit(-1, state, 0, NULL);
+	ret |= commits != 1;
+
+	/* Test-only commits leave the changes pending. */
+	drmModeAtomicStateSetProperty(state, 2, 3, 0);
+	drmModeAtomicStateSetProperty(state, 5, 7, 0);
+	drmModeAtomicStateCommit(-1, state, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	ret |= last_count_props != 2;
+	drmModeAtomicStateCommit(-1, state, 0, NULL);
+	ret |= last_count_props != 2 || commits != 3;
+
+	drmModeAtomicStateInvalidate(state);
+	drmModeAtomicStateCommit(-1, state, 0, NULL);
+	ret |= last_count_props != NUM_OBJECTS * NUM_PROPS;
+
+	start = get_time();
+	for (i = 0; i < NUM_COMMITS; i++) {
+		drmModeAtomicStateSetProperty(state, 1 + i % NUM_OBJECTS, 1, i);
+		drmModeAtomicStateCommit(-1, state, 0, NULL);
+	}
+	elapsed = get_time() - start;
+	ret |= last_count_props != 1;
+
+	printf("%d state commits of 1 changed property out of %d: "
+	       "%.3f us/commit, %u bad\n",
+	       NUM_COMMITS, NUM_OBJECTS * NUM_PROPS,
+	       elapsed * 1e6 / NUM_COMMITS, errors);
+
+	drmModeAtomicStateFree(state);
+
+	return ret || errors;
+}
+
+int main(void)
+{
+	drmModeAtomicReqPtr req, dup;
+	double start, elapsed;
+	int i, ret;
+
+	req = build_request();
+	if (!req)
+		return 1;
+
+	ret = drmModeAtomicCommit(-1, req, 0, NULL);
+	if (ret || errors) {
+		printf("Commit produced a bad request (ret = %d)\n", ret);
+		return 1;
+	}
+
+	/* Merged requests must still resolve to the value added last. */
+	dup = drmModeAtomicDuplicate(req);
+	drmModeAtomicSetCursor(req, 0);
+	drmModeAtomicMerge(req, dup);
+	drmModeAtomicFree(dup);
+
+	start = get_time();
+	for (i = 0; i < NUM_COMMITS; i++)
+		drmModeAtomicCommit(-1, req, 0, NULL);
+	elapsed = get_time() - start;
+
+	printf("%d commits of %d items: %.3f us/commit, %u bad\n",
+	       NUM_COMMITS, drmModeAtomicGetCursor(req),
+	       elapsed * 1e6 / NUM_COMMITS, errors);
+
+	drmModeAtomicFree(req);
+
+	if (errors != 0 || commits != NUM_COMMITS + 1)
+		return 1;
+
+	return test_state();
+}
@@ -0,0 +1,296 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/*
+ * Builds a fake /dev/dri and sysfs tree with a number of PCI GPUs under a
+ * temporary directory, points LIBDRM_DEVICE_ROOT at it and checks that
+ * the device table follows nodes being added and removed.  Creating the
+ * device nodes needs CAP_MKNOD; the test is skipped without it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "xf86drm.h"
+
+#define NUM_GPUS	8
+#define NUM_LOOKUPS	1000
+#define RENDER_MINOR	128
+
+static char root[] = "/tmp/drmdevice-XXXXXX";
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const void *data, size_t size)
+{
+	FILE *f = fopen(path, "w");
+	int ret;
+
+	if (!f)
+		return -1;
+	ret = fwrite(data, 1, size, f) != size;
+	return fclose(f) || ret ? -1 : 0;
+}
+
+static uint16_t gpu_vendor(int gpu)
+{
+	return gpu < NUM_GPUS / 2 ? 0x8086 : 0x1002;
+}
+
+/* Populates the sysfs directory of one minor as a PCI device at bus 'gpu'. */
+static int add_sysfs(int minor, int gpu)
+{
+	unsigned char config[64];
+	char path[256], uevent[128];
+
+	snprintf(path, sizeof path, "%s/sys/dev/char/226:%d", root, minor);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof path, "%s/sys/dev/char/226:%d/device", root, minor);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof path,
+		 "%s/sys/dev/char/226:%d/device/subsystem", root, minor);
+	if (symlink("../../../bus/pci", path) && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof path,
+		 "%s/sys/dev/char/226:%d/device/uevent", root, minor);
+	snprintf(uevent, sizeof uevent,
+		 "DRIVER=fake\nPCI_SLOT_NAME=0000:%02x:00.0\n", gpu);
+	if (write_file(path, uevent, strlen(uevent)))
+		return -1;
+
+	memset(config, 0, sizeof config);
+	config[0] = gpu_vendor(gpu) & 0xff;
+	config[1] = gpu_vendor(gpu) >> 8;
+	config[2] = 0x10 + gpu;
+	config[8] = 1;
+
+	snprintf(path, sizeof path,
+		 "%s/sys/dev/char/226:%d/device/config", root, minor);
+	return write_file(path, config, sizeof config);
+}
+
+static int add_node(const char *name, int minor, int gpu)
+{
+	char path[256];
+
+	snprintf(path, sizeof path, "%s/dev/dri/%s", root, name);
+	if (mknod(path, S_IFCHR | 0666, makedev(226, minor)))
+		return -1;
+
+	return add_sysfs(minor, gpu);
+}
+
+/* All GPUs but the last one get a render node. */
+static int add_gpu(int gpu)
+{
+	char name[32];
+
+	snprintf(name, sizeof name, "card%d", gpu);
+	if (add_node(name, gpu, gpu))
+		return -1;
+
+	if (gpu == NUM_GPUS - 1)
+		return 0;
+
+	snprintf(name, sizeof name, "renderD%d", RENDER_MINOR + gpu);
+	return add_node(name, RENDER_MINOR + gpu, gpu);
+}
+
+static int remove_gpu(int gpu)
+{
+	char path[256];
+
+	snprintf(path, sizeof path, "%s/dev/dri/card%d", root, gpu);
+	if (unlink(path))
+		return -1;
+
+	snprintf(path, sizeof path, "%s/dev/dri/renderD%d", root,
+		 RENDER_MINOR + gpu);
+	return unlink(path);
+}
+
+static int make_dirs(void)
+{
+	static const char *dirs[] = { "/dev", "/dev/dri", "/sys", "/sys/dev",
+				      "/sys/dev/char" };
+	char path[256];
+	unsigned int i;
+
+	for (i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+		snprintf(path, sizeof path, "%s%s", root, dirs[i]);
+		if (mkdir(path, 0755))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static int count_devices(int vendor, int bus, int nodes)
+{
+	drmDeviceFilter filter;
+
+	memset(&filter, 0, sizeof filter);
+	if (vendor >= 0) {
+		filter.flags |= DRM_DEVICE_FILTER_VENDOR;
+		filter.vendor_id = vendor;
+	}
+	if (bus >= 0) {
+		filter.flags |= DRM_DEVICE_FILTER_BUS;
+		filter.pci_bus.bus = bus;
+	}
+	filter.available_nodes = nodes;
+
+	return drmGetDevicesFiltered(&filter, NULL, 0);
+}
+
+static int check_devices(int first, int last)
+{
+	drmDevicePtr devices[NUM_GPUS + 1];
+	int count, i, gpu, ret = 0;
+
+	count = drmGetDevices(devices, NUM_GPUS + 1);
+	if (count != last - first + 1)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		gpu = devices[i]->businfo.pci->bus;
+		ret |= gpu < first || gpu > last;
+		ret |= devices[i]->bustype != DRM_BUS_PCI;
+		ret |= devices[i]->deviceinfo.pci->vendor_id != gpu_vendor(gpu);
+		ret |= devices[i]->deviceinfo.pci->device_id != 0x10 + gpu;
+		ret |= devices[i]->deviceinfo.pci->revision_id != 1;
+		ret |= !(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY));
+		ret |= !devices[i]->nodes[DRM_NODE_PRIMARY];
+		ret |= !!(devices[i]->available_nodes & (1 << DRM_NODE_RENDER)) !=
+		       (gpu != NUM_GPUS - 1);
+	}
+	drmFreeDevices(devices, count);
+
+	return ret;
+}
+
+static int check_fd(const char *name, int gpu)
+{
+	drmDevicePtr device;
+	char path[256];
+	int fd, ret;
+
+	/* O_PATH gives a descriptor for the node without a driver behind it. */
+	snprintf(path, sizeof path, "%s/dev/dri/%s", root, name);
+	fd = open(path, O_PATH);
+	if (fd < 0)
+		return 1;
+
+	ret = drmGetDevice(fd, &device);
+	close(fd);
+	if (ret)
+		return 1;
+
+	ret = device->businfo.pci->bus != gpu ||
+	      strncmp(device->nodes[DRM_NODE_PRIMARY], root, strlen(root));
+	drmFreeDevices(&device, 1);
+
+	return ret;
+}
+
+int main(void)
+{
+	double start, cold, warm;
+	int i, ret = 0;
+
+	if (!mkdtemp(root))
+		return 1;
+	setenv("LIBDRM_DEVICE_ROOT", root, 1);
+
+	if (make_dirs())
+		ret = 1;
+	for (i = 0; !ret && i < NUM_GPUS; i++) {
+		if (add_gpu(i)) {
+			ret = errno == EPERM ? 77 : 1;
+			if (ret == 77)
+				printf("Cannot create device nodes, skipping\n");
+		}
+	}
+	if (ret)
+		goto out;
+
+	start = get_time();
+	ret |= check_devices(0, NUM_GPUS - 1);
+	cold = get_time() - start;
+
+	start = get_time();
+	for (i = 0; i < NUM_LOOKUPS; i++)
+		ret |= drmGetDevices(NULL, 0) != NUM_GPUS;
+	warm = (get_time() - start) / NUM_LOOKUPS;
+
+	ret |= count_devices(0x8086, -1, 0) != NUM_GPUS / 2;
+	ret |= count_devices(0x1002, 5, 0) != 1;
+	ret |= count_devices(0x8086, 5, 0) != 0;
+	ret |= count_devices(-1, -1, 1 << DRM_NODE_RENDER) != NUM_GPUS - 1;
+
+	ret |= check_fd("card3", 3);
+	ret |= check_fd("renderD130", 2);
+
+	/* New and removed nodes must show up without any explicit flush. */
+	ret |= add_gpu(NUM_GPUS);
+	ret |= check_devices(0, NUM_GPUS);
+	ret |= check_fd("renderD136", NUM_GPUS);
+	ret |= remove_gpu(0);
+	ret |= check_devices(1, NUM_GPUS);
+
+	printf("%d devices: first scan %.1f us, cached lookup %.2f us\n",
+	       NUM_GPUS, cold * 1e6, warm * 1e6);
+
+out:
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -38,6 +38,7 @@
  *
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -106,6 +107,97 @@ static double do_time(int size, int iter)
     return usec;
 }
 
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long ka = *(const unsigned long *)a;
+    unsigned long kb = *(const unsigned long *)b;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static double elapsed_usec(struct timeval *start, struct timeval *stop)
+{
+    return (double)(stop->tv_sec * 1000000 + stop->tv_usec
+		    - start->tv_sec * 1000000 - start->tv_usec);
+}
+
+/* Compare a list built by inserting keys in random order, whose entries
+   end up scattered relative to list order, with one bulk-loaded from the
+   sorted keys, whose entries are laid out in order. */
+static int do_layout(int size, int iter)
+{
+    static unsigned long keys[100000];
+    static unsigned long sorted[100000];
+    static void          *values[100000];
+    void           *random_list, *sorted_list, *list;
+    void           *ranstate, *value;
+    struct timeval start, stop;
+    unsigned long  key, sum;
+    int            i, j, n, l, ret = 0;
+
+    ranstate = drmRandomCreate(54321);
+    for (i = 0; i < size; i++) {
+	keys[i] = drmRandom(ranstate);
+	sorted[i] = keys[i];
+    }
+    drmRandomDestroy(ranstate);
+
+    qsort(sorted, size, sizeof(sorted[0]), compare_keys);
+    for (i = 1, n = 1; i < size; i++)
+	if (sorted[i] != sorted[n - 1]) sorted[n++] = sorted[i];
+
+    for (i = 0; i < n; i++)
+	values[i] = (void *)sorted[i];
+
+    random_list = drmSLCreate();
+    for (i = 0; i < size; i++)
+	drmSLInsert(random_list, keys[i], (void *)keys[i]);
+
+    sorted_list = drmSLCreate();
+    gettimeofday(&start, NULL);
+    ret |= drmSLInsertSorted(sorted_list, sorted, values, n);
+    gettimeofday(&stop, NULL);
+    printf("bulk load of %d keys: %0.2f microseconds/key\n",
+	   n, elapsed_usec(&start, &stop) / n);
+
+    for (l = 0; l < 2; l++) {
+	list = l ? sorted_list : random_list;
+
+	gettimeofday(&start, NULL);
+	for (j = 0; j < iter; j++) {
+	    for (i = 0; i < size; i++) {
+		if (drmSLLookup(list, keys[i], &value) ||
+		    value != (void *)keys[i])
+		    ret = 1;
+	    }
+	}
+	gettimeofday(&stop, NULL);
+	printf("%s: %0.3f microseconds/lookup, ",
+	       l ? "bulk loaded" : "random insert",
+	       elapsed_usec(&start, &stop) / (size * iter));
+
+	/* Walk the middle half of the key space with drmSLRange. */
+	gettimeofday(&start, NULL);
+	for (j = 0, sum = 0; j < iter; j++) {
+	    if (drmSLRange(list, sorted[n / 4], sorted[3 * n / 4],
+			   &key, &value)) {
+		do {
+		    sum++;
+		} while (drmSLNext(list, &key, &value));
+	    }
+	}
+	gettimeofday(&stop, NULL);
+	printf("%0.3f microseconds/range step\n",
+	       elapsed_usec(&start, &stop) / sum);
+	ret |= sum != (unsigned long)(3 * n / 4 - n / 4 + 1) * iter;
+    }
+
+    drmSLDestroy(random_list);
+    drmSLDestroy(sorted_list);
+
+    return ret;
+}
+
 static void print_neighbors(void *list, unsigned long key)
 {
     unsigned long prev_key = 0;
@@ -125,6 +217,7 @@ int main(void)
 {
     void*    list;
     double   usec, usec2, usec3, usec4;
+    int      ret = 0;
 
     list = drmSLCreate();
     printf( "list at %p\n", list);
@@ -151,6 +244,39 @@ int main(void)
     print(list);
     printf("\n==============================\n\n");
 
+    {
+	unsigned long keys[] = { 300, 400, 500 };
+	unsigned long key;
+	void          *value;
+
+	drmSLInsertSorted(list, keys, NULL, 3);
+	if (drmSLRange(list, 200, 400, &key, &value)) {
+	    do {
+		printf("key in [200, 400] = %5lu\n", key);
+	    } while (drmSLNext(list, &key, &value));
+	}
+	printf("\n==============================\n\n");
+    }
+
+    {
+	unsigned long keys[] = { 600, ULONG_MAX };
+	unsigned long key, prev = 0;
+	void          *value;
+	int           tail = 0;
+
+	/* ULONG_MAX is a valid key, and must not be appended twice. */
+	drmSLInsert(list, ULONG_MAX, NULL);
+	ret |= drmSLInsertSorted(list, keys, NULL, 2) < 0;
+	if (drmSLFirst(list, &key, &value)) {
+	    do {
+		ret |= key <= prev && prev;
+		tail += key == ULONG_MAX;
+		prev = key;
+	    } while (drmSLNext(list, &key, &value));
+	}
+	ret |= tail != 1 || drmSLLookup(list, 600, &value);
+    }
+
     drmSLDump(list);
     drmSLDestroy(list);
     printf("\n==============================\n\n");
@@ -167,6 +293,10 @@ int main(void)
     usec4 = do_time(100000, 4);
     printf("Table size increased by %0.2f, search time increased by %0.2f\n",
 	   100000.0/100.0, usec4 / usec);
+    printf("\n==============================\n\n");
+
+    ret |= do_layout(1000, 500);
+    ret |= do_layout(100000, 4);
 
-    return 0;
+    return ret;
 }
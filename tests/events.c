@@ -0,0 +1,171 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Feeds vblank, flip and unknown events through a pipe standing in for the
+ * DRM fd, and compares drmHandleEvent() with the batched event queue.  All
+ * events are 32 bytes so that reads from the pipe never split one, which
+ * the DRM fd guarantees by itself.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+
+#define NUM_CRTCS	6
+#define NUM_EVENTS	4096
+#define EVENT_UNKNOWN	0x80000000
+
+static unsigned int handled;
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_event(int fd, uint32_t type, uint32_t i)
+{
+	struct drm_event_vblank vblank;
+	struct {
+		struct drm_event base;
+		uint32_t payload[6];
+	} unknown;
+
+	if (type == EVENT_UNKNOWN) {
+		memset(&unknown, 0, sizeof unknown);
+		unknown.base.type = type;
+		unknown.base.length = sizeof unknown;
+		unknown.payload[0] = i;
+		if (write(fd, &unknown, sizeof unknown) != sizeof unknown)
+			abort();
+		return;
+	}
+
+	memset(&vblank, 0, sizeof vblank);
+	vblank.base.type = type;
+	vblank.base.length = sizeof vblank;
+	vblank.user_data = i;
+	vblank.tv_sec = i / 1000;
+	vblank.tv_usec = i % 1000;
+	vblank.sequence = i;
+	vblank.crtc_id = 100 + i % NUM_CRTCS;
+	if (write(fd, &vblank, sizeof vblank) != sizeof vblank)
+		abort();
+}
+
+static uint32_t event_type(uint32_t i)
+{
+	if (i % 7 == 6)
+		return EVENT_UNKNOWN;
+	return i & 1 ? DRM_EVENT_FLIP_COMPLETE : DRM_EVENT_VBLANK;
+}
+
+static int check_record(const drmEventRecord *r, uint32_t i)
+{
+	if (r->type != event_type(i))
+		return 1;
+
+	if (r->type == EVENT_UNKNOWN)
+		return r->crtc_id != 0 || ((const uint32_t *)(r->event + 1))[0] != i;
+
+	return r->crtc_id != 100 + i % NUM_CRTCS ||
+	       r->sequence != i ||
+	       r->user_data != (void *)(uintptr_t)i ||
+	       r->timestamp != (i / 1000) * 1000000000ull + (i % 1000) * 1000ull;
+}
+
+static void handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		    unsigned int tv_usec, void *user_data)
+{
+	handled++;
+}
+
+int main(void)
+{
+	drmEventContext evctx;
+	drmEventQueuePtr queue;
+	drmEventRecord events[64];
+	double start, legacy, batched;
+	unsigned int expected = 0;
+	uint32_t i, next = 0;
+	int fds[2], count, j, ret = 0;
+
+	if (pipe(fds))
+		return 1;
+
+	/* Legacy path: one read of at most 1024 bytes per call. */
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.vblank_handler = handler;
+	evctx.page_flip_handler = handler;
+
+	start = get_time();
+	for (i = 0; i < NUM_EVENTS; i++) {
+		write_event(fds[1], event_type(i), i);
+		expected += event_type(i) != EVENT_UNKNOWN;
+		if (i % 64 == 63)
+			while (handled < expected)
+				drmHandleEvent(fds[0], &evctx);
+	}
+	legacy = get_time() - start;
+
+	/* Batched path: a queue larger than what we ask for per call, so
+	 * that leftovers have to be carried over between calls.
+	 */
+	queue = drmEventQueueCreate(fds[0], 64 * 1024);
+	if (!queue)
+		return 1;
+
+	start = get_time();
+	for (i = 0; i < NUM_EVENTS; i++) {
+		write_event(fds[1], event_type(i), i);
+		if (i % 64 != 63)
+			continue;
+		while (next <= i) {
+			count = drmEventQueueRead(queue, events, 16);
+			if (count <= 0) {
+				ret = 1;
+				break;
+			}
+			for (j = 0; j < count; j++)
+				ret |= check_record(&events[j], next++);
+		}
+	}
+	batched = get_time() - start;
+
+	drmEventQueueDestroy(queue);
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%u events: drmHandleEvent %.3f us/event, "
+	       "drmEventQueueRead %.3f us/event\n", NUM_EVENTS,
+	       legacy * 1e6 / NUM_EVENTS, batched * 1e6 / NUM_EVENTS);
+
+	return ret || handled != expected || next != NUM_EVENTS;
+}
@@ -70,6 +70,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "xf86drm.h"
 #include "xf86drmHash.h"
@@ -103,19 +104,19 @@ static void update_dist(int count)
 
 static void compute_dist(HashTablePtr table)
 {
-    int           i;
+    unsigned long i;
     HashBucketPtr bucket;
 
-    printf("Entries = %ld, hits = %ld, partials = %ld, misses = %ld\n",
-          table->entries, table->hits, table->partials, table->misses);
+    printf("Entries = %ld, buckets = %ld\n",
+           table->entries, table->maxp + table->p);
     clear_dist();
-    for (i = 0; i < HASH_SIZE; i++) {
-        bucket = table->buckets[i];
+    for (i = 0; i < table->maxp + table->p; i++) {
+        bucket = (*table->directory[i / HASH_SEGMENT_SIZE])[i % HASH_SEGMENT_SIZE];
         update_dist(count_entries(bucket));
     }
     for (i = 0; i < DIST_LIMIT; i++) {
         if (i != DIST_LIMIT-1)
-            printf("%5d %10d\n", i, dist[i]);
+            printf("%5ld %10d\n", i, dist[i]);
         else
             printf("other %10d\n", dist[i]);
     }
@@ -152,6 +153,57 @@ static int check_table(HashTablePtr table,
     return retcode;
 }
 
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time lookups in tables of growing size; with a table that grows, the
+   cost per lookup should stay flat. */
+static int check_scaling(void)
+{
+    HashTablePtr  table;
+    unsigned long i, n, count;
+    double        start, elapsed;
+    void          *value;
+    int           ret = 0;
+
+    printf("\n***** Scaling ****\n");
+    for (n = 1000; n <= 1000000; n *= 10) {
+        table = drmHashCreate();
+        for (i = 0; i < n; i++)
+            drmHashInsert(table, i * 4096, (void *)i);
+
+        start = get_time();
+        for (count = 0; count < 2000000; count++) {
+            i = (count * 7919) % n;
+            if (drmHashLookup(table, i * 4096, &value) || value != (void *)i)
+                ret = 1;
+        }
+        elapsed = get_time() - start;
+
+        /* Remove every other key and make sure the rest survives. */
+        for (i = 0; i < n; i += 2)
+            ret |= drmHashDelete(table, i * 4096) != 0;
+        for (i = 0; i < n; i++)
+            ret |= drmHashLookup(table, i * 4096, &value) != (int)(~i & 1);
+
+        count = 0;
+        if (drmHashFirst(table, &i, &value))
+            do { ++count; } while (drmHashNext(table, &i, &value));
+        ret |= count != n / 2 || table->entries != n / 2;
+
+        printf("%8lu keys, %8lu buckets: %6.1f ns/lookup\n",
+               n, table->maxp + table->p, elapsed * 1e9 / 2000000);
+        drmHashDestroy(table);
+    }
+
+    return ret;
+}
+
 int main(void)
 {
     HashTablePtr  table;
@@ -213,5 +265,7 @@ int main(void)
     compute_dist(table);
     drmHashDestroy(table);
 
+    ret |= check_scaling();
+
     return ret;
 }
@@ -0,0 +1,397 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Walks the KMS topology of a mocked device the way modetest does, with and
+ * without the KMS object cache, and reports the number of ioctls issued.
+ * Then changes a property while another thread keeps reading it, and checks
+ * that the cache never hands out the value from before the change.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#define NUM_CRTCS	3
+#define NUM_CONNECTORS	6
+#define NUM_PLANES	9
+#define NUM_PROPS	8
+#define NUM_PASSES	100
+#define NUM_CHANGES	200
+
+#define CRTC_ID(i)	(10 + (i))
+#define CONNECTOR_ID(i)	(20 + (i))
+#define ENCODER_ID(i)	(40 + (i))
+#define PLANE_ID(i)	(60 + (i))
+#define PROP_ID(i)	(100 + (i))
+
+static unsigned int ioctls;
+
+/* The one property value that can be changed, of the last crtc. */
+static volatile uint64_t crtc_value;
+static volatile int slow_reads, done;
+
+static void fill_ids(uint64_t ptr, uint32_t count, uint32_t base)
+{
+	uint32_t *ids = (uint32_t *)(uintptr_t)ptr;
+	uint32_t i;
+
+	for (i = 0; ids && i < count; i++)
+		ids[i] = base + i;
+}
+
+static void fake_get_resources(struct drm_mode_card_res *res)
+{
+	if (res->count_crtcs >= NUM_CRTCS)
+		fill_ids(res->crtc_id_ptr, NUM_CRTCS, CRTC_ID(0));
+	if (res->count_connectors >= NUM_CONNECTORS)
+		fill_ids(res->connector_id_ptr, NUM_CONNECTORS, CONNECTOR_ID(0));
+	if (res->count_encoders >= NUM_CONNECTORS)
+		fill_ids(res->encoder_id_ptr, NUM_CONNECTORS, ENCODER_ID(0));
+
+	res->count_fbs = 0;
+	res->count_crtcs = NUM_CRTCS;
+	res->count_connectors = NUM_CONNECTORS;
+	res->count_encoders = NUM_CONNECTORS;
+	res->max_width = res->max_height = 8192;
+}
+
+static void fake_get_connector(struct drm_mode_get_connector *conn)
+{
+	uint32_t index = conn->connector_id - CONNECTOR_ID(0);
+
+	if (conn->count_props >= NUM_PROPS) {
+		uint64_t *values = (uint64_t *)(uintptr_t)conn->prop_values_ptr;
+		uint32_t i;
+
+		fill_ids(conn->props_ptr, NUM_PROPS, PROP_ID(0));
+		for (i = 0; i < NUM_PROPS; i++)
+			values[i] = index * i;
+	}
+	if (conn->count_modes >= 2) {
+		struct drm_mode_modeinfo *modes =
+			(struct drm_mode_modeinfo *)(uintptr_t)conn->modes_ptr;
+
+		memset(modes, 0, 2 * sizeof(*modes));
+		modes[0].hdisplay = 1920;
+		modes[1].hdisplay = 1280;
+	}
+	if (conn->count_encoders >= 1)
+		fill_ids(conn->encoders_ptr, 1, ENCODER_ID(index));
+
+	conn->count_props = NUM_PROPS;
+	conn->count_modes = 2;
+	conn->count_encoders = 1;
+	conn->encoder_id = ENCODER_ID(index);
+	conn->connection = DRM_MODE_CONNECTED;
+}
+
+static void fake_get_plane(struct drm_mode_get_plane *plane)
+{
+	if (plane->count_format_types >= 4)
+		fill_ids(plane->format_type_ptr, 4, 0x34325258);
+
+	plane->count_format_types = 4;
+	plane->possible_crtcs = (1 << NUM_CRTCS) - 1;
+}
+
+static void fake_get_object_properties(struct drm_mode_obj_get_properties *props)
+{
+	if (props->count_props >= NUM_PROPS) {
+		uint64_t *values = (uint64_t *)(uintptr_t)props->prop_values_ptr;
+		uint32_t i;
+
+		fill_ids(props->props_ptr, NUM_PROPS, PROP_ID(0));
+		for (i = 0; i < NUM_PROPS; i++)
+			values[i] = props->obj_id + i;
+		if (props->obj_id == CRTC_ID(NUM_CRTCS - 1))
+			values[0] += crtc_value;
+	}
+
+	/* Let a change land between reading the state and replying. */
+	if (slow_reads) {
+		struct timespec ts = { 0, 20000 };
+
+		nanosleep(&ts, NULL);
+	}
+
+	props->count_props = NUM_PROPS;
+}
+
+/* Takes a while, so that reads start while the change is under way. */
+static int fake_set_property(struct drm_mode_obj_set_property *prop)
+{
+	struct timespec ts = { 0, 100000 };
+
+	if (prop->obj_id != CRTC_ID(NUM_CRTCS - 1) ||
+	    prop->prop_id != PROP_ID(0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nanosleep(&ts, NULL);
+	crtc_value = prop->value;
+	return 0;
+}
+
+static void fake_get_property(struct drm_mode_get_property *prop)
+{
+	if (prop->count_enum_blobs >= 2) {
+		struct drm_mode_property_enum *enums =
+			(struct drm_mode_property_enum *)(uintptr_t)prop->enum_blob_ptr;
+		uint64_t *values = (uint64_t *)(uintptr_t)prop->values_ptr;
+
+		memset(enums, 0, 2 * sizeof(*enums));
+		strcpy(enums[0].name, "Off");
+		strcpy(enums[1].name, "On");
+		enums[1].value = values[1] = 1;
+		values[0] = 0;
+	}
+
+	snprintf(prop->name, sizeof(prop->name), "prop%u", prop->prop_id);
+	prop->flags = DRM_MODE_PROP_ENUM;
+	prop->count_values = 2;
+	prop->count_enum_blobs = 2;
+}
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	__sync_fetch_and_add(&ioctls, 1);
+
+	switch (request) {
+	case DRM_IOCTL_MODE_GETRESOURCES:
+		fake_get_resources(arg);
+		return 0;
+	case DRM_IOCTL_MODE_GETCONNECTOR:
+		fake_get_connector(arg);
+		return 0;
+	case DRM_IOCTL_MODE_GETPLANE:
+		fake_get_plane(arg);
+		return 0;
+	case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+		fake_get_object_properties(arg);
+		return 0;
+	case DRM_IOCTL_MODE_GETPROPERTY:
+		fake_get_property(arg);
+		return 0;
+	case DRM_IOCTL_MODE_OBJ_SETPROPERTY:
+		return fake_set_property(arg);
+	case DRM_IOCTL_MODE_SETPLANE:
+	case DRM_IOCTL_MODE_PAGE_FLIP:
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* Returns a checksum of everything that was read back. */
+static uint64_t dump_properties(int fd, uint32_t id, uint32_t type)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint64_t sum = 0;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, id, type);
+	if (!props)
+		return ~0ull;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			return ~0ull;
+		sum += props->prop_values[i] + prop->enums[1].value +
+		       prop->name[4];
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return sum;
+}
+
+static uint64_t dump(int fd)
+{
+	drmModeResPtr res;
+	drmModeConnectorPtr conn;
+	drmModePlanePtr plane;
+	uint64_t sum = 0;
+	int i;
+
+	res = drmModeGetResources(fd);
+	if (!res)
+		return ~0ull;
+
+	for (i = 0; i < res->count_connectors; i++) {
+		conn = drmModeGetConnector(fd, res->connectors[i]);
+		if (!conn)
+			return ~0ull;
+		sum += conn->modes[1].hdisplay + conn->encoders[0];
+		sum += dump_properties(fd, conn->connector_id,
+				       DRM_MODE_OBJECT_CONNECTOR);
+		drmModeFreeConnector(conn);
+	}
+
+	for (i = 0; i < res->count_crtcs; i++)
+		sum += dump_properties(fd, res->crtcs[i], DRM_MODE_OBJECT_CRTC);
+
+	for (i = 0; i < NUM_PLANES; i++) {
+		plane = drmModeGetPlane(fd, PLANE_ID(i));
+		if (!plane)
+			return ~0ull;
+		sum += plane->formats[3] + plane->possible_crtcs;
+		sum += dump_properties(fd, PLANE_ID(i), DRM_MODE_OBJECT_PLANE);
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreeResources(res);
+
+	return sum;
+}
+
+static uint64_t get_crtc_value(int fd)
+{
+	drmModeObjectPropertiesPtr props;
+	uint64_t value;
+
+	props = drmModeObjectGetProperties(fd, CRTC_ID(NUM_CRTCS - 1),
+					   DRM_MODE_OBJECT_CRTC);
+	if (!props)
+		return ~0ull;
+	value = props->prop_values[0] - CRTC_ID(NUM_CRTCS - 1);
+	drmModeFreeObjectProperties(props);
+
+	return value;
+}
+
+static void *reader(void *arg)
+{
+	int fd = *(int *)arg;
+
+	while (!done)
+		get_crtc_value(fd);
+
+	return NULL;
+}
+
+/* Once a change returned, no reader may bring back the old value. */
+static int test_concurrent_change(int fd)
+{
+	struct timespec ts = { 0, 200000 };
+	pthread_t thread;
+	uint64_t i;
+	int errors = 0;
+
+	if (drmModeCacheEnable(fd))
+		return 1;
+
+	slow_reads = 1;
+	if (pthread_create(&thread, NULL, reader, &fd))
+		return 1;
+
+	for (i = 1; i <= NUM_CHANGES; i++) {
+		drmModeObjectSetProperty(fd, CRTC_ID(NUM_CRTCS - 1),
+					 DRM_MODE_OBJECT_CRTC, PROP_ID(0), i);
+		/* Give a read that started before the change time to end. */
+		nanosleep(&ts, NULL);
+		errors += get_crtc_value(fd) != i;
+	}
+
+	done = 1;
+	pthread_join(thread, NULL);
+	slow_reads = 0;
+	drmModeCacheDisable(fd);
+
+	if (errors)
+		printf("%d of %d reads after a change were stale\n", errors,
+		       NUM_CHANGES);
+	return errors != 0;
+}
+
+int main(void)
+{
+	unsigned int uncached, cached, after_flush, after_flip;
+	uint64_t expected, sum;
+	int fd = 3;
+	int i, ret = 0;
+
+	expected = dump(fd);
+	for (i = 1, ioctls = 0; i < NUM_PASSES; i++)
+		ret |= dump(fd) != expected;
+	uncached = ioctls;
+
+	ret |= drmModeCacheEnable(fd);
+	for (i = 0, ioctls = 0; i < NUM_PASSES; i++)
+		ret |= dump(fd) != expected;
+	cached = ioctls;
+
+	/* Changing state must drop the mutable objects, but not the
+	 * property definitions.
+	 */
+	drmModeSetPlane(fd, PLANE_ID(0), CRTC_ID(0), 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	ioctls = 0;
+	sum = dump(fd);
+	after_flush = ioctls;
+	ret |= sum != expected;
+
+	/* A flip only changes the crtc, none of the planes is on it. */
+	drmModePageFlip(fd, CRTC_ID(1), 0, 0, NULL);
+	ioctls = 0;
+	sum = dump(fd);
+	after_flip = ioctls;
+	ret |= sum != expected;
+
+	drmModeCacheInvalidate(fd);
+	drmModeCacheDisable(fd);
+	ret |= dump(fd) != expected;
+
+	printf("%d passes: %u ioctls uncached, %u cached (%u saved)\n",
+	       NUM_PASSES - 1, uncached, cached, uncached - cached);
+	printf("first pass after a state change: %u ioctls\n", after_flush);
+	printf("first pass after a page flip: %u ioctls\n", after_flip);
+
+	/* Only the first cached pass may reach the kernel. */
+	ret |= cached > uncached / (NUM_PASSES - 1);
+	ret |= after_flush == 0 || after_flush >= uncached / (NUM_PASSES - 1);
+	ret |= after_flip == 0 || after_flip >= after_flush;
+
+	ret |= test_concurrent_change(fd);
+
+	return ret;
+}
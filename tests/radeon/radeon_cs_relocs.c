@@ -0,0 +1,386 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Writes command streams referencing thousands of buffers, each several
+ * times and in random order, against a stub DRM_RADEON_CS ioctl that
+ * checks every buffer has exactly one reloc and every reloc packet points
+ * at the right one.  Reports the time per reloc as the streams grow, and
+ * with more streams alive than there are cs ids.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "xf86drm.h"
+#include "radeon_cs.h"
+#include "radeon_cs_gem.h"
+#include "radeon_bo_gem.h"
+
+#define MAX_BOS     8192
+#define REFS        4       /* relocs written per buffer and cs */
+#define ROUNDS      4       /* cs emitted per size */
+#define SHARED_EVERY 8      /* how often the shared buffer comes back */
+#define NUM_STREAMS 48      /* more than the 32 cs ids */
+#define STREAM_BOS  256
+#define NUM_THREADS 4
+#define THREAD_CS   10      /* streams each thread keeps alive */
+#define THREAD_ITERS 500
+
+struct cs_reloc {
+    uint32_t handle;
+    uint32_t read_domain;
+    uint32_t write_domain;
+    uint32_t flags;
+};
+
+struct stream {
+    struct radeon_cs *cs;
+    /* handles in the order their reloc packets were written */
+    uint32_t *expected;
+    unsigned nexpected;
+};
+
+static struct stream *emitting;
+static uint32_t live_ids;
+static uint32_t next_handle = 1;
+static unsigned live_bos, emits, errors;
+static uint32_t seed = 1;
+
+static uint32_t random_u32(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One reloc per handle, and reloc packets in the order they were written. */
+static int fake_cs(struct drm_radeon_cs *cs)
+{
+    static uint8_t seen[MAX_BOS + 1];
+    uint64_t *chunk_array = (uint64_t *)(uintptr_t)cs->chunks;
+    struct drm_radeon_cs_chunk *ib = NULL, *relocs = NULL;
+    struct cs_reloc *r;
+    uint32_t *packets, i, n, nrelocs;
+
+    for (i = 0; i < cs->num_chunks; i++) {
+        struct drm_radeon_cs_chunk *chunk =
+            (struct drm_radeon_cs_chunk *)(uintptr_t)chunk_array[i];
+
+        if (chunk->chunk_id == RADEON_CHUNK_ID_IB)
+            ib = chunk;
+        else if (chunk->chunk_id == RADEON_CHUNK_ID_RELOCS)
+            relocs = chunk;
+    }
+    if (!ib || !relocs) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = (struct cs_reloc *)(uintptr_t)relocs->chunk_data;
+    nrelocs = relocs->length_dw / 4;
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < nrelocs; i++) {
+        if (r[i].handle > MAX_BOS || seen[r[i].handle]++)
+            errors++;
+    }
+
+    packets = (uint32_t *)(uintptr_t)ib->chunk_data;
+    for (i = 0, n = 0; i + 1 < ib->length_dw && packets[i] == 0xc0001000;
+         i += 2, n++) {
+        if (packets[i + 1] % 4 || packets[i + 1] / 4 >= nrelocs ||
+            n >= emitting->nexpected ||
+            r[packets[i + 1] / 4].handle != emitting->expected[n])
+            errors++;
+    }
+    if (n != emitting->nexpected)
+        errors++;
+
+    emits++;
+    return 0;
+}
+
+/* Stands in for the kernel: libdrm's drmIoctl() ends up here. */
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    void *arg;
+
+    va_start(args, request);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    switch (request) {
+    case DRM_IOCTL_RADEON_INFO:
+        *(uint32_t *)(uintptr_t)((struct drm_radeon_info *)arg)->value = 0x6798;
+        return 0;
+    case DRM_IOCTL_RADEON_GEM_CREATE:
+        ((struct drm_radeon_gem_create *)arg)->handle = next_handle++;
+        live_bos++;
+        return 0;
+    case DRM_IOCTL_GEM_CLOSE:
+        live_bos--;
+        return 0;
+    case DRM_IOCTL_RADEON_CS:
+        return fake_cs(arg);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+static int stream_init(struct stream *s, struct radeon_cs_manager *csm,
+                       unsigned nbos)
+{
+    s->expected = malloc(nbos * (REFS + 1) * sizeof(uint32_t));
+    s->nexpected = 0;
+    s->cs = radeon_cs_create(csm, 64 * 1024 / 4);
+    if (!s->expected || !s->cs)
+        return 1;
+
+    radeon_cs_set_limit(s->cs, RADEON_GEM_DOMAIN_GTT, 1 << 30);
+    radeon_cs_set_limit(s->cs, RADEON_GEM_DOMAIN_VRAM, 1 << 30);
+    return 0;
+}
+
+static void stream_fini(struct stream *s)
+{
+    radeon_cs_destroy(s->cs);
+    free(s->expected);
+}
+
+static int stream_emit(struct stream *s)
+{
+    int r;
+
+    emitting = s;
+    r = radeon_cs_emit(s->cs);
+    r |= radeon_cs_erase(s->cs);
+    s->nexpected = 0;
+    return r;
+}
+
+static int write_reloc(struct stream *s, struct radeon_bo *bo)
+{
+    uint32_t read = 0, write = 0;
+    int r;
+
+    /* Even handles are sampled from GTT, odd ones rendered to in VRAM. */
+    if (bo->handle & 1)
+        write = RADEON_GEM_DOMAIN_VRAM;
+    else
+        read = RADEON_GEM_DOMAIN_GTT;
+
+    s->expected[s->nexpected++] = bo->handle;
+    r = radeon_cs_begin(s->cs, 2, __FILE__, __func__, __LINE__);
+    r |= radeon_cs_write_reloc(s->cs, bo, read, write, 0);
+    r |= radeon_cs_end(s->cs, __FILE__, __func__, __LINE__);
+    return r;
+}
+
+static int fill_cs(struct stream *s, struct radeon_bo **bos, unsigned nbos)
+{
+    static unsigned order[MAX_BOS * REFS];
+    unsigned i, j, tmp, n = nbos * REFS;
+    int r = 0;
+
+    for (i = 0; i < n; i++)
+        order[i] = i % nbos;
+    for (i = n - 1; i > 0; i--) {
+        j = random_u32() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    for (i = 0; i < nbos; i++)
+        r |= radeon_cs_space_check_with_bo(s->cs, bos[i],
+                                           bos[i]->handle & 1 ? 0 :
+                                           RADEON_GEM_DOMAIN_GTT,
+                                           bos[i]->handle & 1 ?
+                                           RADEON_GEM_DOMAIN_VRAM : 0);
+
+    for (i = 0; i < n && !r; i++) {
+        r |= write_reloc(s, bos[order[i]]);
+        if (i % SHARED_EVERY == 0)
+            r |= write_reloc(s, bos[0]);
+    }
+    return r;
+}
+
+static int run(struct radeon_cs_manager *csm, struct radeon_bo **bos,
+               unsigned nbos)
+{
+    struct stream s;
+    double start, elapsed = 0;
+    unsigned i, relocs = 0;
+    int r;
+
+    r = stream_init(&s, csm, nbos);
+    for (i = 0; i < ROUNDS && !r; i++) {
+        start = get_time();
+        r |= fill_cs(&s, bos, nbos);
+        elapsed += get_time() - start;
+        relocs += s.nexpected;
+
+        r |= stream_emit(&s);
+    }
+    stream_fini(&s);
+
+    printf("%5u buffers: %6.1f ns per reloc\n", nbos,
+           elapsed * 1e9 / relocs);
+    return r;
+}
+
+/* The streams past the 32nd get no id, and must still dedup their relocs. */
+static int run_many(struct radeon_cs_manager *csm, struct radeon_bo **bos)
+{
+    static struct stream streams[NUM_STREAMS];
+    double start, elapsed[2] = { 0, 0 };
+    unsigned i, relocs[2] = { 0, 0 };
+    int r = 0;
+
+    for (i = 0; i < NUM_STREAMS; i++)
+        r |= stream_init(&streams[i], csm, STREAM_BOS);
+
+    /* All of them hold the same buffers before any is emitted. */
+    for (i = 0; i < NUM_STREAMS && !r; i++) {
+        int no_id = radeon_cs_get_id(streams[i].cs) == 0;
+
+        start = get_time();
+        r |= fill_cs(&streams[i], bos, STREAM_BOS);
+        elapsed[no_id] += get_time() - start;
+        relocs[no_id] += streams[i].nexpected;
+    }
+
+    for (i = 0; i < NUM_STREAMS; i++) {
+        r |= stream_emit(&streams[i]);
+        stream_fini(&streams[i]);
+    }
+
+    printf("%u streams: %6.1f ns per reloc with an id, %6.1f without\n",
+           NUM_STREAMS, elapsed[0] * 1e9 / relocs[0],
+           elapsed[1] * 1e9 / relocs[1]);
+    return r || relocs[1] != (NUM_STREAMS - 32) * relocs[0] / 32;
+}
+
+/* Live streams never share an id bit. */
+static void *churn_ids(void *data)
+{
+    struct radeon_cs_manager *csm = data;
+    struct radeon_cs *cs[THREAD_CS];
+    uint32_t id;
+    unsigned i, j;
+
+    for (i = 0; i < THREAD_ITERS; i++) {
+        for (j = 0; j < THREAD_CS; j++) {
+            cs[j] = radeon_cs_create(csm, 16);
+            if (!cs[j])
+                return (void *)1;
+            id = radeon_cs_get_id(cs[j]);
+            if (__sync_fetch_and_or(&live_ids, id) & id)
+                __sync_fetch_and_add(&errors, 1);
+        }
+        for (j = 0; j < THREAD_CS; j++) {
+            id = radeon_cs_get_id(cs[j]);
+            __sync_fetch_and_and(&live_ids, ~id);
+            radeon_cs_destroy(cs[j]);
+        }
+    }
+    return NULL;
+}
+
+static int run_threads(struct radeon_cs_manager *csm)
+{
+    pthread_t threads[NUM_THREADS];
+    void *ret;
+    int i, r = 0;
+
+    for (i = 0; i < NUM_THREADS; i++)
+        r |= pthread_create(&threads[i], NULL, churn_ids, csm);
+    for (i = 0; i < NUM_THREADS; i++) {
+        r |= pthread_join(threads[i], &ret);
+        r |= ret != NULL;
+    }
+    return r;
+}
+
+int main(void)
+{
+    static struct radeon_bo *bos[MAX_BOS];
+    struct radeon_bo_manager *bom;
+    struct radeon_cs_manager *csm;
+    unsigned i, nbos;
+    int fd, r = 0;
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0)
+        return 1;
+
+    bom = radeon_bo_manager_gem_ctor(fd);
+    csm = radeon_cs_manager_gem_ctor(fd);
+    if (!bom || !csm)
+        return 1;
+
+    for (i = 0; i < MAX_BOS; i++) {
+        bos[i] = radeon_bo_open(bom, 0, 4096, 4096,
+                                RADEON_GEM_DOMAIN_GTT, 0);
+        if (!bos[i])
+            return 1;
+    }
+
+    for (nbos = 256; nbos <= MAX_BOS && !r; nbos *= 2)
+        r |= run(csm, bos, nbos);
+    r |= run_many(csm, bos);
+    r |= run_threads(csm);
+
+    for (i = 0; i < MAX_BOS; i++)
+        radeon_bo_unref(bos[i]);
+    radeon_cs_manager_gem_dtor(csm);
+    radeon_bo_manager_gem_dtor(bom);
+    close(fd);
+
+    if (r || errors || live_bos || emits == 0) {
+        printf("bad relocs (%u errors, %u buffers leaked)\n",
+               errors, live_bos);
+        return 1;
+    }
+    return 0;
+}
@@ -73,6 +73,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "xf86drm.h"
 #include "xf86drmRandom.h"
@@ -94,6 +95,63 @@ static void check_period(unsigned long seed)
     drmRandomDestroy(state);
 }
 
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* drmRandomFill() must produce exactly what drmRandom() would have, and
+   leave the state where drmRandom() would have left it. */
+static int check_fill(unsigned long seed)
+{
+    static const unsigned long sizes[] = { 0, 1, 15, 16, 17, 1000, 4099 };
+    uint32_t      buf[4099];
+    void          *ref, *state;
+    unsigned long i, j;
+    int           ret = 0;
+
+    ref   = drmRandomCreate(seed);
+    state = drmRandomCreate(seed);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	drmRandomFill(state, buf, sizes[i]);
+	for (j = 0; j < sizes[i]; j++)
+	    if (buf[j] != drmRandom(ref)) ret = 1;
+	if (drmRandom(state) != drmRandom(ref)) ret = 1;
+    }
+    printf("drmRandomFill with seed of %10lu: %s\n",
+	   seed, ret ? "*INCORRECT*" : "CORRECT");
+    drmRandomDestroy(state);
+    drmRandomDestroy(ref);
+    return ret;
+}
+
+static void time_fill(void)
+{
+    static uint32_t buf[1024 * 1024];
+    void            *state;
+    double          start, single, bulk;
+    unsigned long   i;
+
+    state = drmRandomCreate(1);
+    start = get_time();
+    for (i = 0; i < sizeof(buf) / sizeof(buf[0]); i++)
+	buf[i] = drmRandom(state);
+    single = get_time() - start;
+
+    start = get_time();
+    drmRandomFill(state, buf, sizeof(buf) / sizeof(buf[0]));
+    bulk = get_time() - start;
+    drmRandomDestroy(state);
+
+    printf("%lu values: drmRandom %.2f ns/value, drmRandomFill %.2f ns/value\n",
+	   (unsigned long)(sizeof(buf) / sizeof(buf[0])),
+	   single * 1e9 / (sizeof(buf) / sizeof(buf[0])),
+	   bulk * 1e9 / (sizeof(buf) / sizeof(buf[0])));
+}
+
 int main(void)
 {
     RandomState   *state;
@@ -115,6 +173,11 @@ int main(void)
     check_period(1);
     check_period(2);
     check_period(31415926);
-    
+
+    ret |= check_fill(1);
+    ret |= check_fill(31415926);
+    ret |= check_fill(2147483646);
+    time_fill();
+
     return ret;
 }
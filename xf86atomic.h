@@ -54,6 +54,7 @@ typedef struct {
 # define atomic_add(x, v) ((void) __sync_add_and_fetch(&(x)->atomic, (v)))
 # define atomic_dec(x, v) ((void) __sync_sub_and_fetch(&(x)->atomic, (v)))
 # define atomic_cmpxchg(x, oldv, newv) __sync_val_compare_and_swap (&(x)->atomic, oldv, newv)
+# define atomic_cmpxchg_bool(x, oldv, newv) __sync_bool_compare_and_swap (&(x)->atomic, oldv, newv)
 
 #endif
 
@@ -74,6 +75,7 @@ typedef struct {
 # define atomic_dec(x, v) ((void) AO_fetch_and_add_full(&(x)->atomic, -(v)))
 # define atomic_dec_and_test(x) (AO_fetch_and_sub1_full(&(x)->atomic) == 1)
 # define atomic_cmpxchg(x, oldv, newv) AO_compare_and_swap_full(&(x)->atomic, oldv, newv)
+# define atomic_cmpxchg_bool(x, oldv, newv) AO_compare_and_swap_full(&(x)->atomic, oldv, newv)
 
 #endif
 
@@ -98,6 +100,15 @@ typedef struct { LIBDRM_ATOMIC_TYPE atomic; } atomic_t;
 # define atomic_add(x, v) (atomic_add_int(&(x)->atomic, (v)))
 # define atomic_dec(x, v) (atomic_add_int(&(x)->atomic, -(v)))
 # define atomic_cmpxchg(x, oldv, newv) atomic_cas_uint (&(x)->atomic, oldv, newv)
+# define atomic_cmpxchg_bool(x, oldv, newv) libdrm_atomic_cas_bool(&(x)->atomic, (oldv), (newv))
+
+static inline int libdrm_atomic_cas_bool(volatile LIBDRM_ATOMIC_TYPE *p,
+					 LIBDRM_ATOMIC_TYPE oldv,
+					 LIBDRM_ATOMIC_TYPE newv)
+{
+	return atomic_cas_uint((volatile unsigned int *)p, (unsigned int)oldv,
+			       (unsigned int)newv) == (unsigned int)oldv;
+}
 
 #endif
 
@@ -105,12 +116,17 @@ typedef struct { LIBDRM_ATOMIC_TYPE atomic; } atomic_t;
 #error libdrm requires atomic operations, please define them for your CPU/compiler.
 #endif
 
+/*
+ * atomic_cmpxchg() returns the old value on some backends and whether the
+ * swap happened on others (libatomic_ops), so code that needs to know if it
+ * won uses atomic_cmpxchg_bool(), which is non-zero on success everywhere.
+ */
 static inline int atomic_add_unless(atomic_t *v, int add, int unless)
 {
-	int c, old;
+	int c;
 	c = atomic_read(v);
-	while (c != unless && (old = atomic_cmpxchg(v, c, c + add)) != c)
-		c = old;
+	while (c != unless && !atomic_cmpxchg_bool(v, c, c + add))
+		c = atomic_read(v);
 	return c == unless;
 }
 
@@ -56,6 +56,11 @@
 # include <sys/mkdev.h> /* defines major(), minor(), and makedev() on Solaris */
 #endif
 #include <math.h>
+#ifdef __linux__
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#endif
 
 /* Not all systems have MAP_FAILED defined */
 #ifndef MAP_FAILED
@@ -147,7 +152,11 @@ drmMsg(const char *format, ...)
     }
 }
 
-static void *drmHashTable = NULL; /* Context switch callbacks */
+/* Context switch callbacks.  Neither this table nor the tag tables hanging
+ * off its entries are locked, so drmGetEntry(), drmClose() and the context
+ * tag functions must not race with each other.
+ */
+static void *drmHashTable = NULL;
 
 void *drmGetHashTable(void)
 {
@@ -2881,22 +2890,6 @@ static int drmParsePciBusInfo(const char *str, drmPciBusInfoPtr info)
     return 0;
 }
 
-static int drmSameDevice(drmDevicePtr a, drmDevicePtr b)
-{
-    if (a->bustype != b->bustype)
-        return 0;
-
-    switch (a->bustype) {
-    case DRM_BUS_PCI:
-        if (memcmp(a->businfo.pci, b->businfo.pci, sizeof(drmPciBusInfo)) == 0)
-            return 1;
-    default:
-        break;
-    }
-
-    return 0;
-}
-
 static int drmGetNodeType(const char *name)
 {
     if (strncmp(name, DRM_PRIMARY_MINOR_NAME,
@@ -2959,45 +2952,163 @@ void drmFreeDevices(drmDevicePtr devices[], int count)
     }
 }
 
-/**
- * Get drm devices on the system
- *
- * \param devices the array of devices with drmDevicePtr elements
- *                can be NULL to get the device number first
- * \param max_devices the maximum number of devices for the array
+/*
+ * Enumerating the devices means a stat() of every node in DRM_DIR_NAME and
+ * three sysfs reads per node, which adds up quickly on machines with many
+ * GPUs.  The result is therefore kept in a process-wide table, which is
+ * thrown away whenever inotify reports a change to DRM_DIR_NAME.  Without
+ * inotify, every call rescans.
  *
- * \return on error - negative error code,
- *         if devices is NULL - total number of devices available on the system,
- *         alternatively the number of devices stored in devices[], which is
- *         capped by the max_devices.
+ * For testing, the paths can be prefixed by setting LIBDRM_DEVICE_ROOT.
  */
-int drmGetDevices(drmDevicePtr devices[], int max_devices)
+typedef struct _drmCachedDevice {
+    char *nodes[DRM_NODE_MAX];
+    dev_t rdev[DRM_NODE_MAX];
+    int available_nodes;
+    int bustype;
+    drmPciBusInfo pci_bus;
+    drmPciDeviceInfo pci_device;
+} drmCachedDevice;
+
+static struct {
+    pthread_mutex_t lock;
+    drmCachedDevice *devices;
+    int count;
+    int inotify_fd;
+    pid_t pid;
+} drm_device_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, -1, 0 };
+
+static const char *drmGetDeviceRoot(void)
 {
-    drmDevicePtr devs = NULL;
-    drmPciBusInfoPtr pcibus = NULL;
-    drmPciDeviceInfoPtr pcidevice = NULL;
-    DIR *sysdir = NULL;
-    struct dirent *dent = NULL;
-    struct stat sbuf = {0};
-    char node[PATH_MAX + 1] = "";
-    char path[PATH_MAX + 1] = "";
-    char data[128] = "";
-    unsigned char config[64] = "";
-    int node_type, subsystem_type;
-    int maj, min;
-    int fd;
-    int ret, i = 0, j, node_count, device_count = 0;
-    int max_count = 16;
-    int *duplicated = NULL;
+    const char *root = NULL;
 
-    devs = calloc(max_count, sizeof(*devs));
-    if (devs == NULL)
-        return -ENOMEM;
+    if (geteuid() == getuid())
+        root = getenv("LIBDRM_DEVICE_ROOT");
 
-    sysdir = opendir(DRM_DIR_NAME);
-    if (!sysdir) {
+    return root ? root : "";
+}
+
+static int drmReadSysfsFile(const char *path, void *data, int size)
+{
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    ret = read(fd, data, size);
+    if (ret < 0)
         ret = -errno;
-        goto free_locals;
+
+    close(fd);
+    return ret;
+}
+
+/* Reads the bus and device information for the node DRM_DIR_NAME/name. */
+static int drmScanNode(const char *root, const char *name,
+                       drmCachedDevice *device, dev_t *rdev)
+{
+    struct stat sbuf;
+    char path[PATH_MAX + 1];
+    char data[256];
+    unsigned char config[64];
+    int maj, min, ret;
+
+    snprintf(path, PATH_MAX, "%s%s/%s", root, DRM_DIR_NAME, name);
+    if (stat(path, &sbuf))
+        return -errno;
+
+    maj = major(sbuf.st_rdev);
+    min = minor(sbuf.st_rdev);
+
+    if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        return -EINVAL;
+
+    snprintf(path, PATH_MAX, "%s/sys/dev/char/%d:%d/device/subsystem",
+             root, maj, min);
+    device->bustype = drmParseSubsystemType(path);
+    if (device->bustype != DRM_BUS_PCI)
+        return -EINVAL;
+
+    snprintf(path, PATH_MAX, "%s/sys/dev/char/%d:%d/device/uevent",
+             root, maj, min);
+    ret = drmReadSysfsFile(path, data, sizeof(data) - 1);
+    if (ret < 0)
+        return ret;
+    data[ret] = '\0';
+
+    ret = drmParsePciBusInfo(data, &device->pci_bus);
+    if (ret)
+        return ret;
+
+    snprintf(path, PATH_MAX, "%s/sys/dev/char/%d:%d/device/config",
+             root, maj, min);
+    ret = drmReadSysfsFile(path, config, sizeof(config));
+    if (ret < 0)
+        return ret;
+    if (ret < 48)
+        return -EINVAL;
+
+    *rdev = sbuf.st_rdev;
+    return drmParsePciDeviceInfo(config, &device->pci_device);
+}
+
+static int drmSameBus(const drmPciBusInfo *a, const drmPciBusInfo *b)
+{
+    return a->domain == b->domain && a->bus == b->bus &&
+           a->dev == b->dev && a->func == b->func;
+}
+
+static void drmDeviceCacheClear(void)
+{
+    int i, j;
+
+    for (i = 0; i < drm_device_cache.count; i++)
+        for (j = 0; j < DRM_NODE_MAX; j++)
+            free(drm_device_cache.devices[i].nodes[j]);
+
+    free(drm_device_cache.devices);
+    drm_device_cache.devices = NULL;
+    drm_device_cache.count = 0;
+
+    if (drm_device_cache.inotify_fd >= 0)
+        close(drm_device_cache.inotify_fd);
+    drm_device_cache.inotify_fd = -1;
+}
+
+static int drmDeviceCacheScan(void)
+{
+    const char *root = drmGetDeviceRoot();
+    drmCachedDevice *devs = NULL, *dev, tmp;
+    struct dirent *dent;
+    char dir[PATH_MAX + 1];
+    char node[PATH_MAX + 1];
+    DIR *sysdir;
+    dev_t rdev = 0;
+    int node_type, i, count = 0, max_count = 0;
+
+    drmDeviceCacheClear();
+    drm_device_cache.pid = getpid();
+
+    snprintf(dir, PATH_MAX, "%s%s", root, DRM_DIR_NAME);
+
+    /* Watch before scanning, so that nodes appearing during the scan
+     * invalidate the result.
+     */
+    drm_device_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (drm_device_cache.inotify_fd >= 0 &&
+        inotify_add_watch(drm_device_cache.inotify_fd, dir,
+                          IN_CREATE | IN_DELETE | IN_MOVE | IN_ATTRIB |
+                          IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        close(drm_device_cache.inotify_fd);
+        drm_device_cache.inotify_fd = -1;
+    }
+
+    sysdir = opendir(dir);
+    if (!sysdir) {
+        i = -errno;
+        drmDeviceCacheClear();
+        return i;
     }
 
     while ((dent = readdir(sysdir))) {
@@ -3005,165 +3116,241 @@ int drmGetDevices(drmDevicePtr devices[], int max_devices)
         if (node_type < 0)
             continue;
 
-        snprintf(node, PATH_MAX, "%s/%s", DRM_DIR_NAME, dent->d_name);
-        if (stat(node, &sbuf))
+        memset(&tmp, 0, sizeof(tmp));
+        if (drmScanNode(root, dent->d_name, &tmp, &rdev))
             continue;
 
-        maj = major(sbuf.st_rdev);
-        min = minor(sbuf.st_rdev);
+        for (i = 0; i < count; i++)
+            if (drmSameBus(&devs[i].pci_bus, &tmp.pci_bus))
+                break;
 
-        if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        if (i == count) {
+            if (count == max_count) {
+                max_count += 16;
+                dev = realloc(devs, max_count * sizeof(*devs));
+                if (dev == NULL)
+                    goto nomem;
+                devs = dev;
+            }
+            devs[count++] = tmp;
+        }
+
+        dev = &devs[i];
+        if (dev->nodes[node_type] != NULL)
             continue;
 
-        snprintf(path, PATH_MAX, "/sys/dev/char/%d:%d/device/subsystem",
-                 maj, min);
-        subsystem_type = drmParseSubsystemType(path);
+        snprintf(node, PATH_MAX, "%s%s/%s", root, DRM_DIR_NAME, dent->d_name);
+        dev->nodes[node_type] = strdup(node);
+        if (dev->nodes[node_type] == NULL)
+            goto nomem;
+        dev->rdev[node_type] = rdev;
+        dev->available_nodes |= 1 << node_type;
+    }
 
-        if (subsystem_type < 0)
-            continue;
+    closedir(sysdir);
+    drm_device_cache.devices = devs;
+    drm_device_cache.count = count;
+    return 0;
 
-        switch (subsystem_type) {
-        case DRM_BUS_PCI:
-            pcibus = calloc(1, sizeof(*pcibus));
-            if (pcibus == NULL) {
-                ret = -ENOMEM;
-                goto free_locals;
-            }
+nomem:
+    closedir(sysdir);
+    drm_device_cache.devices = devs;
+    drm_device_cache.count = count;
+    drmDeviceCacheClear();
+    return -ENOMEM;
+}
 
-            snprintf(path, PATH_MAX, "/sys/dev/char/%d:%d/device/uevent",
-                     maj, min);
-            fd = open(path, O_RDONLY);
-            if (fd < 0) {
-                ret = -errno;
-                goto free_locals;
-            }
-            ret = read(fd, data, sizeof(data));
-            if (ret < 0) {
-                ret = -errno;
-                close(fd);
-                goto free_locals;
-            }
+/* Rescans unless the table is known to be current.  Sets *scanned if the
+ * table was rebuilt.
+ */
+static int drmDeviceCacheUpdate(int *scanned)
+{
+    char event[sizeof(struct inotify_event) + NAME_MAX + 1];
 
-            ret = drmParsePciBusInfo(data, pcibus);
-            close(fd);
-            if (ret)
-                goto free_locals;
+    *scanned = 0;
 
-            if (i >= max_count) {
-                max_count += 16;
-                devs = realloc(devs, max_count * sizeof(*devs));
-            }
+    /* A forked child shares the inotify queue with its parent, and
+     * either of them reading it would hide the events from the other.
+     */
+    if (drm_device_cache.inotify_fd >= 0 &&
+        drm_device_cache.pid == getpid() &&
+        read(drm_device_cache.inotify_fd, event, sizeof(event)) < 0 &&
+        errno == EAGAIN)
+        return 0;
 
-            devs[i].businfo.pci = pcibus;
-            devs[i].bustype = subsystem_type;
-            devs[i].nodes = calloc(DRM_NODE_MAX, sizeof(char *));
-            if (devs[i].nodes == NULL) {
-                ret = -ENOMEM;
-                goto free_locals;
-            }
-            devs[i].nodes[node_type] = strdup(node);
-            if (devs[i].nodes[node_type] == NULL) {
-                ret = -ENOMEM;
-                goto free_locals;
-            }
-            devs[i].available_nodes = 1 << node_type;
-
-            if (devices != NULL) {
-                snprintf(path, PATH_MAX, "/sys/class/drm/%s/device/config",
-                         dent->d_name);
-                fd = open(path, O_RDONLY);
-                if (fd < 0) {
-                     ret = -errno;
-                     goto free_locals;
-                }
-                ret = read(fd, config, 64);
-                if (ret < 0) {
-                    ret = -errno;
-                    close(fd);
-                    goto free_locals;
-                }
+    *scanned = 1;
+    return drmDeviceCacheScan();
+}
 
-                pcidevice = calloc(1, sizeof(*pcidevice));
-                if (pcidevice == NULL) {
-                    ret = -ENOMEM;
-                    goto free_locals;
-                }
+static int drmCopyDevice(const drmCachedDevice *src, drmDevicePtr *device)
+{
+    drmDevicePtr dev;
+    int i;
 
-                ret = drmParsePciDeviceInfo(config, pcidevice);
-                if (ret)
-                    goto free_locals;
+    dev = calloc(1, sizeof(*dev));
+    if (dev == NULL)
+        return -ENOMEM;
 
-                devs[i].deviceinfo.pci = pcidevice;
-                close(fd);
-            }
-            break;
-        default:
-            fprintf(stderr, "The subsystem type is not supported yet\n");
-            break;
-        }
-        i++;
+    dev->available_nodes = src->available_nodes;
+    dev->bustype = src->bustype;
+    dev->nodes = calloc(DRM_NODE_MAX, sizeof(char *));
+    dev->businfo.pci = malloc(sizeof(drmPciBusInfo));
+    dev->deviceinfo.pci = malloc(sizeof(drmPciDeviceInfo));
+    if (!dev->nodes || !dev->businfo.pci || !dev->deviceinfo.pci)
+        goto nomem;
+
+    for (i = 0; i < DRM_NODE_MAX; i++) {
+        if (src->nodes[i] == NULL)
+            continue;
+        dev->nodes[i] = strdup(src->nodes[i]);
+        if (dev->nodes[i] == NULL)
+            goto nomem;
     }
 
-    node_count = i;
+    *dev->businfo.pci = src->pci_bus;
+    *dev->deviceinfo.pci = src->pci_device;
+    *device = dev;
+    return 0;
+
+nomem:
+    drmFreeDevice(dev);
+    free(dev);
+    return -ENOMEM;
+}
 
-    /* merge duplicated devices with same domain/bus/device/func IDs */
-    duplicated = calloc(node_count, sizeof(*duplicated));
-    if (duplicated == NULL) {
-        ret = -ENOMEM;
-        goto free_locals;
-    }
+static int drmDeviceMatches(const drmCachedDevice *dev,
+                            const drmDeviceFilter *filter)
+{
+    if (filter == NULL)
+        return 1;
+
+    if ((filter->flags & DRM_DEVICE_FILTER_VENDOR) &&
+        dev->pci_device.vendor_id != filter->vendor_id)
+        return 0;
+
+    if ((filter->flags & DRM_DEVICE_FILTER_DEVICE) &&
+        dev->pci_device.device_id != filter->device_id)
+        return 0;
+
+    if ((filter->flags & DRM_DEVICE_FILTER_BUS) &&
+        !drmSameBus(&dev->pci_bus, &filter->pci_bus))
+        return 0;
+
+    return (dev->available_nodes & filter->available_nodes) ==
+           filter->available_nodes;
+}
 
-    for (i = 0; i < node_count; i++) {
-        for (j = i+1; j < node_count; j++) {
-            if (duplicated[i] || duplicated[j])
-                continue;
-            if (drmSameDevice(&devs[i], &devs[j])) {
-                duplicated[j] = 1;
-                devs[i].available_nodes |= devs[j].available_nodes;
-                node_type = log2(devs[j].available_nodes);
-                devs[i].nodes[node_type] = devs[j].nodes[node_type];
-                free(devs[j].nodes);
-                free(devs[j].businfo.pci);
-                free(devs[j].deviceinfo.pci);
+/**
+ * Get drm devices on the system that match a filter
+ *
+ * \param filter the properties the devices must have, or NULL for all
+ * \param devices the array of devices with drmDevicePtr elements
+ *                can be NULL to get the device number first
+ * \param max_devices the maximum number of devices for the array
+ *
+ * \return on error - negative error code,
+ *         if devices is NULL - total number of matching devices,
+ *         alternatively the number of devices stored in devices[], which is
+ *         capped by the max_devices.
+ */
+int drmGetDevicesFiltered(const drmDeviceFilter *filter,
+                          drmDevicePtr devices[], int max_devices)
+{
+    int scanned, i, ret, count = 0;
+
+    pthread_mutex_lock(&drm_device_cache.lock);
+
+    ret = drmDeviceCacheUpdate(&scanned);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < drm_device_cache.count; i++) {
+        if (!drmDeviceMatches(&drm_device_cache.devices[i], filter))
+            continue;
+
+        if (devices != NULL) {
+            if (count >= max_devices)
+                break;
+
+            ret = drmCopyDevice(&drm_device_cache.devices[i],
+                                &devices[count]);
+            if (ret) {
+                drmFreeDevices(devices, count);
+                goto out;
             }
         }
+        count++;
     }
+    ret = count;
 
-    for (i = 0; i < node_count; i++) {
-        if(duplicated[i] == 0) {
-            if ((devices != NULL) && (device_count < max_devices)) {
-                devices[device_count] = calloc(1, sizeof(drmDevice));
-                if (devices[device_count] == NULL) {
-                    ret = -ENOMEM;
-                    break;
+out:
+    pthread_mutex_unlock(&drm_device_cache.lock);
+    return ret;
+}
+
+/**
+ * Get drm devices on the system
+ *
+ * \param devices the array of devices with drmDevicePtr elements
+ *                can be NULL to get the device number first
+ * \param max_devices the maximum number of devices for the array
+ *
+ * \return on error - negative error code,
+ *         if devices is NULL - total number of devices available on the system,
+ *         alternatively the number of devices stored in devices[], which is
+ *         capped by the max_devices.
+ */
+int drmGetDevices(drmDevicePtr devices[], int max_devices)
+{
+    return drmGetDevicesFiltered(NULL, devices, max_devices);
+}
+
+/**
+ * Get the drm device an open file descriptor refers to
+ *
+ * \param fd file descriptor of a DRM node
+ * \param device returns the device, to be freed with drmFreeDevices()
+ *
+ * \return zero on success, negative error code otherwise.
+ */
+int drmGetDevice(int fd, drmDevicePtr *device)
+{
+    struct stat sbuf;
+    int scanned, i, j, ret;
+
+    if (device == NULL)
+        return -EINVAL;
+
+    if (fstat(fd, &sbuf))
+        return -errno;
+
+    if (major(sbuf.st_rdev) != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        return -EINVAL;
+
+    pthread_mutex_lock(&drm_device_cache.lock);
+
+    ret = drmDeviceCacheUpdate(&scanned);
+    while (ret == 0) {
+        for (i = 0; i < drm_device_cache.count; i++) {
+            for (j = 0; j < DRM_NODE_MAX; j++) {
+                if (drm_device_cache.devices[i].nodes[j] != NULL &&
+                    drm_device_cache.devices[i].rdev[j] == sbuf.st_rdev) {
+                    ret = drmCopyDevice(&drm_device_cache.devices[i], device);
+                    goto out;
                 }
-                memcpy(devices[device_count], &devs[i], sizeof(drmDevice));
-            } else
-                drmFreeDevice(&devs[i]);
-            device_count++;
+            }
         }
-    }
 
-    if (i < node_count) {
-        drmFreeDevices(devices, device_count);
-        for ( ; i < node_count; i++)
-            if(duplicated[i] == 0)
-                drmFreeDevice(&devs[i]);
-    } else
-        ret = device_count;
-
-    free(duplicated);
-    free(devs);
-    closedir(sysdir);
-    return ret;
+        /* The node may be newer than the last inotify event we read. */
+        ret = -ENODEV;
+        if (scanned)
+            break;
+        scanned = 1;
+        ret = drmDeviceCacheScan();
+    }
 
-free_locals:
-    for (j = 0; j < i; j++)
-        drmFreeDevice(&devs[j]);
-    free(pcidevice);
-    free(pcibus);
-    free(devs);
-    closedir(sysdir);
+out:
+    pthread_mutex_unlock(&drm_device_cache.lock);
     return ret;
 }
 #else
@@ -3180,6 +3367,22 @@ int drmGetDevices(drmDevicePtr devices[], int max_devices)
     return -EINVAL;
 }
 
+int drmGetDevicesFiltered(const drmDeviceFilter *filter,
+                          drmDevicePtr devices[], int max_devices)
+{
+    (void)filter;
+    (void)devices;
+    (void)max_devices;
+    return -EINVAL;
+}
+
+int drmGetDevice(int fd, drmDevicePtr *device)
+{
+    (void)fd;
+    (void)device;
+    return -EINVAL;
+}
+
 #warning "Missing implementation of drmGetDevices/drmFreeDevices"
 
 #endif
@@ -691,7 +691,10 @@ extern int           drmError(int err, const char *label);
 extern void          *drmMalloc(int size);
 extern void          drmFree(void *pt);
 
-/* Hash table routines */
+/* Hash table routines.  The tables do no locking: lookups may run
+ * concurrently, but callers must serialize insertions and deletions with
+ * each other and with lookups.
+ */
 extern void *drmHashCreate(void);
 extern int  drmHashDestroy(void *t);
 extern int  drmHashLookup(void *t, unsigned long key, void **value);
@@ -705,6 +708,8 @@ extern void          *drmRandomCreate(unsigned long seed);
 extern int           drmRandomDestroy(void *state);
 extern unsigned long drmRandom(void *state);
 extern double        drmRandomDouble(void *state);
+extern void          drmRandomFill(void *state, uint32_t *buf,
+				   unsigned long n);
 
 /* Skip list routines */
 
@@ -719,6 +724,10 @@ extern void drmSLDump(void *l);
 extern int  drmSLLookupNeighbors(void *l, unsigned long key,
 				 unsigned long *prev_key, void **prev_value,
 				 unsigned long *next_key, void **next_value);
+extern int  drmSLInsertSorted(void *l, const unsigned long *keys,
+			      void **values, int count);
+extern int  drmSLRange(void *l, unsigned long lo, unsigned long hi,
+		       unsigned long *key, void **value);
 
 extern int drmOpenOnce(void *unused, const char *BusID, int *newlyopened);
 extern int drmOpenOnceWithType(const char *BusID, int *newlyopened, int type);
@@ -752,6 +761,32 @@ typedef struct _drmEventContext {
 
 extern int drmHandleEvent(int fd, drmEventContextPtr evctx);
 
+/*
+ * Batched event reading.  Records point into the buffer the events were
+ * read into and stay valid until that buffer is reused.  Events of types
+ * libdrm doesn't know about are returned with only type, length and event
+ * filled in.
+ */
+typedef struct _drmEventRecord {
+	uint32_t type;			/* DRM_EVENT_* */
+	uint32_t length;		/* size of the raw event in bytes */
+	uint32_t crtc_id;		/* 0 if not reported by the kernel */
+	uint32_t sequence;
+	uint64_t timestamp;		/* CLOCK_MONOTONIC, in nanoseconds */
+	void *user_data;
+	const struct drm_event *event;	/* raw event */
+} drmEventRecord, *drmEventRecordPtr;
+
+typedef struct _drmEventQueue drmEventQueue, *drmEventQueuePtr;
+
+extern int drmParseEvents(const void *buffer, int length,
+			  drmEventRecordPtr events, int max_events,
+			  int *consumed);
+extern drmEventQueuePtr drmEventQueueCreate(int fd, int size);
+extern void drmEventQueueDestroy(drmEventQueuePtr queue);
+extern int drmEventQueueRead(drmEventQueuePtr queue,
+			     drmEventRecordPtr events, int max_events);
+
 extern char *drmGetDeviceNameFromFd(int fd);
 extern int drmGetNodeTypeFromFd(int fd);
 
@@ -790,7 +825,22 @@ typedef struct _drmDevice {
     } deviceinfo;
 } drmDevice, *drmDevicePtr;
 
+#define DRM_DEVICE_FILTER_VENDOR (1 << 0)
+#define DRM_DEVICE_FILTER_DEVICE (1 << 1)
+#define DRM_DEVICE_FILTER_BUS    (1 << 2)
+
+typedef struct _drmDeviceFilter {
+    int flags; /* DRM_DEVICE_FILTER_* */
+    uint16_t vendor_id;
+    uint16_t device_id;
+    drmPciBusInfo pci_bus;
+    int available_nodes; /* DRM_NODE_* bitmask, all of them required */
+} drmDeviceFilter, *drmDeviceFilterPtr;
+
 extern int drmGetDevices(drmDevicePtr devices[], int max_devices);
+extern int drmGetDevicesFiltered(const drmDeviceFilter *filter,
+                                 drmDevicePtr devices[], int max_devices);
+extern int drmGetDevice(int fd, drmDevicePtr *device);
 extern void drmFreeDevices(drmDevicePtr devices[], int count);
 
 #if defined(__cplusplus)
@@ -27,10 +27,9 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward implementation of a fixed-sized
- * hash table using self-organizing linked lists [Knuth73, pp. 398-399] for
- * collision resolution.  There are two potentially interesting things
- * about this implementation:
+ * This file contains a straightforward implementation of a dynamic hash
+ * table using linked lists for collision resolution.  There are three
+ * potentially interesting things about this implementation:
  *
  * 1) The table is power-of-two sized.  Prime sized tables are more
  * traditional, but do not have a significant advantage over power-of-two
@@ -40,18 +39,23 @@
  * 2) The hash computation uses a table of random integers [Hanson97,
  * pp. 39-41].
  *
+ * 3) The table grows using linear hashing [Larson88]: once the average
+ * chain length exceeds HASH_LOAD_FACTOR, a single bucket is split per
+ * insertion, distributing the expansion cost over several insertions.
+ * Buckets live in fixed-size segments reached through a directory, so
+ * growing never moves existing buckets.
+ *
+ * Lookups do not reorganize the chains, so concurrent lookups are safe.
+ * The table has no lock of its own: insertions and deletions must be
+ * serialized by the caller against each other and against lookups.  Not
+ * every user does so; the per-fd table behind drmGetEntry() and the
+ * context tag functions is unsynchronized, as it always was.
+ *
  * FUTURE ENHANCEMENTS
  *
- * With a table size of 512, the current implementation is sufficient for a
- * few hundred keys.  Since this is well above the expected size of the
- * tables for which this implementation was designed, the implementation of
- * dynamic hash tables was postponed until the need arises.  A common (and
- * naive) approach to dynamic hash table implementation simply creates a
- * new hash table when necessary, rehashes all the data into the new table,
- * and destroys the old table.  The approach in [Larson88] is superior in
- * two ways: 1) only a portion of the table is expanded when needed,
- * distributing the expansion cost over several insertions, and 2) portions
- * of the table can be locked, enabling a scalable thread-safe
+ * The table never shrinks.  [Larson88] also describes contraction, which
+ * could be added if tables with a high turnover turn out to waste memory.
+ * Locking portions of the table would allow a scalable thread-safe
  * implementation.
  *
  * REFERENCES
@@ -70,6 +74,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "xf86drm.h"
 #include "xf86drmHash.h"
@@ -97,27 +102,95 @@ static unsigned long HashHash(unsigned long key)
 	tmp >>= 8;
     }
 
-    hash %= HASH_SIZE;
 #if DEBUG
     printf( "Hash(%lu) = %lu\n", key, hash);
 #endif
     return hash;
 }
 
+/* Map a hash value to its bucket, following [Larson88]: buckets below the
+   split pointer have already been split and use one more bit of the
+   hash. */
+
+static HashBucketPtr *HashSlot(HashTablePtr table, unsigned long hash)
+{
+    unsigned long addr = hash & (table->maxp - 1);
+
+    if (addr < table->p) addr = hash & (2 * table->maxp - 1);
+
+    return &(*table->directory[addr / HASH_SEGMENT_SIZE])[addr % HASH_SEGMENT_SIZE];
+}
+
+/* Split the bucket at the split pointer into itself and a new bucket at
+   the end of the table.  Only the entries of that one bucket move, so the
+   cost of growing is spread evenly over the insertions. */
+
+static void HashExpand(HashTablePtr table)
+{
+    unsigned long addr = table->maxp + table->p;
+    unsigned long segment = addr / HASH_SEGMENT_SIZE;
+    HashBucketPtr *old, *new, bucket, next;
+
+    if (segment >= table->segments) {
+	HashSegment **directory;
+
+	directory = realloc(table->directory,
+			    2 * table->segments * sizeof(*directory));
+	if (!directory) return;
+	memset(&directory[table->segments], 0,
+	       table->segments * sizeof(*directory));
+	table->directory = directory;
+	table->segments *= 2;
+    }
+
+    if (!table->directory[segment]) {
+	table->directory[segment] = drmMalloc(sizeof(HashSegment));
+	if (!table->directory[segment]) return;
+    }
+
+    old = HashSlot(table, table->p);
+    new = &(*table->directory[segment])[addr % HASH_SEGMENT_SIZE];
+
+    bucket = *old;
+    *old   = NULL;
+    for (; bucket; bucket = next) {
+	next = bucket->next;
+	if (HashHash(bucket->key) & table->maxp) {
+	    bucket->next = *new;
+	    *new         = bucket;
+	} else {
+	    bucket->next = *old;
+	    *old         = bucket;
+	}
+    }
+
+    if (++table->p == table->maxp) {
+	table->maxp *= 2;
+	table->p     = 0;
+    }
+}
+
 void *drmHashCreate(void)
 {
     HashTablePtr table;
-    int          i;
 
     table           = drmMalloc(sizeof(*table));
     if (!table) return NULL;
     table->magic    = HASH_MAGIC;
     table->entries  = 0;
-    table->hits     = 0;
-    table->partials = 0;
-    table->misses   = 0;
+    table->p        = 0;
+    table->maxp     = HASH_SEGMENT_SIZE;
+    table->segments = 4;
+
+    table->directory = drmMalloc(table->segments * sizeof(*table->directory));
+    if (table->directory)
+	table->directory[0] = drmMalloc(sizeof(HashSegment));
+    if (!table->directory || !table->directory[0]) {
+	drmFree(table->directory);
+	drmFree(table);
+	return NULL;
+    }
 
-    for (i = 0; i < HASH_SIZE; i++) table->buckets[i] = NULL;
     return table;
 }
 
@@ -126,50 +199,36 @@ int drmHashDestroy(void *t)
     HashTablePtr  table = (HashTablePtr)t;
     HashBucketPtr bucket;
     HashBucketPtr next;
-    int           i;
+    unsigned long i, j;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    for (i = 0; i < HASH_SIZE; i++) {
-	for (bucket = table->buckets[i]; bucket;) {
-	    next = bucket->next;
-	    drmFree(bucket);
-	    bucket = next;
+    for (i = 0; i < table->segments && table->directory[i]; i++) {
+	for (j = 0; j < HASH_SEGMENT_SIZE; j++) {
+	    for (bucket = (*table->directory[i])[j]; bucket;) {
+		next = bucket->next;
+		drmFree(bucket);
+		bucket = next;
+	    }
 	}
+	drmFree(table->directory[i]);
     }
+    drmFree(table->directory);
     drmFree(table);
     return 0;
 }
 
-/* Find the bucket and organize the list so that this bucket is at the
-   top. */
+/* Find the bucket.  Lookups never modify the table, so any number of
+   them may run concurrently as long as nothing is inserted or deleted. */
 
-static HashBucketPtr HashFind(HashTablePtr table,
-			      unsigned long key, unsigned long *h)
+static HashBucketPtr *HashFind(HashTablePtr table, unsigned long key)
 {
-    unsigned long hash = HashHash(key);
-    HashBucketPtr prev = NULL;
-    HashBucketPtr bucket;
+    HashBucketPtr *prev = HashSlot(table, HashHash(key));
 
-    if (h) *h = hash;
-
-    for (bucket = table->buckets[hash]; bucket; bucket = bucket->next) {
-	if (bucket->key == key) {
-	    if (prev) {
-				/* Organize */
-		prev->next           = bucket->next;
-		bucket->next         = table->buckets[hash];
-		table->buckets[hash] = bucket;
-		++table->partials;
-	    } else {
-		++table->hits;
-	    }
-	    return bucket;
-	}
-	prev = bucket;
+    for (; *prev; prev = &(*prev)->next) {
+	if ((*prev)->key == key) break;
     }
-    ++table->misses;
-    return NULL;
+    return prev;
 }
 
 int drmHashLookup(void *t, unsigned long key, void **value)
@@ -179,7 +238,7 @@ int drmHashLookup(void *t, unsigned long key, void **value)
 
     if (!table || table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, NULL);
+    bucket = *HashFind(table, key);
     if (!bucket) return 1;	/* Not found */
     *value = bucket->value;
     return 0;			/* Found */
@@ -189,37 +248,42 @@ int drmHashInsert(void *t, unsigned long key, void *value)
 {
     HashTablePtr  table = (HashTablePtr)t;
     HashBucketPtr bucket;
-    unsigned long hash;
+    HashBucketPtr *slot;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    if (HashFind(table, key, &hash)) return 1; /* Already in table */
+    slot = HashFind(table, key);
+    if (*slot) return 1; /* Already in table */
 
     bucket               = drmMalloc(sizeof(*bucket));
     if (!bucket) return -1;	/* Error */
     bucket->key          = key;
     bucket->value        = value;
-    bucket->next         = table->buckets[hash];
-    table->buckets[hash] = bucket;
+    *slot                = bucket;
 #if DEBUG
-    printf("Inserted %lu at %lu/%p\n", key, hash, bucket);
+    printf("Inserted %lu at %p\n", key, bucket);
 #endif
+
+    if (++table->entries > HASH_LOAD_FACTOR * (table->maxp + table->p))
+	HashExpand(table);
     return 0;			/* Added to table */
 }
 
 int drmHashDelete(void *t, unsigned long key)
 {
     HashTablePtr  table = (HashTablePtr)t;
-    unsigned long hash;
     HashBucketPtr bucket;
+    HashBucketPtr *slot;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, &hash);
+    slot   = HashFind(table, key);
+    bucket = *slot;
 
     if (!bucket) return 1;	/* Not found */
 
-    table->buckets[hash] = bucket->next;
+    *slot = bucket->next;
+    --table->entries;
     drmFree(bucket);
     return 0;
 }
@@ -228,15 +292,17 @@ int drmHashNext(void *t, unsigned long *key, void **value)
 {
     HashTablePtr  table = (HashTablePtr)t;
 
-    while (table->p0 < HASH_SIZE) {
+    while (table->p0 < table->maxp + table->p) {
 	if (table->p1) {
 	    *key       = table->p1->key;
 	    *value     = table->p1->value;
 	    table->p1  = table->p1->next;
 	    return 1;
 	}
-	table->p1 = table->buckets[table->p0];
 	++table->p0;
+	if (table->p0 < table->maxp + table->p)
+	    table->p1 = (*table->directory[table->p0 / HASH_SEGMENT_SIZE])
+		[table->p0 % HASH_SEGMENT_SIZE];
     }
     return 0;
 }
@@ -248,6 +314,6 @@ int drmHashFirst(void *t, unsigned long *key, void **value)
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
     table->p0 = 0;
-    table->p1 = table->buckets[0];
+    table->p1 = (*table->directory[0])[0];
     return drmHashNext(table, key, value);
 }
@@ -24,10 +24,8 @@
  * Authors: Rickard E. (Rik) Faith <faith@valinux.com>
  */
 
-#define HASH_SIZE  512		/* Good for about 100 entries */
-				/* If you change this value, you probably
-                                   have to change the HashHash hashing
-                                   function! */
+#define HASH_SEGMENT_SIZE  64	/* Buckets per segment, a power of two */
+#define HASH_LOAD_FACTOR   2	/* Average chain length that triggers a split */
 
 typedef struct HashBucket {
     unsigned long     key;
@@ -35,13 +33,15 @@ typedef struct HashBucket {
     struct HashBucket *next;
 } HashBucket, *HashBucketPtr;
 
+typedef HashBucketPtr HashSegment[HASH_SEGMENT_SIZE];
+
 typedef struct HashTable {
     unsigned long    magic;
     unsigned long    entries;
-    unsigned long    hits;	/* At top of linked list */
-    unsigned long    partials;	/* Not at top of linked list */
-    unsigned long    misses;	/* Not in table */
-    HashBucketPtr    buckets[HASH_SIZE];
-    int              p0;
+    unsigned long    p;		/* Next bucket to split */
+    unsigned long    maxp;	/* Buckets at the start of this round */
+    unsigned long    segments;	/* Size of the directory */
+    HashSegment      **directory;
+    unsigned long    p0;
     HashBucketPtr    p1;
 } HashTable, *HashTablePtr;
@@ -59,6 +59,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define memclear(s) memset(&s, 0, sizeof(s))
 
@@ -92,6 +93,518 @@ static void* drmAllocCpy(char *array, int count, int entry_size)
 	return r;
 }
 
+/*
+ * KMS object cache
+ *
+ * When enabled for an fd with drmModeCacheEnable(), the getters below hand
+ * out copies of previously fetched objects instead of asking the kernel
+ * again.  Property definitions never change for the lifetime of an fd and
+ * are kept until the cache is disabled.  Everything else is dropped by
+ * drmModeCacheInvalidate(), which callers are expected to invoke on hotplug
+ * uevents, and whenever the state is changed through this library.  Page
+ * flips and plane updates only drop the objects they touch.
+ *
+ * All caches are protected by drm_mode_cache_lock, which is never held
+ * across an ioctl.  A getter that missed remembers the generation before
+ * asking the kernel and only stores the answer if nothing was invalidated
+ * in the meantime.  Setters invalidate once their ioctl returned, so a
+ * getter racing with one either has its reply refused or sees it dropped
+ * right after, and a stale reply can't outlive the change.
+ */
+
+struct drm_mode_cache {
+	void *properties;	/* property id -> drmModePropertyPtr */
+
+	drmModeResPtr res;
+	drmModePlaneResPtr plane_res;
+	void *connectors;	/* connector id -> struct drm_mode_cache_connector */
+	void *planes;		/* plane id -> drmModePlanePtr */
+	void *object_props;	/* object id -> struct drm_mode_cache_object */
+	void *blobs;		/* blob id -> drmModePropertyBlobPtr */
+};
+
+struct drm_mode_cache_connector {
+	drmModeConnectorPtr connector;
+	int probed;
+};
+
+struct drm_mode_cache_object {
+	drmModeObjectPropertiesPtr props;
+	uint32_t object_type;
+};
+
+static pthread_mutex_t drm_mode_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *drm_mode_caches;	/* fd -> struct drm_mode_cache */
+static unsigned long drm_mode_cache_generation;	/* bumped on invalidation */
+
+static struct drm_mode_cache *drm_mode_cache_get(int fd)
+{
+	void *cache;
+
+	if (!drm_mode_caches || drmHashLookup(drm_mode_caches, fd, &cache))
+		return NULL;
+
+	return cache;
+}
+
+static void *drm_mode_cache_lookup(void *table, unsigned long id)
+{
+	void *value;
+
+	if (!table || drmHashLookup(table, id, &value))
+		return NULL;
+
+	return value;
+}
+
+/* Returns the cache of fd if nothing was invalidated since generation. */
+static struct drm_mode_cache *drm_mode_cache_get_since(int fd,
+						      unsigned long generation)
+{
+	if (generation != drm_mode_cache_generation)
+		return NULL;
+
+	return drm_mode_cache_get(fd);
+}
+
+static void drm_mode_cache_insert(void **table, unsigned long id, void *value,
+				  void (*destroy)(void *))
+{
+	if (!value)
+		return;
+
+	if (!*table)
+		*table = drmHashCreate();
+
+	if (!*table || drmHashInsert(*table, id, value))
+		destroy(value);
+}
+
+static unsigned long drm_mode_cache_count(void *table)
+{
+	unsigned long id, count = 0;
+	void *value;
+
+	if (table && drmHashFirst(table, &id, &value)) {
+		do {
+			count++;
+		} while (drmHashNext(table, &id, &value));
+	}
+
+	return count;
+}
+
+static void drm_mode_cache_drop(void *table, unsigned long id,
+				void (*destroy)(void *))
+{
+	void *value;
+
+	if (!table || drmHashLookup(table, id, &value))
+		return;
+
+	drmHashDelete(table, id);
+	destroy(value);
+}
+
+static void drm_mode_cache_clear(void **table, void (*destroy)(void *))
+{
+	unsigned long id;
+	void *value;
+
+	if (!*table)
+		return;
+
+	if (drmHashFirst(*table, &id, &value)) {
+		do {
+			destroy(value);
+		} while (drmHashNext(*table, &id, &value));
+	}
+
+	drmHashDestroy(*table);
+	*table = NULL;
+}
+
+static drmModeResPtr drmModeDupResources(drmModeResPtr res)
+{
+	drmModeResPtr r;
+
+	if (!res || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	*r = *res;
+	r->fbs = drmAllocCpy((char *)res->fbs, res->count_fbs, sizeof(uint32_t));
+	r->crtcs = drmAllocCpy((char *)res->crtcs, res->count_crtcs, sizeof(uint32_t));
+	r->connectors = drmAllocCpy((char *)res->connectors, res->count_connectors, sizeof(uint32_t));
+	r->encoders = drmAllocCpy((char *)res->encoders, res->count_encoders, sizeof(uint32_t));
+	if ((r->count_fbs && !r->fbs) ||
+	    (r->count_crtcs && !r->crtcs) ||
+	    (r->count_connectors && !r->connectors) ||
+	    (r->count_encoders && !r->encoders)) {
+		drmModeFreeResources(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModePlaneResPtr drmModeDupPlaneResources(drmModePlaneResPtr res)
+{
+	drmModePlaneResPtr r;
+
+	if (!res || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	r->count_planes = res->count_planes;
+	r->planes = drmAllocCpy((char *)res->planes, res->count_planes, sizeof(uint32_t));
+	if (r->count_planes && !r->planes) {
+		drmFree(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModeConnectorPtr drmModeDupConnector(drmModeConnectorPtr conn)
+{
+	drmModeConnectorPtr r;
+
+	if (!conn || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	*r = *conn;
+	r->props = drmAllocCpy((char *)conn->props, conn->count_props, sizeof(uint32_t));
+	r->prop_values = drmAllocCpy((char *)conn->prop_values, conn->count_props, sizeof(uint64_t));
+	r->modes = drmAllocCpy((char *)conn->modes, conn->count_modes, sizeof(drmModeModeInfo));
+	r->encoders = drmAllocCpy((char *)conn->encoders, conn->count_encoders, sizeof(uint32_t));
+	if ((r->count_props && (!r->props || !r->prop_values)) ||
+	    (r->count_modes && !r->modes) ||
+	    (r->count_encoders && !r->encoders)) {
+		drmModeFreeConnector(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModePlanePtr drmModeDupPlane(drmModePlanePtr plane)
+{
+	drmModePlanePtr r;
+
+	if (!plane || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	*r = *plane;
+	r->formats = drmAllocCpy((char *)plane->formats, plane->count_formats, sizeof(uint32_t));
+	if (r->count_formats && !r->formats) {
+		drmFree(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModeObjectPropertiesPtr
+drmModeDupObjectProperties(drmModeObjectPropertiesPtr props)
+{
+	drmModeObjectPropertiesPtr r;
+
+	if (!props || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	r->count_props = props->count_props;
+	r->props = drmAllocCpy((char *)props->props, props->count_props, sizeof(uint32_t));
+	r->prop_values = drmAllocCpy((char *)props->prop_values, props->count_props, sizeof(uint64_t));
+	if (r->count_props && (!r->props || !r->prop_values)) {
+		drmModeFreeObjectProperties(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModePropertyPtr drmModeDupProperty(drmModePropertyPtr prop)
+{
+	drmModePropertyPtr r;
+
+	if (!prop || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	*r = *prop;
+	r->values = NULL;
+	r->enums = NULL;
+	r->blob_ids = NULL;
+
+	/* Mirrors the layout produced by drmModeGetProperty(). */
+	if (prop->flags & DRM_MODE_PROP_BLOB)
+		r->values = drmAllocCpy((char *)prop->values, prop->count_blobs, sizeof(uint32_t));
+	else
+		r->values = drmAllocCpy((char *)prop->values, prop->count_values, sizeof(uint64_t));
+	if (prop->enums)
+		r->enums = drmAllocCpy((char *)prop->enums, prop->count_enums, sizeof(struct drm_mode_property_enum));
+	if (prop->blob_ids)
+		r->blob_ids = drmAllocCpy((char *)prop->blob_ids, prop->count_blobs, sizeof(uint32_t));
+
+	if ((prop->values && !r->values) ||
+	    (prop->enums && !r->enums) ||
+	    (prop->blob_ids && !r->blob_ids)) {
+		drmModeFreeProperty(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static drmModePropertyBlobPtr drmModeDupPropertyBlob(drmModePropertyBlobPtr blob)
+{
+	drmModePropertyBlobPtr r;
+
+	if (!blob || !(r = drmMalloc(sizeof(*r))))
+		return NULL;
+
+	*r = *blob;
+	r->data = drmAllocCpy(blob->data, 1, blob->length);
+	if (r->length && !r->data) {
+		drmFree(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static void drm_mode_cache_free_connector(void *value)
+{
+	struct drm_mode_cache_connector *entry = value;
+
+	drmModeFreeConnector(entry->connector);
+	drmFree(entry);
+}
+
+static void drm_mode_cache_free_object(void *value)
+{
+	struct drm_mode_cache_object *entry = value;
+
+	drmModeFreeObjectProperties(entry->props);
+	drmFree(entry);
+}
+
+static void drm_mode_cache_free_plane(void *value)
+{
+	drmModeFreePlane(value);
+}
+
+static void drm_mode_cache_free_property(void *value)
+{
+	drmModeFreeProperty(value);
+}
+
+static void drm_mode_cache_free_blob(void *value)
+{
+	drmModeFreePropertyBlob(value);
+}
+
+static void drm_mode_cache_flush(struct drm_mode_cache *cache)
+{
+	drm_mode_cache_generation++;
+
+	drmModeFreeResources(cache->res);
+	cache->res = NULL;
+	drmModeFreePlaneResources(cache->plane_res);
+	cache->plane_res = NULL;
+
+	drm_mode_cache_clear(&cache->connectors, drm_mode_cache_free_connector);
+	drm_mode_cache_clear(&cache->planes, drm_mode_cache_free_plane);
+	drm_mode_cache_clear(&cache->object_props, drm_mode_cache_free_object);
+	drm_mode_cache_clear(&cache->blobs, drm_mode_cache_free_blob);
+}
+
+/* Called by everything that changes KMS state through this library, after
+ * the ioctl, whose errno is kept.
+ */
+static void drm_mode_cache_dirty(int fd)
+{
+	struct drm_mode_cache *cache;
+	int err = errno;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (cache)
+		drm_mode_cache_flush(cache);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+	errno = err;
+}
+
+/* A plane reports the crtc and fb it scans out, and its properties carry
+ * the same.  Without the plane itself we can't tell which crtc a plane's
+ * properties refer to, so those are dropped as well.
+ */
+static int drm_mode_cache_plane_on_crtc(struct drm_mode_cache *cache,
+					unsigned long plane_id,
+					uint32_t crtc_id)
+{
+	drmModePlanePtr plane = drm_mode_cache_lookup(cache->planes, plane_id);
+
+	return !plane || plane->crtc_id == crtc_id;
+}
+
+/* Drops the crtc and every plane scanning out from it, which is all that a
+ * page flip changes.  Called after the flip, keeping its errno.
+ */
+static void drm_mode_cache_dirty_crtc(int fd, uint32_t crtc_id)
+{
+	struct drm_mode_cache *cache;
+	struct drm_mode_cache_object *entry;
+	drmModePlanePtr plane;
+	unsigned long *stale, id;
+	unsigned long count = 0, i;
+	void *value;
+	int err = errno;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache)
+		goto out;
+
+	stale = drmMalloc((drm_mode_cache_count(cache->planes) +
+			   drm_mode_cache_count(cache->object_props) + 1) *
+			  sizeof(*stale));
+	if (!stale) {
+		drm_mode_cache_flush(cache);
+		goto out;
+	}
+
+	drm_mode_cache_generation++;
+	drm_mode_cache_drop(cache->object_props, crtc_id,
+			    drm_mode_cache_free_object);
+
+	/* The hash can't be modified while it is walked. */
+	if (cache->object_props && drmHashFirst(cache->object_props, &id, &value)) {
+		do {
+			entry = value;
+			if (entry->object_type == DRM_MODE_OBJECT_PLANE &&
+			    drm_mode_cache_plane_on_crtc(cache, id, crtc_id))
+				stale[count++] = id;
+		} while (drmHashNext(cache->object_props, &id, &value));
+	}
+	for (i = 0; i < count; i++)
+		drm_mode_cache_drop(cache->object_props, stale[i],
+				    drm_mode_cache_free_object);
+
+	count = 0;
+	if (cache->planes && drmHashFirst(cache->planes, &id, &value)) {
+		do {
+			plane = value;
+			if (plane->crtc_id == crtc_id)
+				stale[count++] = id;
+		} while (drmHashNext(cache->planes, &id, &value));
+	}
+	for (i = 0; i < count; i++)
+		drm_mode_cache_drop(cache->planes, stale[i],
+				    drm_mode_cache_free_plane);
+
+	drmFree(stale);
+out:
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+	errno = err;
+}
+
+/* The crtc a plane scans out from as far as the cache knows, or 0.  Taken
+ * before the plane is moved, as the cache may learn the new one meanwhile.
+ */
+static uint32_t drm_mode_cache_plane_crtc(int fd, uint32_t plane_id)
+{
+	struct drm_mode_cache *cache;
+	drmModePlanePtr plane = NULL;
+	uint32_t crtc_id;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (cache)
+		plane = drm_mode_cache_lookup(cache->planes, plane_id);
+	crtc_id = plane ? plane->crtc_id : 0;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return crtc_id;
+}
+
+/* Drops a plane, the crtc it is moved to and the one it leaves.  Called
+ * after the plane was set, keeping the errno of that.
+ */
+static void drm_mode_cache_dirty_plane(int fd, uint32_t plane_id,
+				       uint32_t crtc_id, uint32_t old_crtc_id)
+{
+	struct drm_mode_cache *cache;
+	int err = errno;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		errno = err;
+		return;
+	}
+
+	drm_mode_cache_generation++;
+	drm_mode_cache_drop(cache->planes, plane_id, drm_mode_cache_free_plane);
+	drm_mode_cache_drop(cache->object_props, plane_id,
+			    drm_mode_cache_free_object);
+	drm_mode_cache_drop(cache->object_props, crtc_id,
+			    drm_mode_cache_free_object);
+	if (old_crtc_id)
+		drm_mode_cache_drop(cache->object_props, old_crtc_id,
+				    drm_mode_cache_free_object);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+	errno = err;
+}
+
+int drmModeCacheEnable(int fd)
+{
+	struct drm_mode_cache *cache;
+	int ret = 0;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	if (drm_mode_cache_get(fd))
+		goto out;
+
+	ret = -ENOMEM;
+	if (!drm_mode_caches && !(drm_mode_caches = drmHashCreate()))
+		goto out;
+
+	cache = drmMalloc(sizeof(*cache));
+	if (!cache)
+		goto out;
+
+	if (drmHashInsert(drm_mode_caches, fd, cache)) {
+		drmFree(cache);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+	return ret;
+}
+
+void drmModeCacheDisable(int fd)
+{
+	struct drm_mode_cache *cache;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (cache) {
+		drm_mode_cache_flush(cache);
+		drm_mode_cache_clear(&cache->properties,
+				     drm_mode_cache_free_property);
+		drmHashDelete(drm_mode_caches, fd);
+		drmFree(cache);
+	}
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+}
+
+void drmModeCacheInvalidate(int fd)
+{
+	drm_mode_cache_dirty(fd);
+}
+
 /*
  * A couple of free functions.
  */
@@ -154,7 +667,7 @@ void drmModeFreeEncoder(drmModeEncoderPtr ptr)
  * ModeSetting functions.
  */
 
-drmModeResPtr drmModeGetResources(int fd)
+static drmModeResPtr _drmModeGetResources(int fd)
 {
 	struct drm_mode_card_res res, counts;
 	drmModeResPtr r = 0;
@@ -248,6 +761,35 @@ err_allocs:
 	return r;
 }
 
+drmModeResPtr drmModeGetResources(int fd)
+{
+	struct drm_mode_cache *cache;
+	unsigned long generation;
+	drmModeResPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (cache && cache->res) {
+		r = drmModeDupResources(cache->res);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetResources(fd);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !cache->res)
+		cache->res = drmModeDupResources(r);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
 		 uint8_t bpp, uint32_t pitch, uint32_t bo_handle,
 		 uint32_t *buf_id)
@@ -263,7 +805,9 @@ int drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
 	f.depth  = depth;
 	f.handle = bo_handle;
 
-	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ADDFB, &f)))
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ADDFB, &f);
+	drm_mode_cache_dirty(fd);
+	if (ret)
 		return ret;
 
 	*buf_id = f.fb_id;
@@ -287,7 +831,9 @@ int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
 	memcpy(f.pitches, pitches, 4 * sizeof(pitches[0]));
 	memcpy(f.offsets, offsets, 4 * sizeof(offsets[0]));
 
-	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ADDFB2, &f)))
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ADDFB2, &f);
+	drm_mode_cache_dirty(fd);
+	if (ret)
 		return ret;
 
 	*buf_id = f.fb_id;
@@ -296,7 +842,11 @@ int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
 
 int drmModeRmFB(int fd, uint32_t bufferId)
 {
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_RMFB, &bufferId);
+	int ret;
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_RMFB, &bufferId);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 drmModeFBPtr drmModeGetFB(int fd, uint32_t buf)
@@ -378,6 +928,7 @@ int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId,
 		   drmModeModeInfoPtr mode)
 {
 	struct drm_mode_crtc crtc;
+	int ret;
 
 	memclear(crtc);
 	crtc.x             = x;
@@ -391,7 +942,9 @@ int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId,
 	  crtc.mode_valid = 1;
 	}
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 /*
@@ -401,6 +954,7 @@ int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId,
 int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t width, uint32_t height)
 {
 	struct drm_mode_cursor arg;
+	int ret;
 
 	memclear(arg);
 	arg.flags = DRM_MODE_CURSOR_BO;
@@ -409,12 +963,15 @@ int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t width
 	arg.height = height;
 	arg.handle = bo_handle;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR, &arg);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR, &arg);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 int drmModeSetCursor2(int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t width, uint32_t height, int32_t hot_x, int32_t hot_y)
 {
 	struct drm_mode_cursor2 arg;
+	int ret;
 
 	memclear(arg);
 	arg.flags = DRM_MODE_CURSOR_BO;
@@ -425,12 +982,15 @@ int drmModeSetCursor2(int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t widt
 	arg.hot_x = hot_x;
 	arg.hot_y = hot_y;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR2, &arg);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR2, &arg);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 int drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
 {
 	struct drm_mode_cursor arg;
+	int ret;
 
 	memclear(arg);
 	arg.flags = DRM_MODE_CURSOR_MOVE;
@@ -438,7 +998,9 @@ int drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
 	arg.x = x;
 	arg.y = y;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR, &arg);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CURSOR, &arg);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 /*
@@ -573,39 +1135,99 @@ err_allocs:
 	return r;
 }
 
+static drmModeConnectorPtr
+drmModeGetConnectorCached(int fd, uint32_t connector_id, int probe)
+{
+	struct drm_mode_cache *cache;
+	struct drm_mode_cache_connector *entry;
+	unsigned long generation;
+	drmModeConnectorPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return _drmModeGetConnector(fd, connector_id, probe);
+	}
+
+	/* A probing request can't be answered from a non-probed entry. */
+	entry = drm_mode_cache_lookup(cache->connectors, connector_id);
+	if (entry && entry->probed >= probe) {
+		r = drmModeDupConnector(entry->connector);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetConnector(fd, connector_id, probe);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache) {
+		entry = drm_mode_cache_lookup(cache->connectors, connector_id);
+		if (entry && entry->probed < probe) {
+			drm_mode_cache_drop(cache->connectors, connector_id,
+					    drm_mode_cache_free_connector);
+			entry = NULL;
+		}
+		if (!entry && (entry = drmMalloc(sizeof(*entry)))) {
+			entry->connector = drmModeDupConnector(r);
+			entry->probed = probe;
+			if (entry->connector)
+				drm_mode_cache_insert(&cache->connectors,
+						      connector_id, entry,
+						      drm_mode_cache_free_connector);
+			else
+				drmFree(entry);
+		}
+	}
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connector_id)
 {
-	return _drmModeGetConnector(fd, connector_id, 1);
+	return drmModeGetConnectorCached(fd, connector_id, 1);
 }
 
 drmModeConnectorPtr drmModeGetConnectorCurrent(int fd, uint32_t connector_id)
 {
-	return _drmModeGetConnector(fd, connector_id, 0);
+	return drmModeGetConnectorCached(fd, connector_id, 0);
 }
 
 int drmModeAttachMode(int fd, uint32_t connector_id, drmModeModeInfoPtr mode_info)
 {
 	struct drm_mode_mode_cmd res;
+	int ret;
 
 	memclear(res);
 	memcpy(&res.mode, mode_info, sizeof(struct drm_mode_modeinfo));
 	res.connector_id = connector_id;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_ATTACHMODE, &res);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATTACHMODE, &res);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 int drmModeDetachMode(int fd, uint32_t connector_id, drmModeModeInfoPtr mode_info)
 {
 	struct drm_mode_mode_cmd res;
+	int ret;
 
 	memclear(res);
 	memcpy(&res.mode, mode_info, sizeof(struct drm_mode_modeinfo));
 	res.connector_id = connector_id;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DETACHMODE, &res);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_DETACHMODE, &res);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
-drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
+static drmModePropertyPtr _drmModeGetProperty(int fd, uint32_t property_id)
 {
 	struct drm_mode_get_property prop;
 	drmModePropertyPtr r;
@@ -659,6 +1281,43 @@ err_allocs:
 	return r;
 }
 
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
+{
+	struct drm_mode_cache *cache;
+	unsigned long generation;
+	drmModePropertyPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return _drmModeGetProperty(fd, property_id);
+	}
+
+	r = drm_mode_cache_lookup(cache->properties, property_id);
+	if (r) {
+		r = drmModeDupProperty(r);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetProperty(fd, property_id);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !drm_mode_cache_lookup(cache->properties, property_id))
+		drm_mode_cache_insert(&cache->properties, property_id,
+				      drmModeDupProperty(r),
+				      drm_mode_cache_free_property);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 void drmModeFreeProperty(drmModePropertyPtr ptr)
 {
 	if (!ptr)
@@ -666,10 +1325,11 @@ void drmModeFreeProperty(drmModePropertyPtr ptr)
 
 	drmFree(ptr->values);
 	drmFree(ptr->enums);
+	drmFree(ptr->blob_ids);
 	drmFree(ptr);
 }
 
-drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+static drmModePropertyBlobPtr _drmModeGetPropertyBlob(int fd, uint32_t blob_id)
 {
 	struct drm_mode_get_blob blob;
 	drmModePropertyBlobPtr r;
@@ -695,8 +1355,45 @@ drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
 	r->length = blob.length;
 	r->data = drmAllocCpy(U642VOID(blob.data), 1, blob.length);
 
-err_allocs:
-	drmFree(U642VOID(blob.data));
+err_allocs:
+	drmFree(U642VOID(blob.data));
+	return r;
+}
+
+drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	struct drm_mode_cache *cache;
+	unsigned long generation;
+	drmModePropertyBlobPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return _drmModeGetPropertyBlob(fd, blob_id);
+	}
+
+	r = drm_mode_cache_lookup(cache->blobs, blob_id);
+	if (r) {
+		r = drmModeDupPropertyBlob(r);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetPropertyBlob(fd, blob_id);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !drm_mode_cache_lookup(cache->blobs, blob_id))
+		drm_mode_cache_insert(&cache->blobs, blob_id,
+				      drmModeDupPropertyBlob(r),
+				      drm_mode_cache_free_blob);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
 	return r;
 }
 
@@ -713,13 +1410,16 @@ int drmModeConnectorSetProperty(int fd, uint32_t connector_id, uint32_t property
 			     uint64_t value)
 {
 	struct drm_mode_connector_set_property osp;
+	int ret;
 
 	memclear(osp);
 	osp.connector_id = connector_id;
 	osp.prop_id = property_id;
 	osp.value = value;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPROPERTY, &osp);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPROPERTY, &osp);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 /*
@@ -856,6 +1556,7 @@ int drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
 			uint16_t *red, uint16_t *green, uint16_t *blue)
 {
 	struct drm_mode_crtc_lut l;
+	int ret;
 
 	memclear(l);
 	l.crtc_id = crtc_id;
@@ -864,15 +1565,61 @@ int drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
 	l.green = VOID2U64(green);
 	l.blue = VOID2U64(blue);
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETGAMMA, &l);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_SETGAMMA, &l);
+	drm_mode_cache_dirty(fd);
+	return ret;
+}
+
+int drmParseEvents(const void *buffer, int length, drmEventRecordPtr events,
+		   int max_events, int *consumed)
+{
+	const char *data = buffer;
+	const struct drm_event *e;
+	const struct drm_event_vblank *vblank;
+	drmEventRecordPtr r;
+	int i = 0, count = 0;
+
+	while (count < max_events && length - i >= (int)sizeof *e) {
+		e = (const struct drm_event *) &data[i];
+		if (e->length < sizeof *e || e->length > (uint32_t)(length - i))
+			break;
+
+		r = &events[count++];
+		memset(r, 0, sizeof *r);
+		r->type = e->type;
+		r->length = e->length;
+		r->event = e;
+
+		switch (e->type) {
+		case DRM_EVENT_VBLANK:
+		case DRM_EVENT_FLIP_COMPLETE:
+			if (e->length < sizeof *vblank)
+				break;
+			vblank = (const struct drm_event_vblank *) e;
+			r->crtc_id = vblank->crtc_id;
+			r->sequence = vblank->sequence;
+			r->timestamp = vblank->tv_sec * 1000000000ull +
+				       vblank->tv_usec * 1000ull;
+			r->user_data = U642VOID (vblank->user_data);
+			break;
+		default:
+			break;
+		}
+
+		i += e->length;
+	}
+
+	if (consumed)
+		*consumed = i;
+
+	return count;
 }
 
 int drmHandleEvent(int fd, drmEventContextPtr evctx)
 {
 	char buffer[1024];
-	int len, i;
-	struct drm_event *e;
-	struct drm_event_vblank *vblank;
+	drmEventRecord events[sizeof buffer / sizeof(struct drm_event)];
+	int len, i, count;
 
 	/* The DRM read semantics guarantees that we always get only
 	 * complete events. */
@@ -880,48 +1627,113 @@ int drmHandleEvent(int fd, drmEventContextPtr evctx)
 	len = read(fd, buffer, sizeof buffer);
 	if (len == 0)
 		return 0;
-	if (len < (int)sizeof *e)
+	if (len < (int)sizeof(struct drm_event))
 		return -1;
 
-	i = 0;
-	while (i < len) {
-		e = (struct drm_event *) &buffer[i];
-		switch (e->type) {
+	count = drmParseEvents(buffer, len, events,
+			       sizeof events / sizeof events[0], NULL);
+	for (i = 0; i < count; i++) {
+		switch (events[i].type) {
 		case DRM_EVENT_VBLANK:
 			if (evctx->version < 1 ||
 			    evctx->vblank_handler == NULL)
 				break;
-			vblank = (struct drm_event_vblank *) e;
 			evctx->vblank_handler(fd,
-					      vblank->sequence,
-					      vblank->tv_sec,
-					      vblank->tv_usec,
-					      U642VOID (vblank->user_data));
+					      events[i].sequence,
+					      events[i].timestamp / 1000000000,
+					      events[i].timestamp / 1000 % 1000000,
+					      events[i].user_data);
 			break;
 		case DRM_EVENT_FLIP_COMPLETE:
 			if (evctx->version < 2 ||
 			    evctx->page_flip_handler == NULL)
 				break;
-			vblank = (struct drm_event_vblank *) e;
 			evctx->page_flip_handler(fd,
-						 vblank->sequence,
-						 vblank->tv_sec,
-						 vblank->tv_usec,
-						 U642VOID (vblank->user_data));
+						 events[i].sequence,
+						 events[i].timestamp / 1000000000,
+						 events[i].timestamp / 1000 % 1000000,
+						 events[i].user_data);
 			break;
 		default:
 			break;
 		}
-		i += e->length;
 	}
 
 	return 0;
 }
 
+struct _drmEventQueue {
+	int fd;
+	int size;
+	int head;	/* first byte not yet handed out */
+	int tail;	/* end of the data read from the fd */
+	char *buffer;
+};
+
+drmEventQueuePtr drmEventQueueCreate(int fd, int size)
+{
+	drmEventQueuePtr queue;
+
+	if (size < (int)sizeof(struct drm_event_vblank))
+		size = 4096;
+
+	queue = drmMalloc(sizeof *queue);
+	if (!queue)
+		return NULL;
+
+	queue->buffer = drmMalloc(size);
+	if (!queue->buffer) {
+		drmFree(queue);
+		return NULL;
+	}
+
+	queue->fd = fd;
+	queue->size = size;
+
+	return queue;
+}
+
+void drmEventQueueDestroy(drmEventQueuePtr queue)
+{
+	if (!queue)
+		return;
+
+	drmFree(queue->buffer);
+	drmFree(queue);
+}
+
+int drmEventQueueRead(drmEventQueuePtr queue, drmEventRecordPtr events,
+		      int max_events)
+{
+	int len, count, consumed;
+
+	/* Hand out whatever is left from the previous read before reading
+	 * again, as that would overwrite the events still referenced. */
+	if (queue->head == queue->tail) {
+		len = read(queue->fd, queue->buffer, queue->size);
+		if (len <= 0)
+			return len;
+		queue->head = 0;
+		queue->tail = len;
+	}
+
+	count = drmParseEvents(queue->buffer + queue->head,
+			       queue->tail - queue->head,
+			       events, max_events, &consumed);
+	queue->head += consumed;
+
+	/* Drop anything that doesn't parse rather than spinning on it. */
+	if (count < max_events)
+		queue->head = queue->tail;
+
+	return count;
+}
+
 int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
 		    uint32_t flags, void *user_data)
 {
 	struct drm_mode_crtc_page_flip flip;
+	int ret;
 
 	memclear(flip);
 	flip.fb_id = fb_id;
@@ -929,7 +1741,9 @@ int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
 	flip.user_data = VOID2U64(user_data);
 	flip.flags = flags;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	drm_mode_cache_dirty_crtc(fd, crtc_id);
+	return ret;
 }
 
 int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
@@ -940,6 +1754,8 @@ int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
 		    uint32_t src_w, uint32_t src_h)
 {
 	struct drm_mode_set_plane s;
+	uint32_t old_crtc_id;
+	int ret;
 
 	memclear(s);
 	s.plane_id = plane_id;
@@ -955,10 +1771,13 @@ int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
 	s.src_w = src_w;
 	s.src_h = src_h;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPLANE, &s);
+	old_crtc_id = drm_mode_cache_plane_crtc(fd, plane_id);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPLANE, &s);
+	drm_mode_cache_dirty_plane(fd, plane_id, crtc_id, old_crtc_id);
+	return ret;
 }
 
-drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+static drmModePlanePtr _drmModeGetPlane(int fd, uint32_t plane_id)
 {
 	struct drm_mode_get_plane ovr, counts;
 	drmModePlanePtr r = 0;
@@ -1009,6 +1828,43 @@ err_allocs:
 	return r;
 }
 
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	struct drm_mode_cache *cache;
+	unsigned long generation;
+	drmModePlanePtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return _drmModeGetPlane(fd, plane_id);
+	}
+
+	r = drm_mode_cache_lookup(cache->planes, plane_id);
+	if (r) {
+		r = drmModeDupPlane(r);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetPlane(fd, plane_id);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !drm_mode_cache_lookup(cache->planes, plane_id))
+		drm_mode_cache_insert(&cache->planes, plane_id,
+				      drmModeDupPlane(r),
+				      drm_mode_cache_free_plane);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 void drmModeFreePlane(drmModePlanePtr ptr)
 {
 	if (!ptr)
@@ -1018,7 +1874,7 @@ void drmModeFreePlane(drmModePlanePtr ptr)
 	drmFree(ptr);
 }
 
-drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+static drmModePlaneResPtr _drmModeGetPlaneResources(int fd)
 {
 	struct drm_mode_get_plane_res res, counts;
 	drmModePlaneResPtr r = 0;
@@ -1063,6 +1919,35 @@ err_allocs:
 	return r;
 }
 
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+	struct drm_mode_cache *cache;
+	unsigned long generation;
+	drmModePlaneResPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (cache && cache->plane_res) {
+		r = drmModeDupPlaneResources(cache->plane_res);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeGetPlaneResources(fd);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !cache->plane_res)
+		cache->plane_res = drmModeDupPlaneResources(r);
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
 {
 	if (!ptr)
@@ -1072,9 +1957,9 @@ void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
 	drmFree(ptr);
 }
 
-drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd,
-						      uint32_t object_id,
-						      uint32_t object_type)
+static drmModeObjectPropertiesPtr _drmModeObjectGetProperties(int fd,
+							      uint32_t object_id,
+							      uint32_t object_type)
 {
 	struct drm_mode_obj_get_properties properties;
 	drmModeObjectPropertiesPtr ret = NULL;
@@ -1133,6 +2018,52 @@ err_allocs:
 	return ret;
 }
 
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd,
+						      uint32_t object_id,
+						      uint32_t object_type)
+{
+	struct drm_mode_cache *cache;
+	struct drm_mode_cache_object *entry;
+	unsigned long generation;
+	drmModeObjectPropertiesPtr r;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get(fd);
+	if (!cache) {
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return _drmModeObjectGetProperties(fd, object_id, object_type);
+	}
+
+	entry = drm_mode_cache_lookup(cache->object_props, object_id);
+	if (entry && entry->object_type == object_type) {
+		r = drmModeDupObjectProperties(entry->props);
+		pthread_mutex_unlock(&drm_mode_cache_lock);
+		return r;
+	}
+	generation = drm_mode_cache_generation;
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	r = _drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&drm_mode_cache_lock);
+	cache = drm_mode_cache_get_since(fd, generation);
+	if (cache && !drm_mode_cache_lookup(cache->object_props, object_id) &&
+	    (entry = drmMalloc(sizeof(*entry)))) {
+		entry->props = drmModeDupObjectProperties(r);
+		entry->object_type = object_type;
+		if (entry->props)
+			drm_mode_cache_insert(&cache->object_props, object_id,
+					      entry, drm_mode_cache_free_object);
+		else
+			drmFree(entry);
+	}
+	pthread_mutex_unlock(&drm_mode_cache_lock);
+
+	return r;
+}
+
 void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
 {
 	if (!ptr)
@@ -1146,6 +2077,7 @@ int drmModeObjectSetProperty(int fd, uint32_t object_id, uint32_t object_type,
 			     uint32_t property_id, uint64_t value)
 {
 	struct drm_mode_obj_set_property prop;
+	int ret;
 
 	memclear(prop);
 	prop.value = value;
@@ -1153,7 +2085,9 @@ int drmModeObjectSetProperty(int fd, uint32_t object_id, uint32_t object_type,
 	prop.obj_id = object_id;
 	prop.obj_type = object_type;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &prop);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &prop);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
 
 typedef struct _drmModeAtomicReqItem drmModeAtomicReqItem, *drmModeAtomicReqItemPtr;
@@ -1162,12 +2096,21 @@ struct _drmModeAtomicReqItem {
 	uint32_t object_id;
 	uint32_t property_id;
 	uint64_t value;
+	uint32_t cursor;
 };
 
 struct _drmModeAtomicReq {
 	uint32_t cursor;
 	uint32_t size_items;
 	drmModeAtomicReqItemPtr items;
+
+	/* Scratch space used by drmModeAtomicCommit() to build the sorted
+	 * item list and the arrays passed to the kernel.  It is kept around
+	 * between commits so that committing a request of a stable size does
+	 * not touch the heap.
+	 */
+	void *scratch;
+	uint32_t size_scratch;
 };
 
 drmModeAtomicReqPtr drmModeAtomicAlloc(void)
@@ -1181,6 +2124,8 @@ drmModeAtomicReqPtr drmModeAtomicAlloc(void)
 	req->items = NULL;
 	req->cursor = 0;
 	req->size_items = 0;
+	req->scratch = NULL;
+	req->size_scratch = 0;
 
 	return req;
 }
@@ -1195,6 +2140,8 @@ drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
 
 	new->cursor = old->cursor;
 	new->size_items = old->size_items;
+	new->scratch = NULL;
+	new->size_scratch = 0;
 
 	if (old->size_items) {
 		new->items = drmMalloc(old->size_items * sizeof(*new->items));
@@ -1213,6 +2160,8 @@ drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
 
 int drmModeAtomicMerge(drmModeAtomicReqPtr base, drmModeAtomicReqPtr augment)
 {
+	uint32_t i;
+
 	if (!augment || augment->cursor == 0)
 		return 0;
 
@@ -1232,6 +2181,8 @@ int drmModeAtomicMerge(drmModeAtomicReqPtr base, drmModeAtomicReqPtr augment)
 
 	memcpy(&base->items[base->cursor], augment->items,
 	       augment->cursor * sizeof(*augment->items));
+	for (i = base->cursor; i < base->cursor + augment->cursor; i++)
+		base->items[i].cursor = i;
 	base->cursor += augment->cursor;
 
 	return 0;
@@ -1267,6 +2218,7 @@ int drmModeAtomicAddProperty(drmModeAtomicReqPtr req,
 	req->items[req->cursor].object_id = object_id;
 	req->items[req->cursor].property_id = property_id;
 	req->items[req->cursor].value = value;
+	req->items[req->cursor].cursor = req->cursor;
 	req->cursor++;
 
 	return req->cursor;
@@ -1279,6 +2231,7 @@ void drmModeAtomicFree(drmModeAtomicReqPtr req)
 
 	if (req->items)
 		drmFree(req->items);
+	drmFree(req->scratch);
 	drmFree(req);
 }
 
@@ -1287,114 +2240,416 @@ static int sort_req_list(const void *misc, const void *other)
 	const drmModeAtomicReqItem *first = misc;
 	const drmModeAtomicReqItem *second = other;
 
-	if (first->object_id < second->object_id)
-		return -1;
-	else if (first->object_id > second->object_id)
-		return 1;
-	else
-		return second->property_id - first->property_id;
+	if (first->object_id != second->object_id)
+		return first->object_id < second->object_id ? -1 : 1;
+	if (first->property_id != second->property_id)
+		return first->property_id < second->property_id ? -1 : 1;
+	/* Keep insertion order so that the last value set wins below. */
+	return first->cursor < second->cursor ? -1 : 1;
+}
+
+/*
+ * Per-item footprint of the commit scratch space: one sorted item, a
+ * property id and value, and (at most) one object id and property count.
+ */
+#define ATOMIC_SCRATCH_ITEM_SIZE \
+	(sizeof(drmModeAtomicReqItem) + sizeof(uint64_t) + 3 * sizeof(uint32_t))
+
+static int drmModeAtomicReserveScratch(drmModeAtomicReqPtr req)
+{
+	void *scratch;
+	uint32_t size;
+
+	if (req->cursor <= req->size_scratch)
+		return 0;
+
+	size = req->size_items > req->cursor ? req->size_items : req->cursor;
+	scratch = drmMalloc(size * ATOMIC_SCRATCH_ITEM_SIZE);
+	if (!scratch)
+		return -ENOMEM;
+
+	drmFree(req->scratch);
+	req->scratch = scratch;
+	req->size_scratch = size;
+
+	return 0;
 }
 
 int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
 			void *user_data)
 {
-	drmModeAtomicReqPtr sorted;
 	struct drm_mode_atomic atomic;
-	uint32_t *objs_ptr = NULL;
-	uint32_t *count_props_ptr = NULL;
-	uint32_t *props_ptr = NULL;
-	uint64_t *prop_values_ptr = NULL;
-	uint32_t last_obj_id = 0;
+	drmModeAtomicReqItemPtr sorted;
+	uint64_t *prop_values_ptr;
+	uint32_t *objs_ptr;
+	uint32_t *count_props_ptr;
+	uint32_t *props_ptr;
+	uint32_t count_items;
 	uint32_t i;
-	int obj_idx = -1;
-	int ret = -1;
+	int ret;
 
 	if (req->cursor == 0)
 		return 0;
 
-	sorted = drmModeAtomicDuplicate(req);
-	if (sorted == NULL)
+	if (drmModeAtomicReserveScratch(req))
 		return -ENOMEM;
 
-	memclear(atomic);
+	/* The 64-bit members go first so everything stays naturally aligned. */
+	sorted = req->scratch;
+	prop_values_ptr = (uint64_t *)(sorted + req->size_scratch);
+	objs_ptr = (uint32_t *)(prop_values_ptr + req->size_scratch);
+	count_props_ptr = objs_ptr + req->size_scratch;
+	props_ptr = count_props_ptr + req->size_scratch;
+
+	memcpy(sorted, req->items, req->cursor * sizeof(*sorted));
 
 	/* Sort the list by object ID, then by property ID. */
-	qsort(sorted->items, sorted->cursor, sizeof(*sorted->items),
-	      sort_req_list);
+	qsort(sorted, req->cursor, sizeof(*sorted), sort_req_list);
+
+	/* Now the list is sorted, eliminate duplicate property sets in a
+	 * single pass, keeping the value that was added last, and fill in
+	 * the kernel arrays as we go.
+	 */
+	memclear(atomic);
+	count_items = 0;
+	for (i = 0; i < req->cursor; i++) {
+		if (count_items &&
+		    sorted[i].object_id == sorted[count_items - 1].object_id &&
+		    sorted[i].property_id == sorted[count_items - 1].property_id) {
+			prop_values_ptr[count_items - 1] = sorted[i].value;
+			continue;
+		}
 
-	/* Now the list is sorted, eliminate duplicate property sets. */
-	for (i = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
+		if (!atomic.count_objs ||
+		    objs_ptr[atomic.count_objs - 1] != sorted[i].object_id) {
+			objs_ptr[atomic.count_objs] = sorted[i].object_id;
+			count_props_ptr[atomic.count_objs] = 0;
 			atomic.count_objs++;
-			last_obj_id = sorted->items[i].object_id;
 		}
 
-		if (i == sorted->cursor - 1)
-			continue;
+		sorted[count_items] = sorted[i];
+		count_props_ptr[atomic.count_objs - 1]++;
+		props_ptr[count_items] = sorted[i].property_id;
+		prop_values_ptr[count_items] = sorted[i].value;
+		count_items++;
+	}
 
-		if (sorted->items[i].object_id != sorted->items[i + 1].object_id ||
-		    sorted->items[i].property_id != sorted->items[i + 1].property_id)
-			continue;
+	atomic.flags = flags;
+	atomic.objs_ptr = VOID2U64(objs_ptr);
+	atomic.count_props_ptr = VOID2U64(count_props_ptr);
+	atomic.props_ptr = VOID2U64(props_ptr);
+	atomic.prop_values_ptr = VOID2U64(prop_values_ptr);
+	atomic.user_data = VOID2U64(user_data);
 
-		memmove(&sorted->items[i], &sorted->items[i + 1],
-			(sorted->cursor - i - 1) * sizeof(*sorted->items));
-		sorted->cursor--;
-	}
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	if (!(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		drm_mode_cache_dirty(fd);
 
-	objs_ptr = drmMalloc(atomic.count_objs * sizeof objs_ptr[0]);
-	if (!objs_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+	return ret;
+}
 
-	count_props_ptr = drmMalloc(atomic.count_objs * sizeof count_props_ptr[0]);
-	if (!count_props_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+/*
+ * Atomic state
+ */
 
-	props_ptr = drmMalloc(sorted->cursor * sizeof props_ptr[0]);
-	if (!props_ptr) {
-		errno = ENOMEM;
-		goto out;
+#define ATOMIC_STATE_DIRTY	(1 << 0)
+#define ATOMIC_STATE_COMMITTED	(1 << 1)
+
+struct _drmModeAtomicState {
+	/* Objects sorted by ID.  The arrays match what the kernel expects
+	 * in struct drm_mode_atomic, so a full commit needs no copying.
+	 */
+	uint32_t count_objs;
+	uint32_t size_objs;
+	uint32_t *objs;
+	uint32_t *count_props;
+	uint32_t *first_prop;
+	uint32_t *dirty_props;
+
+	/* Properties, grouped by object and sorted by ID within an object. */
+	uint32_t count_items;
+	uint32_t size_items;
+	uint32_t *props;
+	uint64_t *values;
+	uint64_t *committed;
+	uint8_t *flags;
+
+	uint32_t count_dirty;
+
+	/* Storage for partial commits, sized like the arrays above. */
+	uint32_t *delta_objs;
+	uint32_t *delta_count_props;
+	uint32_t *delta_props;
+	uint64_t *delta_values;
+};
+
+#define ATOMIC_STATE_GROW(array, size) do {				\
+	void *_new = realloc(array, (size) * sizeof(*(array)));		\
+	if (!_new)							\
+		return -ENOMEM;						\
+	(array) = _new;							\
+} while (0)
+
+drmModeAtomicStatePtr drmModeAtomicStateAlloc(void)
+{
+	return drmMalloc(sizeof(drmModeAtomicState));
+}
+
+void drmModeAtomicStateFree(drmModeAtomicStatePtr state)
+{
+	if (!state)
+		return;
+
+	drmFree(state->objs);
+	drmFree(state->count_props);
+	drmFree(state->first_prop);
+	drmFree(state->dirty_props);
+	drmFree(state->delta_objs);
+	drmFree(state->delta_count_props);
+	drmFree(state->props);
+	drmFree(state->values);
+	drmFree(state->committed);
+	drmFree(state->flags);
+	drmFree(state->delta_props);
+	drmFree(state->delta_values);
+	drmFree(state);
+}
+
+static int atomic_state_reserve_objs(drmModeAtomicStatePtr state)
+{
+	uint32_t size;
+
+	if (state->count_objs < state->size_objs)
+		return 0;
+
+	size = state->size_objs ? state->size_objs * 2 : 8;
+	ATOMIC_STATE_GROW(state->objs, size);
+	ATOMIC_STATE_GROW(state->count_props, size);
+	ATOMIC_STATE_GROW(state->first_prop, size);
+	ATOMIC_STATE_GROW(state->dirty_props, size);
+	ATOMIC_STATE_GROW(state->delta_objs, size);
+	ATOMIC_STATE_GROW(state->delta_count_props, size);
+	state->size_objs = size;
+
+	return 0;
+}
+
+static int atomic_state_reserve_items(drmModeAtomicStatePtr state)
+{
+	uint32_t size;
+
+	if (state->count_items < state->size_items)
+		return 0;
+
+	size = state->size_items ? state->size_items * 2 : 32;
+	ATOMIC_STATE_GROW(state->props, size);
+	ATOMIC_STATE_GROW(state->values, size);
+	ATOMIC_STATE_GROW(state->committed, size);
+	ATOMIC_STATE_GROW(state->flags, size);
+	ATOMIC_STATE_GROW(state->delta_props, size);
+	ATOMIC_STATE_GROW(state->delta_values, size);
+	state->size_items = size;
+
+	return 0;
+}
+
+/* Binary search for @key in @array; on a miss, @index is where it belongs. */
+static int atomic_state_find(const uint32_t *array, uint32_t count,
+			     uint32_t key, uint32_t *index)
+{
+	uint32_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (array[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	prop_values_ptr = drmMalloc(sorted->cursor * sizeof prop_values_ptr[0]);
-	if (!prop_values_ptr) {
-		errno = ENOMEM;
-		goto out;
+	*index = lo;
+	return lo < count && array[lo] == key;
+}
+
+static int atomic_state_add_object(drmModeAtomicStatePtr state, uint32_t o,
+				   uint32_t object_id)
+{
+	uint32_t tail = state->count_objs - o;
+	uint32_t first;
+
+	if (atomic_state_reserve_objs(state))
+		return -ENOMEM;
+
+	first = o < state->count_objs ? state->first_prop[o] : state->count_items;
+
+	memmove(&state->objs[o + 1], &state->objs[o],
+		tail * sizeof(*state->objs));
+	memmove(&state->count_props[o + 1], &state->count_props[o],
+		tail * sizeof(*state->count_props));
+	memmove(&state->first_prop[o + 1], &state->first_prop[o],
+		tail * sizeof(*state->first_prop));
+	memmove(&state->dirty_props[o + 1], &state->dirty_props[o],
+		tail * sizeof(*state->dirty_props));
+
+	state->objs[o] = object_id;
+	state->count_props[o] = 0;
+	state->first_prop[o] = first;
+	state->dirty_props[o] = 0;
+	state->count_objs++;
+
+	return 0;
+}
+
+static int atomic_state_add_property(drmModeAtomicStatePtr state, uint32_t o,
+				     uint32_t p, uint32_t property_id)
+{
+	uint32_t tail = state->count_items - p;
+	uint32_t i;
+
+	if (atomic_state_reserve_items(state))
+		return -ENOMEM;
+
+	memmove(&state->props[p + 1], &state->props[p],
+		tail * sizeof(*state->props));
+	memmove(&state->values[p + 1], &state->values[p],
+		tail * sizeof(*state->values));
+	memmove(&state->committed[p + 1], &state->committed[p],
+		tail * sizeof(*state->committed));
+	memmove(&state->flags[p + 1], &state->flags[p],
+		tail * sizeof(*state->flags));
+
+	state->props[p] = property_id;
+	state->flags[p] = 0;
+	state->count_props[o]++;
+	state->count_items++;
+
+	for (i = o + 1; i < state->count_objs; i++)
+		state->first_prop[i]++;
+
+	return 0;
+}
+
+int drmModeAtomicStateSetProperty(drmModeAtomicStatePtr state,
+				  uint32_t object_id,
+				  uint32_t property_id,
+				  uint64_t value)
+{
+	uint32_t o, p;
+	int dirty;
+
+	if (!atomic_state_find(state->objs, state->count_objs, object_id, &o) &&
+	    atomic_state_add_object(state, o, object_id))
+		return -ENOMEM;
+
+	if (!atomic_state_find(&state->props[state->first_prop[o]],
+			       state->count_props[o], property_id, &p)) {
+		p += state->first_prop[o];
+		if (atomic_state_add_property(state, o, p, property_id))
+			return -ENOMEM;
+	} else {
+		p += state->first_prop[o];
 	}
 
-	for (i = 0, last_obj_id = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
-			obj_idx++;
-			objs_ptr[obj_idx] = sorted->items[i].object_id;
-			last_obj_id = objs_ptr[obj_idx];
-		}
+	state->values[p] = value;
 
-		count_props_ptr[obj_idx]++;
-		props_ptr[i] = sorted->items[i].property_id;
-		prop_values_ptr[i] = sorted->items[i].value;
+	dirty = !(state->flags[p] & ATOMIC_STATE_COMMITTED) ||
+		state->committed[p] != value;
+	if (dirty == !!(state->flags[p] & ATOMIC_STATE_DIRTY))
+		return 0;
 
+	state->flags[p] ^= ATOMIC_STATE_DIRTY;
+	if (dirty) {
+		state->dirty_props[o]++;
+		state->count_dirty++;
+	} else {
+		state->dirty_props[o]--;
+		state->count_dirty--;
 	}
 
+	return 0;
+}
+
+void drmModeAtomicStateInvalidate(drmModeAtomicStatePtr state)
+{
+	uint32_t i;
+
+	for (i = 0; i < state->count_objs; i++)
+		state->dirty_props[i] = state->count_props[i];
+	for (i = 0; i < state->count_items; i++)
+		state->flags[i] = ATOMIC_STATE_DIRTY;
+	state->count_dirty = state->count_items;
+}
+
+int drmModeAtomicStateCommit(int fd, drmModeAtomicStatePtr state,
+			     uint32_t flags, void *user_data)
+{
+	struct drm_mode_atomic atomic;
+	uint32_t o, p, end, n;
+	int ret;
+
+	if (state->count_dirty == 0)
+		return 0;
+
+	memclear(atomic);
 	atomic.flags = flags;
-	atomic.objs_ptr = VOID2U64(objs_ptr);
-	atomic.count_props_ptr = VOID2U64(count_props_ptr);
-	atomic.props_ptr = VOID2U64(props_ptr);
-	atomic.prop_values_ptr = VOID2U64(prop_values_ptr);
 	atomic.user_data = VOID2U64(user_data);
 
+	if (state->count_dirty == state->count_items) {
+		atomic.count_objs = state->count_objs;
+		atomic.objs_ptr = VOID2U64(state->objs);
+		atomic.count_props_ptr = VOID2U64(state->count_props);
+		atomic.props_ptr = VOID2U64(state->props);
+		atomic.prop_values_ptr = VOID2U64(state->values);
+	} else {
+		/* Only objects with changed properties need to be visited. */
+		for (o = 0, n = 0; o < state->count_objs; o++) {
+			if (!state->dirty_props[o])
+				continue;
+
+			state->delta_objs[atomic.count_objs] = state->objs[o];
+			state->delta_count_props[atomic.count_objs] =
+				state->dirty_props[o];
+			atomic.count_objs++;
+
+			end = state->first_prop[o] + state->count_props[o];
+			for (p = state->first_prop[o]; p < end; p++) {
+				if (!(state->flags[p] & ATOMIC_STATE_DIRTY))
+					continue;
+				state->delta_props[n] = state->props[p];
+				state->delta_values[n] = state->values[p];
+				n++;
+			}
+		}
+
+		atomic.objs_ptr = VOID2U64(state->delta_objs);
+		atomic.count_props_ptr = VOID2U64(state->delta_count_props);
+		atomic.props_ptr = VOID2U64(state->delta_props);
+		atomic.prop_values_ptr = VOID2U64(state->delta_values);
+	}
+
 	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	if (!(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		drm_mode_cache_dirty(fd);
+	if (ret || (flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		return ret;
 
-out:
-	drmFree(objs_ptr);
-	drmFree(count_props_ptr);
-	drmFree(props_ptr);
-	drmFree(prop_values_ptr);
-	drmModeAtomicFree(sorted);
+	for (o = 0; o < state->count_objs; o++) {
+		if (!state->dirty_props[o])
+			continue;
 
-	return ret;
+		end = state->first_prop[o] + state->count_props[o];
+		for (p = state->first_prop[o]; p < end; p++) {
+			if (!(state->flags[p] & ATOMIC_STATE_DIRTY))
+				continue;
+			state->committed[p] = state->values[p];
+			state->flags[p] = ATOMIC_STATE_COMMITTED;
+		}
+		state->dirty_props[o] = 0;
+	}
+	state->count_dirty = 0;
+
+	return 0;
 }
 
 int
@@ -1425,8 +2680,11 @@ int
 drmModeDestroyPropertyBlob(int fd, uint32_t id)
 {
 	struct drm_mode_destroy_blob destroy;
+	int ret;
 
 	memclear(destroy);
 	destroy.blob_id = id;
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+	drm_mode_cache_dirty(fd);
+	return ret;
 }
@@ -503,6 +503,39 @@ extern int drmModeAtomicCommit(int fd,
 			       uint32_t flags,
 			       void *user_data);
 
+/*
+ * An atomic state keeps every property that was ever set on it, sorted by
+ * object and property ID, and only submits the ones that changed since the
+ * last successful (non test-only) commit.
+ */
+typedef struct _drmModeAtomicState drmModeAtomicState, *drmModeAtomicStatePtr;
+
+extern drmModeAtomicStatePtr drmModeAtomicStateAlloc(void);
+extern void drmModeAtomicStateFree(drmModeAtomicStatePtr state);
+extern int drmModeAtomicStateSetProperty(drmModeAtomicStatePtr state,
+					 uint32_t object_id,
+					 uint32_t property_id,
+					 uint64_t value);
+extern void drmModeAtomicStateInvalidate(drmModeAtomicStatePtr state);
+extern int drmModeAtomicStateCommit(int fd,
+				    drmModeAtomicStatePtr state,
+				    uint32_t flags,
+				    void *user_data);
+
+/*
+ * Opt-in per-fd cache of KMS objects.  While enabled, repeated queries for
+ * resources, connectors, planes, properties and blobs are answered without
+ * calling into the kernel.  Property definitions are kept until the cache
+ * is disabled; everything else is dropped by drmModeCacheInvalidate(),
+ * which should be called on hotplug uevents, and by any call that modifies
+ * KMS state through this library; page flips and plane updates only drop
+ * the crtc and planes involved.  The cache may be used from several
+ * threads.  Disable the cache before closing the fd.
+ */
+extern int drmModeCacheEnable(int fd);
+extern void drmModeCacheDisable(int fd);
+extern void drmModeCacheInvalidate(int fd);
+
 extern int drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
 				     uint32_t *id);
 extern int drmModeDestroyPropertyBlob(int fd, uint32_t id);
@@ -36,6 +36,14 @@
  * that is suitable for testing a hash table implementation and for
  * implementing skip lists.
  *
+ * drmRandomFill() produces the same sequence as repeated calls to
+ * drmRandom(), but splits it into RANDOM_LANES interleaved streams.  Lane k
+ * yields x[k], x[k+LANES], x[k+2*LANES], ..., each step a multiplication
+ * by a^LANES mod m.  The lanes are independent, so the loop has no carried
+ * dependency and the compiler is free to vectorize it.  Since m = 2^31-1
+ * is a Mersenne prime, the reduction is two shift-and-add folds instead of
+ * the division needed by Schrage's method in drmRandom().
+ *
  * FUTURE ENHANCEMENTS
  *
  * If initial seeds are not selected randomly, two instances of the PRNG
@@ -73,6 +81,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "xf86drm.h"
 #include "xf86drmRandom.h"
@@ -135,3 +144,45 @@ double drmRandomDouble(void *state)
     
     return (double)drmRandom(state)/(double)s->m;
 }
+
+#define RANDOM_LANES 8
+
+static uint32_t drmRandomMulMod(uint32_t x, uint32_t y, uint32_t m)
+{
+    uint64_t p = (uint64_t)x * y;
+
+    p = (p & m) + (p >> 31);
+    p = (p & m) + (p >> 31);
+    return p >= m ? p - m : p;
+}
+
+void drmRandomFill(void *state, uint32_t *buf, unsigned long n)
+{
+    RandomState   *s = (RandomState *)state;
+    uint32_t      lane[RANDOM_LANES];
+    uint32_t      m  = s->m;
+    uint32_t      step;
+    unsigned long i;
+    int           k;
+
+    if (n < 2 * RANDOM_LANES) {
+	for (i = 0; i < n; i++) buf[i] = drmRandom(state);
+	return;
+    }
+
+				/* a^LANES mod m, LANES a power of two */
+    for (step = s->a, k = 1; k < RANDOM_LANES; k *= 2)
+	step = drmRandomMulMod(step, step, m);
+
+    for (k = 0; k < RANDOM_LANES; k++) buf[k] = lane[k] = drmRandom(state);
+
+    for (i = RANDOM_LANES; i + RANDOM_LANES <= n; i += RANDOM_LANES) {
+	for (k = 0; k < RANDOM_LANES; k++) {
+	    lane[k]    = drmRandomMulMod(lane[k], step, m);
+	    buf[i + k] = lane[k];
+	}
+    }
+
+    s->seed = buf[i - 1];
+    for (; i < n; i++) buf[i] = drmRandom(state);
+}
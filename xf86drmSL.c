@@ -27,7 +27,11 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward skip list implementation.n
+ * This file contains a straightforward skip list implementation.
+ *
+ * Entries are allocated from an arena owned by the list rather than with
+ * one malloc each, and every list has its own PRNG, so that a list built
+ * by the same sequence of operations always has the same structure.
  *
  * FUTURE ENHANCEMENTS
  *
@@ -38,6 +42,7 @@
  *
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -49,9 +54,8 @@
 #define SL_MAX_LEVEL   16
 #define SL_RANDOM_SEED 0xc01055a1LU
 
-#define SL_RANDOM_DECL        static void *state = NULL
-#define SL_RANDOM_INIT(seed)  if (!state) state = drmRandomCreate(seed)
-#define SL_RANDOM             drmRandom(state)
+#define SL_CHUNK_MIN   4096
+#define SL_CHUNK_MAX   (256 * 1024)
 
 typedef struct SLEntry {
     unsigned long     magic;	   /* SL_ENTRY_MAGIC */
@@ -61,23 +65,62 @@ typedef struct SLEntry {
     struct SLEntry    *forward[1]; /* variable sized array */
 } SLEntry, *SLEntryPtr;
 
+typedef struct SLChunk {
+    struct SLChunk    *next;
+} SLChunk, *SLChunkPtr;
+
 typedef struct SkipList {
     unsigned long    magic;	/* SL_LIST_MAGIC */
     int              level;
     int              count;
     SLEntryPtr       head;
     SLEntryPtr       p0;	/* Position for iteration */
+    unsigned long    p0_limit;	/* Last key returned by iteration */
+    void             *random;	/* Per-list PRNG state */
+    SLChunkPtr       chunks;	/* Node arena */
+    char             *chunk_next;
+    char             *chunk_end;
+    size_t           chunk_size;
+    SLEntryPtr       free[SL_MAX_LEVEL + 1]; /* Freed entries, by level */
 } SkipList, *SkipListPtr;
 
-static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
+static size_t SLEntrySize(int max_level)
+{
+    return sizeof(SLEntry) + max_level * sizeof(SLEntryPtr);
+}
+
+/* Entries are carved out of large chunks owned by the list, so entries
+   inserted together end up next to each other in memory.  Freed entries
+   are kept on per-level free lists for reuse. */
+
+static SLEntryPtr SLCreateEntry(SkipListPtr list, int max_level,
+				unsigned long key, void *value)
 {
     SLEntryPtr entry;
-    
+    size_t     size;
+
     if (max_level < 0 || max_level > SL_MAX_LEVEL) max_level = SL_MAX_LEVEL;
 
-    entry         = drmMalloc(sizeof(*entry)
-			     + (max_level + 1) * sizeof(entry->forward[0]));
-    if (!entry) return NULL;
+    size = SLEntrySize(max_level);
+    if (list->free[max_level]) {
+	entry                   = list->free[max_level];
+	list->free[max_level]   = entry->forward[0];
+    } else {
+	if (list->chunk_next + size > list->chunk_end) {
+	    SLChunkPtr chunk;
+
+	    if (list->chunk_size < SL_CHUNK_MAX) list->chunk_size *= 2;
+	    chunk = drmMalloc(list->chunk_size);
+	    if (!chunk) return NULL;
+	    chunk->next      = list->chunks;
+	    list->chunks     = chunk;
+	    list->chunk_next = (char *)(chunk + 1);
+	    list->chunk_end  = (char *)chunk + list->chunk_size;
+	}
+	entry             = (SLEntryPtr)list->chunk_next;
+	list->chunk_next += size;
+    }
+
     entry->magic  = SL_ENTRY_MAGIC;
     entry->key    = key;
     entry->value  = value;
@@ -86,14 +129,27 @@ static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
     return entry;
 }
 
-static int SLRandomLevel(void)
+static void SLFreeEntry(SkipListPtr list, SLEntryPtr entry)
 {
-    int level = 1;
-    SL_RANDOM_DECL;
+    int level = entry->levels - 1;
 
-    SL_RANDOM_INIT(SL_RANDOM_SEED);
-    
-    while ((SL_RANDOM & 0x01) && level < SL_MAX_LEVEL) ++level;
+    entry->magic        = SL_FREED_MAGIC;
+    entry->forward[0]   = list->free[level];
+    list->free[level]   = entry;
+}
+
+/* Each level is reached with probability 1/2, so one PRNG call yields
+   enough bits for all levels. */
+
+static int SLRandomLevel(SkipListPtr list)
+{
+    unsigned long bits  = drmRandom(list->random);
+    int           level = 1;
+
+    while ((bits & 0x01) && level < SL_MAX_LEVEL) {
+	++level;
+	bits >>= 1;
+    }
     return level;
 }
 
@@ -102,32 +158,38 @@ void *drmSLCreate(void)
     SkipListPtr  list;
     int          i;
 
-    list           = drmMalloc(sizeof(*list));
+    list             = drmMalloc(sizeof(*list));
     if (!list) return NULL;
-    list->magic    = SL_LIST_MAGIC;
-    list->level    = 0;
-    list->head     = SLCreateEntry(SL_MAX_LEVEL, 0, NULL);
-    list->count    = 0;
+    list->magic      = SL_LIST_MAGIC;
+    list->level      = 0;
+    list->count      = 0;
+    list->chunk_size = SL_CHUNK_MIN / 2;
+    list->random     = drmRandomCreate(SL_RANDOM_SEED);
+    if (list->random)
+	list->head   = SLCreateEntry(list, SL_MAX_LEVEL, 0, NULL);
+    if (!list->random || !list->head) {
+	drmSLDestroy(list);
+	return NULL;
+    }
 
     for (i = 0; i <= SL_MAX_LEVEL; i++) list->head->forward[i] = NULL;
-    
+
     return list;
 }
 
 int drmSLDestroy(void *l)
 {
     SkipListPtr   list  = (SkipListPtr)l;
-    SLEntryPtr    entry;
-    SLEntryPtr    next;
+    SLChunkPtr    chunk;
+    SLChunkPtr    next;
 
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
-    for (entry = list->head; entry; entry = next) {
-	if (entry->magic != SL_ENTRY_MAGIC) return -1; /* Bad magic */
-	next         = entry->forward[0];
-	entry->magic = SL_FREED_MAGIC;
-	drmFree(entry);
+    for (chunk = list->chunks; chunk; chunk = next) {
+	next = chunk->next;
+	drmFree(chunk);
     }
+    if (list->random) drmRandomDestroy(list->random);
 
     list->magic = SL_FREED_MAGIC;
     drmFree(list);
@@ -151,13 +213,44 @@ static SLEntryPtr SLLocate(void *l, unsigned long key, SLEntryPtr *update)
     return entry->forward[0];
 }
 
+/* Like SLLocate() past the largest key, which can't be expressed as a key
+   when that is ULONG_MAX itself. */
+static void SLLocateTail(SkipListPtr list, SLEntryPtr *update)
+{
+    SLEntryPtr    entry;
+    int           i;
+
+    for (i = list->level, entry = list->head; i >= 0; i--) {
+	while (entry->forward[i]) entry = entry->forward[i];
+	update[i] = entry;
+    }
+}
+
+static void SLLink(SkipListPtr list, SLEntryPtr entry, SLEntryPtr *update)
+{
+    int i;
+
+    if (entry->levels - 1 > list->level) {
+	for (i = list->level + 1; i < entry->levels; i++)
+	    update[i] = list->head;
+	list->level = entry->levels - 1;
+    }
+
+				/* Fix up forward pointers */
+    for (i = 0; i < entry->levels; i++) {
+	entry->forward[i]     = update[i]->forward[i];
+	update[i]->forward[i] = entry;
+    }
+
+    ++list->count;
+}
+
 int drmSLInsert(void *l, unsigned long key, void *value)
 {
     SkipListPtr   list  = (SkipListPtr)l;
     SLEntryPtr    entry;
     SLEntryPtr    update[SL_MAX_LEVEL + 1];
     int           level;
-    int           i;
 
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
@@ -165,23 +258,63 @@ int drmSLInsert(void *l, unsigned long key, void *value)
 
     if (entry && entry->key == key) return 1; /* Already in list */
 
+    level = SLRandomLevel(list);
+    if (level > list->level) level = list->level + 1;
+
+    entry = SLCreateEntry(list, level, key, value);
+    if (!entry) return -1;
+
+    SLLink(list, entry, update);
+    return 0;			/* Added to table */
+}
 
-    level = SLRandomLevel();
-    if (level > list->level) {
-	level = ++list->level;
-	update[level] = list->head;
+/* Insert count entries whose keys are in strictly ascending order.  When
+   the keys all sort after the current contents of the list, which is
+   always the case for an empty list, the entries are appended in O(count)
+   with levels chosen to give a perfectly balanced list.  Otherwise every
+   entry is inserted individually. */
+
+int drmSLInsertSorted(void *l, const unsigned long *keys, void **values,
+		      int count)
+{
+    SkipListPtr   list  = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1] = {0};
+    SLEntryPtr    entry;
+    int           level;
+    int           i;
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    for (i = 1; i < count; i++)
+	if (keys[i] <= keys[i - 1]) return -1; /* Not sorted */
+
+    if (count == 0) return 0;
+
+    SLLocateTail(list, update);
+    if (update[0] != list->head && update[0]->key >= keys[0]) {
+	for (i = 0; i < count; i++)
+	    if (drmSLInsert(list, keys[i], values ? values[i] : NULL) < 0)
+		return -1;
+	return 0;
     }
 
-    entry = SLCreateEntry(level, key, value);
+    for (i = list->level + 1; i <= SL_MAX_LEVEL; i++) update[i] = list->head;
 
-				/* Fix up forward pointers */
-    for (i = 0; i <= level; i++) {
-	entry->forward[i]     = update[i]->forward[i];
-	update[i]->forward[i] = entry;
+    for (i = 0; i < count; i++) {
+	/* Level k on every 2^k-th entry, as in a perfect skip list. */
+	for (level = 0;
+	     level < SL_MAX_LEVEL && !((list->count + 1) & (1UL << level));
+	     level++)
+	    ;
+	entry = SLCreateEntry(list, level, keys[i], values ? values[i] : NULL);
+	if (!entry) return -1;
+
+	SLLink(list, entry, update);
+	for (level = 0; level < entry->levels; level++)
+	    update[level] = entry;
     }
 
-    ++list->count;
-    return 0;			/* Added to table */
+    return 0;
 }
 
 int drmSLDelete(void *l, unsigned long key)
@@ -203,8 +336,8 @@ int drmSLDelete(void *l, unsigned long key)
 	    update[i]->forward[i] = entry->forward[i];
     }
 
-    entry->magic = SL_FREED_MAGIC;
-    drmFree(entry);
+    if (list->p0 == entry) list->p0 = entry->forward[0];
+    SLFreeEntry(list, entry);
 
     while (list->level && !list->head->forward[list->level]) --list->level;
     --list->count;
@@ -220,7 +353,7 @@ int drmSLLookup(void *l, unsigned long key, void **value)
     entry = SLLocate(list, key, update);
 
     if (entry && entry->key == key) {
-	*value = entry;
+	*value = entry->value;
 	return 0;
     }
     *value = NULL;
@@ -257,12 +390,12 @@ int drmSLNext(void *l, unsigned long *key, void **value)
 {
     SkipListPtr   list = (SkipListPtr)l;
     SLEntryPtr    entry;
-    
+
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
     entry    = list->p0;
 
-    if (entry) {
+    if (entry && entry->key <= list->p0_limit) {
 	list->p0 = entry->forward[0];
 	*key     = entry->key;
 	*value   = entry->value;
@@ -275,10 +408,28 @@ int drmSLNext(void *l, unsigned long *key, void **value)
 int drmSLFirst(void *l, unsigned long *key, void **value)
 {
     SkipListPtr   list = (SkipListPtr)l;
-    
+
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
-    
-    list->p0 = list->head->forward[0];
+
+    list->p0       = list->head->forward[0];
+    list->p0_limit = ULONG_MAX;
+    return drmSLNext(list, key, value);
+}
+
+/* Like drmSLFirst, but only iterates over the keys in [lo, hi].  Finding
+   the start of the range costs the same as drmSLLookupNeighbors; every
+   following drmSLNext call is O(1). */
+
+int drmSLRange(void *l, unsigned long lo, unsigned long hi,
+	       unsigned long *key, void **value)
+{
+    SkipListPtr   list = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    list->p0       = SLLocate(list, lo, update);
+    list->p0_limit = hi;
     return drmSLNext(list, key, value);
 }
 